@@ -11,6 +11,10 @@
   See NIST Administration Manual 4.09.07 b and Appendix I. 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* for CPU_SET, sched_setaffinity */
+#endif
+
 #include <stdio.h>		/* f,printf(), stderr, perror() */
 #include <stddef.h>		/* sizeof() */
 #include <stdarg.h>		/* va_list,ap,end */
@@ -20,208 +24,2438 @@
 #include "serdes.h"
 #include "smsg.h"
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_FCNTL_H)
+#define HAVE_NODEMGR_REACTOR 1
+#include <sys/types.h>
+#include <sys/socket.h>		/* accept, recv, send */
+#include <sys/epoll.h>		/* epoll_create, epoll_ctl, epoll_wait */
+#include <netinet/in.h>		/* sockaddr_in, INADDR_ANY */
+#include <unistd.h>		/* close, sysconf */
+#include <errno.h>		/* errno, EAGAIN, EINTR */
+#include <sched.h>		/* sched_setaffinity */
+#endif
+
+#if defined(HAVE_POLL_H) && defined(HAVE_UNISTD_H)
+#define HAVE_NODEMGR_PARK_WAKE 1
+#include <poll.h>		/* poll */
+#include <unistd.h>		/* pipe, read, write */
+#endif
+
+#if defined(__GNUC__)
+#define HAVE_NODEMGR_STATS 1
+#include <signal.h>		/* sigwait, SIGUSR1 */
+#endif
+
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_NETINET_IN_H) && defined(HAVE_ARPA_INET_H)
+#define HAVE_NODEMGR_MULTICAST 1
+#include <sys/types.h>
+#include <sys/socket.h>		/* socket, setsockopt, sendto */
+#include <netinet/in.h>		/* ip_mreq, IP_ADD_MEMBERSHIP */
+#include <arpa/inet.h>		/* inet_addr */
+#include <unistd.h>		/* close */
+#endif
+
 /* the component database */
 static component_db_t db;
 
+enum {NODEMGR_ASKED = 256};	/* recent lookup-miss queries we remember */
+
+typedef struct {
+  unsigned int key;		/* the ids, a byte each */
+  ulapi_real time;		/* when we asked */
+} nodemgr_asked_t;
+
 typedef struct {
   int fd;
   void *mutex;
+  /* these are guarded by 'mutex' too */
+  nodemgr_asked_t asked[NODEMGR_ASKED]; /* by hash of the key */
+  ulapi_real dump_time;		/* when we last broadcast all of ours */
+  unsigned int dump_generation;	/* and the database generation we sent */
+  /* for multicast, if 'group' isn't 0, in network byte order */
+  smsg_addr group;		/* for everyone, and the next 256 for each subsystem */
+  smsg_addr interface;		/* to send and join on, or INADDR_ANY */
+  int port;
+  int listen_fd;		/* the broadcastee, which joins the groups */
+  unsigned char joined[256 / 8]; /* the subsystems whose groups it's in */
 } shared_fd_t;
 
-static int nodemgr_broadcast_handler(smsg_byte *smsg_inbuf, int broadcastee_fd, void *handler_args)
+/* seconds over which lookup misses share one broadcast, and peers' dumps are limited */
+static ulapi_real nodemgr_window = 1.0;
+
+/* the host's address, which the components registered with us have */
+static smsg_addr nodemgr_host_address;
+
+/* seconds before a component we heard of from another node manager expires, or 0 for never */
+static ulapi_real nodemgr_expiry = 60.0;
+
+/* packs the ids, a byte each */
+static unsigned int nodemgr_key(component_entry_t *component)
+{
+  return (unsigned int) component->component_id |
+    ((unsigned int) component->instance_id << 8) |
+    ((unsigned int) component->node_id << 16) |
+    ((unsigned int) component->subsystem_id << 24);
+}
+
+/* Fibonacci hashing, to spread keys that differ in one byte, down to 'bits' */
+#define nodemgr_hash(key,bits) ((((key) * 2654435761U) & 0xFFFFFFFFU) >> (32 - (bits)))
+
+#ifdef HAVE_NODEMGR_STATS
+
+/*
+  Statistics are kept per thread, so counting takes no lock and the
+  threads don't share cache lines. Each thread takes a slot the first
+  time it counts, and adds to it atomically, since with more threads
+  than slots some of them share. Reading them sums the slots.
+
+  Latencies go in log-linear histograms, in microseconds: values up
+  to 8 get a bucket each, and each power of two above that is split
+  into 8 buckets, so a bucket's top is at most an eighth above
+  anything in it, over the whole 32-bit range in 240 buckets.
+*/
+
+enum {
+  NODEMGR_STATS_SLOTS = 64,	/* threads that get slots of their own */
+  NODEMGR_SUB_BITS = 3,		/* log2 of the buckets per power of two */
+  NODEMGR_BUCKETS = (32 - NODEMGR_SUB_BITS + 1) << NODEMGR_SUB_BITS
+};
+
+typedef struct {
+  smsg_uint counters[SMSG_STATS_COUNTERS];
+  smsg_uint buckets[SMSG_STATS_LATENCIES][NODEMGR_BUCKETS];
+  smsg_uint max[SMSG_STATS_LATENCIES];
+} __attribute__((aligned(64))) nodemgr_stats_t;
+
+static nodemgr_stats_t nodemgr_stats[NODEMGR_STATS_SLOTS];
+static unsigned int nodemgr_stats_slots = 0; /* handed out so far */
+static __thread nodemgr_stats_t *nodemgr_my_stats = NULL;
+
+static nodemgr_stats_t *nodemgr_stats_slot(void)
+{
+  if (NULL == nodemgr_my_stats) {
+    nodemgr_my_stats = &nodemgr_stats[__sync_fetch_and_add(&nodemgr_stats_slots, 1) % NODEMGR_STATS_SLOTS];
+  }
+
+  return nodemgr_my_stats;
+}
+
+static void nodemgr_count(int counter)
+{
+  __sync_fetch_and_add(&nodemgr_stats_slot()->counters[counter], 1);
+}
+
+/* the histogram bucket for 'value' */
+static int nodemgr_bucket(smsg_uint value)
+{
+  int top;
+
+  if (value < (1 << NODEMGR_SUB_BITS)) return (int) value;
+  for (top = NODEMGR_SUB_BITS; (value >> top) > 1; top++);
+
+  return ((top - NODEMGR_SUB_BITS + 1) << NODEMGR_SUB_BITS) +
+    (int) ((value >> (top - NODEMGR_SUB_BITS)) & ((1 << NODEMGR_SUB_BITS) - 1));
+}
+
+/* the largest value that goes in 'bucket' */
+static smsg_uint nodemgr_bucket_top(int bucket)
+{
+  int shift;
+
+  if (bucket < (1 << NODEMGR_SUB_BITS)) return (smsg_uint) bucket;
+  shift = (bucket >> NODEMGR_SUB_BITS) - 1;
+
+  return ((((smsg_uint) bucket & ((1 << NODEMGR_SUB_BITS) - 1)) | (1 << NODEMGR_SUB_BITS)) << shift) +
+    (((smsg_uint) 1 << shift) - 1);
+}
+
+/* adds the time since 'since' to the 'latency' histogram */
+static void nodemgr_latency(int latency, ulapi_real since)
+{
+  nodemgr_stats_t *stats;
+  ulapi_real usec;
+  smsg_uint value;
+  smsg_uint max;
+
+  usec = (ulapi_time() - since) * 1.0e6;
+  value = (usec <= 0) ? 0 : (usec >= 4294967295.0) ? 0xFFFFFFFFU : (smsg_uint) usec;
+  stats = nodemgr_stats_slot();
+  __sync_fetch_and_add(&stats->buckets[latency][nodemgr_bucket(value)], 1);
+  for (max = stats->max[latency]; value > max; max = stats->max[latency]) {
+    if (__sync_bool_compare_and_swap(&stats->max[latency], max, value)) break;
+  }
+}
+
+/* the top of the bucket that the 'permille' point of 'count' values falls in */
+static smsg_uint nodemgr_percentile(smsg_uint *buckets, smsg_uint count, int permille)
+{
+  smsg_uint rank;
+  smsg_uint sum;
+  int bucket;
+
+  rank = (smsg_uint) (((double) count * permille + 999) / 1000);
+  if (0 == rank) rank = 1;
+  for (bucket = 0, sum = 0; bucket < NODEMGR_BUCKETS; bucket++) {
+    sum += buckets[bucket];
+    if (sum >= rank) return nodemgr_bucket_top(bucket);
+  }
+
+  return 0;
+}
+
+#else
+
+#define nodemgr_count(counter)
+#define nodemgr_latency(latency, since)
+
+#endif	/* HAVE_NODEMGR_STATS */
+
+/* fills in the statistics so far */
+static void nodemgr_stats_get(smsg_report_stats_t *report)
+{
+#ifdef HAVE_NODEMGR_STATS
+  smsg_uint buckets[NODEMGR_BUCKETS];
+  smsg_latency_t *latency;
+  int slot, i, bucket;
+#endif
+
+  memset(report, 0, sizeof(*report));
+  report->counters[SMSG_STATS_DECODE_ERRORS] = smsg_get_decode_errors();
+  report->db_size = (smsg_uint) db_size(&db);
+
+#ifdef HAVE_NODEMGR_STATS
+  for (slot = 0; slot < NODEMGR_STATS_SLOTS; slot++) {
+    for (i = 0; i < SMSG_STATS_COUNTERS; i++) {
+      report->counters[i] += nodemgr_stats[slot].counters[i];
+    }
+  }
+
+  for (i = 0; i < SMSG_STATS_LATENCIES; i++) {
+    latency = &report->latencies[i];
+    memset(buckets, 0, sizeof(buckets));
+    for (slot = 0; slot < NODEMGR_STATS_SLOTS; slot++) {
+      for (bucket = 0; bucket < NODEMGR_BUCKETS; bucket++) {
+	buckets[bucket] += nodemgr_stats[slot].buckets[i][bucket];
+      }
+      if (nodemgr_stats[slot].max[i] > latency->max) latency->max = nodemgr_stats[slot].max[i];
+    }
+    for (bucket = 0; bucket < NODEMGR_BUCKETS; bucket++) latency->count += buckets[bucket];
+    if (0 == latency->count) continue;
+    latency->p50 = nodemgr_percentile(buckets, latency->count, 500);
+    latency->p90 = nodemgr_percentile(buckets, latency->count, 900);
+    latency->p99 = nodemgr_percentile(buckets, latency->count, 990);
+    /* the top of a bucket can be above anything in it */
+    if (latency->p50 > latency->max) latency->p50 = latency->max;
+    if (latency->p90 > latency->max) latency->p90 = latency->max;
+    if (latency->p99 > latency->max) latency->p99 = latency->max;
+  }
+#endif
+}
+
+static const char *nodemgr_counter_names[SMSG_STATS_COUNTERS] = {
+  "registrations",
+  "queries",
+  "misses",
+  "timeouts",
+  "broadcasts sent",
+  "broadcasts received",
+  "decode errors"
+};
+
+static const char *nodemgr_latency_names[SMSG_STATS_LATENCIES] = {
+  "register",
+  "query",
+  "wait"
+};
+
+/* prints the statistics so far */
+static void nodemgr_stats_print(FILE *file)
+{
+  smsg_report_stats_t report;
+  int i;
+
+  nodemgr_stats_get(&report);
+  fprintf(file, "%s: stats\n", smsg_debug_name);
+  for (i = 0; i < SMSG_STATS_COUNTERS; i++) {
+    fprintf(file, "  %-20s %u\n", nodemgr_counter_names[i], (unsigned int) report.counters[i]);
+  }
+  fprintf(file, "  %-20s %u\n", "db size", (unsigned int) report.db_size);
+  for (i = 0; i < SMSG_STATS_LATENCIES; i++) {
+    fprintf(file, "  %-8s latency usec: count %u p50 %u p90 %u p99 %u max %u\n",
+	    nodemgr_latency_names[i],
+	    (unsigned int) report.latencies[i].count,
+	    (unsigned int) report.latencies[i].p50,
+	    (unsigned int) report.latencies[i].p90,
+	    (unsigned int) report.latencies[i].p99,
+	    (unsigned int) report.latencies[i].max);
+  }
+  fflush(file);
+}
+
+#if defined(HAVE_NODEMGR_STATS) && defined(SIGUSR1)
+
+/*
+  SIGUSR1 is blocked in every thread but taken by this one, with
+  sigwait, so the statistics are printed from an ordinary thread
+  rather than from a signal handler.
+*/
+static sigset_t nodemgr_stats_signals;
+
+static void nodemgr_stats_thread(void *args)
+{
+  int signal;
+
+  (void) args;
+
+  for (;;) {
+    if (0 == sigwait(&nodemgr_stats_signals, &signal)) nodemgr_stats_print(stderr);
+  }
+}
+
+#endif
+
+#ifdef HAVE_NODEMGR_MULTICAST
+
+/*
+  With multicast, discovery goes to a group per subsystem instead of
+  the whole LAN. Queries and reports about a component go to the group
+  of its subsystem, and a node manager joins the groups of the
+  subsystems it serves or asks about, so the others don't hear them.
+  Everyone is in the group for everyone, which is 'group' itself.
+*/
+
+/* the group for 'subsystem_id', or for everyone if it's -1 */
+static smsg_addr nodemgr_group(shared_fd_t *broadcaster, int subsystem_id)
+{
+  if (subsystem_id < 0) return broadcaster->group;
+  return htonl(ntohl(broadcaster->group) + 1 + subsystem_id);
+}
+
+/* joins the broadcastee to a group; returns 0, or -1 on error */
+static int nodemgr_join_group(shared_fd_t *broadcaster, smsg_addr group)
+{
+  struct ip_mreq mreq;
+
+  mreq.imr_multiaddr.s_addr = group;
+  mreq.imr_interface.s_addr = broadcaster->interface;
+
+  return setsockopt(broadcaster->listen_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+}
+
+/* joins the group for 'subsystem_id', if we're not in it already */
+static void nodemgr_join(shared_fd_t *broadcaster, int subsystem_id)
+{
+  unsigned char bit;
+
+  if (0 == broadcaster->group) return;
+
+  bit = 1 << (subsystem_id & 7);
+  ulapi_mutex_take(broadcaster->mutex);
+  if (! (broadcaster->joined[subsystem_id >> 3] & bit)) {
+    if (0 == nodemgr_join_group(broadcaster, nodemgr_group(broadcaster, subsystem_id))) {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Joined the group for subsystem %d\n", subsystem_id);
+    } else {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Can't join the group for subsystem %d\n", subsystem_id);
+    }
+    /* don't keep trying if it failed */
+    broadcaster->joined[subsystem_id >> 3] |= bit;
+  }
+  ulapi_mutex_give(broadcaster->mutex);
+}
+
+/*
+  Sets up the broadcaster to send to the groups from 'interface' with
+  'ttl', looping them back to this host if 'loop', and returns a
+  broadcastee on 'port' in the groups for everyone and our subsystem,
+  or -1 on error.
+*/
+static int nodemgr_multicast_open(shared_fd_t *broadcaster, int port, int ttl, int loop)
+{
+  struct sockaddr_in addr;
+  struct in_addr interface;
+  unsigned char ttl_byte = (unsigned char) ttl;
+  unsigned char loop_byte = (unsigned char) (loop ? 1 : 0);
+  int on = 1;
+#ifdef IP_MULTICAST_ALL
+  int off = 0;
+#endif
+
+  broadcaster->port = port;
+  memset(broadcaster->joined, 0, sizeof(broadcaster->joined));
+
+  broadcaster->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (broadcaster->fd < 0) return -1;
+  interface.s_addr = broadcaster->interface;
+  if (0 != setsockopt(broadcaster->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl_byte, sizeof(ttl_byte)) ||
+      0 != setsockopt(broadcaster->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop_byte, sizeof(loop_byte)) ||
+      (INADDR_ANY != broadcaster->interface &&
+       0 != setsockopt(broadcaster->fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)))) {
+    close(broadcaster->fd);
+    return -1;
+  }
+
+  broadcaster->listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (broadcaster->listen_fd < 0) {
+    close(broadcaster->fd);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((unsigned short) port);
+  if (0 != setsockopt(broadcaster->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+#ifdef IP_MULTICAST_ALL
+      /* just the groups we join, not every group anything on the host joins */
+      0 != setsockopt(broadcaster->listen_fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off)) ||
+#endif
+      0 != bind(broadcaster->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      0 != nodemgr_join_group(broadcaster, nodemgr_group(broadcaster, -1))) {
+    close(broadcaster->listen_fd);
+    close(broadcaster->fd);
+    return -1;
+  }
+  nodemgr_join(broadcaster, smsg_get_subsystem_id());
+
+  return broadcaster->listen_fd;
+}
+
+#else
+
+#define nodemgr_join(broadcaster, subsystem_id)
+
+#endif	/* HAVE_NODEMGR_MULTICAST */
+
+/*
+  Sends discovery traffic about 'subsystem_id', or for everyone if
+  it's -1: to its group with multicast, otherwise broadcast. The
+  broadcaster's mutex is held.
+*/
+static void nodemgr_send(shared_fd_t *broadcaster, int subsystem_id, const char *buf, int len)
+{
+#ifdef HAVE_NODEMGR_MULTICAST
+  struct sockaddr_in addr;
+#endif
+
+  nodemgr_count(SMSG_STATS_BROADCASTS_SENT);
+
+#ifdef HAVE_NODEMGR_MULTICAST
+  if (0 != broadcaster->group) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = nodemgr_group(broadcaster, subsystem_id);
+    addr.sin_port = htons((unsigned short) broadcaster->port);
+    sendto(broadcaster->fd, buf, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+    return;
+  }
+#endif
+
+  ulapi_socket_write(broadcaster->fd, buf, len);
+}
+
+/*
+  Broadcasts a QUERY_ONEREG for a lookup miss on 'component', unless
+  one went out for it in the last window. Every node manager hears the
+  report that answers it, so later misses are covered by the one
+  that's outstanding. Returns 1 if it went out, 0 if it was coalesced.
+*/
+static int nodemgr_query_onereg(shared_fd_t *broadcaster, component_entry_t *component)
+{
+  smsg_query_onereg_t query_onereg;
+  int smsg_outbuflen;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
+  int writebuflen;
+  nodemgr_asked_t *asked;
+  unsigned int key;
+  ulapi_real now;
+
+  key = nodemgr_key(component);
+  /* the answer goes to the component's subsystem, so we have to be listening there */
+  nodemgr_join(broadcaster, component->subsystem_id);
+
+  query_onereg.sequence_number = 1;
+  query_onereg.component_id = component->component_id;
+  query_onereg.instance_id = component->instance_id;
+  query_onereg.node_id = component->node_id;
+  query_onereg.subsystem_id = component->subsystem_id;
+  smsg_outbuflen = smsg_query_onereg_to_message(&query_onereg, smsg_outbuf);
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+
+  now = ulapi_time();
+  asked = &broadcaster->asked[nodemgr_hash(key, 8)];
+  ulapi_mutex_take(broadcaster->mutex);
+  if (asked->key == key && now - asked->time < nodemgr_window) {
+    ulapi_mutex_give(broadcaster->mutex);
+    return 0;
+  }
+  asked->key = key;
+  asked->time = now;
+  nodemgr_send(broadcaster, component->subsystem_id, writebuf, writebuflen);
+  ulapi_mutex_give(broadcaster->mutex);
+
+  return 1;
+}
+
+/* broadcasts a REPORT_ALLREG for one of our components */
+static void nodemgr_report_allreg(shared_fd_t *broadcaster, component_entry_t *component)
 {
-  shared_fd_t shared_fd;
-  smsg_byte identifier;
-  component_entry_t component;
-  int index, last;
-  smsg_query_allreg_t query_allreg;
   smsg_report_allreg_t report_allreg;
   int smsg_outbuflen;
   smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
   char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
   int writebuflen;
 
-  shared_fd = *((shared_fd_t *) handler_args);
-  identifier = smsg_message_identifier(smsg_inbuf);
+  report_allreg.component_id = component->component_id;
+  report_allreg.instance_id = component->instance_id;
+  report_allreg.node_id = component->node_id;
+  report_allreg.subsystem_id = component->subsystem_id;
+  report_allreg.address = component->address;
+  report_allreg.port = component->port;
+  report_allreg.sequence_number = 1;
+  smsg_outbuflen = smsg_report_allreg_to_message(&report_allreg, smsg_outbuf);
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+  ulapi_mutex_take(broadcaster->mutex);
+  nodemgr_send(broadcaster, component->subsystem_id, writebuf, writebuflen);
+  ulapi_mutex_give(broadcaster->mutex);
+  smsg_print_debug(SMSG_DEBUG_BCAST, "Broadcasting component %d %d %d %d %s %d\n", 
+		   (int) component->component_id,
+		   (int) component->instance_id,
+		   (int) component->node_id,
+		   (int) component->subsystem_id,
+		   ulapi_address_to_hostname(component->address),
+		   (int) component->port);
+}
+
+/*
+  Decides whether to answer a QUERY_ALLREG with a dump of the database
+  at 'generation'. A dump goes to every node manager, so if we've sent
+  this same generation within the window, whoever's asking heard it.
+  Returns 1 if we should dump, 0 if not.
+*/
+static int nodemgr_dump_due(shared_fd_t *broadcaster, unsigned int generation)
+{
+  ulapi_real now;
+  int due;
+
+  now = ulapi_time();
+  ulapi_mutex_take(broadcaster->mutex);
+  due = (generation != broadcaster->dump_generation || now - broadcaster->dump_time >= nodemgr_window);
+  if (due) {
+    broadcaster->dump_time = now;
+    broadcaster->dump_generation = generation;
+  }
+  ulapi_mutex_give(broadcaster->mutex);
+
+  return due;
+}
+
+struct nodemgr_conn;
+
+/* what the handlers get */
+typedef struct {
+  shared_fd_t *broadcaster;	/* for broadcasts to other node managers */
+  struct nodemgr_conn *conn;	/* the client's on the event loop, or NULL */
+} nodemgr_handler_args_t;
+
+static void nodemgr_write(nodemgr_handler_args_t *args, int fd, const char *buf, int len);
+
+/*
+  QUERY_WAITREGs for components we don't know yet are parked here
+  until the component registers with us or another node manager
+  reports it, or their time runs out. They're hashed by key, so an
+  addition finds its waiters right away, and kept in a heap by
+  deadline, so a timer thread can sleep until the earliest one and
+  answer it if it's timed out. A client on an event loop is answered
+  through that loop's mailbox, since only the loop writes to it. A
+  client on its own handler thread waits in the handler, which keeps
+  its fd open, and is answered from there.
+*/
+
+enum {
+  NODEMGR_PARK_BITS = 10,	/* log2 of the buckets */
+  NODEMGR_PARK_MAX = 4096,	/* most queries parked at once */
+  NODEMGR_PARK_TIMEOUT_MAX = 60000 /* longest wait, in milliseconds */
+};
+
+#ifndef HAVE_NODEMGR_PARK_WAKE
+/* without a pipe to wake it early, the longest the timer sleeps while any are parked */
+#define NODEMGR_PARK_TICK 0.005
+#endif
+
+typedef struct nodemgr_parked {
+  struct nodemgr_parked *next;	/* in its bucket, or its loop's mailbox */
+  unsigned int key;
+  ulapi_real since;		/* when it was asked */
+  ulapi_real deadline;
+  smsg_byte sequence_number;	/* of the query, for the report */
+  component_entry_t component;	/* what's wanted, filled in when found */
+  int found;
+  struct nodemgr_conn *conn;	/* the client on an event loop, or NULL */
+  int done;			/* for a handler thread, set when answered */
+  smsg_byte change;		/* in a mailbox, a REPORT_CHANGE to push instead of an answer */
+  int slot;			/* in the heap, while parked */
+} nodemgr_parked_t;
+
+static nodemgr_parked_t *nodemgr_parked[1 << NODEMGR_PARK_BITS];
+static nodemgr_parked_t *nodemgr_park_heap[NODEMGR_PARK_MAX]; /* earliest deadline first */
+static int nodemgr_parked_count = 0;	/* in the table, and the heap */
+static void *nodemgr_park_mutex = NULL;	/* for all of these, and the mailboxes */
+static void *nodemgr_park_timer_cond = NULL; /* for the timer, when one's parked */
+static void *nodemgr_park_done_cond = NULL; /* for handler threads, when one's answered */
+#ifdef HAVE_NODEMGR_PARK_WAKE
+static int nodemgr_park_wake[2] = {-1, -1}; /* to wake the timer for an earlier deadline */
+static ulapi_real nodemgr_park_waking = 0; /* the deadline the timer's sleeping until, or 0 */
+#endif
+
+#ifdef HAVE_NODEMGR_REACTOR
+/* hands an answered query to its client's event loop */
+static void nodemgr_post(nodemgr_parked_t *parked);
+/* counts the queries, notes and mail a client on an event loop has outstanding; the mutex is held */
+static void nodemgr_conn_parked(struct nodemgr_conn *conn, int n);
+/* notes that a client on an event loop caches or subscribes to 'component'; returns 0, or -1 if it can't */
+static int nodemgr_interest_add(struct nodemgr_conn *conn, component_entry_t *component, smsg_byte mask, int subscribed);
+/* stops a subscription; returns 0, or -1 if there wasn't one */
+static int nodemgr_interest_drop(struct nodemgr_conn *conn, component_entry_t *component, smsg_byte mask);
+/* pushes the change to 'component' to the clients that cache it or subscribe to it */
+static void nodemgr_changed(nodemgr_handler_args_t *args, component_entry_t *component, smsg_byte change);
+#else
+/* clients on handler threads can't be pushed to */
+#define nodemgr_interest_add(conn,component,mask,subscribed) (-1)
+#define nodemgr_interest_drop(conn,component,mask) (-1)
+#define nodemgr_changed(args,component,change)
+#endif
+
+/* puts 'parked' in the heap at 'slot'; the mutex is held */
+static void nodemgr_park_heap_set(int slot, nodemgr_parked_t *parked)
+{
+  nodemgr_park_heap[slot] = parked;
+  parked->slot = slot;
+}
+
+/* moves the query at 'slot' up or down to where its deadline belongs; the mutex is held */
+static void nodemgr_park_heap_fix(int slot)
+{
+  nodemgr_parked_t *parked;
+  int child;
+
+  parked = nodemgr_park_heap[slot];
+  while (slot > 0 && nodemgr_park_heap[(slot - 1) / 2]->deadline > parked->deadline) {
+    nodemgr_park_heap_set(slot, nodemgr_park_heap[(slot - 1) / 2]);
+    slot = (slot - 1) / 2;
+  }
+  for (;;) {
+    child = 2 * slot + 1;
+    if (child >= nodemgr_parked_count) break;
+    if (child + 1 < nodemgr_parked_count &&
+	nodemgr_park_heap[child + 1]->deadline < nodemgr_park_heap[child]->deadline) child++;
+    if (nodemgr_park_heap[child]->deadline >= parked->deadline) break;
+    nodemgr_park_heap_set(slot, nodemgr_park_heap[child]);
+    slot = child;
+  }
+  nodemgr_park_heap_set(slot, parked);
+}
+
+/* takes 'parked', already off its bucket, out of the heap; the mutex is held */
+static void nodemgr_park_heap_remove(nodemgr_parked_t *parked)
+{
+  nodemgr_parked_t *last;
+
+  last = nodemgr_park_heap[--nodemgr_parked_count];
+  if (last != parked) {
+    nodemgr_park_heap_set(parked->slot, last);
+    nodemgr_park_heap_fix(last->slot);
+  }
+}
+
+/* answers a query that's been taken off the table; the mutex is held */
+static void nodemgr_park_answer(nodemgr_parked_t *parked)
+{
+#ifdef HAVE_NODEMGR_REACTOR
+  if (NULL != parked->conn) {
+    nodemgr_post(parked);
+    return;
+  }
+#endif
+  parked->done = 1;
+  ulapi_cond_broadcast(nodemgr_park_done_cond);
+}
+
+/* takes 'parked' off the table; returns 0, or -1 if it's been answered; the mutex is held */
+static int nodemgr_park_unlink(nodemgr_parked_t *parked)
+{
+  nodemgr_parked_t **pp;
+
+  for (pp = &nodemgr_parked[nodemgr_hash(parked->key, NODEMGR_PARK_BITS)]; NULL != *pp; pp = &(*pp)->next) {
+    if (*pp == parked) {
+      *pp = parked->next;
+      nodemgr_park_heap_remove(parked);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/* parks a query; returns 0, or -1 if too many are parked already */
+static int nodemgr_park(nodemgr_parked_t *parked)
+{
+  nodemgr_parked_t **bucket;
+
+  ulapi_mutex_take(nodemgr_park_mutex);
+  if (nodemgr_parked_count >= NODEMGR_PARK_MAX) {
+    ulapi_mutex_give(nodemgr_park_mutex);
+    return -1;
+  }
+  bucket = &nodemgr_parked[nodemgr_hash(parked->key, NODEMGR_PARK_BITS)];
+  parked->next = *bucket;
+  *bucket = parked;
+#ifdef HAVE_NODEMGR_REACTOR
+  if (NULL != parked->conn) nodemgr_conn_parked(parked->conn, 1);
+#endif
+  nodemgr_park_heap_set(nodemgr_parked_count, parked);
+  nodemgr_parked_count++;
+  nodemgr_park_heap_fix(parked->slot);
+  if (1 == nodemgr_parked_count) ulapi_cond_signal(nodemgr_park_timer_cond);
+#ifdef HAVE_NODEMGR_PARK_WAKE
+  if (0 == parked->slot && nodemgr_park_waking > parked->deadline) {
+    /* the timer's sleeping past this one's deadline */
+    nodemgr_park_waking = 0;
+    if (1 != write(nodemgr_park_wake[1], "", 1)) {
+      smsg_print_debug(SMSG_DEBUG_REG, "Can't wake the timer for waiting queries\n");
+    }
+  }
+#endif
+  ulapi_mutex_give(nodemgr_park_mutex);
+
+  return 0;
+}
+
+/* takes back a parked query; returns 0, or -1 if it's been answered meanwhile */
+static int nodemgr_unpark(nodemgr_parked_t *parked)
+{
+  int retval;
+
+  ulapi_mutex_take(nodemgr_park_mutex);
+  retval = nodemgr_park_unlink(parked);
+#ifdef HAVE_NODEMGR_REACTOR
+  if (0 == retval && NULL != parked->conn) nodemgr_conn_parked(parked->conn, -1);
+#endif
+  ulapi_mutex_give(nodemgr_park_mutex);
+
+  return retval;
+}
+
+/* waits, on a handler thread, for a parked query to be answered */
+static void nodemgr_park_wait(nodemgr_parked_t *parked)
+{
+  ulapi_mutex_take(nodemgr_park_mutex);
+  while (! parked->done) {
+    ulapi_cond_wait(nodemgr_park_done_cond, nodemgr_park_mutex);
+  }
+  ulapi_mutex_give(nodemgr_park_mutex);
+}
+
+/* answers every query parked for 'component', which has just been added */
+static void nodemgr_park_complete(component_entry_t *component)
+{
+  nodemgr_parked_t **pp;
+  nodemgr_parked_t *parked;
+  unsigned int key;
+
+  key = nodemgr_key(component);
+  ulapi_mutex_take(nodemgr_park_mutex);
+  for (pp = &nodemgr_parked[nodemgr_hash(key, NODEMGR_PARK_BITS)]; NULL != *pp; ) {
+    parked = *pp;
+    if (parked->key != key) {
+      pp = &parked->next;
+      continue;
+    }
+    *pp = parked->next;
+    nodemgr_park_heap_remove(parked);
+    parked->component = *component;
+    parked->found = 1;
+    nodemgr_park_answer(parked);
+  }
+  ulapi_mutex_give(nodemgr_park_mutex);
+}
+
+/*
+  Components we heard of from other node managers are kept only until
+  they've gone unheard of for the expiry, since we're never told when
+  they go away. Their owners only report them when asked, so once one
+  is halfway to expiring the housekeeper asks for it, and again each
+  quarter of the expiry after, and the report keeps it. They're hashed
+  by key, to be found as they're heard of again, and listed oldest
+  first, so the housekeeper only looks at the ones that are due.
+  Clients that cache or subscribe to one that does expire are told
+  it's gone, and the next lookup for it asks the network again.
+*/
+
+typedef struct nodemgr_heard {
+  struct nodemgr_heard *next;	/* in its bucket */
+  struct nodemgr_heard *older;
+  struct nodemgr_heard *newer;
+  unsigned int key;
+  component_entry_t component;	/* as last heard */
+  ulapi_real when;
+  ulapi_real asked;		/* when we last asked for it since, or 0 */
+} nodemgr_heard_t;
+
+static nodemgr_heard_t *nodemgr_heard[1 << NODEMGR_PARK_BITS];
+static nodemgr_heard_t *nodemgr_heard_oldest = NULL;
+static nodemgr_heard_t *nodemgr_heard_newest = NULL;
+static void *nodemgr_heard_mutex = NULL; /* for all of these */
+
+/* takes 'heard' off the list, but not its bucket; the mutex is held */
+static void nodemgr_heard_unlist(nodemgr_heard_t *heard)
+{
+  if (NULL != heard->older) heard->older->newer = heard->newer;
+  else nodemgr_heard_oldest = heard->newer;
+  if (NULL != heard->newer) heard->newer->older = heard->older;
+  else nodemgr_heard_newest = heard->older;
+}
+
+/* notes that we've just heard of 'component' from another node manager */
+static void nodemgr_hear(component_entry_t *component)
+{
+  nodemgr_heard_t *heard;
+  unsigned int key;
+
+  if (nodemgr_expiry <= 0) return;
+
+  key = nodemgr_key(component);
+  ulapi_mutex_take(nodemgr_heard_mutex);
+  for (heard = nodemgr_heard[nodemgr_hash(key, NODEMGR_PARK_BITS)]; NULL != heard; heard = heard->next) {
+    if (heard->key == key) break;
+  }
+  if (NULL == heard) {
+    heard = malloc(sizeof(*heard));
+    if (NULL == heard) {
+      ulapi_mutex_give(nodemgr_heard_mutex);
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Can't note when component %d %d %d %d was heard of, it won't expire\n", (int) component->component_id, (int) component->instance_id, (int) component->node_id, (int) component->subsystem_id);
+      return;
+    }
+    heard->key = key;
+    heard->next = nodemgr_heard[nodemgr_hash(key, NODEMGR_PARK_BITS)];
+    nodemgr_heard[nodemgr_hash(key, NODEMGR_PARK_BITS)] = heard;
+  } else {
+    nodemgr_heard_unlist(heard);
+  }
+  heard->component = *component;
+  heard->when = ulapi_time();
+  heard->asked = 0;
+  heard->older = nodemgr_heard_newest;
+  heard->newer = NULL;
+  if (NULL != nodemgr_heard_newest) nodemgr_heard_newest->newer = heard;
+  else nodemgr_heard_oldest = heard;
+  nodemgr_heard_newest = heard;
+  ulapi_mutex_give(nodemgr_heard_mutex);
+}
+
+/*
+  Drops the components that have gone unheard of for the expiry, and
+  tells their clients, then asks the network for the ones that are
+  halfway there, so those still about are reported and kept.
+*/
+static void nodemgr_expire(nodemgr_handler_args_t *args)
+{
+  nodemgr_heard_t **pp;
+  nodemgr_heard_t *heard;
+  component_entry_t component;
+  ulapi_real now;
+
+  if (nodemgr_expiry <= 0) return;
+
+  now = ulapi_time();
+  for (;;) {
+    ulapi_mutex_take(nodemgr_heard_mutex);
+    heard = nodemgr_heard_oldest;
+    if (NULL == heard || now - heard->when < nodemgr_expiry) {
+      ulapi_mutex_give(nodemgr_heard_mutex);
+      break;
+    }
+    nodemgr_heard_unlist(heard);
+    for (pp = &nodemgr_heard[nodemgr_hash(heard->key, NODEMGR_PARK_BITS)]; *pp != heard; pp = &(*pp)->next);
+    *pp = heard->next;
+    ulapi_mutex_give(nodemgr_heard_mutex);
+
+    /* only if it's still as we heard it, and not since registered with us */
+    component = heard->component;
+    if (0 <= db_find(&db, &component) &&
+	component.address == heard->component.address &&
+	component.port == heard->component.port &&
+	component.address != nodemgr_host_address &&
+	0 <= db_remove(&db, &component)) {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Component %d %d %d %d expired\n", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+      nodemgr_changed(args, &component, SMSG_CHANGE_REMOVE);
+    }
+    free(heard);
+  }
+
+  ulapi_mutex_take(nodemgr_heard_mutex);
+  for (heard = nodemgr_heard_oldest; NULL != heard && now - heard->when >= 0.5 * nodemgr_expiry; heard = heard->newer) {
+    /* a report or a query can be lost, so ask more than once */
+    if (now - heard->asked < 0.25 * nodemgr_expiry) continue;
+    heard->asked = now;
+    smsg_print_debug(SMSG_DEBUG_BCAST, "Asking whether component %d %d %d %d is still there\n", (int) heard->component.component_id, (int) heard->component.instance_id, (int) heard->component.node_id, (int) heard->component.subsystem_id);
+    nodemgr_query_onereg(args->broadcaster, &heard->component);
+  }
+  ulapi_mutex_give(nodemgr_heard_mutex);
+}
+
+/*
+  Does what can wait, off the reactors: keeps the shared registry's
+  readers trusting it, compacts the store once enough is logged, and
+  expires the components other node managers haven't mentioned lately.
+*/
+static void nodemgr_housekeeper(void *args)
+{
+  for (;;) {
+    ulapi_sleep(SMSG_SHM_BEAT);
+    db_beat_shm(&db);
+    db_compact_store_due(&db);
+    nodemgr_expire((nodemgr_handler_args_t *) args);
+  }
+}
+
+/* waits until 'deadline', or until woken for an earlier one; the mutex is held */
+static void nodemgr_park_sleep(ulapi_real deadline)
+{
+  ulapi_real wait;
+#ifdef HAVE_NODEMGR_PARK_WAKE
+  struct pollfd pfd;
+  char drain[64];
+#endif
+
+  wait = deadline - ulapi_time();
+  if (wait <= 0) return;
+#ifdef HAVE_NODEMGR_PARK_WAKE
+  nodemgr_park_waking = deadline;
+  ulapi_mutex_give(nodemgr_park_mutex);
+  pfd.fd = nodemgr_park_wake[0];
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  /* round up, so it's not woken just short of the deadline */
+  if (poll(&pfd, 1, (int) (1000 * wait) + 1) > 0 && (pfd.revents & POLLIN)) {
+    if (read(nodemgr_park_wake[0], drain, sizeof(drain)) < 0) {
+      smsg_print_debug(SMSG_DEBUG_REG, "Can't read the timer's wakeups\n");
+    }
+  }
+  ulapi_mutex_take(nodemgr_park_mutex);
+  nodemgr_park_waking = 0;
+#else
+  ulapi_mutex_give(nodemgr_park_mutex);
+  ulapi_sleep(wait < NODEMGR_PARK_TICK ? wait : NODEMGR_PARK_TICK);
+  ulapi_mutex_take(nodemgr_park_mutex);
+#endif
+}
+
+/* answers parked queries as they run out of time, with empty reports */
+static void nodemgr_park_timer(void *args)
+{
+  nodemgr_parked_t *parked;
+
+  (void) args;
+
+  ulapi_mutex_take(nodemgr_park_mutex);
+  for (;;) {
+    while (0 == nodemgr_parked_count) {
+      ulapi_cond_wait(nodemgr_park_timer_cond, nodemgr_park_mutex);
+    }
+    parked = nodemgr_park_heap[0];
+    if (parked->deadline > ulapi_time()) {
+      nodemgr_park_sleep(parked->deadline);
+      continue;
+    }
+    nodemgr_park_unlink(parked);
+    parked->found = 0;
+    nodemgr_count(SMSG_STATS_TIMEOUTS);
+    nodemgr_park_answer(parked);
+  }
+}
+
+/* sends a REPORT_CHANGE for 'component', with 0s if it's been removed */
+static void nodemgr_report_change(nodemgr_handler_args_t *args, int fd, component_entry_t *component, smsg_byte change, smsg_byte sequence_number)
+{
+  smsg_report_change_t report_change;
+  int smsg_outbuflen;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
+  int writebuflen;
+
+  report_change.sequence_number = sequence_number;
+  report_change.change = change;
+  report_change.component_id = component->component_id;
+  report_change.instance_id = component->instance_id;
+  report_change.node_id = component->node_id;
+  report_change.subsystem_id = component->subsystem_id;
+  report_change.address = (SMSG_CHANGE_ADD == change) ? component->address : 0;
+  report_change.port = (SMSG_CHANGE_ADD == change) ? component->port : 0;
+  smsg_outbuflen = smsg_report_change_to_message(&report_change, smsg_outbuf);
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+  nodemgr_write(args, fd, writebuf, writebuflen);
+}
+
+/* streams the REPORT_MATCHREGs of what matches 'component' under 'mask' */
+static void nodemgr_report_matchreg(nodemgr_handler_args_t *args, int fd, component_entry_t *component, smsg_byte mask, smsg_byte sequence_number)
+{
+  smsg_report_matchreg_t report_matchreg;
+  component_snapshot_t *snapshot;
+  int index;
+  int smsg_outbuflen;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
+  int writebuflen;
+
+  snapshot = db_match(&db, component, mask);
+  smsg_print_debug(SMSG_DEBUG_REG, "Matched %d components to %d %d %d %d mask 0x%X\n", NULL == snapshot ? 0 : snapshot->count, (int) component->component_id, (int) component->instance_id, (int) component->node_id, (int) component->subsystem_id, (int) mask);
+  report_matchreg.sequence_number = sequence_number;
+  index = 0;
+  do {
+    for (report_matchreg.count = 0;
+	 report_matchreg.count < SMSG_MATCHREG_ENTRIES && NULL != snapshot && index < snapshot->count;
+	 report_matchreg.count++, index++) {
+      report_matchreg.entries[report_matchreg.count].component_id = snapshot->entries[index].component_id;
+      report_matchreg.entries[report_matchreg.count].instance_id = snapshot->entries[index].instance_id;
+      report_matchreg.entries[report_matchreg.count].node_id = snapshot->entries[index].node_id;
+      report_matchreg.entries[report_matchreg.count].subsystem_id = snapshot->entries[index].subsystem_id;
+      report_matchreg.entries[report_matchreg.count].address = snapshot->entries[index].address;
+      report_matchreg.entries[report_matchreg.count].port = snapshot->entries[index].port;
+    }
+    report_matchreg.more = (NULL != snapshot && index < snapshot->count) ? 1 : 0;
+    smsg_outbuflen = smsg_report_matchreg_to_message(&report_matchreg, smsg_outbuf);
+    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+    nodemgr_write(args, fd, writebuf, writebuflen);
+  } while (report_matchreg.more);
+  if (NULL != snapshot) db_snapshot_release(&db, snapshot);
+}
+
+/* sends a REPORT_DYNREG for 'component', empty if it wasn't found */
+static void nodemgr_report_dynreg(nodemgr_handler_args_t *args, int fd, component_entry_t *component, int found, smsg_byte sequence_number)
+{
+  smsg_report_dynreg_t report_dynreg;
+  int smsg_outbuflen;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
+  int writebuflen;
+
+  report_dynreg.sequence_number = sequence_number;
+  report_dynreg.component_id = component->component_id;
+  report_dynreg.instance_id = component->instance_id;
+  report_dynreg.node_id = component->node_id;
+  report_dynreg.subsystem_id = component->subsystem_id;
+  report_dynreg.address = found ? component->address : 0;
+  report_dynreg.port = found ? component->port : 0;
+  smsg_outbuflen = smsg_report_dynreg_to_message(&report_dynreg, smsg_outbuf);
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+  nodemgr_write(args, fd, writebuf, writebuflen);
+}
+
+static int nodemgr_broadcast_handler(smsg_byte *smsg_inbuf, int broadcastee_fd, void *handler_args)
+{
+  shared_fd_t *broadcaster;
+  smsg_byte identifier;
+  component_entry_t component;
+  component_entry_t known;
+  component_snapshot_t *snapshot;
+  int index;
+  smsg_query_allreg_t query_allreg;
+  smsg_query_onereg_t query_onereg;
+  smsg_report_allreg_t report_allreg;
+
+  (void) broadcastee_fd;
+
+  broadcaster = ((nodemgr_handler_args_t *) handler_args)->broadcaster;
+  identifier = smsg_message_identifier(smsg_inbuf);
+  nodemgr_count(SMSG_STATS_BROADCASTS_RECEIVED);
+
+  smsg_print_debug(SMSG_DEBUG_MSG, "Got broadcast message %s\n", smsg_id_to_string(identifier));
+
+  /* handle message */
+  switch (identifier) {
+  case SMSG_CODE_QUERY_ALLREG:
+    /* we got a query, so report all we have */
+    smsg_message_to_query_allreg(smsg_inbuf, &query_allreg);
+    /* no parameters except sequence_number, which we're ignoring */
+    snapshot = db_snapshot(&db);
+    if (NULL == snapshot) {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Can't get db snapshot to report\n");
+      break;
+    }
+    if (! nodemgr_dump_due(broadcaster, snapshot->generation)) {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Just reported these components, not again\n");
+      db_snapshot_release(&db, snapshot);
+      break;
+    }
+    for (index = 0; index < snapshot->count; index++) {
+      nodemgr_report_allreg(broadcaster, &snapshot->entries[index]);
+    }
+    db_snapshot_release(&db, snapshot);
+    break;
+
+  case SMSG_CODE_QUERY_ONEREG:
+    /* we got a query for one component, which we answer only if it's ours */
+    smsg_message_to_query_onereg(smsg_inbuf, &query_onereg);
+    component.component_id = query_onereg.component_id;
+    component.instance_id = query_onereg.instance_id;
+    component.node_id = query_onereg.node_id;
+    component.subsystem_id = query_onereg.subsystem_id;
+    if (0 > db_find(&db, &component) || component.address != nodemgr_host_address) {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "Component %d %d %d %d isn't ours to report\n", (int) query_onereg.component_id, (int) query_onereg.instance_id, (int) query_onereg.node_id, (int) query_onereg.subsystem_id);
+      break;
+    }
+    nodemgr_report_allreg(broadcaster, &component);
+    break;
+
+  case SMSG_CODE_REPORT_ALLREG:
+    /* we got some news on a component from another node manager */
+    smsg_message_to_report_allreg(smsg_inbuf, &report_allreg);
+    component.component_id = report_allreg.component_id;
+    component.instance_id = report_allreg.instance_id;
+    component.node_id = report_allreg.node_id;
+    component.subsystem_id = report_allreg.subsystem_id;
+    component.address = report_allreg.address;
+    component.port = report_allreg.port;
+    component.fd = -1;
+    /* ignore component.fd */
+    known = component;
+    if (0 > db_find(&db, &known)) {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "News on component %d %d %d %d %s %d\n", 
+	      (int) component.component_id,
+	      (int) component.instance_id,
+	      (int) component.node_id,
+	      (int) component.subsystem_id,
+	      ulapi_address_to_hostname(component.address),
+	      (int) component.port);
+      if (0 > db_add(&db, &component)) {
+	smsg_print_debug(SMSG_DEBUG_BCAST, "Can't update db with broadcast entry\n");
+      } else {
+	nodemgr_hear(&component);
+	nodemgr_park_complete(&component);
+	nodemgr_changed(handler_args, &component, SMSG_CHANGE_ADD);
+      }
+    } else if (known.address != nodemgr_host_address &&
+	       known.address == component.address &&
+	       known.port == component.port) {
+      /* it's still there, so it keeps */
+      nodemgr_hear(&component);
+    } else {
+      smsg_print_debug(SMSG_DEBUG_BCAST, "This one is my component\n");
+    }
+    break;
+
+  default:
+    smsg_print_debug(SMSG_DEBUG_MSG, "Unknown message type: %d\n", (int) identifier);
+    break;
+  } /* switch (identifier) */
+
+  return 0;
+}
+
+static int nodemgr_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_args)
+{
+  smsg_byte identifier;
+  component_entry_t component;
+  int bad;
+  smsg_request_dynreg_t request_dynreg;
+  smsg_reply_dynreg_t reply_dynreg;
+  smsg_request_unreg_t request_unreg;
+  smsg_query_dynreg_t query_dynreg;
+  smsg_query_cachereg_t query_cachereg;
+  smsg_query_waitreg_t query_waitreg;
+  nodemgr_parked_t *parked;
+  int found;
+  smsg_query_matchreg_t query_matchreg;
+  smsg_report_matchreg_t report_matchreg;
+  int index;
+  smsg_query_multireg_t query_multireg;
+  smsg_request_subscribe_t request_subscribe;
+  smsg_request_unsubscribe_t request_unsubscribe;
+  smsg_query_stats_t query_stats;
+  smsg_report_stats_t report_stats;
+  ulapi_real since;
+  int smsg_outbuflen;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
+  int writebuflen;
+
+  since = ulapi_time();
+  identifier = smsg_message_identifier(smsg_inbuf);
+
+  smsg_print_debug(SMSG_DEBUG_MSG, "Got node message %s\n", smsg_id_to_string(identifier));
+
+  /* handle message */
+  switch (identifier) {
+  case SMSG_CODE_REQUEST_DYNREG:
+    /* register this component and reply */
+    smsg_message_to_request_dynreg(smsg_inbuf, &request_dynreg);
+    component.component_id = request_dynreg.component_id;
+    component.instance_id = request_dynreg.instance_id;
+    if (request_dynreg.node_id != smsg_get_node_id()) {
+      smsg_print_debug(SMSG_DEBUG_REG, "Component node id %d doesn't match node manager node id %d\n", (int) request_dynreg.node_id, (int) smsg_get_node_id());
+    }
+    if (request_dynreg.subsystem_id != smsg_get_subsystem_id()) {
+      smsg_print_debug(SMSG_DEBUG_REG, "Component subsystem id %d doesn't match node manager subsystem id %d\n", (int) request_dynreg.subsystem_id, (int) smsg_get_subsystem_id());
+    }
+    component.node_id = request_dynreg.node_id;
+    component.subsystem_id = request_dynreg.subsystem_id;
+    component.address = ulapi_get_host_address();
+    component.port = 0;		/* will be filled in */
+    component.fd = -1;
+    found = (0 <= db_find(&db, &component));
+    /* finds it if it's already registered, otherwise adds it */
+    bad = (0 > db_add(&db, &component)) ? 1 : 0;
+    if (! bad) {
+      nodemgr_park_complete(&component);
+      if (! found) nodemgr_changed(handler_args, &component, SMSG_CHANGE_ADD);
+      /* queries for it go to its subsystem, so we have to be listening there */
+      nodemgr_join(((nodemgr_handler_args_t *) handler_args)->broadcaster, component.subsystem_id);
+    }
+    reply_dynreg.component_id = component.component_id;
+    reply_dynreg.instance_id = component.instance_id;
+    reply_dynreg.node_id = component.node_id;
+    reply_dynreg.subsystem_id = component.subsystem_id;
+    reply_dynreg.address = component.address;
+    reply_dynreg.port = component.port;
+    if (bad) {
+      /* reply that we can't register them due to db error */
+      reply_dynreg.address = 0;
+      reply_dynreg.port = 0;
+    }
+    smsg_print_debug(SMSG_DEBUG_REG, "Replying with %s port %d\n", ulapi_address_to_hostname(reply_dynreg.address), reply_dynreg.port);
+    reply_dynreg.sequence_number = request_dynreg.sequence_number;
+    smsg_outbuflen = smsg_reply_dynreg_to_message(&reply_dynreg, smsg_outbuf);
+    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+    nodemgr_write(handler_args, fd, writebuf, writebuflen);
+    nodemgr_count(SMSG_STATS_REGISTRATIONS);
+    nodemgr_latency(SMSG_STATS_REGISTER, since);
+    break;
+
+  case SMSG_CODE_REQUEST_UNREG:
+    /* drop this component if it registered with us, and reply with what it had */
+    smsg_message_to_request_unreg(smsg_inbuf, &request_unreg);
+    component.component_id = request_unreg.component_id;
+    component.instance_id = request_unreg.instance_id;
+    component.node_id = request_unreg.node_id;
+    component.subsystem_id = request_unreg.subsystem_id;
+    found = (0 <= db_find(&db, &component) &&
+	     component.address == nodemgr_host_address &&
+	     0 <= db_remove(&db, &component));
+    if (found) nodemgr_changed(handler_args, &component, SMSG_CHANGE_REMOVE);
+    smsg_print_debug(SMSG_DEBUG_REG, "%s component %d %d %d %d\n", found ? "Unregistered" : "Can't unregister", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+    reply_dynreg.sequence_number = request_unreg.sequence_number;
+    reply_dynreg.component_id = component.component_id;
+    reply_dynreg.instance_id = component.instance_id;
+    reply_dynreg.node_id = component.node_id;
+    reply_dynreg.subsystem_id = component.subsystem_id;
+    reply_dynreg.address = found ? component.address : 0;
+    reply_dynreg.port = found ? component.port : 0;
+    smsg_outbuflen = smsg_reply_dynreg_to_message(&reply_dynreg, smsg_outbuf);
+    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+    nodemgr_write(handler_args, fd, writebuf, writebuflen);
+    break;
+
+  case SMSG_CODE_REPLY_DYNREG:
+  case SMSG_CODE_REPORT_DYNREG:
+    /* we send these, shouldn't receive them */
+    smsg_print_debug(SMSG_DEBUG_REG, "Unexpected message type: %d\n", (int) identifier);
+    break;
+
+  case SMSG_CODE_QUERY_DYNREG:
+    /* look up this component and report */
+    smsg_message_to_query_dynreg(smsg_inbuf, &query_dynreg);
+    component.component_id = query_dynreg.component_id;
+    component.instance_id = query_dynreg.instance_id;
+    component.node_id = query_dynreg.node_id;
+    component.subsystem_id = query_dynreg.subsystem_id;
+    found = (0 <= db_find(&db, &component));
+    nodemgr_count(SMSG_STATS_QUERIES);
+    if (! found) {
+      nodemgr_count(SMSG_STATS_MISSES);
+      /* can't find this component, so ask our other node manager
+	 brothers to send us news, unless we just did */
+      if (nodemgr_query_onereg(((nodemgr_handler_args_t *) handler_args)->broadcaster, &component)) {
+	smsg_print_debug(SMSG_DEBUG_REG, "No record of component %d %d %d %d, broadcasting for news\n", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+      } else {
+	smsg_print_debug(SMSG_DEBUG_REG, "No record of component %d %d %d %d, waiting on news already asked for\n", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+      }
+    }
+    /* now send the report to the queryer, empty if we don't have it */
+    nodemgr_report_dynreg(handler_args, fd, &component, found, query_dynreg.sequence_number);
+    nodemgr_latency(SMSG_STATS_QUERY, since);
+    break;
+
+  case SMSG_CODE_QUERY_CACHEREG:
+    /* look up this component for a client that caches it, and tell it of changes */
+    smsg_message_to_query_cachereg(smsg_inbuf, &query_cachereg);
+    component.component_id = query_cachereg.component_id;
+    component.instance_id = query_cachereg.instance_id;
+    component.node_id = query_cachereg.node_id;
+    component.subsystem_id = query_cachereg.subsystem_id;
+    /* noted first, so a change after the lookup is pushed after the answer */
+    bad = (0 != nodemgr_interest_add(((nodemgr_handler_args_t *) handler_args)->conn, &component, SMSG_MATCH_ALL, 0));
+    found = (0 <= db_find(&db, &component));
+    nodemgr_count(SMSG_STATS_QUERIES);
+    if (! found) {
+      nodemgr_count(SMSG_STATS_MISSES);
+      nodemgr_query_onereg(((nodemgr_handler_args_t *) handler_args)->broadcaster, &component);
+    }
+    if (bad) {
+      /* we can't push to it, so it shouldn't cache it */
+      nodemgr_report_dynreg(handler_args, fd, &component, found, query_cachereg.sequence_number);
+    } else {
+      nodemgr_report_change(handler_args, fd, &component, found ? SMSG_CHANGE_ADD : SMSG_CHANGE_REMOVE, query_cachereg.sequence_number);
+    }
+    nodemgr_latency(SMSG_STATS_QUERY, since);
+    break;
+
+  case SMSG_CODE_QUERY_WAITREG:
+    /* look up this component, and if it's not here, wait for it */
+    smsg_message_to_query_waitreg(smsg_inbuf, &query_waitreg);
+    component.component_id = query_waitreg.component_id;
+    component.instance_id = query_waitreg.instance_id;
+    component.node_id = query_waitreg.node_id;
+    component.subsystem_id = query_waitreg.subsystem_id;
+    found = (0 <= db_find(&db, &component));
+    nodemgr_count(SMSG_STATS_QUERIES);
+    if (! found) nodemgr_count(SMSG_STATS_MISSES);
+    if (found || 0 == query_waitreg.timeout) {
+      nodemgr_report_dynreg(handler_args, fd, &component, found, query_waitreg.sequence_number);
+      nodemgr_latency(SMSG_STATS_QUERY, since);
+      break;
+    }
+    parked = malloc(sizeof(*parked));
+    if (NULL == parked) {
+      nodemgr_report_dynreg(handler_args, fd, &component, 0, query_waitreg.sequence_number);
+      break;
+    }
+    if (query_waitreg.timeout > NODEMGR_PARK_TIMEOUT_MAX) query_waitreg.timeout = NODEMGR_PARK_TIMEOUT_MAX;
+    parked->key = nodemgr_key(&component);
+    parked->since = since;
+    parked->deadline = since + 0.001 * query_waitreg.timeout;
+    parked->sequence_number = query_waitreg.sequence_number;
+    parked->component = component;
+    parked->found = 0;
+    parked->conn = ((nodemgr_handler_args_t *) handler_args)->conn;
+    parked->done = 0;
+    parked->change = 0;
+    if (0 != nodemgr_park(parked)) {
+      smsg_print_debug(SMSG_DEBUG_REG, "Too many queries waiting, not waiting for component %d %d %d %d\n", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+      free(parked);
+      nodemgr_report_dynreg(handler_args, fd, &component, 0, query_waitreg.sequence_number);
+      break;
+    }
+    smsg_print_debug(SMSG_DEBUG_REG, "Waiting up to %d ms for component %d %d %d %d\n", (int) query_waitreg.timeout, (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+    nodemgr_query_onereg(((nodemgr_handler_args_t *) handler_args)->broadcaster, &component);
+    /* it may have been added after we looked, but before it was parked */
+    if (0 <= db_find(&db, &component) && 0 == nodemgr_unpark(parked)) {
+      free(parked);
+      nodemgr_report_dynreg(handler_args, fd, &component, 1, query_waitreg.sequence_number);
+      nodemgr_latency(SMSG_STATS_WAIT, since);
+      break;
+    }
+    if (NULL != parked->conn) {
+      /* its event loop will answer it */
+      break;
+    }
+    nodemgr_park_wait(parked);
+    nodemgr_report_dynreg(handler_args, fd, &parked->component, parked->found, parked->sequence_number);
+    nodemgr_latency(SMSG_STATS_WAIT, parked->since);
+    free(parked);
+    break;
+
+  case SMSG_CODE_QUERY_MATCHREG:
+    /* look up everything that matches and stream it back */
+    smsg_message_to_query_matchreg(smsg_inbuf, &query_matchreg);
+    component.component_id = query_matchreg.component_id;
+    component.instance_id = query_matchreg.instance_id;
+    component.node_id = query_matchreg.node_id;
+    component.subsystem_id = query_matchreg.subsystem_id;
+    nodemgr_report_matchreg(handler_args, fd, &component, query_matchreg.mask, query_matchreg.sequence_number);
+    nodemgr_count(SMSG_STATS_QUERIES);
+    nodemgr_latency(SMSG_STATS_QUERY, since);
+    break;
+
+  case SMSG_CODE_QUERY_MULTIREG:
+    /* look up each of these components and report them all, found or not */
+    if (0 != smsg_message_to_query_multireg(smsg_inbuf, &query_multireg)) {
+      smsg_print_debug(SMSG_DEBUG_MSG, "Bad multiple query of %d keys\n", (int) query_multireg.count);
+      break;
+    }
+    report_matchreg.sequence_number = query_multireg.sequence_number;
+    index = 0;
+    do {
+      for (report_matchreg.count = 0;
+	   report_matchreg.count < SMSG_MATCHREG_ENTRIES && index < query_multireg.count;
+	   report_matchreg.count++, index++) {
+	component.component_id = query_multireg.keys[index].component_id;
+	component.instance_id = query_multireg.keys[index].instance_id;
+	component.node_id = query_multireg.keys[index].node_id;
+	component.subsystem_id = query_multireg.keys[index].subsystem_id;
+	nodemgr_count(SMSG_STATS_QUERIES);
+	if (0 > db_find(&db, &component)) {
+	  nodemgr_count(SMSG_STATS_MISSES);
+	  nodemgr_query_onereg(((nodemgr_handler_args_t *) handler_args)->broadcaster, &component);
+	  component.address = 0;
+	  component.port = 0;
+	}
+	report_matchreg.entries[report_matchreg.count].component_id = component.component_id;
+	report_matchreg.entries[report_matchreg.count].instance_id = component.instance_id;
+	report_matchreg.entries[report_matchreg.count].node_id = component.node_id;
+	report_matchreg.entries[report_matchreg.count].subsystem_id = component.subsystem_id;
+	report_matchreg.entries[report_matchreg.count].address = component.address;
+	report_matchreg.entries[report_matchreg.count].port = component.port;
+      }
+      report_matchreg.more = (index < query_multireg.count) ? 1 : 0;
+      smsg_outbuflen = smsg_report_matchreg_to_message(&report_matchreg, smsg_outbuf);
+      writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+      nodemgr_write(handler_args, fd, writebuf, writebuflen);
+    } while (report_matchreg.more);
+    smsg_print_debug(SMSG_DEBUG_REG, "Reported %d components at once\n", (int) query_multireg.count);
+    nodemgr_latency(SMSG_STATS_QUERY, since);
+    break;
+
+  case SMSG_CODE_REQUEST_SUBSCRIBE:
+    /* note what this client wants pushed, then report what matches now */
+    smsg_message_to_request_subscribe(smsg_inbuf, &request_subscribe);
+    component.component_id = request_subscribe.component_id;
+    component.instance_id = request_subscribe.instance_id;
+    component.node_id = request_subscribe.node_id;
+    component.subsystem_id = request_subscribe.subsystem_id;
+    nodemgr_count(SMSG_STATS_QUERIES);
+    if (0 != nodemgr_interest_add(((nodemgr_handler_args_t *) handler_args)->conn, &component, request_subscribe.mask, 1)) {
+      smsg_print_debug(SMSG_DEBUG_REG, "Can't push changes to this client\n");
+      nodemgr_report_dynreg(handler_args, fd, &component, 0, request_subscribe.sequence_number);
+      break;
+    }
+    nodemgr_report_matchreg(handler_args, fd, &component, request_subscribe.mask, request_subscribe.sequence_number);
+    nodemgr_latency(SMSG_STATS_QUERY, since);
+    break;
+
+  case SMSG_CODE_REQUEST_UNSUBSCRIBE:
+    /* stop pushing these changes, and say so */
+    smsg_message_to_request_unsubscribe(smsg_inbuf, &request_unsubscribe);
+    component.component_id = request_unsubscribe.component_id;
+    component.instance_id = request_unsubscribe.instance_id;
+    component.node_id = request_unsubscribe.node_id;
+    component.subsystem_id = request_unsubscribe.subsystem_id;
+    if (0 != nodemgr_interest_drop(((nodemgr_handler_args_t *) handler_args)->conn, &component, request_unsubscribe.mask)) {
+      smsg_print_debug(SMSG_DEBUG_REG, "No subscription to %d %d %d %d mask 0x%X\n", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id, (int) request_unsubscribe.mask);
+    }
+    reply_dynreg.sequence_number = request_unsubscribe.sequence_number;
+    reply_dynreg.component_id = component.component_id;
+    reply_dynreg.instance_id = component.instance_id;
+    reply_dynreg.node_id = component.node_id;
+    reply_dynreg.subsystem_id = component.subsystem_id;
+    reply_dynreg.address = 0;
+    reply_dynreg.port = 0;
+    smsg_outbuflen = smsg_reply_dynreg_to_message(&reply_dynreg, smsg_outbuf);
+    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+    nodemgr_write(handler_args, fd, writebuf, writebuflen);
+    break;
+
+  case SMSG_CODE_QUERY_STATS:
+    /* report how we're doing */
+    smsg_message_to_query_stats(smsg_inbuf, &query_stats);
+    nodemgr_stats_get(&report_stats);
+    report_stats.sequence_number = query_stats.sequence_number;
+    smsg_outbuflen = smsg_report_stats_to_message(&report_stats, smsg_outbuf);
+    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+    nodemgr_write(handler_args, fd, writebuf, writebuflen);
+    break;
+
+  default:
+    smsg_print_debug(SMSG_DEBUG_MSG, "Unknown message type: %d\n", (int) identifier);
+    break;
+  } /* switch (identifier) */
+
+  return 0;
+}
+
+/* says who's on a new client connection, if it's local and we can tell */
+static void nodemgr_log_client(int client_fd)
+{
+  int pid, uid, gid;
+
+  if (0 == smsg_get_peer_credentials(client_fd, &pid, &uid, &gid)) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Got a local client connection on fd %d from process %d, user %d, group %d\n", client_fd, pid, uid, gid);
+  } else {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Got a client connection on fd %d\n", client_fd);
+  }
+}
+
+#ifdef HAVE_NODEMGR_REACTOR
+
+/*
+  Each event loop serves a listening socket and its client connections
+  from one thread with epoll, instead of a thread per client, and the
+  first one serves the broadcastee socket too. Each connection keeps
+  its own decoder state, so messages can arrive in any pieces, and its
+  own queue of output that the socket wouldn't take yet, which is sent
+  as it drains.
+
+  With more than one event loop, each has its own listener on the port,
+  shared through SO_REUSEPORT so that the kernel spreads new clients
+  over them, and each runs pinned to its own processor. They share only
+  the database, whose lookups don't lock.
+
+  With io_uring turned on, each event loop runs on a ring instead of
+  epoll. The listener and every connection keep a multishot accept or
+  receive armed, input is decoded straight from the ring's buffers,
+  and each connection has at most one send in flight, from 'out',
+  while anything written meanwhile waits in 'later'. The sends for all
+  the connections served in a pass go to the kernel together with the
+  next wait. A connection that's done with is shut down and freed once
+  the ring has nothing more of its in flight.
+
+  Answers to parked queries can come from any thread, so they're put
+  in the client's event loop's mailbox, and a byte on the loop's wake
+  socket gets it to send them.
+*/
+
+enum {
+  NODEMGR_READ_SIZE = 4096,	/* how much to read at once */
+  NODEMGR_EVENTS = 64,		/* how many events to take at once */
+  NODEMGR_BUFFERS = 256,	/* io_uring receive buffers per event loop */
+  NODEMGR_OUT_MAX = 1 << 20	/* most output to queue for a client */
+};
+
+typedef enum {
+  NODEMGR_LISTENER,		/* accepts clients */
+  NODEMGR_CLIENT,		/* a client's stream */
+  NODEMGR_DATAGRAM,		/* the broadcastee's datagrams */
+  NODEMGR_WAKER			/* says there's mail */
+} nodemgr_conn_kind_t;
+
+typedef struct {
+  int epoll_fd;
+  void *ring;			/* the io_uring, if it's on one instead */
+  int listen_fd;
+  int local_fd;			/* the local socket's listener, or -1 if another loop has it */
+  int broadcastee_fd;		/* or -1 if another loop has it */
+  int cpu;			/* to run on, or -1 for anywhere */
+  shared_fd_t *broadcaster;
+  nodemgr_parked_t *mailbox;	/* answered queries to send, under the park mutex */
+  int wake_fd[2];		/* written to say there's mail, read by the loop */
+} nodemgr_reactor_t;
+
+typedef struct nodemgr_conn {
+  nodemgr_reactor_t *reactor;	/* the event loop it's on */
+  nodemgr_conn_kind_t kind;
+  int fd;
+  smsg_message_handler_t handler;
+  nodemgr_handler_args_t args;	/* what 'handler' gets */
+  char readbuf[NODEMGR_READ_SIZE];
+  serdes_decode_state state;
+  smsg_byte inbuf[SMSG_INBUFSIZE];
+  char *out;			/* queued output, from 'outpos' to 'outlen' */
+  int outpos;
+  int outlen;
+  int outsize;
+  int writing;			/* waiting for the socket to drain */
+  char *later;			/* output waiting for the ring's send from 'out' */
+  int laterlen;
+  int latersize;
+  int inflight;			/* ring requests not yet completed */
+  int parked;			/* its queries parked, notes and mail, under the park mutex */
+  int dead;			/* to be closed once we're done with it, 2 once shut down */
+} nodemgr_conn_t;
+
+/* puts a multishot accept or receive on the ring for 'conn' */
+static int nodemgr_conn_arm(nodemgr_conn_t *conn)
+{
+  int retval;
+
+  if (NODEMGR_LISTENER == conn->kind) {
+    retval = smsg_uring_accept(conn->reactor->ring, conn->fd, conn);
+  } else {
+    retval = smsg_uring_recv(conn->reactor->ring, conn->fd, conn);
+  }
+  if (0 == retval) conn->inflight++;
+
+  return retval;
+}
+
+static nodemgr_conn_t *nodemgr_conn_new(nodemgr_reactor_t *reactor, nodemgr_conn_kind_t kind, int fd, smsg_message_handler_t handler)
+{
+  nodemgr_conn_t *conn;
+  struct epoll_event event;
+
+  conn = malloc(sizeof(*conn));
+  if (NULL == conn) return NULL;
+
+  conn->reactor = reactor;
+  conn->kind = kind;
+  conn->fd = fd;
+  conn->handler = handler;
+  conn->args.broadcaster = reactor->broadcaster;
+  conn->args.conn = (NODEMGR_CLIENT == kind) ? conn : NULL;
+  conn->out = NULL;
+  conn->outpos = 0;
+  conn->outlen = 0;
+  conn->outsize = 0;
+  conn->writing = 0;
+  conn->later = NULL;
+  conn->laterlen = 0;
+  conn->latersize = 0;
+  conn->inflight = 0;
+  conn->parked = 0;
+  conn->dead = 0;
+  if (0 != serdes_decode_state_init(&conn->state, conn->readbuf, (char *) conn->inbuf, NODEMGR_READ_SIZE, SMSG_INBUFSIZE)) {
+    free(conn);
+    return NULL;
+  }
+
+  ulapi_socket_set_nonblocking(fd);
+  if (NULL != reactor->ring) {
+    if (0 != nodemgr_conn_arm(conn)) {
+      free(conn);
+      return NULL;
+    }
+    return conn;
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  if (0 != epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    free(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+static void nodemgr_park_cancel(nodemgr_conn_t *conn);
+
+static void nodemgr_conn_close(nodemgr_conn_t *conn)
+{
+  smsg_print_debug(SMSG_DEBUG_MSG, "Closing connection on fd %d\n", conn->fd);
+  nodemgr_park_cancel(conn);
+  if (NULL == conn->reactor->ring) epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  ulapi_socket_close(conn->fd);
+  if (NULL != conn->out) free(conn->out);
+  if (NULL != conn->later) free(conn->later);
+  free(conn);
+}
+
+/* makes 'buf' at least 'need' big; returns 0, or -1 if it can't */
+static int nodemgr_grow(char **buf, int *size, int need)
+{
+  char *grown;
+  int newsize;
+
+  if (need <= *size) return 0;
+  for (newsize = *size > 0 ? *size : NODEMGR_READ_SIZE; newsize < need; newsize *= 2);
+  grown = realloc(*buf, newsize);
+  if (NULL == grown) return -1;
+  *buf = grown;
+  *size = newsize;
+
+  return 0;
+}
+
+/* asks to hear when the socket will take more, or stops asking */
+static void nodemgr_conn_want_write(nodemgr_conn_t *conn, int writing)
+{
+  struct epoll_event event;
+
+  if (conn->writing == writing) return;
+  conn->writing = writing;
+  event.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+  event.data.ptr = conn;
+  epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/* sends what's queued until it's gone or the socket is full */
+static void nodemgr_conn_flush(nodemgr_conn_t *conn)
+{
+  int n;
+
+  if (NULL != conn->reactor->ring) {
+    /* one send at a time, so the ring's sends stay in order */
+    if (conn->writing || conn->outpos == conn->outlen) return;
+    if (0 != smsg_uring_send(conn->reactor->ring, conn->fd, conn->out + conn->outpos, conn->outlen - conn->outpos, conn)) {
+      conn->dead = 1;
+      return;
+    }
+    conn->writing = 1;
+    conn->inflight++;
+    return;
+  }
+
+  while (conn->outpos < conn->outlen) {
+    n = send(conn->fd, conn->out + conn->outpos, conn->outlen - conn->outpos, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (EINTR == errno) continue;
+      if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+      conn->dead = 1;
+      return;
+    }
+    conn->outpos += n;
+  }
+
+  if (conn->outpos == conn->outlen) {
+    conn->outpos = conn->outlen = 0;
+    nodemgr_conn_want_write(conn, 0);
+  } else {
+    nodemgr_conn_want_write(conn, 1);
+  }
+}
+
+/* queues output for the client, sending right away if nothing's ahead of it */
+static void nodemgr_conn_write(nodemgr_conn_t *conn, const char *buf, int len)
+{
+  if (conn->dead) return;
+
+  if (NULL != conn->reactor->ring && conn->writing) {
+    /* the ring is sending from 'out', which mustn't move until it's done */
+    if (conn->outlen - conn->outpos + conn->laterlen + len > NODEMGR_OUT_MAX) {
+      smsg_print_debug(SMSG_DEBUG_MSG, "Client on fd %d isn't reading, dropping it\n", conn->fd);
+      conn->dead = 1;
+      return;
+    }
+    if (0 != nodemgr_grow(&conn->later, &conn->latersize, conn->laterlen + len)) {
+      conn->dead = 1;
+      return;
+    }
+    memcpy(conn->later + conn->laterlen, buf, len);
+    conn->laterlen += len;
+    return;
+  }
+
+  if (conn->outlen + len > conn->outsize && conn->outpos > 0) {
+    /* slide what's left down to make room */
+    memmove(conn->out, conn->out + conn->outpos, conn->outlen - conn->outpos);
+    conn->outlen -= conn->outpos;
+    conn->outpos = 0;
+  }
+  if (conn->outlen + len > conn->outsize) {
+    if (conn->outlen + len > NODEMGR_OUT_MAX) {
+      smsg_print_debug(SMSG_DEBUG_MSG, "Client on fd %d isn't reading, dropping it\n", conn->fd);
+      conn->dead = 1;
+      return;
+    }
+    if (0 != nodemgr_grow(&conn->out, &conn->outsize, conn->outlen + len)) {
+      conn->dead = 1;
+      return;
+    }
+  }
+  memcpy(conn->out + conn->outlen, buf, len);
+  conn->outlen += len;
+
+  if (! conn->writing) nodemgr_conn_flush(conn);
+}
+
+/* handles each message that 'len' more bytes in 'buf' complete */
+static void nodemgr_conn_input(nodemgr_conn_t *conn, char *buf, int len)
+{
+  int smsg_inbuflen;
+
+  /* the decoder carries on from whatever buffer it's given */
+  conn->state.encptr = buf;
+  while (! conn->dead) {
+    smsg_inbuflen = serdes_decode(buf, &len, (char *) conn->inbuf, &conn->state);
+    if (0 == smsg_inbuflen) break;
+    if (0 > smsg_inbuflen) nodemgr_count(SMSG_STATS_DECODE_ERRORS);
+    if (0 > smsg_inbuflen || 0 != conn->handler(conn->inbuf, conn->fd, &conn->args)) {
+      conn->dead = 1;
+    }
+  }
+}
+
+/* reads what's there and handles each message it completes */
+static void nodemgr_conn_read(nodemgr_conn_t *conn)
+{
+  int readlen;
+
+  while (! conn->dead) {
+    readlen = recv(conn->fd, conn->readbuf, NODEMGR_READ_SIZE, 0);
+    if (readlen < 0) {
+      if (EINTR == errno) continue;
+      if (EAGAIN != errno && EWOULDBLOCK != errno) conn->dead = 1;
+      return;
+    }
+    if (0 == readlen) {
+      /* end of file, unless it's just an empty datagram */
+      if (NODEMGR_CLIENT == conn->kind) conn->dead = 1;
+      return;
+    }
+
+    nodemgr_conn_input(conn, conn->readbuf, readlen);
+  }
+}
+
+static void nodemgr_conn_parked(nodemgr_conn_t *conn, int n)
+{
+  conn->parked += n;
+}
+
+static void nodemgr_post(nodemgr_parked_t *parked)
+{
+  nodemgr_reactor_t *reactor;
+  char wake = 1;
+
+  reactor = parked->conn->reactor;
+  parked->next = reactor->mailbox;
+  reactor->mailbox = parked;
+  /* one byte's enough until the loop empties the mailbox */
+  if (NULL == parked->next && send(reactor->wake_fd[1], &wake, 1, MSG_DONTWAIT) < 0) {
+    smsg_print_debug(SMSG_DEBUG_MSG, "Can't wake event loop\n");
+  }
+}
+
+/* sends the answers in the loop's mailbox */
+static void nodemgr_drain(nodemgr_reactor_t *reactor)
+{
+  nodemgr_parked_t *mail;
+  nodemgr_parked_t *parked;
+  nodemgr_parked_t *first;
+
+  ulapi_mutex_take(nodemgr_park_mutex);
+  mail = reactor->mailbox;
+  reactor->mailbox = NULL;
+  /* it's last in first out, so turn it around; only this loop closes its clients, so they stay until it's sent */
+  for (first = NULL; NULL != mail; ) {
+    parked = mail;
+    mail = parked->next;
+    parked->next = first;
+    first = parked;
+    nodemgr_conn_parked(parked->conn, -1);
+  }
+  ulapi_mutex_give(nodemgr_park_mutex);
+
+  while (NULL != first) {
+    parked = first;
+    first = parked->next;
+    if (parked->change) {
+      nodemgr_report_change(&parked->conn->args, parked->conn->fd, &parked->component, parked->change, 0);
+    } else {
+      nodemgr_report_dynreg(&parked->conn->args, parked->conn->fd, &parked->component, parked->found, parked->sequence_number);
+      nodemgr_latency(SMSG_STATS_WAIT, parked->since);
+    }
+    free(parked);
+  }
+}
+
+/*
+  Clients on an event loop can be pushed the changes to what they
+  look up with QUERY_CACHEREGs, or subscribe to with
+  REQUEST_SUBSCRIBEs, and are noted here until they stop or go away.
+  Each mask has its own table, hashed like the parked queries by the
+  key with its wildcards zeroed, so a change looks in one bucket of
+  each table that's in use and finds just the clients it concerns. A
+  looked-up key is noted like an exact subscription. They're under
+  the park mutex. A change is pushed to each client through its
+  loop's mailbox, and the loop making the change empties its own
+  right after, so the client that made it hears of it before the reply
+  to it. Nothing's written under the mutex. A client's notes and mail
+  are counted with its parked queries, so they're cleared when it
+  closes.
+*/
+
+enum {NODEMGR_INTEREST_MAX = 65536}; /* most notes at once */
+
+typedef struct nodemgr_interest {
+  struct nodemgr_interest *next;	/* in its bucket */
+  unsigned int key;		/* with the wildcards zeroed */
+  smsg_byte mask;		/* which ids must match */
+  int cached;			/* by a QUERY_CACHEREG */
+  int subscribed;		/* by a REQUEST_SUBSCRIBE */
+  nodemgr_conn_t *conn;
+} nodemgr_interest_t;
+
+static nodemgr_interest_t *nodemgr_interest[SMSG_MATCH_ALL + 1][1 << NODEMGR_PARK_BITS];
+static int nodemgr_interest_masks[SMSG_MATCH_ALL + 1]; /* how many in each table */
+static int nodemgr_interest_count = 0;
+
+/* the bits of a key that 'mask' says must match */
+static unsigned int nodemgr_key_mask(smsg_byte mask)
+{
+  return ((mask & SMSG_MATCH_COMPONENT) ? 0xFFU : 0) |
+    ((mask & SMSG_MATCH_INSTANCE) ? 0xFF00U : 0) |
+    ((mask & SMSG_MATCH_NODE) ? 0xFF0000U : 0) |
+    ((mask & SMSG_MATCH_SUBSYSTEM) ? 0xFF000000U : 0);
+}
+
+static int nodemgr_interest_add(nodemgr_conn_t *conn, component_entry_t *component, smsg_byte mask, int subscribed)
+{
+  nodemgr_interest_t **bucket;
+  nodemgr_interest_t *interest;
+  unsigned int key;
+
+  if (NULL == conn) return -1;
+
+  mask &= SMSG_MATCH_ALL;
+  key = nodemgr_key(component) & nodemgr_key_mask(mask);
+  ulapi_mutex_take(nodemgr_park_mutex);
+  bucket = &nodemgr_interest[mask][nodemgr_hash(key, NODEMGR_PARK_BITS)];
+  for (interest = *bucket; NULL != interest; interest = interest->next) {
+    if (interest->key == key && interest->mask == mask && interest->conn == conn) break;
+  }
+  if (NULL == interest) {
+    interest = (nodemgr_interest_count < NODEMGR_INTEREST_MAX) ? malloc(sizeof(*interest)) : NULL;
+    if (NULL == interest) {
+      ulapi_mutex_give(nodemgr_park_mutex);
+      return -1;
+    }
+    interest->key = key;
+    interest->mask = mask;
+    interest->cached = 0;
+    interest->subscribed = 0;
+    interest->conn = conn;
+    interest->next = *bucket;
+    *bucket = interest;
+    nodemgr_interest_masks[mask]++;
+    nodemgr_interest_count++;
+    nodemgr_conn_parked(conn, 1);
+  }
+  if (subscribed) {
+    interest->subscribed = 1;
+  } else {
+    interest->cached = 1;
+  }
+  ulapi_mutex_give(nodemgr_park_mutex);
+
+  return 0;
+}
+
+static int nodemgr_interest_drop(nodemgr_conn_t *conn, component_entry_t *component, smsg_byte mask)
+{
+  nodemgr_interest_t **pp;
+  nodemgr_interest_t *interest;
+  unsigned int key;
+
+  if (NULL == conn) return -1;
+
+  mask &= SMSG_MATCH_ALL;
+  key = nodemgr_key(component) & nodemgr_key_mask(mask);
+  ulapi_mutex_take(nodemgr_park_mutex);
+  for (pp = &nodemgr_interest[mask][nodemgr_hash(key, NODEMGR_PARK_BITS)]; NULL != *pp; pp = &(*pp)->next) {
+    interest = *pp;
+    if (interest->key != key || interest->mask != mask || interest->conn != conn || ! interest->subscribed) continue;
+    interest->subscribed = 0;
+    /* a looked-up key stays noted for the client's cache */
+    if (! interest->cached) {
+      *pp = interest->next;
+      nodemgr_interest_masks[mask]--;
+      nodemgr_interest_count--;
+      nodemgr_conn_parked(conn, -1);
+      free(interest);
+    }
+    ulapi_mutex_give(nodemgr_park_mutex);
+    return 0;
+  }
+  ulapi_mutex_give(nodemgr_park_mutex);
+
+  return -1;
+}
+
+static void nodemgr_changed(nodemgr_handler_args_t *args, component_entry_t *component, smsg_byte change)
+{
+  nodemgr_interest_t *interest;
+  nodemgr_parked_t *mail;
+  unsigned int key;
+  unsigned int masked;
+  int mask;
+
+  key = nodemgr_key(component);
+  ulapi_mutex_take(nodemgr_park_mutex);
+  for (mask = 0; mask <= SMSG_MATCH_ALL; mask++) {
+    if (0 == nodemgr_interest_masks[mask]) continue;
+    masked = key & nodemgr_key_mask(mask);
+    for (interest = nodemgr_interest[mask][nodemgr_hash(masked, NODEMGR_PARK_BITS)]; NULL != interest; interest = interest->next) {
+      if (interest->key != masked || interest->mask != mask) continue;
+      mail = malloc(sizeof(*mail));
+      if (NULL == mail) {
+	smsg_print_debug(SMSG_DEBUG_MSG, "Can't push change to client on fd %d\n", interest->conn->fd);
+	continue;
+      }
+      mail->key = key;
+      mail->component = *component;
+      mail->conn = interest->conn;
+      mail->change = change;
+      nodemgr_conn_parked(mail->conn, 1);
+      nodemgr_post(mail);
+    }
+  }
+  ulapi_mutex_give(nodemgr_park_mutex);
+
+  if (NULL != args->conn) nodemgr_drain(args->conn->reactor);
+}
+
+/* empties the wake socket and sends what's in the mailbox */
+static void nodemgr_wake(nodemgr_conn_t *conn)
+{
+  char buf[64];
+
+  while (recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+  nodemgr_drain(conn->reactor);
+}
+
+/* drops the queries parked for a client that's going away, and its notes */
+static void nodemgr_park_cancel(nodemgr_conn_t *conn)
+{
+  nodemgr_parked_t **pp;
+  nodemgr_parked_t *parked;
+  nodemgr_interest_t **ip;
+  nodemgr_interest_t *interest;
+  int bucket;
+  int mask;
+
+  ulapi_mutex_take(nodemgr_park_mutex);
+  if (0 == conn->parked) {
+    ulapi_mutex_give(nodemgr_park_mutex);
+    return;
+  }
+  for (bucket = 0; bucket < (1 << NODEMGR_PARK_BITS); bucket++) {
+    for (pp = &nodemgr_parked[bucket]; NULL != *pp; ) {
+      parked = *pp;
+      if (parked->conn != conn) {
+	pp = &parked->next;
+	continue;
+      }
+      *pp = parked->next;
+      nodemgr_park_heap_remove(parked);
+      free(parked);
+    }
+  }
+  for (pp = &conn->reactor->mailbox; NULL != *pp; ) {
+    parked = *pp;
+    if (parked->conn != conn) {
+      pp = &parked->next;
+      continue;
+    }
+    *pp = parked->next;
+    free(parked);
+  }
+  for (mask = 0; mask <= SMSG_MATCH_ALL; mask++) {
+    for (bucket = 0; nodemgr_interest_masks[mask] > 0 && bucket < (1 << NODEMGR_PARK_BITS); bucket++) {
+      for (ip = &nodemgr_interest[mask][bucket]; NULL != *ip; ) {
+	interest = *ip;
+	if (interest->conn != conn) {
+	  ip = &interest->next;
+	  continue;
+	}
+	*ip = interest->next;
+	nodemgr_interest_masks[mask]--;
+	nodemgr_interest_count--;
+	free(interest);
+      }
+    }
+  }
+  conn->parked = 0;
+  ulapi_mutex_give(nodemgr_park_mutex);
+}
+
+/* puts a newly accepted client on the listener's event loop */
+static void nodemgr_serve(nodemgr_conn_t *listener, int client_fd)
+{
+  if (NULL == nodemgr_conn_new(listener->reactor, NODEMGR_CLIENT, client_fd, nodemgr_message_handler)) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't serve client fd %d\n", client_fd);
+    ulapi_socket_close(client_fd);
+    return;
+  }
+  nodemgr_log_client(client_fd);
+}
+
+/* takes all the clients that are waiting */
+static void nodemgr_accept(nodemgr_conn_t *listener)
+{
+  int client_fd;
+
+  for (;;) {
+    client_fd = accept(listener->fd, NULL, NULL);
+    if (client_fd < 0) {
+      if (EINTR == errno) continue;
+      if (EAGAIN != errno && EWOULDBLOCK != errno) {
+	smsg_print_debug(SMSG_DEBUG_CFG, "Can't get client connection\n");
+      }
+      return;
+    }
+    nodemgr_serve(listener, client_fd);
+  }
+}
+
+/* takes the result of the ring's send from 'out', and starts the next */
+static void nodemgr_conn_sent(nodemgr_conn_t *conn, int result)
+{
+  char *tmp;
+  int size;
+
+  conn->writing = 0;
+  if (result < 0) {
+    conn->dead = 1;
+    return;
+  }
+
+  conn->outpos += result;
+  if (conn->outpos == conn->outlen) {
+    /* what waited becomes what's sent, and the old buffer takes the next */
+    tmp = conn->out;
+    size = conn->outsize;
+    conn->out = conn->later;
+    conn->outsize = conn->latersize;
+    conn->outpos = 0;
+    conn->outlen = conn->laterlen;
+    conn->later = tmp;
+    conn->latersize = size;
+    conn->laterlen = 0;
+  } else if (conn->laterlen > 0) {
+    /* the rest of 'out' goes first, so what waited goes after it */
+    if (0 != nodemgr_grow(&conn->out, &conn->outsize, conn->outlen + conn->laterlen)) {
+      conn->dead = 1;
+      return;
+    }
+    memcpy(conn->out + conn->outlen, conn->later, conn->laterlen);
+    conn->outlen += conn->laterlen;
+    conn->laterlen = 0;
+  }
+
+  nodemgr_conn_flush(conn);
+}
+
+/* shuts down a dead client on the ring, freeing it once nothing's in flight */
+static void nodemgr_conn_retire(nodemgr_conn_t *conn)
+{
+  if (NODEMGR_CLIENT != conn->kind) {
+    /* a bad datagram shouldn't stop the broadcastee */
+    conn->dead = 0;
+    return;
+  }
+  if (0 == conn->inflight) {
+    nodemgr_conn_close(conn);
+    return;
+  }
+  /* ends the armed receive, and any send, so their events come back */
+  if (conn->dead == 1) {
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->dead = 2;
+  }
+}
+
+/* runs an opened event loop on its ring; returns only on a fatal error */
+static int nodemgr_reactor_run_uring(nodemgr_reactor_t *reactor)
+{
+  smsg_uring_event_t events[NODEMGR_EVENTS];
+  smsg_uring_event_t *event;
+  nodemgr_conn_t *conn;
+  int n, i;
+
+  for (;;) {
+    n = smsg_uring_wait(reactor->ring, events, NODEMGR_EVENTS);
+    if (n < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't wait for ring events\n");
+      return 1;
+    }
+    for (i = 0; i < n; i++) {
+      event = &events[i];
+      conn = event->tag;
+      switch (event->type) {
+      case SMSG_URING_ACCEPT:
+	if (event->result >= 0) {
+	  nodemgr_serve(conn, event->result);
+	} else {
+	  smsg_print_debug(SMSG_DEBUG_CFG, "Can't get client connection\n");
+	}
+	if (! event->more) {
+	  conn->inflight--;
+	  if (0 != nodemgr_conn_arm(conn)) {
+	    smsg_print_debug(SMSG_DEBUG_CFG, "Can't take more clients on fd %d\n", conn->fd);
+	    return 1;
+	  }
+	}
+	continue;
+
+      case SMSG_URING_RECV:
+	if (NODEMGR_WAKER == conn->kind) {
+	  if (NULL != event->buf) smsg_uring_release(reactor->ring, event->buf_id);
+	  if (! event->more) {
+	    conn->inflight--;
+	    if (0 != nodemgr_conn_arm(conn)) {
+	      smsg_print_debug(SMSG_DEBUG_CFG, "Can't rearm wake socket\n");
+	      return 1;
+	    }
+	  }
+	  nodemgr_drain(reactor);
+	  continue;
+	}
+	if (event->result > 0) {
+	  if (! conn->dead) nodemgr_conn_input(conn, event->buf, event->result);
+	} else if (-ENOBUFS != event->result && NODEMGR_CLIENT == conn->kind) {
+	  /* end of file or read error; an empty datagram is just empty */
+	  if (! conn->dead) conn->dead = 1;
+	}
+	if (NULL != event->buf) smsg_uring_release(reactor->ring, event->buf_id);
+	if (! event->more) {
+	  conn->inflight--;
+	  /* it stops when the buffers run out, so start it again */
+	  if (! conn->dead && 0 != nodemgr_conn_arm(conn)) conn->dead = 1;
+	}
+	break;
+
+      case SMSG_URING_SEND:
+	conn->inflight--;
+	if (! conn->dead) nodemgr_conn_sent(conn, event->result);
+	break;
+
+      default:
+	continue;
+      }
+
+      if (conn->dead) nodemgr_conn_retire(conn);
+    }
+  }
+
+  return 0;
+}
+
+/* returns a listener on 'port' that other event loops can share, or -1 */
+static int nodemgr_listen(int port)
+{
+  int fd;
+  int on = 1;
+  struct sockaddr_in addr;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((unsigned short) port);
+
+  if (0 != setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+#ifdef SO_REUSEPORT
+      0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) ||
+#endif
+      0 != bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      0 != listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* sets up the event loop's ring or epoll and its sockets; returns 0, or -1 on error */
+static int nodemgr_reactor_open(nodemgr_reactor_t *reactor)
+{
+  reactor->epoll_fd = -1;
+  reactor->ring = NULL;
+  if (smsg_get_io_uring()) {
+    reactor->ring = smsg_uring_new(NODEMGR_EVENTS * 4, NODEMGR_BUFFERS, NODEMGR_READ_SIZE);
+    if (NULL == reactor->ring) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't set up io_uring, using epoll\n");
+    }
+  }
+  if (NULL == reactor->ring) {
+    reactor->epoll_fd = epoll_create(NODEMGR_EVENTS);
+    if (reactor->epoll_fd < 0) return -1;
+  }
+
+  reactor->mailbox = NULL;
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, reactor->wake_fd)) {
+    reactor->wake_fd[0] = reactor->wake_fd[1] = -1;
+  }
+
+  if (reactor->wake_fd[0] < 0 ||
+      NULL == nodemgr_conn_new(reactor, NODEMGR_WAKER, reactor->wake_fd[0], NULL) ||
+      NULL == nodemgr_conn_new(reactor, NODEMGR_LISTENER, reactor->listen_fd, NULL) ||
+      (reactor->local_fd >= 0 &&
+       NULL == nodemgr_conn_new(reactor, NODEMGR_LISTENER, reactor->local_fd, NULL)) ||
+      (reactor->broadcastee_fd >= 0 &&
+       NULL == nodemgr_conn_new(reactor, NODEMGR_DATAGRAM, reactor->broadcastee_fd, nodemgr_broadcast_handler))) {
+    if (reactor->wake_fd[0] >= 0) {
+      close(reactor->wake_fd[0]);
+      close(reactor->wake_fd[1]);
+    }
+    if (reactor->epoll_fd >= 0) close(reactor->epoll_fd);
+    reactor->epoll_fd = -1;
+    smsg_uring_delete(reactor->ring);
+    reactor->ring = NULL;
+    return -1;
+  }
+
+  return 0;
+}
 
-  smsg_print_debug(SMSG_DEBUG_MSG, "Got broadcast message %s\n", smsg_id_to_string(identifier));
+/* runs an opened event loop; returns only on a fatal error */
+static int nodemgr_reactor_run(nodemgr_reactor_t *reactor)
+{
+  struct epoll_event events[NODEMGR_EVENTS];
+  nodemgr_conn_t *conn;
+  int n, i;
 
-  /* handle message */
-  switch (identifier) {
-  case SMSG_CODE_QUERY_ALLREG:
-    /* we got a query, so report all we have */
-    smsg_message_to_query_allreg(smsg_inbuf, &query_allreg);
-    /* no parameters except sequence_number, which we're ignoring */
-    for (index = 0, last = db_last(&db); index <= last; index++) {
-      if (db_lookup(&db, index, &component) == index) {
-	report_allreg.component_id = component.component_id;
-	report_allreg.instance_id = component.instance_id;
-	report_allreg.node_id = component.node_id;
-	report_allreg.subsystem_id = component.subsystem_id;
-	report_allreg.address = component.address;
-	report_allreg.port = component.port;
-	report_allreg.sequence_number = 1;
-	smsg_outbuflen = smsg_report_allreg_to_message(&report_allreg, smsg_outbuf);
-	writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
-	ulapi_mutex_take(shared_fd.mutex);
-	ulapi_socket_write(shared_fd.fd, writebuf, writebuflen);
-	ulapi_mutex_give(shared_fd.mutex);
-	smsg_print_debug(SMSG_DEBUG_BCAST, "Broadcasting component %d %d %d %d %s %d\n", 
-		(int) component.component_id,
-		(int) component.instance_id,
-		(int) component.node_id,
-		(int) component.subsystem_id,
-		ulapi_address_to_hostname(component.address),
-		(int) component.port);
-      }
+#ifdef CPU_SET
+  if (reactor->cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(reactor->cpu, &cpus);
+    if (0 != sched_setaffinity(0, sizeof(cpus), &cpus)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't pin event loop to processor %d\n", reactor->cpu);
     }
-    break;
+  }
+#endif
 
-  case SMSG_CODE_REPORT_ALLREG:
-    /* we got some news on a component from another node manager */
-    smsg_message_to_report_allreg(smsg_inbuf, &report_allreg);
-    component.component_id = report_allreg.component_id;
-    component.instance_id = report_allreg.instance_id;
-    component.node_id = report_allreg.node_id;
-    component.subsystem_id = report_allreg.subsystem_id;
-    component.address = report_allreg.address;
-    component.port = report_allreg.port;
-    component.fd = -1;
-    /* ignore component.fd */
-    if (0 > db_find(&db, &component)) {
-      smsg_print_debug(SMSG_DEBUG_BCAST, "News on component %d %d %d %d %s %d\n", 
-	      (int) component.component_id,
-	      (int) component.instance_id,
-	      (int) component.node_id,
-	      (int) component.subsystem_id,
-	      ulapi_address_to_hostname(component.address),
-	      (int) component.port);
-      if (0 > db_add(&db, &component)) {
-	smsg_print_debug(SMSG_DEBUG_BCAST, "Can't update db with broadcast entry\n");
+  if (NULL != reactor->ring) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Serving fd %d on an io_uring event loop\n", reactor->listen_fd);
+    return nodemgr_reactor_run_uring(reactor);
+  }
+  smsg_print_debug(SMSG_DEBUG_CFG, "Serving fd %d on an event loop\n", reactor->listen_fd);
+
+  for (;;) {
+    n = epoll_wait(reactor->epoll_fd, events, NODEMGR_EVENTS, -1);
+    if (n < 0) {
+      if (EINTR == errno) continue;
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't wait for events\n");
+      return 1;
+    }
+    for (i = 0; i < n; i++) {
+      conn = events[i].data.ptr;
+      if (NODEMGR_LISTENER == conn->kind) {
+	nodemgr_accept(conn);
+	continue;
+      }
+      if (NODEMGR_WAKER == conn->kind) {
+	nodemgr_wake(conn);
+	continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) nodemgr_conn_read(conn);
+      if (! conn->dead && (events[i].events & EPOLLOUT)) nodemgr_conn_flush(conn);
+      if (! conn->dead) continue;
+      if (NODEMGR_CLIENT == conn->kind) {
+	nodemgr_conn_close(conn);
+      } else {
+	/* a bad datagram shouldn't stop the broadcastee */
+	conn->dead = 0;
       }
-    } else {
-      smsg_print_debug(SMSG_DEBUG_BCAST, "This one is my component\n");
     }
-    break;
-
-  default:
-    smsg_print_debug(SMSG_DEBUG_MSG, "Unknown message type: %d\n", (int) identifier);
-    break;
-  } /* switch (identifier) */
+  }
 
   return 0;
 }
 
-static int nodemgr_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_args)
+static void nodemgr_reactor_thread(void *args)
 {
-  shared_fd_t shared_fd;
-  smsg_byte identifier;
-  component_entry_t component;
-  int bad;
-  smsg_request_dynreg_t request_dynreg;
-  smsg_reply_dynreg_t reply_dynreg;
-  smsg_query_dynreg_t query_dynreg;
-  smsg_report_dynreg_t report_dynreg;
-  smsg_query_allreg_t query_allreg;
-  int smsg_outbuflen;
-  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
-  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
-  int writebuflen;
+  nodemgr_reactor_run((nodemgr_reactor_t *) args);
+  ulapi_task_exit(0);
+}
 
-  shared_fd = *((shared_fd_t *) handler_args);
-  identifier = smsg_message_identifier(smsg_inbuf);
+/*
+  Runs 'threads' event loops, the first in this thread. With just one,
+  it serves 'socket_fd'; with more, each gets its own listener on
+  'port'. The first also serves the local socket 'local_fd', if it's
+  >= 0. Returns -1 right away if the loops can't be set up, so the
+  caller can fall back to threads, otherwise only on a fatal error.
+*/
+static int nodemgr_reactors(int threads, int port, int socket_fd, int local_fd, int broadcastee_fd, shared_fd_t *broadcaster)
+{
+  nodemgr_reactor_t *reactors;
+  void *task;
+  long cpus;
+  int i;
 
-  smsg_print_debug(SMSG_DEBUG_MSG, "Got node message %s\n", smsg_id_to_string(identifier));
+  reactors = malloc(threads * sizeof(*reactors));
+  if (NULL == reactors) return -1;
 
-  /* handle message */
-  switch (identifier) {
-  case SMSG_CODE_REQUEST_DYNREG:
-    /* register this component and reply */
-    smsg_message_to_request_dynreg(smsg_inbuf, &request_dynreg);
-    component.component_id = request_dynreg.component_id;
-    component.instance_id = request_dynreg.instance_id;
-    if (request_dynreg.node_id != smsg_get_node_id()) {
-      smsg_print_debug(SMSG_DEBUG_REG, "Component node id %d doesn't match node manager node id %d\n", (int) request_dynreg.node_id, (int) smsg_get_node_id());
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (i = 0; i < threads; i++) {
+    reactors[i].listen_fd = (threads > 1) ? nodemgr_listen(port) : socket_fd;
+    reactors[i].local_fd = (0 == i) ? local_fd : -1;
+    reactors[i].broadcastee_fd = (0 == i) ? broadcastee_fd : -1;
+    reactors[i].cpu = (threads > 1 && cpus > 0) ? (int) (i % cpus) : -1;
+    reactors[i].broadcaster = broadcaster;
+    if (reactors[i].listen_fd < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't get shared listener on port %d\n", port);
+      return -1;
     }
-    if (request_dynreg.subsystem_id != smsg_get_subsystem_id()) {
-      smsg_print_debug(SMSG_DEBUG_REG, "Component subsystem id %d doesn't match node manager subsystem id %d\n", (int) request_dynreg.subsystem_id, (int) smsg_get_subsystem_id());
+    if (0 != nodemgr_reactor_open(&reactors[i])) return -1;
+  }
+
+  for (i = 1; i < threads; i++) {
+    task = ulapi_task_new();
+    if (NULL == task ||
+	ULAPI_OK != ulapi_task_start(task, nodemgr_reactor_thread, &reactors[i], ulapi_prio_highest(), 1)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn event loop thread %d\n", i);
+      return 1;
     }
-    component.node_id = request_dynreg.node_id;
-    component.subsystem_id = request_dynreg.subsystem_id;
-    component.address = ulapi_get_host_address();
-    component.port = 0;		/* will be filled in */
-    component.fd = -1;
-    bad = 0;
-    if (0 > db_find(&db, &component)) {
-      bad = (0 > db_add(&db, &component)) ? 1 : 0;
+  }
+  smsg_print_debug(SMSG_DEBUG_CFG, "Running %d event loops\n", threads);
+
+  return nodemgr_reactor_run(&reactors[0]);
+}
+
+#endif	/* HAVE_NODEMGR_REACTOR */
+
+/* sends to a client, through the event loop if it's on one */
+static void nodemgr_write(nodemgr_handler_args_t *args, int fd, const char *buf, int len)
+{
+#ifdef HAVE_NODEMGR_REACTOR
+  if (NULL != args->conn) {
+    nodemgr_conn_write(args->conn, buf, len);
+    return;
+  }
+#endif
+
+  ulapi_socket_write(fd, buf, len);
+}
+
+typedef struct {
+  int socket_fd;
+  nodemgr_handler_args_t *handler_args;
+} nodemgr_acceptor_args_t;
+
+/* gives each client on 'socket_fd' a thread of its own; returns only on error */
+static int nodemgr_accept_clients(int socket_fd, nodemgr_handler_args_t *handler_args)
+{
+  int client_fd;
+
+  for (;;) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Waiting for client connection on fd %d...\n", socket_fd);
+    client_fd = ulapi_socket_get_connection_id(socket_fd);
+    if (client_fd < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't get client connection\n");
+      return 1;
     }
-    reply_dynreg.component_id = component.component_id;
-    reply_dynreg.instance_id = component.instance_id;
-    reply_dynreg.node_id = component.node_id;
-    reply_dynreg.subsystem_id = component.subsystem_id;
-    reply_dynreg.address = component.address;
-    reply_dynreg.port = component.port;
-    if (bad) {
-      /* reply that we can't register them due to db error */
-      reply_dynreg.address = 0;
-      reply_dynreg.port = 0;
+    nodemgr_log_client(client_fd);
+
+    if (0 != smsg_start_message_handler(nodemgr_message_handler, client_fd, handler_args, NULL)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn server thread\n");
+      return 1;
     }
-    smsg_print_debug(SMSG_DEBUG_REG, "Replying with %s port %d\n", ulapi_address_to_hostname(reply_dynreg.address), reply_dynreg.port);
-    reply_dynreg.sequence_number = 1;
-    smsg_outbuflen = smsg_reply_dynreg_to_message(&reply_dynreg, smsg_outbuf);
-    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
-    ulapi_socket_write(fd, writebuf, writebuflen);
-    break;
+    smsg_print_debug(SMSG_DEBUG_CFG, "Spawning a server thread on client fd %d\n", client_fd);
+  }
 
-  case SMSG_CODE_REPLY_DYNREG:
-  case SMSG_CODE_REPORT_DYNREG:
-    /* we send these, shouldn't receive them */
-    smsg_print_debug(SMSG_DEBUG_REG, "Unexpected message type: %d\n", (int) identifier);
-    break;
+  return 0;
+}
 
-  case SMSG_CODE_QUERY_DYNREG:
-    /* look up this component and report */
-    smsg_message_to_query_dynreg(smsg_inbuf, &query_dynreg);
-    component.component_id = query_dynreg.component_id;
-    component.instance_id = query_dynreg.instance_id;
-    component.node_id = query_dynreg.node_id;
-    component.subsystem_id = query_dynreg.subsystem_id;
-    if (0 > db_find(&db, &component)) {
-      /* can't find this component, so ask our other node manager
-	 brothers to send us news */
-      smsg_print_debug(SMSG_DEBUG_REG, "No record of component %d %d %d %d, broadcasting for news\n", (int) component.component_id, (int) component.instance_id, (int) component.node_id, (int) component.subsystem_id);
+/* takes clients on the local socket, alongside the main thread's on TCP */
+static void nodemgr_acceptor_thread(void *args)
+{
+  nodemgr_acceptor_args_t *acceptor_args = (nodemgr_acceptor_args_t *) args;
 
-      query_allreg.sequence_number = 1;
-      smsg_outbuflen = smsg_query_allreg_to_message(&query_allreg, smsg_outbuf);
-      writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
-      ulapi_mutex_take(shared_fd.mutex);
-      ulapi_socket_write(shared_fd.fd, writebuf, writebuflen);
-      ulapi_mutex_give(shared_fd.mutex);
-      /* now fill in empty address and port for report message below */
-      report_dynreg.address = 0;
-      report_dynreg.port = 0;
-    } else {
-      /* we have this, so fill in the address and port */
-      report_dynreg.address = component.address;
-      report_dynreg.port = component.port;
-    }
-    /* now sent the report to the queryer */
-    report_dynreg.sequence_number = 1;
-    report_dynreg.component_id = component.component_id;
-    report_dynreg.instance_id = component.instance_id;
-    report_dynreg.node_id = component.node_id;
-    report_dynreg.subsystem_id = component.subsystem_id;
-    smsg_outbuflen = smsg_report_dynreg_to_message(&report_dynreg, smsg_outbuf);
-    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
-    ulapi_socket_write(fd, writebuf, writebuflen);
-    break;
+  nodemgr_accept_clients(acceptor_args->socket_fd, acceptor_args->handler_args);
+  ulapi_task_exit(0);
+}
 
-  default:
-    smsg_print_debug(SMSG_DEBUG_MSG, "Unknown message type: %d\n", (int) identifier);
-    break;
-  } /* switch (identifier) */
+/* most proxy links to serve */
+enum {NODEMGR_PROXY_LINKS = 8};
 
-  return 0;
+/* serves a proxy link, for a component that's not on the network, until it goes */
+static void nodemgr_proxy_thread(void *args)
+{
+  char *path = (char *) args;
+  int fd;
+
+  fd = smsg_open_proxy_link(path);
+  if (fd < 0) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't open proxy link %s\n", path);
+  } else {
+    smsg_proxy_serve(fd);
+    smsg_close_proxy_link(fd);
+    smsg_print_debug(SMSG_DEBUG_CFG, "Stopped serving proxy link %s\n", path);
+  }
+  ulapi_task_exit(0);
 }
 
 /*
@@ -230,6 +2464,19 @@ static int nodemgr_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_
   -d <debug mask>   : set debug printing level
   -n <node id>      : set the node id, default 1
   -s <subsystem id> : set the subsystem id, default 1
+  -f <file>         : keep the component database in <file>, default none
+  -t <threads>      : serve clients with <threads> event loops, default 1
+  -u                : serve clients with io_uring, if there is one
+  -w <seconds>      : share lookup-miss broadcasts over <seconds>, default 1
+  -e <seconds>      : forget other node managers' components after <seconds>
+                      unheard of, default 60, 0 for never
+  -m <group>        : discover over multicast, on <group> and the 256 after
+                      it for each subsystem, instead of broadcast
+  -T <ttl>          : multicast time to live, default 1
+  -I <address>      : multicast interface address, default any
+  -L                : don't loop multicast back to this host
+  -p <device>       : proxy for a component on serial <device>, up to 8
+  Statistics are printed on SIGUSR1.
 */
 
 static void print_help(void)
@@ -239,6 +2486,19 @@ static void print_help(void)
   printf("-d <debug mask>   : set debug printing level\n");
   printf("-n <node id>      : set the node id, default 1\n");
   printf("-s <subsystem id> : set the subsystem id, default 1\n");
+  printf("-f <file>         : keep the component database in <file>, default none\n");
+  printf("-t <threads>      : serve clients with <threads> event loops, default 1\n");
+  printf("-u                : serve clients with io_uring, if there is one\n");
+  printf("-w <seconds>      : share lookup-miss broadcasts over <seconds>, default 1\n");
+  printf("-e <seconds>      : forget other node managers' components after <seconds>\n");
+  printf("                    unheard of, default 60, 0 for never\n");
+  printf("-m <group>        : discover over multicast, on <group> and the 256 after\n");
+  printf("                    it for each subsystem, instead of broadcast\n");
+  printf("-T <ttl>          : multicast time to live, default 1\n");
+  printf("-I <address>      : multicast interface address, default any\n");
+  printf("-L                : don't loop multicast back to this host\n");
+  printf("-p <device>       : proxy for a component on serial <device>, up to 8\n");
+  printf("Statistics are printed on SIGUSR1.\n");
 
   return;
 }
@@ -250,17 +2510,44 @@ int main(int argc, char *argv[])
   smsg_addr addr;
   int port = SMSG_PORT;
   int socket_fd;
+  int local_fd;
   int broadcaster_fd;
   int broadcastee_fd;
   void *broadcaster_mutex;
   shared_fd_t shared_fd;
-  int client_fd;
+  nodemgr_handler_args_t handler_args;
+  nodemgr_acceptor_args_t acceptor_args;
+  void *acceptor_task;
+  char *store_path = NULL;
+  int threads = 1;
+  int multicast_ttl = 1;
+  int multicast_loop = 1;
+#ifdef HAVE_NODEMGR_MULTICAST
+  smsg_addr multicast_addr;
+#endif
+  void *park_timer;
+  void *housekeeper;
+  int retval;
+  component_snapshot_t *snapshot;
+#if defined(HAVE_NODEMGR_STATS) && defined(SIGUSR1)
+  void *stats_thread;
+#endif
+  double window;
+  double expiry;
+  ulapi_real load_time;
+  int count;
+  char *proxy_paths[NODEMGR_PROXY_LINKS];
+  int proxy_links = 0;
+  void *proxy_task;
 
   smsg_set_debug_name("Nodemgr");
   smsg_set_debug_mask(SMSG_DEBUG_ALL);
 
+  shared_fd.group = 0;
+  shared_fd.interface = 0;	/* INADDR_ANY */
+
   for (opterr = 0;;) {
-    option = ulapi_getopt(argc, argv, ":n:s:d:h");
+    option = ulapi_getopt(argc, argv, ":n:s:f:t:uw:e:m:T:I:Lp:d:h");
     if (option == -1)
       break;
 
@@ -273,6 +2560,86 @@ int main(int argc, char *argv[])
       smsg_set_subsystem_id((smsg_byte) atoi(optarg));
       break;
 
+    case 'f':
+      store_path = optarg;
+      break;
+
+    case 't':
+      threads = atoi(optarg);
+      if (threads < 1) {
+	fprintf(stderr, "bad value for -t: %s\n", optarg);
+	return 1;
+      }
+#ifndef HAVE_NODEMGR_REACTOR
+      fprintf(stderr, "No event loops on this platform, ignoring -t\n");
+      threads = 1;
+#endif
+      break;
+
+    case 'u':
+      if (0 != smsg_set_io_uring(1)) {
+	fprintf(stderr, "No io_uring on this platform, ignoring -u\n");
+      }
+      break;
+
+    case 'w':
+      if (1 != sscanf(optarg, "%lf", &window) || window < 0) {
+	fprintf(stderr, "bad value for -w: %s\n", optarg);
+	return 1;
+      }
+      nodemgr_window = (ulapi_real) window;
+      break;
+
+    case 'e':
+      if (1 != sscanf(optarg, "%lf", &expiry) || expiry < 0) {
+	fprintf(stderr, "bad value for -e: %s\n", optarg);
+	return 1;
+      }
+      nodemgr_expiry = (ulapi_real) expiry;
+      break;
+
+    case 'm':
+    case 'I':
+#ifdef HAVE_NODEMGR_MULTICAST
+      multicast_addr = inet_addr(optarg);
+      if (INADDR_NONE == multicast_addr) {
+	fprintf(stderr, "bad value for -%c: %s\n", option, optarg);
+	return 1;
+      }
+      if ('m' == option) {
+	if (! IN_MULTICAST(ntohl(multicast_addr))) {
+	  fprintf(stderr, "not a multicast group: %s\n", optarg);
+	  return 1;
+	}
+	shared_fd.group = multicast_addr;
+      } else {
+	shared_fd.interface = multicast_addr;
+      }
+#else
+      fprintf(stderr, "No multicast on this platform, ignoring -%c\n", option);
+#endif
+      break;
+
+    case 'T':
+      multicast_ttl = atoi(optarg);
+      if (multicast_ttl < 0 || multicast_ttl > 255) {
+	fprintf(stderr, "bad value for -T: %s\n", optarg);
+	return 1;
+      }
+      break;
+
+    case 'L':
+      multicast_loop = 0;
+      break;
+
+    case 'p':
+      if (proxy_links == NODEMGR_PROXY_LINKS) {
+	fprintf(stderr, "too many -p, ignoring %s\n", optarg);
+	break;
+      }
+      proxy_paths[proxy_links++] = optarg;
+      break;
+
     case 'h':
       print_help();
       return 0;
@@ -304,70 +2671,197 @@ int main(int argc, char *argv[])
   smsg_set_debug_name("Nodemgr");
   smsg_set_debug_mask(debug_mask);
 
+#if defined(HAVE_NODEMGR_STATS) && defined(SIGUSR1)
+  /* before any other threads, so they all leave SIGUSR1 to this one */
+  sigemptyset(&nodemgr_stats_signals);
+  sigaddset(&nodemgr_stats_signals, SIGUSR1);
+  stats_thread = ulapi_task_new();
+  if (0 != sigprocmask(SIG_BLOCK, &nodemgr_stats_signals, NULL) ||
+      NULL == stats_thread ||
+      ULAPI_OK != ulapi_task_start(stats_thread, nodemgr_stats_thread, NULL, ulapi_prio_lowest(), 1)) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't start statistics thread, carrying on without it\n");
+  }
+#endif
+
   addr = ulapi_get_host_address();
   if (0 == addr) {
     smsg_print_debug(SMSG_DEBUG_CFG, "Can't get host address\n");
     return 1;
   }
   smsg_print_debug(SMSG_DEBUG_CFG, "Host address is %s\n", ulapi_address_to_hostname(addr));
+  nodemgr_host_address = addr;
 
-  socket_fd = ulapi_socket_get_server_id(port);
-  if (socket_fd < 0) {
-    smsg_print_debug(SMSG_DEBUG_CFG, "Can't get socket fd\n");
-    return 1;
+  if (threads > 1) {
+    /* the event loops will each get their own */
+    socket_fd = -1;
+  } else {
+    socket_fd = ulapi_socket_get_server_id(port);
+    if (socket_fd < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't get socket fd\n");
+      return 1;
+    }
+    smsg_print_debug(SMSG_DEBUG_CFG, "Got socket fd %d\n", socket_fd);
+  }
+
+  /* components on this host can skip TCP by using the local socket */
+  local_fd = smsg_get_local_server_fd(port);
+  if (local_fd < 0) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't get local socket for port %d, carrying on without it\n", port);
+  } else {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Got local socket fd %d\n", local_fd);
   }
-  smsg_print_debug(SMSG_DEBUG_CFG, "Got socket fd %d\n", socket_fd);
 
   if (0 != db_init(&db)) {
     smsg_print_debug(SMSG_DEBUG_CFG, "Can't allocate database\n");
     return 1;
   }
 
+  /* warm-start from the stored database, if we're keeping one */
+  if (NULL != store_path) {
+    load_time = ulapi_time();
+    count = db_open_store(&db, store_path);
+    if (count < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't open database file %s\n", store_path);
+      return 1;
+    }
+    smsg_print_debug(SMSG_DEBUG_CFG, "Loaded %d components from %s in %f seconds\n", count, store_path, (double) (ulapi_time() - load_time));
+  }
+
+  /* the ones other node managers told us of expire unless we hear of them again */
+  nodemgr_heard_mutex = ulapi_mutex_new(5);
+  if (NULL == nodemgr_heard_mutex) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't make mutex for expiring components\n");
+    return 1;
+  }
+  if (NULL != store_path && NULL != (snapshot = db_snapshot(&db))) {
+    for (count = 0; count < snapshot->count; count++) {
+      if (snapshot->entries[count].address != nodemgr_host_address) nodemgr_hear(&snapshot->entries[count]);
+    }
+    db_snapshot_release(&db, snapshot);
+  }
+
+  /* let local components look up others without asking us */
+  retval = db_open_shm(&db, SMSG_SHM_KEY);
+  if (retval > 0) {
+    /* someone else is squatting on the key, which needs looking into */
+    fprintf(stderr, "Shared memory key %d is held by a segment we can't remove, see ipcs -m\n", (int) SMSG_SHM_KEY);
+    return 1;
+  }
+  if (retval < 0) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't publish database in shared memory, carrying on without it\n");
+  }
+
+  broadcaster_mutex = ulapi_mutex_new(1);
+  shared_fd.mutex = broadcaster_mutex;
+  broadcastee_fd = -1;
+#ifdef HAVE_NODEMGR_MULTICAST
+  if (0 != shared_fd.group) {
+    /* the broadcaster and broadcastee are multicast, on the groups */
+    broadcastee_fd = nodemgr_multicast_open(&shared_fd, SMSG_PORT, multicast_ttl, multicast_loop);
+    if (broadcastee_fd < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't set up multicast on group %s\n", ulapi_address_to_hostname(shared_fd.group));
+      return 1;
+    }
+    smsg_print_debug(SMSG_DEBUG_CFG, "Multicasting on group %s, fd %d\n", ulapi_address_to_hostname(shared_fd.group), shared_fd.fd);
+  }
+#endif
+
   /* get the fd of the broadcaster port that will be written by
      both the client message handler when it can't find a requested
      component, and the broadcast message handler when it gets a
      request to broadcast out its components */
-  broadcaster_fd = ulapi_socket_get_broadcaster_id(port);
-  if (broadcaster_fd < 0) {
-    smsg_print_debug(SMSG_DEBUG_CFG, "Can't get broadcaster fd on port %d\n", (int) port);
+  if (broadcastee_fd < 0) {
+    broadcaster_fd = ulapi_socket_get_broadcaster_id(port);
+    if (broadcaster_fd < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't get broadcaster fd on port %d\n", (int) port);
+      return 1;
+    }
+    smsg_print_debug(SMSG_DEBUG_CFG, "Got broadcaster fd %d\n", broadcaster_fd);
+    shared_fd.fd = broadcaster_fd;
+  }
+  /* for queries that wait for their component, and their timer */
+  nodemgr_park_mutex = ulapi_mutex_new(2);
+  nodemgr_park_timer_cond = ulapi_cond_new(3);
+  nodemgr_park_done_cond = ulapi_cond_new(4);
+#ifdef HAVE_NODEMGR_PARK_WAKE
+  if (0 != pipe(nodemgr_park_wake)) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't make a pipe to wake the timer for waiting queries\n");
+    return 1;
+  }
+#endif
+  park_timer = ulapi_task_new();
+  if (NULL == nodemgr_park_mutex || NULL == nodemgr_park_timer_cond || NULL == nodemgr_park_done_cond ||
+      NULL == park_timer ||
+      ULAPI_OK != ulapi_task_start(park_timer, nodemgr_park_timer, NULL, ulapi_prio_highest(), 1)) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't start timer for waiting queries\n");
+    return 1;
+  }
+
+  /* each proxy link gets a thread of its own */
+  for (count = 0; count < proxy_links; count++) {
+    proxy_task = ulapi_task_new();
+    if (NULL == proxy_task ||
+	ULAPI_OK != ulapi_task_start(proxy_task, nodemgr_proxy_thread, proxy_paths[count], ulapi_prio_highest(), 1)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't start proxy for %s\n", proxy_paths[count]);
+      return 1;
+    }
+  }
+
+  /* so the first queries and dump go right out */
+  for (count = 0; count < NODEMGR_ASKED; count++) {
+    shared_fd.asked[count].key = 0;
+    shared_fd.asked[count].time = ulapi_time() - nodemgr_window;
+  }
+  shared_fd.dump_time = ulapi_time() - nodemgr_window;
+  shared_fd.dump_generation = 0;
+  /* the handler threads all share these */
+  handler_args.broadcaster = &shared_fd;
+  handler_args.conn = NULL;
+
+  housekeeper = ulapi_task_new();
+  if (NULL == housekeeper ||
+      ULAPI_OK != ulapi_task_start(housekeeper, nodemgr_housekeeper, &handler_args, ulapi_prio_lowest(), 1)) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Can't start housekeeping thread\n");
     return 1;
   }
-  smsg_print_debug(SMSG_DEBUG_CFG, "Got broadcaster fd %d\n", broadcaster_fd);
-  broadcaster_mutex = ulapi_mutex_new(1);
-  shared_fd.fd = broadcaster_fd;
-  shared_fd.mutex = broadcaster_mutex;
 
   /* get the fd of the broadcastee port that will be read by the
      broadcastee thread awaiting requests from other node managers
      for our component database */
-  broadcastee_fd = ulapi_socket_get_broadcastee_id(SMSG_PORT);
   if (broadcastee_fd < 0) {
-    smsg_print_debug(SMSG_DEBUG_CFG, "Can't get broadcastee fd\n");
-    return 1;
+    broadcastee_fd = ulapi_socket_get_broadcastee_id(SMSG_PORT);
+    if (broadcastee_fd < 0) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't get broadcastee fd\n");
+      return 1;
+    }
   }
   smsg_print_debug(SMSG_DEBUG_CFG, "Got broadcastee fd %d\n", broadcastee_fd);
 
-  if (0 != smsg_start_message_handler(nodemgr_broadcast_handler, broadcastee_fd, &shared_fd, NULL)) {
+#ifdef HAVE_NODEMGR_REACTOR
+  /* this only comes back if there's no event loop to be had */
+  if (0 <= nodemgr_reactors(threads, port, socket_fd, local_fd, broadcastee_fd, &shared_fd) ||
+      socket_fd < 0) {
+    return 1;
+  }
+  smsg_print_debug(SMSG_DEBUG_CFG, "Can't set up event loop, using threads\n");
+#endif
+
+  if (0 != smsg_start_message_handler(nodemgr_broadcast_handler, broadcastee_fd, &handler_args, NULL)) {
     smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn broadcast thread\n");
     return 1;
   }
   smsg_print_debug(SMSG_DEBUG_CFG, "Spawning broadcast thread on fd %d\n", broadcastee_fd);
 
-  for (;;) {
-    smsg_print_debug(SMSG_DEBUG_CFG, "Waiting for client connection on fd %d...\n", socket_fd);
-    client_fd = ulapi_socket_get_connection_id(socket_fd);
-    if (client_fd < 0) {
-      smsg_print_debug(SMSG_DEBUG_CFG, "Can't get client connection\n");
-      return 1;
-    }
-    smsg_print_debug(SMSG_DEBUG_CFG, "Got a client connection on fd %d\n", client_fd);
-
-    if (0 != smsg_start_message_handler(nodemgr_message_handler, client_fd, &shared_fd, NULL)) {
-      smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn server thread\n");
+  if (local_fd >= 0) {
+    acceptor_args.socket_fd = local_fd;
+    acceptor_args.handler_args = &handler_args;
+    acceptor_task = ulapi_task_new();
+    if (NULL == acceptor_task ||
+	ULAPI_OK != ulapi_task_start(acceptor_task, nodemgr_acceptor_thread, &acceptor_args, ulapi_prio_highest(), 1)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn local socket thread\n");
       return 1;
     }
-    smsg_print_debug(SMSG_DEBUG_CFG, "Spawning a server thread on client fd %d\n", client_fd);
   }
 
-  return 0;
+  return nodemgr_accept_clients(socket_fd, &handler_args);
 }
@@ -19,6 +19,12 @@
 #include <ulapi.h>
 #include "smsg.h"
 
+/* how long the node manager should wait for the reporter, in milliseconds */
+#define QUERY_WAIT 10000
+
+/* how long to wait for the reporter to answer, in seconds */
+#define QUERY_TIMEOUT 1.0
+
 static int client_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_args)
 {
   smsg_byte identifier;
@@ -51,6 +57,7 @@ static int client_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_a
    -i <instance id>  : set the instance id, default 1
    -n <node id>      : set the node id, default 1
    -s <subsystem id> : set the subsystem id, default 1
+   -r                : talk over shared-memory rings, if the reporter's local
 */
 
 static void print_help(void)
@@ -62,6 +69,7 @@ static void print_help(void)
   printf("-i <instance id>  : set the instance id, default 1\n");
   printf("-n <node id>      : set the node id, default 1\n");
   printf("-s <subsystem id> : set the subsystem id, default 1\n");
+  printf("-r                : talk over shared-memory rings, if the reporter's local\n");
 
   return;
 }
@@ -80,11 +88,13 @@ int main(int argc, char *argv[])
   smsg_query_test_t query_test;
   int smsg_outbuflen;
   smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
-  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
-  int writebuflen;
+  smsg_rpc_t rpc;
+  int use_rpc;
+  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];
+  ulapi_real since;
 
   for (opterr = 0;;) {
-    option = ulapi_getopt(argc, argv, ":c:i:n:s:d:h");
+    option = ulapi_getopt(argc, argv, ":c:i:n:s:d:rh");
     if (option == -1)
       break;
 
@@ -105,6 +115,13 @@ int main(int argc, char *argv[])
       subsystem_id = atoi(optarg);
       break;
 
+    case 'r':
+      if (0 != smsg_set_shm_rings(1)) {
+	fprintf(stderr, "No shared-memory rings here\n");
+	return 1;
+      }
+      break;
+
     case 'h':
       print_help();
       return 0;
@@ -136,24 +153,32 @@ int main(int argc, char *argv[])
   smsg_set_debug_name("Querytest");
   smsg_set_debug_mask(debug_mask);
 
-  for (;; ulapi_sleep(1)) {
-    smsg_print_debug(SMGS_DEBUG_CFG, "Looking for component %d %d %d %d\n", component_id, instance_id, node_id, subsystem_id);
-    if (0 == smsg_find_component(-1, component_id, instance_id, node_id, subsystem_id, &address, &port)) {
+  /* the node manager answers as soon as it's registered, so there's no need to poll */
+  for (;;) {
+    smsg_print_debug(SMSG_DEBUG_CFG, "Looking for component %d %d %d %d\n", component_id, instance_id, node_id, subsystem_id);
+    since = ulapi_time();
+    if (0 == smsg_wait_component(-1, component_id, instance_id, node_id, subsystem_id, QUERY_WAIT, &address, &port)) {
       break;
     }
+    /* back off if it failed rather than waited, e.g., with no node manager */
+    if (ulapi_time() - since < 0.001 * QUERY_WAIT) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't ask the node manager, trying again\n");
+      ulapi_sleep(1);
+    }
   }
   smsg_print_debug(SMSG_DEBUG_CFG, "Found component on %s port %d\n", ulapi_address_to_hostname(address), (int) port);
 
-  /* now connect as a client */
-  /* FIXME -- have integer address, need char[] host */
-  myclient_id = ulapi_socket_get_client_id(port, ulapi_address_to_hostname(address));
+  /* now connect as a client, over the local socket if it's on this host */
+  myclient_id = smsg_get_client_fd(address, port);
   if (myclient_id < 0) {
     smsg_print_debug(SMSG_DEBUG_CFG, "Can't get socket fd for port %d\n", (int) port);
     return 1;
   }
   
-  /* and set up the message handler */
-  if (0 != smsg_start_message_handler(client_message_handler, myclient_id, NULL, NULL)) {
+  /* and call it over RPC, or set up the message handler if there's none, as with rings */
+  use_rpc = (0 == smsg_rpc_open(&rpc, myclient_id, NULL, NULL));
+  if (! use_rpc &&
+      0 != smsg_start_message_handler(client_message_handler, myclient_id, NULL, NULL)) {
     smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn client thread\n");
     return 1;
   }
@@ -161,12 +186,23 @@ int main(int argc, char *argv[])
   for (query_test.sequence_number = 1; ; ulapi_sleep(1)) {
     query_test.sequence_number++;
     smsg_outbuflen = smsg_query_test_to_message(&query_test, smsg_outbuf);
-    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
-    if (0 > ulapi_socket_write(myclient_id, writebuf, writebuflen)) {
+    if (use_rpc) {
+      if (0 < smsg_rpc_call(&rpc, smsg_outbuf, smsg_outbuflen, smsg_inbuf, QUERY_TIMEOUT)) {
+	client_message_handler(smsg_inbuf, myclient_id, NULL);
+      } else if (smsg_rpc_dead(&rpc)) {
+	smsg_print_debug(SMSG_DEBUG_CFG, "Reporter disconnected\n");
+	break;
+      } else {
+	smsg_print_debug(SMSG_DEBUG_CFG, "Reporter didn't answer\n");
+      }
+      continue;
+    }
+    if (0 != smsg_send(myclient_id, smsg_outbuf, smsg_outbuflen)) {
       smsg_print_debug(SMSG_DEBUG_CFG, "Reporter disconnected\n");
       break;
     }
   }
+  if (use_rpc) smsg_rpc_close(&rpc);
 
   return 0;
 }
@@ -35,23 +35,19 @@ static int client_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_a
   smsg_report_test_t report_test;
   int smsg_outbuflen;
   smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
-  char writebuf[serdes_encode_size(sizeof(smsg_outbuf))];
-  int writebuflen;
 
   identifier = smsg_message_identifier(smsg_inbuf);
 
   /* handle message */
   switch (identifier) {
   case SMSG_CODE_QUERY_TEST:
-    /* echo the input sequence number back */
-    /* FIXME -- need some Smessaging rules for this */
+    /* echo the input sequence number back, which is how RPC replies are matched */
     smsg_message_to_query_test(smsg_inbuf, &query_test);
     report_test.sequence_number = query_test.sequence_number;
     report_test.count = count++;
     report_test.time = (smsg_float) (ulapi_time() - start_time);
     smsg_outbuflen = smsg_report_test_to_message(&report_test, smsg_outbuf);
-    writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
-    ulapi_socket_write(fd, writebuf, writebuflen);
+    smsg_send(fd, smsg_outbuf, smsg_outbuflen);
     break;
 
   default:
@@ -72,6 +68,24 @@ static int client_message_handler(smsg_byte *smsg_inbuf, int fd, void *handler_a
    -s <subsystem id> : set the subsystem id, default 1
 */
 
+/* takes clients on the local socket, alongside main's on TCP */
+static void local_server(void *args)
+{
+  ulapi_integer myserver_id = *((ulapi_integer *) args);
+  ulapi_integer connection_id;
+
+  for (;;) {
+    connection_id = ulapi_socket_get_connection_id(myserver_id);
+    if (connection_id < 0 ||
+	0 != smsg_start_message_handler(client_message_handler, connection_id, NULL, NULL)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't serve local client\n");
+      break;
+    }
+  }
+
+  ulapi_task_exit(0);
+}
+
 static void print_help(void)
 {
   printf("Usage: reporttest <options>, which are:\n");
@@ -92,7 +106,9 @@ int main(int argc, char *argv[])
   smsg_addr address;
   smsg_port port;
   ulapi_integer myserver_id;
+  ulapi_integer mylocal_id;
   ulapi_integer connection_id;
+  void *local_task;
   smsg_byte component_id = 1;
   smsg_byte instance_id = 1;
   smsg_byte node_id = 1;
@@ -164,6 +180,17 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  /* and on the local socket for the port, for clients on this host */
+  mylocal_id = smsg_get_local_server_fd(port);
+  if (mylocal_id >= 0) {
+    local_task = ulapi_task_new();
+    if (NULL == local_task ||
+	ULAPI_OK != ulapi_task_start(local_task, local_server, &mylocal_id, ulapi_prio_highest(), 1)) {
+      smsg_print_debug(SMSG_DEBUG_CFG, "Can't spawn local server thread\n");
+      return 1;
+    }
+  }
+
   start_time = ulapi_time();
 
   /* and wait for connections */
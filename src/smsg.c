@@ -11,16 +11,146 @@
   See NIST Administration Manual 4.09.07 b and Appendix I. 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* for struct ucred */
+#endif
+
 #include <stdio.h>		/* sprintf */
 #include <stddef.h>		/* size_t, sizeof */
 #include <stdarg.h>		/* va_list */
 #include <string.h>		/* memset */
 #include <math.h>		/* M_PI */
 #include <stdlib.h>		/* malloc, free */
+#include <errno.h>		/* errno, ENOENT, EINTR */
 #include <ulapi.h>
 #include "serdes.h"		/* encoding, decoding */
 #include "smsg.h"
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_FCNTL_H) && defined(HAVE_UNISTD_H)
+#define HAVE_DB_STORE 1
+#include <sys/types.h>		/* off_t */
+#include <sys/stat.h>		/* fstat */
+#include <sys/mman.h>		/* mmap, msync, munmap */
+#include <fcntl.h>		/* open, O_* */
+#include <unistd.h>		/* read, write, close, ftruncate, fsync */
+#endif
+
+/* for smsg_send_and_recv, which waits on its reply and leaves what's past it */
+#ifdef HAVE_POLL_H
+#include <poll.h>		/* poll */
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>		/* recv, MSG_PEEK */
+#endif
+
+/* vector key scans, for whatever the compiler was told it can use */
+#if defined(__GNUC__) && (defined(__AVX512F__) || defined(__AVX2__))
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define HAVE_DB_SEQLOCK 1
+/* full memory barrier, for the registry's and shards' sequence locks */
+#define smsg_barrier() __sync_synchronize()
+/* what their readers do before looking again at one that's held */
+#if defined(__i386__) || defined(__x86_64__)
+#define smsg_pause() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define smsg_pause() __asm__ __volatile__ ("yield")
+#else
+#include <sched.h>		/* sched_yield */
+#define smsg_pause() sched_yield()
+#endif
+#endif
+
+/* the shared registry is a System V segment only the node manager can write */
+#if defined(HAVE_SYS_SHM_H) && defined(HAVE_UNISTD_H) && defined(__GNUC__)
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>		/* shmget, shmat, SHM_RDONLY */
+#include <unistd.h>		/* close */
+#define HAVE_DB_SHM 1
+#endif
+
+/* io_uring, through its system calls, for the message handlers and nodemgr */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_SOCKET_H) && defined(HAVE_UNISTD_H) && defined(__GNUC__)
+#include <sys/syscall.h>	/* __NR_io_uring_* */
+#include <sys/mman.h>		/* mmap, munmap */
+#include <sys/socket.h>		/* MSG_NOSIGNAL */
+#include <unistd.h>		/* syscall, close */
+#include <linux/io_uring.h>	/* io_uring_params, io_uring_sqe, io_uring_cqe */
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register) && defined(IORING_RECV_MULTISHOT) && defined(MSG_NOSIGNAL)
+#define HAVE_SMSG_URING 1
+#endif
+#endif
+
+/* caching lookups, which needs a look at what the node manager's pushed without waiting */
+#if defined(HAVE_SYS_SOCKET_H)
+#include <sys/socket.h>		/* recv, MSG_DONTWAIT */
+#if defined(MSG_DONTWAIT)
+#define HAVE_SMSG_CACHE 1
+#endif
+#endif
+
+/* subscriptions, which need the same look, and to wait for what's pushed */
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_POLL_H)
+#include <sys/socket.h>		/* recv, MSG_DONTWAIT */
+#include <poll.h>		/* poll */
+#if defined(MSG_DONTWAIT)
+#define HAVE_SMSG_SUBSCRIBE 1
+#endif
+#endif
+
+/* RPC readers, which wait on replies and deadlines at once, and are woken through a pipe */
+#if defined(HAVE_POLL_H) && defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H)
+#include <poll.h>		/* poll */
+#include <unistd.h>		/* pipe, read, write, close */
+#include <fcntl.h>		/* fcntl, O_NONBLOCK */
+#define HAVE_SMSG_RPC 1
+#endif
+
+/* proxy links, which are polled like RPC readers, with local sockets at both ends */
+#if defined(HAVE_POLL_H) && defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H) && defined(HAVE_TERMIOS_H) && defined(HAVE_SYS_UN_H) && defined(HAVE_SYS_SOCKET_H) && defined(HAVE_ARPA_INET_H) && defined(__GNUC__)
+#include <poll.h>		/* poll */
+#include <unistd.h>		/* pipe, read, write, close */
+#include <fcntl.h>		/* open, fcntl, O_* */
+#include <termios.h>		/* tcgetattr, cfmakeraw */
+#include <sys/socket.h>		/* socketpair, send, recv, MSG_NOSIGNAL */
+#include <sys/un.h>		/* sockaddr_un */
+#include <arpa/inet.h>		/* inet_addr */
+#if defined(MSG_NOSIGNAL)
+#define HAVE_SMSG_PROXY 1
+#endif
+#endif
+
+/* local sockets need AF_UNIX, and the peer's credentials SO_PEERCRED */
+#if defined(HAVE_SYS_UN_H) && defined(HAVE_SYS_SOCKET_H) && defined(HAVE_ARPA_INET_H) && defined(HAVE_UNISTD_H)
+#include <sys/types.h>
+#include <sys/socket.h>		/* socket, bind, listen, connect, getsockopt */
+#include <sys/un.h>		/* sockaddr_un */
+#include <arpa/inet.h>		/* ntohl */
+#include <unistd.h>		/* close, unlink */
+#define HAVE_SMSG_LOCAL 1
+#endif
+
+/* shared-memory rings need futexes, and the peer's credentials to check the segment against */
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_SHM_H) && defined(HAVE_SYS_SOCKET_H) && defined(HAVE_POLL_H) && defined(HAVE_UNISTD_H) && defined(__GNUC__)
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>		/* shmget, shmat, shmctl */
+#include <sys/socket.h>		/* SO_PEERCRED */
+#include <poll.h>		/* poll, POLLHUP */
+#include <unistd.h>		/* sysconf, getpid */
+#include <sys/syscall.h>	/* SYS_futex */
+#include <linux/futex.h>	/* FUTEX_WAIT, FUTEX_WAKE */
+#include <time.h>		/* timespec */
+#if defined(SYS_futex) && defined(SO_PEERCRED)
+#define HAVE_SMSG_RING 1
+#endif
+#endif
+
 const char *smsg_id_to_string(int id) {
   switch (id) {
   case SMSG_CODE_REQUEST_DYNREG: return "REQUEST_DYNREG";
@@ -37,6 +167,22 @@ const char *smsg_id_to_string(int id) {
   case SMSG_CODE_CLOSE_SERVER_CONNECTION: return "CLOSE_SERVER_CONNECTION";
   case SMSG_CODE_QUERY_TEST: return "QUERY_TEST";
   case SMSG_CODE_REPORT_TEST: return "REPORT_TEST";
+  case SMSG_CODE_QUERY_MATCHREG: return "QUERY_MATCHREG";
+  case SMSG_CODE_REPORT_MATCHREG: return "REPORT_MATCHREG";
+  case SMSG_CODE_QUERY_ONEREG: return "QUERY_ONEREG";
+  case SMSG_CODE_QUERY_WAITREG: return "QUERY_WAITREG";
+  case SMSG_CODE_QUERY_STATS: return "QUERY_STATS";
+  case SMSG_CODE_REPORT_STATS: return "REPORT_STATS";
+  case SMSG_CODE_REQUEST_UNREG: return "REQUEST_UNREG";
+  case SMSG_CODE_QUERY_MULTIREG: return "QUERY_MULTIREG";
+  case SMSG_CODE_QUERY_CACHEREG: return "QUERY_CACHEREG";
+  case SMSG_CODE_REPORT_CHANGE: return "REPORT_CHANGE";
+  case SMSG_CODE_REQUEST_SUBSCRIBE: return "REQUEST_SUBSCRIBE";
+  case SMSG_CODE_REQUEST_UNSUBSCRIBE: return "REQUEST_UNSUBSCRIBE";
+  case SMSG_CODE_ACCEPT_CONNECTION: return "ACCEPT_CONNECTION";
+  case SMSG_CODE_CONNECTION_DATA: return "CONNECTION_DATA";
+  case SMSG_CODE_OPEN_RING: return "OPEN_RING";
+  case SMSG_CODE_RETURN_RING: return "RETURN_RING";
   default: return "?";
   }
   return "?";
@@ -208,106 +354,146 @@ int smsg_report_allreg_to_message(smsg_report_allreg_t * smsg_msg, smsg_byte * m
   return msg - start;
 }
 
-int smsg_message_to_open_client_connection(smsg_byte * msg, smsg_open_client_connection_t * smsg_msg)
+int smsg_message_to_query_matchreg(smsg_byte * msg, smsg_query_matchreg_t * smsg_msg)
 {
   T_FR_B(&smsg_msg->identifier, msg);
   T_FR_B(&smsg_msg->sequence_number, msg);
-  T_FR_B(&smsg_msg->address, msg);
-  T_FR_B(&smsg_msg->port, msg);
+  T_FR_B(&smsg_msg->mask, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
 
-  return smsg_msg->identifier != SMSG_CODE_OPEN_CLIENT_CONNECTION;
+  return smsg_msg->identifier != SMSG_CODE_QUERY_MATCHREG;
 }
 
-int smsg_open_client_connection_to_message(smsg_open_client_connection_t * smsg_msg, smsg_byte * msg)
+int smsg_query_matchreg_to_message(smsg_query_matchreg_t * smsg_msg, smsg_byte * msg)
 {
   smsg_byte *start = msg;
-  smsg_byte identifier = SMSG_CODE_OPEN_CLIENT_CONNECTION;
+  smsg_byte identifier = SMSG_CODE_QUERY_MATCHREG;
 
   T_TO_B(&identifier, msg);
   T_TO_B(&smsg_msg->sequence_number, msg);
-  T_TO_B(&smsg_msg->address, msg);
-  T_TO_B(&smsg_msg->port, msg);
+  T_TO_B(&smsg_msg->mask, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
 
   return msg - start;
 }
 
-int smsg_message_to_return_client_connection(smsg_byte * msg, smsg_return_client_connection_t * smsg_msg)
+int smsg_message_to_report_matchreg(smsg_byte * msg, smsg_report_matchreg_t * smsg_msg)
 {
+  int i;
+
   T_FR_B(&smsg_msg->identifier, msg);
   T_FR_B(&smsg_msg->sequence_number, msg);
-  T_FR_B(&smsg_msg->connection, msg);
+  T_FR_B(&smsg_msg->more, msg);
+  T_FR_B(&smsg_msg->count, msg);
+  if (smsg_msg->count > SMSG_MATCHREG_ENTRIES) return 1;
+  for (i = 0; i < smsg_msg->count; i++) {
+    T_FR_B(&smsg_msg->entries[i].component_id, msg);
+    T_FR_B(&smsg_msg->entries[i].instance_id, msg);
+    T_FR_B(&smsg_msg->entries[i].node_id, msg);
+    T_FR_B(&smsg_msg->entries[i].subsystem_id, msg);
+    T_FR_B(&smsg_msg->entries[i].address, msg);
+    T_FR_B(&smsg_msg->entries[i].port, msg);
+  }
 
-  return smsg_msg->identifier != SMSG_CODE_RETURN_CLIENT_CONNECTION;
+  return smsg_msg->identifier != SMSG_CODE_REPORT_MATCHREG;
 }
 
-int smsg_return_client_connection_to_message(smsg_return_client_connection_t * smsg_msg, smsg_byte * msg)
+int smsg_report_matchreg_to_message(smsg_report_matchreg_t * smsg_msg, smsg_byte * msg)
 {
   smsg_byte *start = msg;
-  smsg_byte identifier = SMSG_CODE_RETURN_CLIENT_CONNECTION;
+  smsg_byte identifier = SMSG_CODE_REPORT_MATCHREG;
+  int i;
 
   T_TO_B(&identifier, msg);
   T_TO_B(&smsg_msg->sequence_number, msg);
-  T_TO_B(&smsg_msg->connection, msg);
+  T_TO_B(&smsg_msg->more, msg);
+  T_TO_B(&smsg_msg->count, msg);
+  for (i = 0; i < smsg_msg->count && i < SMSG_MATCHREG_ENTRIES; i++) {
+    T_TO_B(&smsg_msg->entries[i].component_id, msg);
+    T_TO_B(&smsg_msg->entries[i].instance_id, msg);
+    T_TO_B(&smsg_msg->entries[i].node_id, msg);
+    T_TO_B(&smsg_msg->entries[i].subsystem_id, msg);
+    T_TO_B(&smsg_msg->entries[i].address, msg);
+    T_TO_B(&smsg_msg->entries[i].port, msg);
+  }
 
   return msg - start;
 }
 
-int smsg_message_to_open_server_connection(smsg_byte * msg, smsg_open_server_connection_t * smsg_msg)
+int smsg_message_to_query_onereg(smsg_byte * msg, smsg_query_onereg_t * smsg_msg)
 {
   T_FR_B(&smsg_msg->identifier, msg);
   T_FR_B(&smsg_msg->sequence_number, msg);
-  T_FR_B(&smsg_msg->address, msg);
-  T_FR_B(&smsg_msg->port, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
 
-  return smsg_msg->identifier != SMSG_CODE_OPEN_SERVER_CONNECTION;
+  return smsg_msg->identifier != SMSG_CODE_QUERY_ONEREG;
 }
 
-int smsg_open_server_connection_to_message(smsg_open_server_connection_t * smsg_msg, smsg_byte * msg)
+int smsg_query_onereg_to_message(smsg_query_onereg_t * smsg_msg, smsg_byte * msg)
 {
   smsg_byte *start = msg;
-  smsg_byte identifier = SMSG_CODE_OPEN_SERVER_CONNECTION;
+  smsg_byte identifier = SMSG_CODE_QUERY_ONEREG;
 
   T_TO_B(&identifier, msg);
   T_TO_B(&smsg_msg->sequence_number, msg);
-  T_TO_B(&smsg_msg->address, msg);
-  T_TO_B(&smsg_msg->port, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
 
   return msg - start;
 }
 
-int smsg_message_to_return_server_connection(smsg_byte * msg, smsg_return_server_connection_t * smsg_msg)
+int smsg_message_to_query_waitreg(smsg_byte * msg, smsg_query_waitreg_t * smsg_msg)
 {
   T_FR_B(&smsg_msg->identifier, msg);
   T_FR_B(&smsg_msg->sequence_number, msg);
-  T_FR_B(&smsg_msg->connection, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
+  T_FR_B(&smsg_msg->timeout, msg);
 
-  return smsg_msg->identifier != SMSG_CODE_RETURN_SERVER_CONNECTION;
+  return smsg_msg->identifier != SMSG_CODE_QUERY_WAITREG;
 }
 
-int smsg_return_server_connection_to_message(smsg_return_server_connection_t * smsg_msg, smsg_byte * msg)
+int smsg_query_waitreg_to_message(smsg_query_waitreg_t * smsg_msg, smsg_byte * msg)
 {
   smsg_byte *start = msg;
-  smsg_byte identifier = SMSG_CODE_RETURN_SERVER_CONNECTION;
+  smsg_byte identifier = SMSG_CODE_QUERY_WAITREG;
 
   T_TO_B(&identifier, msg);
   T_TO_B(&smsg_msg->sequence_number, msg);
-  T_TO_B(&smsg_msg->connection, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
+  T_TO_B(&smsg_msg->timeout, msg);
 
   return msg - start;
 }
 
-int smsg_message_to_query_test(smsg_byte * msg, smsg_query_test_t * smsg_msg)
+int smsg_message_to_query_stats(smsg_byte * msg, smsg_query_stats_t * smsg_msg)
 {
   T_FR_B(&smsg_msg->identifier, msg);
   T_FR_B(&smsg_msg->sequence_number, msg);
 
-  return smsg_msg->identifier != SMSG_CODE_QUERY_TEST;
+  return smsg_msg->identifier != SMSG_CODE_QUERY_STATS;
 }
 
-int smsg_query_test_to_message(smsg_query_test_t * smsg_msg, smsg_byte * msg)
+int smsg_query_stats_to_message(smsg_query_stats_t * smsg_msg, smsg_byte * msg)
 {
   smsg_byte *start = msg;
-  smsg_byte identifier = SMSG_CODE_QUERY_TEST;
+  smsg_byte identifier = SMSG_CODE_QUERY_STATS;
 
   T_TO_B(&identifier, msg);
   T_TO_B(&smsg_msg->sequence_number, msg);
@@ -315,666 +501,6057 @@ int smsg_query_test_to_message(smsg_query_test_t * smsg_msg, smsg_byte * msg)
   return msg - start;
 }
 
-int smsg_message_to_report_test(smsg_byte * msg, smsg_report_test_t * smsg_msg)
+int smsg_message_to_report_stats(smsg_byte * msg, smsg_report_stats_t * smsg_msg)
 {
+  int i;
+
   T_FR_B(&smsg_msg->identifier, msg);
   T_FR_B(&smsg_msg->sequence_number, msg);
-  T_FR_B(&smsg_msg->count, msg);
-  T_FR_B(&smsg_msg->time, msg);
+  for (i = 0; i < SMSG_STATS_COUNTERS; i++) {
+    T_FR_B(&smsg_msg->counters[i], msg);
+  }
+  T_FR_B(&smsg_msg->db_size, msg);
+  for (i = 0; i < SMSG_STATS_LATENCIES; i++) {
+    T_FR_B(&smsg_msg->latencies[i].count, msg);
+    T_FR_B(&smsg_msg->latencies[i].p50, msg);
+    T_FR_B(&smsg_msg->latencies[i].p90, msg);
+    T_FR_B(&smsg_msg->latencies[i].p99, msg);
+    T_FR_B(&smsg_msg->latencies[i].max, msg);
+  }
 
-  return smsg_msg->identifier != SMSG_CODE_REPORT_TEST;
+  return smsg_msg->identifier != SMSG_CODE_REPORT_STATS;
 }
 
-int smsg_report_test_to_message(smsg_report_test_t * smsg_msg, smsg_byte * msg)
+int smsg_report_stats_to_message(smsg_report_stats_t * smsg_msg, smsg_byte * msg)
 {
   smsg_byte *start = msg;
-  smsg_byte identifier = SMSG_CODE_REPORT_TEST;
+  smsg_byte identifier = SMSG_CODE_REPORT_STATS;
+  int i;
 
   T_TO_B(&identifier, msg);
   T_TO_B(&smsg_msg->sequence_number, msg);
-  T_TO_B(&smsg_msg->count, msg);
-  T_TO_B(&smsg_msg->time, msg);
+  for (i = 0; i < SMSG_STATS_COUNTERS; i++) {
+    T_TO_B(&smsg_msg->counters[i], msg);
+  }
+  T_TO_B(&smsg_msg->db_size, msg);
+  for (i = 0; i < SMSG_STATS_LATENCIES; i++) {
+    T_TO_B(&smsg_msg->latencies[i].count, msg);
+    T_TO_B(&smsg_msg->latencies[i].p50, msg);
+    T_TO_B(&smsg_msg->latencies[i].p90, msg);
+    T_TO_B(&smsg_msg->latencies[i].p99, msg);
+    T_TO_B(&smsg_msg->latencies[i].max, msg);
+  }
 
   return msg - start;
 }
 
-unsigned int smsg_debug_mask = 0;
-char * smsg_debug_name = "Smsg";
-
-/* sets the local included copy of smsg_debug_mask */
-void
-smsg_set_debug_mask(unsigned int mask)
+int smsg_message_to_request_unreg(smsg_byte * msg, smsg_request_unreg_t * smsg_msg)
 {
-  smsg_debug_mask = mask;
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_REQUEST_UNREG;
 }
 
-void
-smsg_set_debug_name(char * name)
+int smsg_request_unreg_to_message(smsg_request_unreg_t * smsg_msg, smsg_byte * msg)
 {
-  smsg_debug_name = name;
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_REQUEST_UNREG;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
+
+  return msg - start;
 }
 
-void
-smsg_print_debug(unsigned int mask, const char * fmt, ...)
+int smsg_message_to_query_multireg(smsg_byte * msg, smsg_query_multireg_t * smsg_msg)
 {
-  va_list ap;
+  int i;
 
-  if (mask & smsg_debug_mask) {
-    va_start(ap, fmt);
-    fprintf(stderr, "%s: ", smsg_debug_name);
-    vfprintf(stderr, fmt, ap);
-    fflush(stderr);
-    va_end(ap);
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->count, msg);
+  if (smsg_msg->count > SMSG_MULTIREG_KEYS) return 1;
+  for (i = 0; i < smsg_msg->count; i++) {
+    T_FR_B(&smsg_msg->keys[i].component_id, msg);
+    T_FR_B(&smsg_msg->keys[i].instance_id, msg);
+    T_FR_B(&smsg_msg->keys[i].node_id, msg);
+    T_FR_B(&smsg_msg->keys[i].subsystem_id, msg);
   }
-}
 
-void my_free(void * ptr)
-{
-  free(ptr);
-  smsg_print_debug(SMSG_DEBUG_MEM, "free(0x%X)\n", (int) ptr);
+  return smsg_msg->identifier != SMSG_CODE_QUERY_MULTIREG;
 }
 
-void * my_malloc(size_t size)
+int smsg_query_multireg_to_message(smsg_query_multireg_t * smsg_msg, smsg_byte * msg)
 {
-  void * ret;
-
-  ret = malloc(size);
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_QUERY_MULTIREG;
+  int i;
 
-  smsg_print_debug(SMSG_DEBUG_MEM, "malloc(%d) = 0x%X\n", (int) size, (int) ret);
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->count, msg);
+  for (i = 0; i < smsg_msg->count && i < SMSG_MULTIREG_KEYS; i++) {
+    T_TO_B(&smsg_msg->keys[i].component_id, msg);
+    T_TO_B(&smsg_msg->keys[i].instance_id, msg);
+    T_TO_B(&smsg_msg->keys[i].node_id, msg);
+    T_TO_B(&smsg_msg->keys[i].subsystem_id, msg);
+  }
 
-  return ret;
+  return msg - start;
 }
 
-void * my_realloc(void * ptr, size_t size)
+int smsg_message_to_query_cachereg(smsg_byte * msg, smsg_query_cachereg_t * smsg_msg)
 {
-  void * ret;
-
-  ret = realloc(ptr, size);
-  smsg_print_debug(SMSG_DEBUG_MEM, "realloc(0x%X, %d) = 0x%X\n", (int) ptr, (int) size, (int) ret);
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
 
-  return ret;
+  return smsg_msg->identifier != SMSG_CODE_QUERY_CACHEREG;
 }
 
-/*
-  Given:
-
-  int i = 0xABCDEFGH;
-  char * c[sizeof(i)] = &i;
+int smsg_query_cachereg_to_message(smsg_query_cachereg_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_QUERY_CACHEREG;
 
-  Big-endian is
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
 
-  c[3] c[2] c[1] c[0]
-  0xGH 0xEF 0xCD 0xAB
+  return msg - start;
+}
 
-  Little-endian is
+int smsg_message_to_report_change(smsg_byte * msg, smsg_report_change_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->change, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
+  T_FR_B(&smsg_msg->address, msg);
+  T_FR_B(&smsg_msg->port, msg);
 
-  c[3] c[2] c[1] c[0]
-  0xAB 0xCD 0xEF 0xGH
-*/
+  return smsg_msg->identifier != SMSG_CODE_REPORT_CHANGE;
+}
 
-void * fwdcpy(void * dest, const void * src, size_t n)
+int smsg_report_change_to_message(smsg_report_change_t * smsg_msg, smsg_byte * msg)
 {
-  size_t i;
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_REPORT_CHANGE;
 
-  for (i = 0; i < n; i++) ((char *) dest)[i] = ((char *) src)[i];
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->change, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
+  T_TO_B(&smsg_msg->address, msg);
+  T_TO_B(&smsg_msg->port, msg);
 
-  return dest;
+  return msg - start;
 }
 
-void * revcpy(void * dest, const void * src, size_t n)
+int smsg_message_to_request_subscribe(smsg_byte * msg, smsg_request_subscribe_t * smsg_msg)
 {
-  size_t i, nm1;
-
-  for (i = 0, nm1 = n-1; i < n; i++, nm1--) ((char *) dest)[i] = ((char *) src)[nm1];
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->mask, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
 
-  return dest;
+  return smsg_msg->identifier != SMSG_CODE_REQUEST_SUBSCRIBE;
 }
 
-int
-db_init(component_db_t * db)
+int smsg_request_subscribe_to_message(smsg_request_subscribe_t * smsg_msg, smsg_byte * msg)
 {
-  db->mutex = ulapi_mutex_new(0);
-  ulapi_mutex_give(db->mutex);
-  db->entries = my_malloc(sizeof(component_db_t));
-  db->size = 1;
-  db->index = 0;
-  db->port = SMSG_PORT_BASE;
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_REQUEST_SUBSCRIBE;
 
-  return 0;
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->mask, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
+
+  return msg - start;
 }
 
-int
-db_free(component_db_t * db)
+int smsg_message_to_request_unsubscribe(smsg_byte * msg, smsg_request_unsubscribe_t * smsg_msg)
 {
-  if (NULL != db->entries) {
-    my_free(db->entries);
-    db->entries = NULL;
-  }
-  db->size = 0;
-  db->index = 0;		/* no value is good here */
-  ulapi_mutex_delete(db->mutex);
-  return 0;
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->mask, msg);
+  T_FR_B(&smsg_msg->component_id, msg);
+  T_FR_B(&smsg_msg->instance_id, msg);
+  T_FR_B(&smsg_msg->node_id, msg);
+  T_FR_B(&smsg_msg->subsystem_id, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_REQUEST_UNSUBSCRIBE;
 }
 
-/*
-  Fill in entry.component,instance,node,subsystem_id and pass pointer.
-  If it's in the DB, the rest will be filled in and the non-negative
-  index of the entry is returned.  Otherwise, a negative value is
-  returned and entry is left alone.
-*/
-int
-db_find(component_db_t * db, component_entry_t * entry)
+int smsg_request_unsubscribe_to_message(smsg_request_unsubscribe_t * smsg_msg, smsg_byte * msg)
 {
-  int index, retval;
-
-  retval = -1;
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_REQUEST_UNSUBSCRIBE;
 
-  ulapi_mutex_take(db->mutex);
-  for (index = 0; index < db->index; index++) {
-    if (db->entries[index].component_id == entry->component_id &&
-	db->entries[index].instance_id == entry->instance_id &&
-	db->entries[index].node_id == entry->node_id &&
-	db->entries[index].subsystem_id == entry->subsystem_id) {
-      entry->address = db->entries[index].address;
-      entry->port = db->entries[index].port;
-      entry->fd = db->entries[index].fd;
-      retval = index;
-      break;
-    }
-  }
-  ulapi_mutex_give(db->mutex);
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->mask, msg);
+  T_TO_B(&smsg_msg->component_id, msg);
+  T_TO_B(&smsg_msg->instance_id, msg);
+  T_TO_B(&smsg_msg->node_id, msg);
+  T_TO_B(&smsg_msg->subsystem_id, msg);
 
-  return retval;
+  return msg - start;
 }
 
-/*
-  Given 'fd', look up the entry at that fd.  If it's in the DB,
-  'entry' will be filled in and the non-negative index of the entry is
-  returned.  Otherwise, a negative value is returned and entry is left
-  alone.
+int smsg_message_to_open_client_connection(smsg_byte * msg, smsg_open_client_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->address, msg);
+  T_FR_B(&smsg_msg->port, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_OPEN_CLIENT_CONNECTION;
+}
+
+int smsg_open_client_connection_to_message(smsg_open_client_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_OPEN_CLIENT_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->address, msg);
+  T_TO_B(&smsg_msg->port, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_return_client_connection(smsg_byte * msg, smsg_return_client_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->connection, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_RETURN_CLIENT_CONNECTION;
+}
+
+int smsg_return_client_connection_to_message(smsg_return_client_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_RETURN_CLIENT_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->connection, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_close_client_connection(smsg_byte * msg, smsg_close_client_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->connection, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_CLOSE_CLIENT_CONNECTION;
+}
+
+int smsg_close_client_connection_to_message(smsg_close_client_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_CLOSE_CLIENT_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->connection, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_open_server_connection(smsg_byte * msg, smsg_open_server_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->address, msg);
+  T_FR_B(&smsg_msg->port, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_OPEN_SERVER_CONNECTION;
+}
+
+int smsg_open_server_connection_to_message(smsg_open_server_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_OPEN_SERVER_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->address, msg);
+  T_TO_B(&smsg_msg->port, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_return_server_connection(smsg_byte * msg, smsg_return_server_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->connection, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_RETURN_SERVER_CONNECTION;
+}
+
+int smsg_return_server_connection_to_message(smsg_return_server_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_RETURN_SERVER_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->connection, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_close_server_connection(smsg_byte * msg, smsg_close_server_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->connection, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_CLOSE_SERVER_CONNECTION;
+}
+
+int smsg_close_server_connection_to_message(smsg_close_server_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_CLOSE_SERVER_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->connection, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_accept_connection(smsg_byte * msg, smsg_accept_connection_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->server, msg);
+  T_FR_B(&smsg_msg->connection, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_ACCEPT_CONNECTION;
+}
+
+int smsg_accept_connection_to_message(smsg_accept_connection_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_ACCEPT_CONNECTION;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->server, msg);
+  T_TO_B(&smsg_msg->connection, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_connection_data(smsg_byte * msg, smsg_connection_data_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->connection, msg);
+  T_FR_B(&smsg_msg->length, msg);
+  if (smsg_msg->length > SMSG_CONNECTION_DATA) return 1;
+  memcpy(smsg_msg->data, msg, smsg_msg->length);
+
+  return smsg_msg->identifier != SMSG_CODE_CONNECTION_DATA;
+}
+
+int smsg_connection_data_to_message(smsg_connection_data_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_CONNECTION_DATA;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->connection, msg);
+  T_TO_B(&smsg_msg->length, msg);
+  memcpy(msg, smsg_msg->data, smsg_msg->length);
+  msg += smsg_msg->length;
+
+  return msg - start;
+}
+
+int smsg_message_to_open_ring(smsg_byte * msg, smsg_open_ring_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->key, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_OPEN_RING;
+}
+
+int smsg_open_ring_to_message(smsg_open_ring_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_OPEN_RING;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->key, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_return_ring(smsg_byte * msg, smsg_return_ring_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->status, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_RETURN_RING;
+}
+
+int smsg_return_ring_to_message(smsg_return_ring_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_RETURN_RING;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->status, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_query_test(smsg_byte * msg, smsg_query_test_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_QUERY_TEST;
+}
+
+int smsg_query_test_to_message(smsg_query_test_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_QUERY_TEST;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+
+  return msg - start;
+}
+
+int smsg_message_to_report_test(smsg_byte * msg, smsg_report_test_t * smsg_msg)
+{
+  T_FR_B(&smsg_msg->identifier, msg);
+  T_FR_B(&smsg_msg->sequence_number, msg);
+  T_FR_B(&smsg_msg->count, msg);
+  T_FR_B(&smsg_msg->time, msg);
+
+  return smsg_msg->identifier != SMSG_CODE_REPORT_TEST;
+}
+
+int smsg_report_test_to_message(smsg_report_test_t * smsg_msg, smsg_byte * msg)
+{
+  smsg_byte *start = msg;
+  smsg_byte identifier = SMSG_CODE_REPORT_TEST;
+
+  T_TO_B(&identifier, msg);
+  T_TO_B(&smsg_msg->sequence_number, msg);
+  T_TO_B(&smsg_msg->count, msg);
+  T_TO_B(&smsg_msg->time, msg);
+
+  return msg - start;
+}
+
+unsigned int smsg_debug_mask = 0;
+char * smsg_debug_name = "Smsg";
+
+/* sets the local included copy of smsg_debug_mask */
+void
+smsg_set_debug_mask(unsigned int mask)
+{
+  smsg_debug_mask = mask;
+}
+
+void
+smsg_set_debug_name(char * name)
+{
+  smsg_debug_name = name;
+}
+
+void
+smsg_print_debug(unsigned int mask, const char * fmt, ...)
+{
+  va_list ap;
+
+  if (mask & smsg_debug_mask) {
+    va_start(ap, fmt);
+    fprintf(stderr, "%s: ", smsg_debug_name);
+    vfprintf(stderr, fmt, ap);
+    fflush(stderr);
+    va_end(ap);
+  }
+}
+
+void my_free(void * ptr)
+{
+  free(ptr);
+  smsg_print_debug(SMSG_DEBUG_MEM, "free(0x%X)\n", (int) ptr);
+}
+
+void * my_malloc(size_t size)
+{
+  void * ret;
+
+  ret = malloc(size);
+
+  smsg_print_debug(SMSG_DEBUG_MEM, "malloc(%d) = 0x%X\n", (int) size, (int) ret);
+
+  return ret;
+}
+
+void * my_realloc(void * ptr, size_t size)
+{
+  void * ret;
+
+  ret = realloc(ptr, size);
+  smsg_print_debug(SMSG_DEBUG_MEM, "realloc(0x%X, %d) = 0x%X\n", (int) ptr, (int) size, (int) ret);
+
+  return ret;
+}
+
+/*
+  Given:
+
+  int i = 0xABCDEFGH;
+  char * c[sizeof(i)] = &i;
+
+  Big-endian is
+
+  c[3] c[2] c[1] c[0]
+  0xGH 0xEF 0xCD 0xAB
+
+  Little-endian is
+
+  c[3] c[2] c[1] c[0]
+  0xAB 0xCD 0xEF 0xGH
+*/
+
+void * fwdcpy(void * dest, const void * src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) ((char *) dest)[i] = ((char *) src)[i];
+
+  return dest;
+}
+
+void * revcpy(void * dest, const void * src, size_t n)
+{
+  size_t i, nm1;
+
+  for (i = 0, nm1 = n-1; i < n; i++, nm1--) ((char *) dest)[i] = ((char *) src)[nm1];
+
+  return dest;
+}
+
+int
+db_init(component_db_t * db)
+{
+  component_shard_t *shard;
+  int index;
+
+  db->mutex = ulapi_mutex_new(0);
+  ulapi_mutex_give(db->mutex);
+  db->compact_mutex = ulapi_mutex_new(0);
+  ulapi_mutex_give(db->compact_mutex);
+  db->fd_mutex = ulapi_mutex_new(0);
+  ulapi_mutex_give(db->fd_mutex);
+  for (shard = db->shards; shard < db->shards + DB_SHARDS; shard++) {
+    shard->mutex = ulapi_mutex_new(0);
+    ulapi_mutex_give(shard->mutex);
+    shard->sequence = 0;
+    for (index = 0; index < DB_SEGMENTS; index++) {
+      shard->segments[index] = NULL;
+    }
+    shard->segment_count = 0;
+    shard->block_count = 0;
+    shard->size = 0;
+    shard->index = 0;
+    for (index = 0; index <= UCHAR_MAX; index++) {
+      shard->component_head[index] = -1;
+    }
+    for (index = 0; index < (UCHAR_MAX + 1) / DB_SHARDS; index++) {
+      shard->subsystem_head[index] = -1;
+    }
+  }
+  db->port = SMSG_PORT_BASE;
+  db->store_path = NULL;
+  db->log_fd = -1;
+  db->log_count = 0;
+  db->shm_id = -1;
+  db->shm_table = NULL;
+  db->generation = 0;
+  db->snapshot = NULL;
+
+  return 0;
+}
+
+int
+db_free(component_db_t * db)
+{
+  component_shard_t *shard;
+
+  db_close_store(db);
+  db_close_shm(db);
+  if (NULL != db->snapshot) {
+    db_snapshot_release(db, db->snapshot);
+    db->snapshot = NULL;
+  }
+  for (shard = db->shards; shard < db->shards + DB_SHARDS; shard++) {
+    while (shard->block_count > 0) {
+      my_free(shard->blocks[--shard->block_count]);
+    }
+    shard->segment_count = 0;
+    shard->size = 0;
+    shard->index = 0;		/* no value is good here */
+    ulapi_mutex_delete(shard->mutex);
+  }
+  ulapi_mutex_delete(db->fd_mutex);
+  ulapi_mutex_delete(db->compact_mutex);
+  ulapi_mutex_delete(db->mutex);
+  return 0;
+}
+
+/* the four ids packed into a key, component id in the low byte */
+#define db_key(c,i,n,s) ((smsg_uint) (c) | ((smsg_uint) (i) << 8) | ((smsg_uint) (n) << 16) | ((smsg_uint) (s) << 24))
+
+#define db_entry_key(e) db_key((e)->component_id, (e)->instance_id, (e)->node_id, (e)->subsystem_id)
+
+/* the key bits to compare for a mask of SMSG_MATCH_ bits */
+#define db_key_mask(mask) db_key(((mask) & SMSG_MATCH_COMPONENT) ? 0xFF : 0, \
+				 ((mask) & SMSG_MATCH_INSTANCE) ? 0xFF : 0, \
+				 ((mask) & SMSG_MATCH_NODE) ? 0xFF : 0, \
+				 ((mask) & SMSG_MATCH_SUBSYSTEM) ? 0xFF : 0)
+
+/* the shard for a subsystem id */
+#define DB_SHARD(db,subsystem_id) (&(db)->shards[(subsystem_id) % DB_SHARDS])
+
+/* the segment, and the slot in it, of the entry at 'index' in a shard */
+#define DB_SEGMENT(shard,index) ((shard)->segments[(index) / DB_SEGMENT_ENTRIES])
+#define DB_SLOT(index) ((index) % DB_SEGMENT_ENTRIES)
+
+#define DB_KEY(shard,index) (DB_SEGMENT(shard,index)->keys[DB_SLOT(index)])
+#define DB_LINK(shard,index) (DB_SEGMENT(shard,index)->links[DB_SLOT(index)])
+
+/* takes all the shard mutexes, always in the same order */
+static void db_take_shards(component_db_t * db)
+{
+  int i;
+
+  for (i = 0; i < DB_SHARDS; i++) ulapi_mutex_take(db->shards[i].mutex);
+}
+
+static void db_give_shards(component_db_t * db)
+{
+  int i;
+
+  for (i = DB_SHARDS - 1; i >= 0; i--) ulapi_mutex_give(db->shards[i].mutex);
+}
+
+/*
+  Returns the database index of the entry at 'index' in 'shard', which
+  is its position counting the entries in the shards before it. Those
+  are counted without their mutexes, so it's only as of now, but any
+  removal could shift it anyway.
+*/
+static int db_position(component_db_t * db, component_shard_t * shard, int index)
+{
+  component_shard_t *before;
+
+  for (before = db->shards; before < shard; before++) index += before->index;
+
+  return index;
+}
+
+/* copies the entry in 'slot' out of the segment */
+static void db_segment_get(component_segment_t * segment, int slot, component_entry_t * entry)
+{
+  smsg_uint key = segment->keys[slot];
+
+  entry->component_id = key & 0xFF;
+  entry->instance_id = (key >> 8) & 0xFF;
+  entry->node_id = (key >> 16) & 0xFF;
+  entry->subsystem_id = (key >> 24) & 0xFF;
+  entry->address = segment->addresses[slot];
+  entry->port = segment->ports[slot];
+  entry->fd = segment->fds[slot];
+}
+
+/* copies the entry at 'index' out of the segments */
+static void db_get(component_shard_t * shard, int index, component_entry_t * entry)
+{
+  db_segment_get(DB_SEGMENT(shard, index), DB_SLOT(index), entry);
+}
+
+/* copies 'entry' into the segments at 'index' */
+static void db_set(component_shard_t * shard, int index, component_entry_t * entry)
+{
+  component_segment_t *segment = DB_SEGMENT(shard, index);
+  int slot = DB_SLOT(index);
+
+  segment->keys[slot] = db_entry_key(entry);
+  segment->addresses[slot] = entry->address;
+  segment->ports[slot] = (unsigned short) entry->port;
+  segment->fds[slot] = entry->fd;
+}
+
+/*
+  Returns the first of keys[start] through keys[end - 1] that equals
+  'key' in the bits of 'keymask', or 'end' if none do. With AVX-512,
+  AVX2 or SSE2 this compares 16, 8 or 4 keys at a time, and finishes
+  off one at a time.
+*/
+static int db_key_scan(const smsg_uint * keys, int start, int end, smsg_uint key, smsg_uint keymask)
+{
+  int index = start;
+
+  key &= keymask;
+
+#if defined(__GNUC__) && defined(__AVX512F__)
+  {
+    __m512i k = _mm512_set1_epi32((int) key);
+    __m512i m = _mm512_set1_epi32((int) keymask);
+    __mmask16 bits;
+
+    for (; index + 16 <= end; index += 16) {
+      bits = _mm512_cmpeq_epi32_mask(_mm512_and_si512(_mm512_loadu_si512((const void *) &keys[index]), m), k);
+      if (bits) return index + __builtin_ctz(bits);
+    }
+  }
+#elif defined(__GNUC__) && defined(__AVX2__)
+  {
+    __m256i k = _mm256_set1_epi32((int) key);
+    __m256i m = _mm256_set1_epi32((int) keymask);
+    int bits;
+
+    for (; index + 8 <= end; index += 8) {
+      bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *) &keys[index]), m), k)));
+      if (bits) return index + __builtin_ctz(bits);
+    }
+  }
+#elif defined(__GNUC__) && defined(__SSE2__)
+  {
+    __m128i k = _mm_set1_epi32((int) key);
+    __m128i m = _mm_set1_epi32((int) keymask);
+    int bits;
+
+    for (; index + 4 <= end; index += 4) {
+      bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *) &keys[index]), m), k)));
+      if (bits) return index + __builtin_ctz(bits);
+    }
+  }
+#endif
+
+  for (; index < end; index++) {
+    if ((keys[index] & keymask) == key) return index;
+  }
+
+  return end;
+}
+
+/*
+  Returns the index of the first entry in the shard at or after
+  'index' whose key matches 'key' in the bits of 'keymask', or -1 if
+  there's none. Call with the shard mutex taken.
+*/
+static int db_scan(component_shard_t * shard, int index, smsg_uint key, smsg_uint keymask)
+{
+  int base, end, slot;
+
+  while (index < shard->index) {
+    base = index - DB_SLOT(index);
+    end = shard->index - base < DB_SEGMENT_ENTRIES ? shard->index - base : DB_SEGMENT_ENTRIES;
+    slot = db_key_scan(DB_SEGMENT(shard, index)->keys, DB_SLOT(index), end, key, keymask);
+    if (slot < end) return base + slot;
+    index = base + DB_SEGMENT_ENTRIES;
+  }
+
+  return -1;
+}
+
+/* brackets a change to a shard, so that lock-free readers retry */
+#ifdef HAVE_DB_SEQLOCK
+#define db_shard_write_begin(shard) do {(shard)->sequence++; smsg_barrier();} while (0)
+#define db_shard_write_end(shard) do {smsg_barrier(); (shard)->sequence++;} while (0)
+#else
+#define db_shard_write_begin(shard)
+#define db_shard_write_end(shard)
+#endif
+
+#ifdef HAVE_DB_SEQLOCK
+
+enum {DB_READ_RETRIES = 100};	/* how often a reader retries before locking */
+
+/*
+  Looks for the entry without the shard mutex. Segments are never
+  freed or moved while the database is open, so whatever the reader
+  sees of a change in progress is safe to look at, and the sequence
+  number says whether to believe it. Returns the index in the shard
+  and fills in 'entry', or returns -1 if it's not there, or -2 if
+  writers kept getting in the way.
+*/
+static int db_find_lockless(component_shard_t * shard, component_entry_t * entry)
+{
+  smsg_uint key = db_entry_key(entry);
+  component_segment_t *segment;
+  component_entry_t found;
+  unsigned int sequence;
+  int count, base, end, slot, index, tries;
+
+  for (tries = 0; tries < DB_READ_RETRIES; tries++) {
+    sequence = shard->sequence;
+    if (sequence & 1) {
+      smsg_pause();
+      continue;
+    }
+    smsg_barrier();
+    count = *(volatile int *) &shard->index;
+    index = -1;
+    for (base = 0; base < count; base += DB_SEGMENT_ENTRIES) {
+      segment = *(component_segment_t * volatile *) &shard->segments[base / DB_SEGMENT_ENTRIES];
+      if (NULL == segment) break; /* torn, so the check below fails */
+      end = count - base < DB_SEGMENT_ENTRIES ? count - base : DB_SEGMENT_ENTRIES;
+      slot = db_key_scan(segment->keys, 0, end, key, 0xFFFFFFFF);
+      if (slot < end) {
+	db_segment_get(segment, slot, &found);
+	index = base + slot;
+	break;
+      }
+    }
+    smsg_barrier();
+    if (shard->sequence == sequence) {
+      if (index >= 0) *entry = found;
+      return index;
+    }
+  }
+
+  return -2;
+}
+
+#endif	/* HAVE_DB_SEQLOCK */
+
+/*
+  Copies the entries in the shard that match into 'out', if it's not
+  NULL, and returns how many there are. Call with the shard mutex taken.
+*/
+static int db_match_copy(component_shard_t * shard, component_entry_t * pattern, int mask, component_entry_t * out)
+{
+  smsg_uint key = db_entry_key(pattern);
+  smsg_uint keymask = db_key_mask(mask);
+  int index, count = 0;
+
+  if (mask & SMSG_MATCH_COMPONENT) {
+    for (index = shard->component_head[pattern->component_id]; index >= 0; index = DB_LINK(shard, index).component_next) {
+      if ((DB_KEY(shard, index) & keymask) == (key & keymask)) {
+	if (NULL != out) db_get(shard, index, &out[count]);
+	count++;
+      }
+    }
+  } else if (mask & SMSG_MATCH_SUBSYSTEM) {
+    for (index = shard->subsystem_head[pattern->subsystem_id / DB_SHARDS]; index >= 0; index = DB_LINK(shard, index).subsystem_next) {
+      if ((DB_KEY(shard, index) & keymask) == (key & keymask)) {
+	if (NULL != out) db_get(shard, index, &out[count]);
+	count++;
+      }
+    }
+  } else {
+    /* no index for these, so scan the keys */
+    for (index = db_scan(shard, 0, key, keymask); index >= 0; index = db_scan(shard, index + 1, key, keymask)) {
+      if (NULL != out) db_get(shard, index, &out[count]);
+      count++;
+    }
+  }
+
+  return count;
+}
+
+enum {DB_COPY_RETRIES = 3};	/* copies shard by shard before taking them all */
+
+/*
+  Copies the entries matching 'pattern' under 'mask', or all of them if
+  it's 0, from every shard into a new array at '*entries', and returns
+  how many there are, with the database mutex taken, or -1 without it
+  if there's no memory. Each shard's mutex is taken just while it's
+  copied, and the copy is redone if the generation changed meanwhile,
+  so it's as consistent as if they'd all been taken, which they are if
+  changes keep getting in the way.
+*/
+static int db_copy_shards(component_db_t * db, component_entry_t * pattern, int mask, component_entry_t ** entries)
+{
+  component_shard_t *shard;
+  component_entry_t *out;
+  unsigned int generation;
+  int room, count, n, tries, locked;
+
+  for (tries = 0;; tries++) {
+    locked = (tries >= DB_COPY_RETRIES);
+    if (locked) db_take_shards(db);
+    ulapi_mutex_take(db->mutex);
+    generation = db->generation;
+    ulapi_mutex_give(db->mutex);
+
+    for (shard = db->shards, room = 0; shard < db->shards + DB_SHARDS; shard++) {
+      if (! locked) ulapi_mutex_take(shard->mutex);
+      room += db_match_copy(shard, pattern, mask, NULL);
+      if (! locked) ulapi_mutex_give(shard->mutex);
+    }
+    out = my_malloc((room > 0 ? room : 1) * sizeof(component_entry_t));
+    if (NULL == out) {
+      if (locked) db_give_shards(db);
+      return -1;
+    }
+    for (shard = db->shards, count = 0; shard < db->shards + DB_SHARDS; shard++) {
+      if (! locked) ulapi_mutex_take(shard->mutex);
+      n = db_match_copy(shard, pattern, mask, NULL);
+      if (count + n <= room) db_match_copy(shard, pattern, mask, out + count);
+      count += n;
+      if (! locked) ulapi_mutex_give(shard->mutex);
+    }
+
+    ulapi_mutex_take(db->mutex);
+    if (locked) db_give_shards(db);
+    if (generation == db->generation && count <= room) {
+      *entries = out;
+      return count;
+    }
+    ulapi_mutex_give(db->mutex);
+    my_free(out);
+  }
+}
+
+/*
+  The optional on-disk store is a fixed-layout entry file, read and
+  written through mmap, plus an append-only write-ahead log of add and
+  remove records. Opening the store loads the entry file, replays the
+  log over it, and compacts the result into a fresh entry file and an
+  empty log. Thereafter each change to the database appends a record to
+  the log, and once there are DB_STORE_COMPACT records the next call to
+  db_compact_store_due compacts it.
+
+  Compaction copies the database shard by shard, then writes the entry
+  file with no mutex taken, so lookups and changes go on meanwhile, and
+  then trims the records it has from the front of the log, keeping any
+  that came in while it wrote. The entry file is written to a temporary
+  file and renamed into place before the log is trimmed, so a crash at
+  any point leaves an entry file plus a log that replays to the latest
+  database. Replay is
+  idempotent, since adding an existing entry or removing a missing one
+  does nothing. The log isn't synced on every record, so what's lost
+  in a crash of the host, but not of the node manager, is at most the
+  changes since the last compaction.
+
+  All numbers are little-endian. The entry file is a header,
+
+  ['S'] ['M'] ['D'] ['B'] [version] [count] [next port]
+
+  followed by 'count' entries,
+
+  [component id] [instance id] [node id] [subsystem id] [address] [port]
+
+  and each log record is
+
+  [op 'A' or 'R'] [component id] [instance id] [node id] [subsystem id]
+  [address] [port] [check]
+
+  where 'check' is the complement of the byte sum of the record before
+  it, so that a record torn by a crash is recognized and dropped.
+*/
+
+enum {
+  DB_STORE_VERSION = 1,
+  DB_STORE_HEADER_SIZE = 4 + sizeof(smsg_uint) + sizeof(smsg_uint) + sizeof(smsg_port),
+  DB_STORE_ENTRY_SIZE = 4 + sizeof(smsg_addr) + sizeof(smsg_port),
+  DB_STORE_LOG_SIZE = 1 + DB_STORE_ENTRY_SIZE + 1,
+  DB_STORE_COMPACT = 1024	/* how many log records before compacting */
+};
+
+#define DB_STORE_MAGIC "SMDB"
+#define DB_STORE_LOG_SUFFIX ".wal"
+#define DB_STORE_TMP_SUFFIX ".tmp"
+
+#ifdef HAVE_DB_STORE
+
+static smsg_byte *db_store_entry_to_bytes(component_entry_t * entry, smsg_byte * ptr)
+{
+  T_TO_B(&entry->component_id, ptr);
+  T_TO_B(&entry->instance_id, ptr);
+  T_TO_B(&entry->node_id, ptr);
+  T_TO_B(&entry->subsystem_id, ptr);
+  T_TO_B(&entry->address, ptr);
+  T_TO_B(&entry->port, ptr);
+
+  return ptr;
+}
+
+static smsg_byte *db_store_bytes_to_entry(smsg_byte * ptr, component_entry_t * entry)
+{
+  T_FR_B(&entry->component_id, ptr);
+  T_FR_B(&entry->instance_id, ptr);
+  T_FR_B(&entry->node_id, ptr);
+  T_FR_B(&entry->subsystem_id, ptr);
+  T_FR_B(&entry->address, ptr);
+  T_FR_B(&entry->port, ptr);
+  entry->fd = -1;		/* any proxy connection is long gone */
+
+  return ptr;
+}
+
+static smsg_byte db_store_check(smsg_byte * record)
+{
+  smsg_byte sum = 0;
+  int i;
+
+  for (i = 0; i < DB_STORE_LOG_SIZE - 1; i++) sum += record[i];
+
+  return ~sum;
+}
+
+static char *db_store_path_with(const char * path, const char * suffix)
+{
+  char *str;
+
+  str = my_malloc(strlen(path) + strlen(suffix) + 1);
+  if (NULL != str) {
+    strcpy(str, path);
+    strcat(str, suffix);
+  }
+
+  return str;
+}
+
+/* writes a new entry file of the 'count' 'entries', with no mutex needed */
+static int db_store_write(component_db_t * db, component_entry_t * entries, smsg_uint count, smsg_port port)
+{
+  char *tmp_path;
+  int fd;
+  size_t size;
+  smsg_byte *map, *ptr;
+  smsg_uint version = DB_STORE_VERSION;
+  smsg_uint index;
+
+  tmp_path = db_store_path_with(db->store_path, DB_STORE_TMP_SUFFIX);
+  if (NULL == tmp_path) return -1;
+
+#define RETURN(r) my_free(tmp_path); return (r)
+
+  size = DB_STORE_HEADER_SIZE + (size_t) count * DB_STORE_ENTRY_SIZE;
+  fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't create db file %s\n", tmp_path);
+    RETURN(-1);
+  }
+  if (0 != ftruncate(fd, (off_t) size)) {
+    close(fd);
+    RETURN(-1);
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == map) {
+    close(fd);
+    RETURN(-1);
+  }
+
+  ptr = map;
+  memcpy(ptr, DB_STORE_MAGIC, 4);
+  ptr += 4;
+  T_TO_B(&version, ptr);
+  T_TO_B(&count, ptr);
+  T_TO_B(&port, ptr);
+  for (index = 0; index < count; index++) {
+    ptr = db_store_entry_to_bytes(&entries[index], ptr);
+  }
+
+  msync(map, size, MS_SYNC);
+  munmap(map, size);
+  close(fd);
+
+  if (0 != rename(tmp_path, db->store_path)) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't rename %s to %s\n", tmp_path, db->store_path);
+    RETURN(-1);
+  }
+
+  smsg_print_debug(SMSG_DEBUG_DB, "Compacted db to %s with %d entries\n", db->store_path, (int) count);
+
+  RETURN(0);
+#undef RETURN
+}
+
+/*
+  Drops the first 'logged' records from the log, which the entry file
+  now has, keeping any logged since in a new log put in its place.
+  Call with the database mutex taken.
+*/
+static int db_store_trim_log(component_db_t * db, int logged)
+{
+  smsg_byte record[DB_STORE_LOG_SIZE];
+  char *log_path, *tmp_path;
+  off_t end;
+  int fd, kept, i;
+
+  if (db->log_fd < 0) return -1;
+
+  kept = db->log_count - logged;
+  if (kept <= 0) {
+    /* as usual, nothing came in while the entry file was written */
+    if (0 != ftruncate(db->log_fd, 0)) return -1;
+    db->log_count = 0;
+    return 0;
+  }
+
+  log_path = db_store_path_with(db->store_path, DB_STORE_LOG_SUFFIX);
+  tmp_path = db_store_path_with(db->store_path, DB_STORE_LOG_SUFFIX DB_STORE_TMP_SUFFIX);
+  fd = -1;
+  end = lseek(db->log_fd, 0, SEEK_END);
+  if (NULL != log_path && NULL != tmp_path && end >= (off_t) kept * DB_STORE_LOG_SIZE) {
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  }
+  /* the ones to keep are the last in the log */
+  for (i = 0; fd >= 0 && i < kept; i++) {
+    if (DB_STORE_LOG_SIZE != pread(db->log_fd, record, DB_STORE_LOG_SIZE, end - (off_t) (kept - i) * DB_STORE_LOG_SIZE) ||
+	DB_STORE_LOG_SIZE != write(fd, record, DB_STORE_LOG_SIZE)) break;
+  }
+  if (fd >= 0 && (i < kept || 0 != rename(tmp_path, log_path))) {
+    close(fd);
+    unlink(tmp_path);
+    fd = -1;
+  }
+  if (NULL != log_path) my_free(log_path);
+  if (NULL != tmp_path) my_free(tmp_path);
+  /* the whole log is still there, which replays to the same thing */
+  if (fd < 0) return -1;
+
+  close(db->log_fd);
+  db->log_fd = fd;
+  db->log_count = kept;
+  smsg_print_debug(SMSG_DEBUG_DB, "Kept %d db log records from while compacting\n", kept);
+
+  return 0;
+}
+
+/*
+  Appends a record of this change to the log. Call with the database
+  mutex taken. Compaction is left for db_compact_store_due, so that
+  writers never wait on it.
+*/
+static void db_store_log(component_db_t * db, smsg_byte op, component_entry_t * entry)
+{
+  smsg_byte record[DB_STORE_LOG_SIZE];
+
+  if (db->log_fd < 0) return;
+
+  record[0] = op;
+  db_store_entry_to_bytes(entry, &record[1]);
+  record[DB_STORE_LOG_SIZE - 1] = db_store_check(record);
+  if (DB_STORE_LOG_SIZE != write(db->log_fd, record, DB_STORE_LOG_SIZE)) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't append to db log, closing it\n");
+    close(db->log_fd);
+    db->log_fd = -1;
+    return;
+  }
+
+  db->log_count++;
+}
+
+/*
+  Copies every shard and writes them out, if 'due' is 0 or the log has
+  grown enough. Only the copy and the trimming of the log are done with
+  the database mutex taken. Call with no mutex taken. Returns 0 if OK,
+  otherwise -1.
+*/
+static int db_store_compact(component_db_t * db, int due)
+{
+  component_entry_t any;
+  component_entry_t *entries;
+  smsg_port port;
+  int count, logged;
+  int retval = 0;
+
+  ulapi_mutex_take(db->compact_mutex);
+  memset(&any, 0, sizeof(any));
+  count = db_copy_shards(db, &any, 0, &entries);
+  if (count < 0) {
+    ulapi_mutex_give(db->compact_mutex);
+    return -1;
+  }
+  /* someone else may have just done it */
+  if (db->log_fd < 0 || (due && db->log_count < DB_STORE_COMPACT)) {
+    ulapi_mutex_give(db->mutex);
+    ulapi_mutex_give(db->compact_mutex);
+    my_free(entries);
+    return 0;
+  }
+  /* the copy has everything logged so far */
+  logged = db->log_count;
+  port = db->port;
+  ulapi_mutex_give(db->mutex);
+
+  retval = db_store_write(db, entries, (smsg_uint) count, port);
+  my_free(entries);
+  if (0 == retval) {
+    ulapi_mutex_take(db->mutex);
+    retval = db_store_trim_log(db, logged);
+    ulapi_mutex_give(db->mutex);
+  }
+  ulapi_mutex_give(db->compact_mutex);
+
+  return retval;
+}
+
+/* loads the entry file, if there is one; returns the count, or -1 on error */
+static int db_store_load_entries(component_db_t * db, const char * path)
+{
+  int fd;
+  struct stat st;
+  smsg_byte *map, *ptr;
+  smsg_uint version, count, i;
+  smsg_port next_port;
+  component_entry_t entry;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    /* no entry file yet is fine, we'll make one */
+    return (ENOENT == errno) ? 0 : -1;
+  }
+  if (0 != fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  if (0 == st.st_size) {
+    close(fd);
+    return 0;
+  }
+  if (st.st_size < DB_STORE_HEADER_SIZE) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Db file %s is truncated\n", path);
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) return -1;
+
+  ptr = map;
+  if (0 != memcmp(ptr, DB_STORE_MAGIC, 4)) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Db file %s isn't a db file\n", path);
+    munmap(map, (size_t) st.st_size);
+    return -1;
+  }
+  ptr += 4;
+  T_FR_B(&version, ptr);
+  T_FR_B(&count, ptr);
+  T_FR_B(&next_port, ptr);
+  if (DB_STORE_VERSION != version ||
+      (size_t) st.st_size < DB_STORE_HEADER_SIZE + (size_t) count * DB_STORE_ENTRY_SIZE) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Db file %s is version %d with %d entries in %d bytes\n", path, (int) version, (int) count, (int) st.st_size);
+    munmap(map, (size_t) st.st_size);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    ptr = db_store_bytes_to_entry(ptr, &entry);
+    if (0 > db_add(db, &entry)) break;
+  }
+  if (next_port > db->port) db->port = next_port;
+
+  munmap(map, (size_t) st.st_size);
+
+  return (int) i;
+}
+
+/* replays the log over what's been loaded; returns the record count */
+static int db_store_replay_log(component_db_t * db, int fd, smsg_addr host_addr)
+{
+  enum {RECORDS = 64};
+  smsg_byte buf[RECORDS * DB_STORE_LOG_SIZE];
+  smsg_byte *ptr;
+  int buflen, have;
+  int count = 0;
+  component_entry_t entry;
+
+  have = 0;
+  for (;;) {
+    buflen = read(fd, buf + have, sizeof(buf) - have);
+    if (buflen <= 0) break;
+    buflen += have;
+    for (ptr = buf; ptr + DB_STORE_LOG_SIZE <= buf + buflen; ptr += DB_STORE_LOG_SIZE) {
+      if (ptr[DB_STORE_LOG_SIZE - 1] != db_store_check(ptr)) {
+	smsg_print_debug(SMSG_DEBUG_DB, "Dropping bad db log record %d and after\n", count);
+	return count;
+      }
+      db_store_bytes_to_entry(ptr + 1, &entry);
+      if ('A' == ptr[0]) {
+	db_add(db, &entry);
+	/* don't hand out a port that a local component is using */
+	if (entry.address == host_addr && entry.port >= db->port) {
+	  db->port = entry.port + 1;
+	}
+      } else if ('R' == ptr[0]) {
+	db_remove(db, &entry);
+      }
+      count++;
+    }
+    /* keep any partial record for the next read */
+    have = buf + buflen - ptr;
+    memmove(buf, ptr, have);
+  }
+
+  return count;
+}
+
+#endif	/* HAVE_DB_STORE */
+
+/*
+  The secondary indexes on component id and subsystem id are doubly
+  linked lists of entry indexes, one list per id value, so that
+  wildcard queries visit only the entries with the id they want and
+  removal can unlink from the middle of a list.
+*/
+
+/* threads the entry at 'index' onto its lists; call with the shard mutex taken */
+static void db_index_link(component_shard_t * shard, int index)
+{
+  component_link_t *link;
+  smsg_byte cid, sid;
+
+  cid = DB_KEY(shard, index) & 0xFF;
+  sid = ((DB_KEY(shard, index) >> 24) & 0xFF) / DB_SHARDS;
+  link = &DB_LINK(shard, index);
+
+  link->component_prev = -1;
+  link->component_next = shard->component_head[cid];
+  if (link->component_next >= 0) DB_LINK(shard, link->component_next).component_prev = index;
+  shard->component_head[cid] = index;
+
+  link->subsystem_prev = -1;
+  link->subsystem_next = shard->subsystem_head[sid];
+  if (link->subsystem_next >= 0) DB_LINK(shard, link->subsystem_next).subsystem_prev = index;
+  shard->subsystem_head[sid] = index;
+}
+
+/* takes the entry at 'index' off its lists; call with the shard mutex taken */
+static void db_index_unlink(component_shard_t * shard, int index)
+{
+  component_link_t *link;
+
+  link = &DB_LINK(shard, index);
+
+  if (link->component_prev >= 0) DB_LINK(shard, link->component_prev).component_next = link->component_next;
+  else shard->component_head[DB_KEY(shard, index) & 0xFF] = link->component_next;
+  if (link->component_next >= 0) DB_LINK(shard, link->component_next).component_prev = link->component_prev;
+
+  if (link->subsystem_prev >= 0) DB_LINK(shard, link->subsystem_prev).subsystem_next = link->subsystem_next;
+  else shard->subsystem_head[((DB_KEY(shard, index) >> 24) & 0xFF) / DB_SHARDS] = link->subsystem_next;
+  if (link->subsystem_next >= 0) DB_LINK(shard, link->subsystem_next).subsystem_prev = link->subsystem_prev;
+}
+
+/*
+  The shared-memory registry is a header followed by an open-addressed
+  hash table of SMSG_SHM_ENTRIES slots, probed linearly. Keys are the
+  four id bytes packed into an smsg_uint. Removed keys leave a
+  tombstone so that probes for keys past them still work, and the table
+  is rehashed without them when they pile up. The table is changed only
+  with the database mutex taken.
+*/
+
+enum {
+  DB_SHM_MAGIC = 0x534d5347,	/* 'SMSG' */
+  DB_SHM_EMPTY = 0,
+  DB_SHM_USED = 1,
+  DB_SHM_GONE = 2,
+  DB_SHM_RETRIES = 100		/* how often a reader retries before giving up */
+};
+
+typedef struct {
+  smsg_uint key;
+  smsg_addr address;
+  smsg_port port;
+  smsg_uint state;
+} db_shm_entry_t;
+
+typedef struct {
+  smsg_uint magic;
+  volatile smsg_uint sequence;	/* odd while being changed */
+  volatile smsg_uint beat;	/* when the node manager last said it's alive, in seconds */
+  smsg_uint count;		/* used slots */
+  smsg_uint gone;		/* tombstones */
+  db_shm_entry_t entries[SMSG_SHM_ENTRIES];
+} db_shm_table_t;
+
+/* Fibonacci hashing spreads the mostly-small id bytes over the table */
+#define db_shm_hash(key) ((smsg_uint) ((key) * 2654435761U) & (SMSG_SHM_ENTRIES - 1))
+
+#ifdef HAVE_DB_SHM
+
+/* returns the slot with 'key', or a negative value if it's not there */
+static int db_shm_probe(db_shm_table_t * table, smsg_uint key)
+{
+  smsg_uint slot;
+  int n;
+
+  for (slot = db_shm_hash(key), n = 0; n < SMSG_SHM_ENTRIES; slot = (slot + 1) & (SMSG_SHM_ENTRIES - 1), n++) {
+    if (DB_SHM_EMPTY == table->entries[slot].state) break;
+    if (DB_SHM_USED == table->entries[slot].state && key == table->entries[slot].key) return slot;
+  }
+
+  return -1;
+}
+
+/* puts 'entry' in the table; call inside a write section */
+static void db_shm_insert(db_shm_table_t * table, component_entry_t * entry)
+{
+  smsg_uint key, slot;
+  int n, free_slot = -1;
+
+  key = db_entry_key(entry);
+  for (slot = db_shm_hash(key), n = 0; n < SMSG_SHM_ENTRIES; slot = (slot + 1) & (SMSG_SHM_ENTRIES - 1), n++) {
+    if (DB_SHM_USED == table->entries[slot].state) {
+      if (key == table->entries[slot].key) {
+	free_slot = slot;	/* update in place */
+	break;
+      }
+    } else {
+      if (free_slot < 0) free_slot = slot;
+      if (DB_SHM_EMPTY == table->entries[slot].state) break;
+    }
+  }
+  if (free_slot < 0) {
+    smsg_print_debug(SMSG_DEBUG_DB, "No room in shared registry for component %d %d %d %d\n", (int) entry->component_id, (int) entry->instance_id, (int) entry->node_id, (int) entry->subsystem_id);
+    return;
+  }
+
+  if (DB_SHM_USED != table->entries[free_slot].state) {
+    if (DB_SHM_GONE == table->entries[free_slot].state) table->gone--;
+    table->count++;
+  }
+  table->entries[free_slot].key = key;
+  table->entries[free_slot].address = entry->address;
+  table->entries[free_slot].port = entry->port;
+  table->entries[free_slot].state = DB_SHM_USED;
+}
+
+/* starts a change that readers will notice and retry */
+static void db_shm_write_begin(db_shm_table_t * table)
+{
+  table->sequence++;
+  smsg_barrier();
+}
+
+static void db_shm_write_end(db_shm_table_t * table)
+{
+  smsg_barrier();
+  table->sequence++;
+}
+
+/* fills the table from the database; call with all the mutexes taken */
+static void db_shm_fill(component_db_t * db)
+{
+  db_shm_table_t *table = db->shm_table;
+  component_shard_t *shard;
+  component_entry_t entry;
+  int index;
+
+  db_shm_write_begin(table);
+  memset(table->entries, 0, sizeof(table->entries));
+  table->count = 0;
+  table->gone = 0;
+  for (shard = db->shards; shard < db->shards + DB_SHARDS; shard++) {
+    for (index = 0; index < shard->index; index++) {
+      db_get(shard, index, &entry);
+      db_shm_insert(table, &entry);
+    }
+  }
+  db_shm_write_end(table);
+}
+
+/*
+  Rehashes the table without its tombstones. This works from a copy of
+  the table rather than from the database, which would mean taking the
+  shard mutexes while a writer already has one.
+*/
+static void db_shm_rehash(db_shm_table_t * table)
+{
+  db_shm_entry_t *entries;
+  component_entry_t entry;
+  int slot;
+
+  entries = my_malloc(sizeof(table->entries));
+  if (NULL == entries) return;	/* it still works, just with longer probes */
+  memcpy(entries, table->entries, sizeof(table->entries));
+
+  db_shm_write_begin(table);
+  memset(table->entries, 0, sizeof(table->entries));
+  table->count = 0;
+  table->gone = 0;
+  for (slot = 0; slot < SMSG_SHM_ENTRIES; slot++) {
+    if (DB_SHM_USED != entries[slot].state) continue;
+    entry.component_id = entries[slot].key & 0xFF;
+    entry.instance_id = (entries[slot].key >> 8) & 0xFF;
+    entry.node_id = (entries[slot].key >> 16) & 0xFF;
+    entry.subsystem_id = (entries[slot].key >> 24) & 0xFF;
+    entry.address = entries[slot].address;
+    entry.port = entries[slot].port;
+    db_shm_insert(table, &entry);
+  }
+  db_shm_write_end(table);
+
+  my_free(entries);
+}
+
+/* publishes an added entry; call with the mutex taken */
+static void db_shm_publish(component_db_t * db, component_entry_t * entry)
+{
+  db_shm_table_t *table = db->shm_table;
+
+  if (NULL == table) return;
+
+  db_shm_write_begin(table);
+  db_shm_insert(table, entry);
+  db_shm_write_end(table);
+}
+
+/* withdraws a removed entry; call with the mutex taken */
+static void db_shm_withdraw(component_db_t * db, component_entry_t * entry)
+{
+  db_shm_table_t *table = db->shm_table;
+  int slot;
+
+  if (NULL == table) return;
+
+  slot = db_shm_probe(table, db_entry_key(entry));
+  if (slot < 0) return;
+
+  db_shm_write_begin(table);
+  table->entries[slot].state = DB_SHM_GONE;
+  table->count--;
+  table->gone++;
+  db_shm_write_end(table);
+
+  /* long probe chains of tombstones slow down every reader */
+  if (table->gone > SMSG_SHM_ENTRIES / 4) db_shm_rehash(table);
+}
+
+#endif	/* HAVE_DB_SHM */
+
+/* returns the index in its shard of the entry with these ids; call with the shard mutex taken */
+static int db_find_index(component_shard_t * shard, component_entry_t * entry)
+{
+  return db_scan(shard, 0, db_entry_key(entry), 0xFFFFFFFF);
+}
+
+/* returns the index in the shard of the entry with this fd; call with the shard mutex taken */
+static int db_find_fd_index(component_shard_t * shard, int fd)
+{
+  int base, end, slot;
+
+  /* the fds are 32-bit too, so they scan the same way as the keys */
+  for (base = 0; base < shard->index; base += DB_SEGMENT_ENTRIES) {
+    end = shard->index - base < DB_SEGMENT_ENTRIES ? shard->index - base : DB_SEGMENT_ENTRIES;
+    slot = db_key_scan((const smsg_uint *) shard->segments[base / DB_SEGMENT_ENTRIES]->fds, 0, end, (smsg_uint) fd, 0xFFFFFFFF);
+    if (slot < end) return base + slot;
+  }
+
+  return -1;
+}
+
+/*
+  Fill in entry.component,instance,node,subsystem_id and pass pointer.
+  If it's in the DB, the rest will be filled in and the non-negative
+  index of the entry is returned.  Otherwise, a negative value is
+  returned and entry is left alone.
+*/
+int
+db_find(component_db_t * db, component_entry_t * entry)
+{
+  component_shard_t *shard = DB_SHARD(db, entry->subsystem_id);
+  int index;
+
+#ifdef HAVE_DB_SEQLOCK
+  /* lookups far outnumber changes, so try without the mutex first */
+  index = db_find_lockless(shard, entry);
+  if (index >= 0) return db_position(db, shard, index);
+  if (-1 == index) return -1;
+#endif
+
+  ulapi_mutex_take(shard->mutex);
+  index = db_find_index(shard, entry);
+  if (index >= 0) {
+    db_get(shard, index, entry);
+    index = db_position(db, shard, index);
+  }
+  ulapi_mutex_give(shard->mutex);
+
+  return index;
+}
+
+/*
+  Given 'fd', look up the entry at that fd.  If it's in the DB,
+  'entry' will be filled in and the non-negative index of the entry is
+  returned.  Otherwise, a negative value is returned and entry is left
+  alone.
+*/
+int
+db_find_fd(component_db_t * db, int fd, component_entry_t * entry)
+{
+  component_shard_t *shard;
+  int index = -1;
+
+  /* the fd could be in any shard, so look in each in turn */
+  for (shard = db->shards; shard < db->shards + DB_SHARDS && index < 0; shard++) {
+    ulapi_mutex_take(shard->mutex);
+    index = db_find_fd_index(shard, fd);
+    if (index >= 0) {
+      db_get(shard, index, entry);
+      index = db_position(db, shard, index);
+    }
+    ulapi_mutex_give(shard->mutex);
+  }
+
+  return index;
+}
+
+/*
+  Finds the entry, by its ids or by 'fd' if 'by_fd' is set, or inserts
+  it if it's not there, all in one critical section so that two
+  registrations of the same entry can't both insert it. Returns the
+  index of the existing or new entry, or -1 on error. That section is
+  the entry's shard. When looking by fd, which could be in any shard,
+  the others are looked in one at a time, with the fd mutex taken so
+  that no other add by fd can slip the same fd in meanwhile.
+
+  When the shard is full, a new arena block of segments is allocated
+  with the mutex given back, and the search is redone once it's in
+  hand, since someone else may have added the entry or grown the shard
+  meanwhile. Growing just adds the new segments to the directory, so it
+  never copies or moves an entry; only db_remove moves one, the last,
+  into the slot it frees.
+*/
+static int db_upsert(component_db_t * db, component_entry_t * entry, int by_fd, int fd)
+{
+  component_shard_t *shard = DB_SHARD(db, entry->subsystem_id);
+  component_shard_t *found;
+  component_segment_t *block = NULL;
+  int block_segments = 0;
+  int index, i;
+
+  if (by_fd) ulapi_mutex_take(db->fd_mutex);
+
+  for (;;) {
+    index = -1;
+    if (by_fd) {
+      /* whichever shard has it is left taken */
+      for (found = db->shards; found < db->shards + DB_SHARDS; found++) {
+	ulapi_mutex_take(found->mutex);
+	index = db_find_fd_index(found, fd);
+	if (index >= 0) break;
+	ulapi_mutex_give(found->mutex);
+      }
+    }
+    if (index < 0) {
+      ulapi_mutex_take(shard->mutex);
+      found = shard;
+      if (! by_fd) index = db_find_index(shard, entry);
+    }
+    if (index >= 0) {
+      db_get(found, index, entry);
+      index = db_position(db, found, index);
+      break;
+    }
+    if (shard->index < shard->size) break;
+    if (NULL != block && shard->segment_count + block_segments <= DB_SEGMENTS) {
+      /* we have more segments, so add them to the directory */
+      for (i = 0; i < block_segments; i++) {
+	shard->segments[shard->segment_count++] = &block[i];
+      }
+      shard->blocks[shard->block_count++] = block;
+      shard->size += block_segments * DB_SEGMENT_ENTRIES;
+      block = NULL;
+      smsg_print_debug(SMSG_DEBUG_DB, "Grew db shard %d to %d entries\n", (int) (shard - db->shards), shard->size);
+      break;
+    }
+    /* double up to the arena limit, but not past the directory */
+    block_segments = shard->segment_count > 0 ? shard->segment_count : 1;
+    if (block_segments > DB_ARENA_SEGMENTS) block_segments = DB_ARENA_SEGMENTS;
+    if (block_segments > DB_SEGMENTS - shard->segment_count) block_segments = DB_SEGMENTS - shard->segment_count;
+    ulapi_mutex_give(shard->mutex);
+
+    if (NULL != block) my_free(block);
+    block = NULL;
+    if (block_segments > 0) {
+      block = my_malloc(block_segments * sizeof(component_segment_t));
+    }
+    if (NULL == block) {
+      smsg_print_debug(SMSG_DEBUG_DB, "Can't grow database\n");
+      if (by_fd) ulapi_mutex_give(db->fd_mutex);
+      return -1;
+    }
+  }
+
+  if (index >= 0) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Already have db entry for component %d %d %d %d %s %d %d\n", 
+		     (int) entry->component_id,
+		     (int) entry->instance_id,
+		     (int) entry->node_id,
+		     (int) entry->subsystem_id,
+		     ulapi_address_to_hostname(entry->address),
+		     (int) entry->port,
+		     (int) entry->fd);
+  } else {
+    if (0 == entry->address) entry->address = ulapi_get_host_address();
+    ulapi_mutex_take(db->mutex);
+    if (0 == entry->port) entry->port = db->port++;
+    db_shard_write_begin(shard);
+    index = shard->index;
+    db_set(shard, index, entry);
+    shard->index++;
+    db_index_link(shard, index);
+    db_shard_write_end(shard);
+    index = db_position(db, shard, index);
+    db->generation++;
+#ifdef HAVE_DB_STORE
+    db_store_log(db, 'A', entry);
+#endif
+#ifdef HAVE_DB_SHM
+    db_shm_publish(db, entry);
+#endif
+    ulapi_mutex_give(db->mutex);
+    smsg_print_debug(SMSG_DEBUG_DB, "Added to db with component %d %d %d %d %s %d %d\n", 
+		     (int) entry->component_id,
+		     (int) entry->instance_id,
+		     (int) entry->node_id,
+		     (int) entry->subsystem_id,
+		     ulapi_address_to_hostname(entry->address),
+		     (int) entry->port,
+		     (int) entry->fd);
+  }
+  ulapi_mutex_give(found->mutex);
+  if (by_fd) ulapi_mutex_give(db->fd_mutex);
+
+  /* if someone else grew it first */
+  if (NULL != block) my_free(block);
+
+  return index;
+}
+
+/*
+  Add this entry to the database. If it's already in the database,
+  the non-negative index of the entry is returned. Otherwise any
+  zero address or port will be filled in, and the index returned.
+  On error, -1 is returned.
+*/
+int
+db_add(component_db_t * db, component_entry_t * entry)
+{
+  return db_upsert(db, entry, 0, -1);
+}
+
+/*
+  Given 'fd', add this entry to the database. If it's already in the
+  database, the non-negative index of the entry is returned. Otherwise
+  any zero address or port will be filled in, and the index returned.
+  On error, -1 is returned.
+*/
+int
+db_add_fd(component_db_t * db, int fd, component_entry_t * entry)
+{
+  return db_upsert(db, entry, 1, fd);
+}
+
+/*
+  Pass an index, and the entry will be filled in and the index returned.
+  If there is no entry at that index, the entry is left alone and a 
+  negative value is returned. Indexes run from 0 to one less than
+  db_size, through the shards in order, each taken in turn.
+*/
+int
+db_lookup(component_db_t * db, int index, component_entry_t * entry)
+{
+  component_shard_t *shard;
+  int position = index;
+
+  if (index < 0) return -1;
+
+  for (shard = db->shards; shard < db->shards + DB_SHARDS; shard++) {
+    ulapi_mutex_take(shard->mutex);
+    if (position < shard->index) {
+      db_get(shard, position, entry);
+      ulapi_mutex_give(shard->mutex);
+      return index;
+    }
+    position -= shard->index;
+    ulapi_mutex_give(shard->mutex);
+  }
+
+  return -1;
+}
+
+/*
+  Returns index of last entry, -1 if empty
+*/
+int
+db_last(component_db_t * db)
+{
+  return db_size(db) - 1;
+}
+
+/* counts each shard in turn, so it's only as of now */
+int
+db_size(component_db_t * db)
+{
+  component_shard_t *shard;
+  int count = 0;
+
+  for (shard = db->shards; shard < db->shards + DB_SHARDS; shard++) {
+    ulapi_mutex_take(shard->mutex);
+    count += shard->index;
+    ulapi_mutex_give(shard->mutex);
+  }
+
+  return count;
+}
+
+/*
+  Snapshots are copy-on-write by generation: the database keeps the
+  latest one it handed out, with a reference of its own, and hands it
+  out again until a change bumps the generation. Then the next request
+  copies the entries afresh and the old one is freed once its last
+  holder releases it.
+*/
+static void db_snapshot_unref(component_snapshot_t * snapshot)
+{
+  if (--snapshot->refs > 0) return;
+  if (NULL != snapshot->entries) my_free(snapshot->entries);
+  my_free(snapshot);
+}
+
+component_snapshot_t *
+db_snapshot(component_db_t * db)
+{
+  component_snapshot_t *snapshot;
+  component_entry_t any;
+  component_entry_t *entries;
+  int count;
+
+  ulapi_mutex_take(db->mutex);
+  snapshot = db->snapshot;
+  if (NULL != snapshot && snapshot->generation == db->generation) {
+    snapshot->refs++;
+    ulapi_mutex_give(db->mutex);
+    return snapshot;
+  }
+  ulapi_mutex_give(db->mutex);
+
+  /* it's stale, so copy every shard */
+  memset(&any, 0, sizeof(any));
+  count = db_copy_shards(db, &any, 0, &entries);
+  if (count < 0) return NULL;
+
+  snapshot = my_malloc(sizeof(*snapshot));
+  if (NULL == snapshot) {
+    my_free(entries);
+  } else {
+    snapshot->count = count;
+    snapshot->entries = entries;
+    snapshot->generation = db->generation;
+    snapshot->refs = 2;	/* ours and the caller's */
+    if (NULL != db->snapshot) db_snapshot_unref(db->snapshot);
+    db->snapshot = snapshot;
+  }
+
+  ulapi_mutex_give(db->mutex);
+
+  return snapshot;
+}
+
+void
+db_snapshot_release(component_db_t * db, component_snapshot_t * snapshot)
+{
+  ulapi_mutex_take(db->mutex);
+  db_snapshot_unref(snapshot);
+  ulapi_mutex_give(db->mutex);
+}
+
+/*
+  A match on the subsystem id needs only its shard. Anything else looks
+  in every shard, with db_copy_shards.
+*/
+component_snapshot_t *
+db_match(component_db_t * db, component_entry_t * pattern, int mask)
+{
+  component_snapshot_t *snapshot;
+  component_shard_t *shard;
+  int count;
+
+  snapshot = my_malloc(sizeof(*snapshot));
+  if (NULL == snapshot) return NULL;
+
+  if (mask & SMSG_MATCH_SUBSYSTEM) {
+    shard = DB_SHARD(db, pattern->subsystem_id);
+    ulapi_mutex_take(shard->mutex);
+    count = db_match_copy(shard, pattern, mask, NULL);
+    snapshot->entries = my_malloc((count > 0 ? count : 1) * sizeof(component_entry_t));
+    if (NULL != snapshot->entries) db_match_copy(shard, pattern, mask, snapshot->entries);
+    ulapi_mutex_take(db->mutex);
+    ulapi_mutex_give(shard->mutex);
+  } else {
+    count = db_copy_shards(db, pattern, mask, &snapshot->entries);
+    if (count < 0) snapshot->entries = NULL;
+  }
+  if (NULL == snapshot->entries) {
+    /* the database mutex is only taken if there's something to stamp */
+    if (mask & SMSG_MATCH_SUBSYSTEM) ulapi_mutex_give(db->mutex);
+    my_free(snapshot);
+    return NULL;
+  }
+  snapshot->count = count;
+  snapshot->generation = db->generation;
+  snapshot->refs = 1;
+  ulapi_mutex_give(db->mutex);
+
+  return snapshot;
+}
+
+/*
+  Fill in entry.component,instance,node,subsystem_id and pass pointer.
+  If it's in the DB, it's removed, the rest of 'entry' is filled in and
+  the non-negative index it had is returned. The last entry is moved
+  into the vacated index. Otherwise, a negative value is returned and
+  entry is left alone.
+*/
+int
+db_remove(component_db_t * db, component_entry_t * entry)
+{
+  component_shard_t *shard = DB_SHARD(db, entry->subsystem_id);
+  component_entry_t last;
+  int index;
+
+  ulapi_mutex_take(shard->mutex);
+  index = db_find_index(shard, entry);
+  if (index >= 0) {
+    db_get(shard, index, entry);
+    db_shard_write_begin(shard);
+    db_index_unlink(shard, index);
+    if (index != --shard->index) {
+      /* move the last entry down into the hole */
+      db_index_unlink(shard, shard->index);
+      db_get(shard, shard->index, &last);
+      db_set(shard, index, &last);
+      db_index_link(shard, index);
+    }
+    db_shard_write_end(shard);
+    index = db_position(db, shard, index);
+    ulapi_mutex_take(db->mutex);
+    db->generation++;
+#ifdef HAVE_DB_STORE
+    db_store_log(db, 'R', entry);
+#endif
+#ifdef HAVE_DB_SHM
+    db_shm_withdraw(db, entry);
+#endif
+    ulapi_mutex_give(db->mutex);
+    smsg_print_debug(SMSG_DEBUG_DB, "Removed from db component %d %d %d %d\n", 
+		     (int) entry->component_id,
+		     (int) entry->instance_id,
+		     (int) entry->node_id,
+		     (int) entry->subsystem_id);
+  }
+  ulapi_mutex_give(shard->mutex);
+
+  return index;
+}
+
+#ifdef HAVE_DB_STORE
+
+int
+db_open_store(component_db_t * db, const char * path)
+{
+  char *log_path;
+  int log_fd;
+  smsg_addr host_addr;
+  int count, records;
+
+  db_close_store(db);
+
+  db->store_path = db_store_path_with(path, "");
+  log_path = db_store_path_with(path, DB_STORE_LOG_SUFFIX);
+  if (NULL == db->store_path || NULL == log_path) {
+    if (NULL != log_path) my_free(log_path);
+    db_close_store(db);
+    return -1;
+  }
+
+  host_addr = ulapi_get_host_address();
+
+  /* load what's there; the log isn't attached yet so it's not relogged */
+  count = db_store_load_entries(db, path);
+  if (count < 0) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't load db file %s\n", path);
+    my_free(log_path);
+    db_close_store(db);
+    return -1;
+  }
+
+  log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (log_fd < 0) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't open db log %s\n", log_path);
+    my_free(log_path);
+    db_close_store(db);
+    return -1;
+  }
+  my_free(log_path);
+
+  /* replay the log, which isn't attached yet so nothing is relogged */
+  records = db_store_replay_log(db, log_fd, host_addr);
+  db->log_count = records;
+  smsg_print_debug(SMSG_DEBUG_DB, "Loaded %d db entries and %d log records from %s\n", count, records, path);
+
+  ulapi_mutex_take(db->mutex);
+  db->log_fd = log_fd;
+  ulapi_mutex_give(db->mutex);
+  /* start clean, with everything in the entry file */
+  if (0 != db_store_compact(db, 0)) {
+    db_close_store(db);
+    return -1;
+  }
+
+  return db_size(db);
+}
+
+int
+db_compact_store(component_db_t * db)
+{
+  if (NULL == db->store_path) return -1;
+
+  return db_store_compact(db, 0);
+}
+
+int
+db_compact_store_due(component_db_t * db)
+{
+  int due;
+
+  if (NULL == db->store_path) return 0;
+
+  ulapi_mutex_take(db->mutex);
+  due = (db->log_count >= DB_STORE_COMPACT);
+  ulapi_mutex_give(db->mutex);
+  if (! due) return 0;
+
+  return db_store_compact(db, 1);
+}
+
+int
+db_close_store(component_db_t * db)
+{
+  int retval = 0;
+
+  if (NULL == db->store_path) return 0;
+
+  if (db->log_fd >= 0) {
+    retval = db_compact_store(db);
+    close(db->log_fd);
+    db->log_fd = -1;
+  }
+  my_free(db->store_path);
+  db->store_path = NULL;
+
+  return retval;
+}
+
+#else
+
+int
+db_open_store(component_db_t * db, const char * path)
+{
+  smsg_print_debug(SMSG_DEBUG_DB, "No db store on this platform\n");
+  return -1;
+}
+
+int
+db_compact_store(component_db_t * db)
+{
+  return -1;
+}
+
+int
+db_compact_store_due(component_db_t * db)
+{
+  return 0;
+}
+
+int
+db_close_store(component_db_t * db)
+{
+  return 0;
+}
+
+#endif	/* HAVE_DB_STORE */
+
+#ifdef HAVE_DB_SHM
+
+int
+db_open_shm(component_db_t * db, int key)
+{
+  db_shm_table_t *table;
+  int id;
+
+  db_close_shm(db);
+
+  /*
+    Whatever's there is from some earlier node manager, and its readers
+    may still have it attached, so withdraw it and make a new one rather
+    than reuse it. If it isn't ours to remove, someone else holds the
+    key, and we won't publish at all.
+  */
+  id = shmget(key, 0, 0);
+  if (id >= 0) {
+    table = shmat(id, NULL, 0);
+    if ((void *) -1 != table) {
+      table->magic = 0;
+      smsg_barrier();
+      shmdt(table);
+    }
+    if (0 != shmctl(id, IPC_RMID, NULL)) {
+      smsg_print_debug(SMSG_DEBUG_DB, "Can't remove old shared memory for key %d\n", key);
+      return 1;
+    }
+  }
+
+  /* only we can write it, anyone on the host can read it */
+  id = shmget(key, sizeof(db_shm_table_t), IPC_CREAT | IPC_EXCL | 0644);
+  if (id < 0) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't get shared memory for key %d\n", key);
+    return -1;
+  }
+  table = shmat(id, NULL, 0);
+  if ((void *) -1 == table) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Can't attach shared memory for key %d\n", key);
+    shmctl(id, IPC_RMID, NULL);
+    return -1;
+  }
+
+  db_take_shards(db);
+  ulapi_mutex_take(db->mutex);
+  db->shm_id = id;
+  db->shm_table = table;
+  db_shm_fill(db);
+  table->beat = (smsg_uint) ulapi_time();
+  smsg_barrier();
+  table->magic = DB_SHM_MAGIC;
+  ulapi_mutex_give(db->mutex);
+  db_give_shards(db);
+
+  smsg_print_debug(SMSG_DEBUG_DB, "Publishing db in shared memory key %d\n", key);
+
+  return 0;
+}
+
+int
+db_beat_shm(component_db_t * db)
+{
+  db_shm_table_t *table;
+
+  ulapi_mutex_take(db->mutex);
+  table = db->shm_table;
+  if (NULL != table) table->beat = (smsg_uint) ulapi_time();
+  ulapi_mutex_give(db->mutex);
+
+  return 0;
+}
+
+int
+db_close_shm(component_db_t * db)
+{
+  db_shm_table_t *table;
+
+  if (db->shm_id < 0) return 0;
+
+  ulapi_mutex_take(db->mutex);
+  table = db->shm_table;
+  /* readers will see this and go to the node manager */
+  table->magic = 0;
+  smsg_barrier();
+  db->shm_table = NULL;
+  ulapi_mutex_give(db->mutex);
+
+  shmdt(table);
+  /* it goes away once the last reader detaches */
+  shmctl(db->shm_id, IPC_RMID, NULL);
+  db->shm_id = -1;
+
+  return 0;
+}
+
+#else
+
+int
+db_open_shm(component_db_t * db, int key)
+{
+  smsg_print_debug(SMSG_DEBUG_DB, "No shared registry on this platform\n");
+  return -1;
+}
+
+int
+db_beat_shm(component_db_t * db)
+{
+  return 0;
+}
+
+int
+db_close_shm(component_db_t * db)
+{
+  return 0;
+}
+
+#endif	/* HAVE_DB_SHM */
+
+#ifdef HAVE_DB_SHM
+
+/*
+  The client's view of the registry, attached read-only on first
+  lookup. Anyone can make a segment with the key, so it's only used if
+  the node manager on the local socket made it. A node manager that
+  starts over publishes a new segment, so when ours is withdrawn or
+  goes quiet we look for another, at most every SMSG_SHM_BEAT seconds.
+  Other threads may still be reading the old one, so it stays attached.
+*/
+static int smsg_shm_id = -1;
+static db_shm_table_t *smsg_shm_table = NULL;
+static smsg_uint smsg_shm_looked = 0;
+
+/* a beat from the future is just clocks being read in a different order */
+#define smsg_shm_live(table, now) (NULL != (table) && DB_SHM_MAGIC == (table)->magic && (int) ((now) - (table)->beat) <= SMSG_SHM_STALE)
+
+static db_shm_table_t *smsg_shm_attach(smsg_uint now)
+{
+  struct shmid_ds ds;
+  db_shm_table_t *table;
+  smsg_uint looked;
+  int id;
+  int fd;
+  int pid, uid, gid;
+
+  looked = smsg_shm_looked;
+  if (now - looked < SMSG_SHM_BEAT) return smsg_shm_table;
+  /* another thread is looking */
+  if (! __sync_bool_compare_and_swap(&smsg_shm_looked, looked, now)) return smsg_shm_table;
+
+  id = shmget(SMSG_SHM_KEY, 0, 0);
+  if (id < 0 || id == smsg_shm_id) return smsg_shm_table;
+  /* who the node manager is, which only it can tell us */
+  fd = smsg_get_local_client_fd(SMSG_PORT);
+  if (fd < 0) return smsg_shm_table;
+  if (0 != smsg_get_peer_credentials(fd, &pid, &uid, &gid)) {
+    close(fd);
+    return smsg_shm_table;
+  }
+  close(fd);
+  /* don't trust a segment that the node manager didn't make, or that anyone else can write */
+  if (0 != shmctl(id, IPC_STAT, &ds) ||
+      ds.shm_segsz < sizeof(db_shm_table_t) ||
+      0 != (ds.shm_perm.mode & 0022) ||
+      (int) ds.shm_cpid != pid ||
+      (int) ds.shm_perm.cuid != uid ||
+      (int) ds.shm_perm.uid != uid) {
+    smsg_print_debug(SMSG_DEBUG_DB, "Not using shared memory key %d, the node manager didn't make it\n", SMSG_SHM_KEY);
+    return smsg_shm_table;
+  }
+  table = shmat(id, NULL, SHM_RDONLY);
+  if ((void *) -1 == table) return smsg_shm_table;
+
+  smsg_shm_id = id;
+  smsg_barrier();
+  smsg_shm_table = table;
+
+  return table;
+}
+
+int smsg_lookup_component(smsg_byte component_id,
+			  smsg_byte instance_id,
+			  smsg_byte node_id,
+			  smsg_byte subsystem_id,
+			  smsg_addr * host_addr,
+			  smsg_port * component_port)
+{
+  db_shm_table_t *table;
+  smsg_uint key, sequence, now;
+  smsg_addr address;
+  smsg_port port;
+  int slot, tries;
+
+  now = (smsg_uint) ulapi_time();
+  table = smsg_shm_table;
+  if (! smsg_shm_live(table, now)) {
+    table = smsg_shm_attach(now);
+    if (! smsg_shm_live(table, now)) return -1;
+  }
+
+  key = db_key(component_id, instance_id, node_id, subsystem_id);
+
+  for (tries = 0; tries < DB_SHM_RETRIES; tries++) {
+    sequence = table->sequence;
+    if (sequence & 1) {
+      /* being changed */
+      smsg_pause();
+      continue;
+    }
+    smsg_barrier();
+    if (DB_SHM_MAGIC != table->magic) return -1;
+    slot = db_shm_probe(table, key);
+    if (slot >= 0) {
+      address = table->entries[slot].address;
+      port = table->entries[slot].port;
+    }
+    smsg_barrier();
+    if (sequence != table->sequence) continue; /* changed while we looked */
+    if (slot < 0) return -1;
+    *host_addr = address;
+    *component_port = port;
+    return 0;
+  }
+
+  return -1;
+}
+
+#else
+
+int smsg_lookup_component(smsg_byte component_id,
+			  smsg_byte instance_id,
+			  smsg_byte node_id,
+			  smsg_byte subsystem_id,
+			  smsg_addr * host_addr,
+			  smsg_port * component_port)
+{
+  return -1;
+}
+
+#endif	/* HAVE_DB_SHM */
+
+/*
+  The lookup cache is a direct-mapped table of a session's answers
+  from QUERY_CACHEREGs, kept up to date with the REPORT_CHANGEs the
+  node manager pushes for them. A key that lands on a slot in use
+  takes it, and pushes for a key that's been put out are dropped.
+*/
+
+static ulapi_real smsg_cache_ttl = 10.0;
+static ulapi_real smsg_cache_miss_ttl = 1.0;
+
+void
+smsg_set_cache_ttl(double ttl, double miss_ttl)
+{
+  smsg_cache_ttl = ttl;
+  smsg_cache_miss_ttl = miss_ttl;
+}
+
+#ifdef HAVE_SMSG_CACHE
+
+enum {SMSG_CACHE_SLOTS = 256};	/* a power of 2 */
+
+enum {
+  SMSG_CACHE_EMPTY,
+  SMSG_CACHE_FOUND,
+  SMSG_CACHE_MISSING
+};
+
+typedef struct {
+  smsg_uint key;
+  int state;			/* SMSG_CACHE_EMPTY, FOUND or MISSING */
+  smsg_addr address;
+  smsg_port port;
+  ulapi_real expires;
+} smsg_cache_entry_t;
+
+#define smsg_cache_slot(key) ((smsg_uint) ((key) * 2654435761U) & (SMSG_CACHE_SLOTS - 1))
+
+static void *smsg_cache_new(void)
+{
+  smsg_cache_entry_t *cache;
+  int slot;
+
+  cache = malloc(SMSG_CACHE_SLOTS * sizeof(*cache));
+  if (NULL == cache) return NULL;
+  for (slot = 0; slot < SMSG_CACHE_SLOTS; slot++) cache[slot].state = SMSG_CACHE_EMPTY;
+
+  return cache;
+}
+
+static void smsg_cache_flush(void *cache_ptr)
+{
+  smsg_cache_entry_t *cache = cache_ptr;
+  int slot;
+
+  for (slot = 0; slot < SMSG_CACHE_SLOTS; slot++) cache[slot].state = SMSG_CACHE_EMPTY;
+}
+
+/* returns 1 and fills in the address and port if it's found, 0 if it's known not to be, otherwise -1 */
+static int smsg_cache_get(void *cache_ptr, smsg_uint key, smsg_addr * host_addr, smsg_port * component_port)
+{
+  smsg_cache_entry_t *entry;
+
+  entry = &((smsg_cache_entry_t *) cache_ptr)[smsg_cache_slot(key)];
+  if (SMSG_CACHE_EMPTY == entry->state || entry->key != key) return -1;
+  if (entry->expires <= ulapi_time()) {
+    entry->state = SMSG_CACHE_EMPTY;
+    return -1;
+  }
+  if (SMSG_CACHE_MISSING == entry->state) return 0;
+  *host_addr = entry->address;
+  *component_port = entry->port;
+
+  return 1;
+}
+
+/* takes an answer, or a push if its key is still here */
+static void smsg_cache_put(void *cache_ptr, smsg_report_change_t * report_change)
+{
+  smsg_cache_entry_t *entry;
+  smsg_uint key;
+  ulapi_real ttl;
+  int found;
+
+  key = db_key(report_change->component_id, report_change->instance_id, report_change->node_id, report_change->subsystem_id);
+  entry = &((smsg_cache_entry_t *) cache_ptr)[smsg_cache_slot(key)];
+  if (0 == report_change->sequence_number &&
+      (SMSG_CACHE_EMPTY == entry->state || entry->key != key)) return;
+
+  found = (SMSG_CHANGE_ADD == report_change->change && 0 != report_change->address && 0 != report_change->port);
+  ttl = found ? smsg_cache_ttl : smsg_cache_miss_ttl;
+  if (ttl <= 0) {
+    entry->state = SMSG_CACHE_EMPTY;
+    return;
+  }
+  entry->key = key;
+  entry->state = found ? SMSG_CACHE_FOUND : SMSG_CACHE_MISSING;
+  entry->address = report_change->address;
+  entry->port = report_change->port;
+  entry->expires = ulapi_time() + ttl;
+}
+
+#else
+
+#define smsg_cache_new() NULL
+#define smsg_cache_flush(cache)
+#define smsg_cache_get(cache,key,host_addr,component_port) (-1)
+#define smsg_cache_put(cache,report_change)
+
+#endif	/* HAVE_SMSG_CACHE */
+
+/*
+  Sessions. A call takes the session's mutex for as long as it uses
+  the connection, packs its message into 'outbuf', and gets the replies
+  one at a time into 'inbuf'. Input left over after a reply stays in
+  'readbuf' for the next. Anything unexpected drops the connection,
+  since what's left on it can't be trusted, and the next call makes
+  a new one.
+*/
+
+int
+smsg_session_open(smsg_session_t * session, int fd)
+{
+  session->fd = fd;
+  session->proxy = (fd >= 0 ? 1 : 0);
+  session->sequence = 0;
+  session->readlen = 0;
+  if (0 != serdes_decode_state_init(&session->state, session->readbuf, (char *) session->inbuf, SMSG_SESSION_READ_SIZE, SMSG_INBUFSIZE)) {
+    return -1;
+  }
+  session->mutex = ulapi_mutex_new(0);
+  if (NULL == session->mutex) return -1;
+  /* proxy sessions are too short-lived to be worth caching for */
+  session->cache = session->proxy ? NULL : smsg_cache_new();
+  session->subscriptions = 0;
+  session->changefirst = 0;
+  session->changecount = 0;
+  session->changeslost = 0;
+  memset(&session->lastchange, 0, sizeof(session->lastchange));
+
+  return 0;
+}
+
+/* closes the connection, unless it's a proxy fd, and forgets any input */
+static void smsg_session_drop(smsg_session_t * session)
+{
+  if (! session->proxy) {
+    if (session->fd >= 0) ulapi_socket_close(session->fd);
+    session->fd = -1;
+  }
+  /* pushes won't come for what's cached or subscribed to any more */
+  if (NULL != session->cache) smsg_cache_flush(session->cache);
+  if (session->subscriptions > 0) session->changeslost = 1;
+  session->subscriptions = 0;
+  memset(&session->lastchange, 0, sizeof(session->lastchange));
+  session->readlen = 0;
+  serdes_decode_state_init(&session->state, session->readbuf, (char *) session->inbuf, SMSG_SESSION_READ_SIZE, SMSG_INBUFSIZE);
+}
+
+void
+smsg_session_close(smsg_session_t * session)
+{
+  smsg_session_drop(session);
+  if (NULL != session->mutex) ulapi_mutex_delete(session->mutex);
+  session->mutex = NULL;
+  if (NULL != session->cache) free(session->cache);
+  session->cache = NULL;
+}
+
+/* the next request's sequence number, which is never 0 */
+static smsg_byte smsg_session_next(smsg_session_t * session)
+{
+  if (0 == ++session->sequence) session->sequence = 1;
+
+  return session->sequence;
+}
+
+/* gets the next message into 'inbuf'; returns its length, or -1 on error */
+static int smsg_session_recv(smsg_session_t * session)
+{
+  int smsg_inbuflen;
+
+  for (;;) {
+    if (session->readlen > 0) {
+      smsg_inbuflen = serdes_decode(session->readbuf, &session->readlen, (char *) session->inbuf, &session->state);
+      if (0 > smsg_inbuflen) return -1;	/* decoding error */
+      if (0 < smsg_inbuflen) return smsg_inbuflen;
+      /* else not a full message yet */
+    }
+    session->readlen = ulapi_socket_read(session->fd, session->readbuf, SMSG_SESSION_READ_SIZE);
+    if (0 >= session->readlen) {
+      /* end of file or read error */
+      session->readlen = 0;
+      return -1;
+    }
+    /* the decoder may have stopped partway into the last read */
+    session->state.encptr = session->readbuf;
+  }
+}
+
+/* queues a change if it's to something subscribed to */
+static void smsg_session_queue(smsg_session_t * session, smsg_report_change_t * report_change)
+{
+  smsg_uint key;
+  int i;
+
+  key = db_key(report_change->component_id, report_change->instance_id, report_change->node_id, report_change->subsystem_id);
+  for (i = 0; i < session->subscriptions; i++) {
+    if ((key & db_key_mask(session->submasks[i])) == session->subkeys[i]) break;
+  }
+  if (i == session->subscriptions) return;
+
+  if (session->changecount == SMSG_SESSION_CHANGES) {
+    session->changeslost = 1;
+    return;
+  }
+  session->changes[(session->changefirst + session->changecount) % SMSG_SESSION_CHANGES] = *report_change;
+  session->changecount++;
+}
+
+/* if what's in 'inbuf' was pushed, takes it in and returns 1, otherwise 0 */
+static int smsg_session_pushed(smsg_session_t * session)
+{
+  smsg_report_change_t report_change;
+
+  if (SMSG_CODE_REPORT_CHANGE != smsg_message_identifier(session->inbuf) ||
+      0 != smsg_message_sequence_number(session->inbuf)) {
+    return 0;
+  }
+  /* zeroed, so changes compare whole */
+  memset(&report_change, 0, sizeof(report_change));
+  smsg_message_to_report_change(session->inbuf, &report_change);
+  /*
+    A change that concerns the session more than one way is pushed
+    once for each, one after the other, and taken in only once.
+  */
+  if (0 == memcmp(&report_change, &session->lastchange, sizeof(report_change))) return 1;
+  session->lastchange = report_change;
+  if (NULL != session->cache) smsg_cache_put(session->cache, &report_change);
+  if (session->subscriptions > 0) smsg_session_queue(session, &report_change);
+
+  return 1;
+}
+
+#if defined(HAVE_SMSG_CACHE) || defined(HAVE_SMSG_SUBSCRIBE)
+
+/*
+  Takes in whatever the node manager has pushed so far, without
+  waiting for more. Returns 0, or -1 if the connection's gone.
+*/
+static int smsg_session_poll(smsg_session_t * session)
+{
+  int smsg_inbuflen;
+
+  for (;;) {
+    if (session->readlen > 0) {
+      smsg_inbuflen = serdes_decode(session->readbuf, &session->readlen, (char *) session->inbuf, &session->state);
+      if (0 > smsg_inbuflen) return -1;
+      /* anything else is a reply to a request given up on */
+      if (0 < smsg_inbuflen) smsg_session_pushed(session);
+      continue;
+    }
+    session->readlen = recv(session->fd, session->readbuf, SMSG_SESSION_READ_SIZE, MSG_DONTWAIT);
+    if (session->readlen < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+      session->readlen = 0;
+      return 0;
+    }
+    if (session->readlen <= 0) {
+      session->readlen = 0;
+      return -1;
+    }
+    session->state.encptr = session->readbuf;
+  }
+}
+
+#endif	/* HAVE_SMSG_CACHE || HAVE_SMSG_SUBSCRIBE */
+
+/*
+  Looks in the cache, after taking in what's been pushed. Returns 1
+  with the address and port if it's there, 0 if it's known not to be
+  registered, otherwise -1.
+*/
+static int smsg_session_cached(smsg_session_t * session,
+			       smsg_byte component_id,
+			       smsg_byte instance_id,
+			       smsg_byte node_id,
+			       smsg_byte subsystem_id,
+			       smsg_addr * host_addr,
+			       smsg_port * component_port)
+{
+  if (NULL == session->cache || session->fd < 0) return -1;
+#ifdef HAVE_SMSG_CACHE
+  if (0 != smsg_session_poll(session)) {
+    smsg_session_drop(session);
+    return -1;
+  }
+#endif
+
+  return smsg_cache_get(session->cache, db_key(component_id, instance_id, node_id, subsystem_id), host_addr, component_port);
+}
+
+/*
+  Gets the next reply to the request with 'sequence_number' into
+  'inbuf', passing over any to earlier requests that were given up
+  on. Returns its length, or -1 on error.
+*/
+static int smsg_session_reply(smsg_session_t * session, smsg_byte sequence_number)
+{
+  int smsg_inbuflen;
+
+  do {
+    smsg_inbuflen = smsg_session_recv(session);
+    if (0 > smsg_inbuflen) return -1;
+  } while (smsg_inbuflen < 2 ||
+	   smsg_session_pushed(session) ||
+	   smsg_message_sequence_number(session->inbuf) != sequence_number);
+
+  return smsg_inbuflen;
+}
+
+#ifdef HAVE_SMSG_LOCAL
+
+/* fills in the name of the local socket for 'port', returning its length */
+static socklen_t smsg_local_name(struct sockaddr_un * addr, smsg_port port)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+#ifdef __linux__
+  /* abstract, so there's no file to clean up after */
+  sprintf(addr->sun_path + 1, SMSG_LOCAL_NAME, (int) port);
+  return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1));
+#else
+  sprintf(addr->sun_path, SMSG_LOCAL_DIR "/" SMSG_LOCAL_NAME, (int) port);
+  return (socklen_t) sizeof(*addr);
+#endif
+}
+
+int
+smsg_get_local_server_fd(smsg_port port)
+{
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  int fd;
+
+  addrlen = smsg_local_name(&addr, port);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+#ifndef __linux__
+  /* one left by a server that's gone */
+  unlink(addr.sun_path);
+#endif
+  if (0 != bind(fd, (struct sockaddr *) &addr, addrlen) ||
+      0 != listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int
+smsg_get_local_client_fd(smsg_port port)
+{
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  int fd;
+
+  addrlen = smsg_local_name(&addr, port);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (0 != connect(fd, (struct sockaddr *) &addr, addrlen)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* returns non-zero if 'address' is loopback or this host's own */
+static int smsg_is_local_address(smsg_addr address)
+{
+  static smsg_addr host_addr = 0;
+
+  if (127 == (ntohl(address) >> 24)) return 1;
+  if (0 == host_addr) host_addr = ulapi_get_host_address();
+
+  return address == host_addr;
+}
+
+int
+smsg_get_client_fd(smsg_addr address, smsg_port port)
+{
+  int fd;
+
+  if (smsg_is_local_address(address)) {
+    fd = smsg_get_local_client_fd(port);
+    if (fd >= 0) {
+      if (smsg_get_shm_rings()) smsg_open_ring(fd);
+      return fd;
+    }
+  }
+
+  return ulapi_socket_get_client_id(port, ulapi_address_to_hostname(address));
+}
+
+int
+smsg_get_peer_credentials(int fd, int *pid, int *uid, int *gid)
+{
+#ifdef SO_PEERCRED
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  struct ucred cred;
+  socklen_t credlen;
+
+  addrlen = sizeof(addr);
+  if (0 != getsockname(fd, (struct sockaddr *) &addr, &addrlen) ||
+      AF_UNIX != addr.sun_family) return -1;
+  credlen = sizeof(cred);
+  if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) return -1;
+  *pid = (int) cred.pid;
+  *uid = (int) cred.uid;
+  *gid = (int) cred.gid;
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+#else
+
+int
+smsg_get_local_server_fd(smsg_port port)
+{
+  return -1;
+}
+
+int
+smsg_get_local_client_fd(smsg_port port)
+{
+  return -1;
+}
+
+int
+smsg_get_client_fd(smsg_addr address, smsg_port port)
+{
+  return ulapi_socket_get_client_id(port, ulapi_address_to_hostname(address));
+}
+
+int
+smsg_get_peer_credentials(int fd, int *pid, int *uid, int *gid)
+{
+  return -1;
+}
+
+#endif	/* HAVE_SMSG_LOCAL */
+
+/* connects to the node manager, if it's not connected; returns 0, or -1 on error */
+static int smsg_session_connect(smsg_session_t * session)
+{
+  if (session->fd < 0) {
+    session->fd = smsg_get_local_client_fd(SMSG_PORT);
+    if (session->fd < 0) session->fd = ulapi_socket_get_client_id(SMSG_PORT, "127.0.0.1");
+    if (session->fd < 0) return -1;
+  }
+
+  return 0;
+}
+
+/*
+  Sends the 'outbuflen' bytes packed in 'outbuf' and gets the first
+  reply to it into 'inbuf'. Returns the reply's length, or -1 on error,
+  with the connection dropped. A connection kept from an earlier call
+  may have been closed by the node manager since, so if that one
+  fails, the message goes again on a new one.
+*/
+static int smsg_session_call(smsg_session_t * session, int outbuflen)
+{
+  int writebuflen;
+  int smsg_inbuflen;
+  int kept;
+
+  writebuflen = serdes_encode((char *) session->outbuf, outbuflen, session->writebuf, SMSG_WRITEBUFSIZE);
+
+  for (;;) {
+    kept = (! session->proxy && session->fd >= 0);
+    if (0 != smsg_session_connect(session)) return -1;
+    if (writebuflen == ulapi_socket_write(session->fd, session->writebuf, writebuflen)) {
+      smsg_inbuflen = smsg_session_reply(session, smsg_message_sequence_number(session->outbuf));
+      if (0 < smsg_inbuflen) return smsg_inbuflen;
+    }
+    smsg_session_drop(session);
+    if (! kept) return -1;
+  }
+}
+
+int
+smsg_session_register(smsg_session_t * session,
+		      smsg_byte component_id,
+		      smsg_byte instance_id,
+		      smsg_byte node_id,
+		      smsg_byte subsystem_id,
+		      smsg_addr * host_addr,
+		      smsg_port * component_port)
+{
+  smsg_request_dynreg_t request_dynreg;
+  smsg_reply_dynreg_t reply_dynreg;
+  int retval = -1;
+
+  request_dynreg.identifier = SMSG_CODE_REQUEST_DYNREG;
+  request_dynreg.component_id = component_id;
+  request_dynreg.instance_id = instance_id;
+  request_dynreg.node_id = node_id;
+  request_dynreg.subsystem_id = subsystem_id;
+
+  ulapi_mutex_take(session->mutex);
+  request_dynreg.sequence_number = smsg_session_next(session);
+  if (0 < smsg_session_call(session, smsg_request_dynreg_to_message(&request_dynreg, session->outbuf))) {
+    if (SMSG_CODE_REPLY_DYNREG == smsg_message_identifier(session->inbuf)) {
+      smsg_message_to_reply_dynreg(session->inbuf, &reply_dynreg);
+      *host_addr = reply_dynreg.address;
+      *component_port = reply_dynreg.port;
+      retval = 0;
+    } else {
+      smsg_session_drop(session);
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return retval;
+}
+
+int
+smsg_session_unregister(smsg_session_t * session,
+			smsg_byte component_id,
+			smsg_byte instance_id,
+			smsg_byte node_id,
+			smsg_byte subsystem_id)
+{
+  smsg_request_unreg_t request_unreg;
+  smsg_reply_dynreg_t reply_dynreg;
+  int retval = -1;
+
+  request_unreg.identifier = SMSG_CODE_REQUEST_UNREG;
+  request_unreg.component_id = component_id;
+  request_unreg.instance_id = instance_id;
+  request_unreg.node_id = node_id;
+  request_unreg.subsystem_id = subsystem_id;
+
+  ulapi_mutex_take(session->mutex);
+  request_unreg.sequence_number = smsg_session_next(session);
+  if (0 < smsg_session_call(session, smsg_request_unreg_to_message(&request_unreg, session->outbuf))) {
+    if (SMSG_CODE_REPLY_DYNREG == smsg_message_identifier(session->inbuf)) {
+      smsg_message_to_reply_dynreg(session->inbuf, &reply_dynreg);
+      if (0 != reply_dynreg.address && 0 != reply_dynreg.port) retval = 0;
+    } else {
+      smsg_session_drop(session);
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return retval;
+}
+
+/* a QUERY_DYNREG, or a QUERY_WAITREG if 'timeout' isn't 0 */
+static int smsg_session_query(smsg_session_t * session,
+			      smsg_byte component_id,
+			      smsg_byte instance_id,
+			      smsg_byte node_id,
+			      smsg_byte subsystem_id,
+			      smsg_uint timeout,
+			      smsg_addr * host_addr,
+			      smsg_port * component_port)
+{
+  smsg_query_dynreg_t query_dynreg;
+  smsg_query_cachereg_t query_cachereg;
+  smsg_query_waitreg_t query_waitreg;
+  smsg_report_dynreg_t report_dynreg;
+  smsg_report_change_t report_change;
+  int smsg_outbuflen;
+  int cached;
+  int retval = -1;
+
+  /* a local node manager may have it in the shared registry */
+  if (! session->proxy &&
+      0 == smsg_lookup_component(component_id, instance_id, node_id, subsystem_id, host_addr, component_port)) {
+    return 0;
+  }
+
+  ulapi_mutex_take(session->mutex);
+  /* a miss that's cached still has to be waited for */
+  cached = smsg_session_cached(session, component_id, instance_id, node_id, subsystem_id, host_addr, component_port);
+  if (cached > 0 || (0 == cached && 0 == timeout)) {
+    ulapi_mutex_give(session->mutex);
+    return cached > 0 ? 0 : -1;
+  }
+
+  if (0 == timeout && NULL != session->cache) {
+    query_cachereg.identifier = SMSG_CODE_QUERY_CACHEREG;
+    query_cachereg.sequence_number = smsg_session_next(session);
+    query_cachereg.component_id = component_id;
+    query_cachereg.instance_id = instance_id;
+    query_cachereg.node_id = node_id;
+    query_cachereg.subsystem_id = subsystem_id;
+    smsg_outbuflen = smsg_query_cachereg_to_message(&query_cachereg, session->outbuf);
+  } else if (0 == timeout) {
+    query_dynreg.identifier = SMSG_CODE_QUERY_DYNREG;
+    query_dynreg.sequence_number = smsg_session_next(session);
+    query_dynreg.component_id = component_id;
+    query_dynreg.instance_id = instance_id;
+    query_dynreg.node_id = node_id;
+    query_dynreg.subsystem_id = subsystem_id;
+    smsg_outbuflen = smsg_query_dynreg_to_message(&query_dynreg, session->outbuf);
+  } else {
+    query_waitreg.identifier = SMSG_CODE_QUERY_WAITREG;
+    query_waitreg.sequence_number = smsg_session_next(session);
+    query_waitreg.component_id = component_id;
+    query_waitreg.instance_id = instance_id;
+    query_waitreg.node_id = node_id;
+    query_waitreg.subsystem_id = subsystem_id;
+    query_waitreg.timeout = timeout;
+    smsg_outbuflen = smsg_query_waitreg_to_message(&query_waitreg, session->outbuf);
+  }
+  if (0 < smsg_session_call(session, smsg_outbuflen)) {
+    if (SMSG_CODE_REPORT_DYNREG == smsg_message_identifier(session->inbuf)) {
+      smsg_message_to_report_dynreg(session->inbuf, &report_dynreg);
+      if (0 != report_dynreg.address && 0 != report_dynreg.port) {
+	*host_addr = report_dynreg.address;
+	*component_port = report_dynreg.port;
+	retval = 0;
+      }
+    } else if (SMSG_CODE_REPORT_CHANGE == smsg_message_identifier(session->inbuf)) {
+      /* the node manager will tell us if this changes */
+      smsg_message_to_report_change(session->inbuf, &report_change);
+      if (NULL != session->cache) smsg_cache_put(session->cache, &report_change);
+      if (SMSG_CHANGE_ADD == report_change.change && 0 != report_change.address && 0 != report_change.port) {
+	*host_addr = report_change.address;
+	*component_port = report_change.port;
+	retval = 0;
+      }
+    } else {
+      smsg_session_drop(session);
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return retval;
+}
+
+int
+smsg_session_find(smsg_session_t * session,
+		  smsg_byte component_id,
+		  smsg_byte instance_id,
+		  smsg_byte node_id,
+		  smsg_byte subsystem_id,
+		  smsg_addr * host_addr,
+		  smsg_port * component_port)
+{
+  return smsg_session_query(session, component_id, instance_id, node_id, subsystem_id, 0, host_addr, component_port);
+}
+
+int
+smsg_session_wait(smsg_session_t * session,
+		  smsg_byte component_id,
+		  smsg_byte instance_id,
+		  smsg_byte node_id,
+		  smsg_byte subsystem_id,
+		  smsg_uint timeout,
+		  smsg_addr * host_addr,
+		  smsg_port * component_port)
+{
+  /* a timeout of 0 would be taken as a plain query, which is what it means anyway */
+  return smsg_session_query(session, component_id, instance_id, node_id, subsystem_id, timeout, host_addr, component_port);
+}
+
+int
+smsg_session_find_batch(smsg_session_t * session,
+			component_entry_t * entries,
+			int count)
+{
+  char batchbuf[SMSG_SESSION_WINDOW * SMSG_WRITEBUFSIZE]; /* a window's worth of queries */
+  int batchlen;
+  int cursor[UCHAR_MAX + 1];	/* the next entry each sequence number answers, or -1 */
+  smsg_query_multireg_t query_multireg;
+  smsg_report_matchreg_t report_matchreg;
+  int next;			/* the next entry to ask for */
+  int inflight;			/* queries not yet fully answered */
+  int answered;			/* if any were, on this connection */
+  int found;
+  int kept;
+  int ok;
+  int index;
+  int i;
+
+  /* a local node manager may have some in the shared registry */
+  found = 0;
+  for (index = 0; index < count; index++) {
+    entries[index].address = 0;
+    entries[index].port = 0;
+    entries[index].fd = -1;
+    if (! session->proxy &&
+	0 == smsg_lookup_component(entries[index].component_id, entries[index].instance_id, entries[index].node_id, entries[index].subsystem_id, &entries[index].address, &entries[index].port)) {
+      found++;
+    }
+  }
+
+  ulapi_mutex_take(session->mutex);
+  for (;;) {
+    kept = (! session->proxy && session->fd >= 0);
+    if (0 != smsg_session_connect(session)) {
+      found = -1;
+      break;
+    }
+    for (index = 0; index <= UCHAR_MAX; index++) cursor[index] = -1;
+    next = 0;
+    inflight = 0;
+    answered = 0;
+    ok = 1;
+    for (;;) {
+      /* top up the window, with one write */
+      for (batchlen = 0; inflight < SMSG_SESSION_WINDOW; inflight++) {
+	query_multireg.identifier = SMSG_CODE_QUERY_MULTIREG;
+	query_multireg.sequence_number = smsg_session_next(session);
+	query_multireg.count = 0;
+	for (; next < count && query_multireg.count < SMSG_MULTIREG_KEYS; next++) {
+	  if (0 != entries[next].address) continue;
+	  if (0 == query_multireg.count) cursor[query_multireg.sequence_number] = next;
+	  query_multireg.keys[query_multireg.count].component_id = entries[next].component_id;
+	  query_multireg.keys[query_multireg.count].instance_id = entries[next].instance_id;
+	  query_multireg.keys[query_multireg.count].node_id = entries[next].node_id;
+	  query_multireg.keys[query_multireg.count].subsystem_id = entries[next].subsystem_id;
+	  query_multireg.count++;
+	}
+	if (0 == query_multireg.count) {
+	  session->sequence--;
+	  break;
+	}
+	batchlen += serdes_encode((char *) session->outbuf,
+				  smsg_query_multireg_to_message(&query_multireg, session->outbuf),
+				  batchbuf + batchlen, sizeof(batchbuf) - batchlen);
+      }
+      if (batchlen > 0 && batchlen != ulapi_socket_write(session->fd, batchbuf, batchlen)) {
+	ok = 0;
+	break;
+      }
+      if (0 == inflight) break;
+
+      /* take the next report, matching its entries up in the order asked */
+      if (0 > smsg_session_recv(session)) {
+	ok = 0;
+	break;
+      }
+      if (smsg_session_pushed(session) ||
+	  SMSG_CODE_REPORT_MATCHREG != smsg_message_identifier(session->inbuf) ||
+	  0 != smsg_message_to_report_matchreg(session->inbuf, &report_matchreg)) continue;
+      index = cursor[report_matchreg.sequence_number];
+      if (index < 0) continue;	/* to a request given up on */
+      answered = 1;
+      for (i = 0; i < report_matchreg.count; i++, index++) {
+	/* skip those the shared registry had, which weren't asked for */
+	while (index < count && 0 != entries[index].address) index++;
+	if (index >= count ||
+	    entries[index].component_id != report_matchreg.entries[i].component_id ||
+	    entries[index].instance_id != report_matchreg.entries[i].instance_id ||
+	    entries[index].node_id != report_matchreg.entries[i].node_id ||
+	    entries[index].subsystem_id != report_matchreg.entries[i].subsystem_id) {
+	  break;
+	}
+	if (0 != report_matchreg.entries[i].address && 0 != report_matchreg.entries[i].port) {
+	  entries[index].address = report_matchreg.entries[i].address;
+	  entries[index].port = report_matchreg.entries[i].port;
+	  found++;
+	}
+      }
+      if (i < report_matchreg.count) {
+	/* not what we asked for */
+	ok = 0;
+	break;
+      }
+      cursor[report_matchreg.sequence_number] = index;
+      if (! report_matchreg.more) {
+	cursor[report_matchreg.sequence_number] = -1;
+	inflight--;
+      }
+    }
+    if (ok) break;
+    smsg_session_drop(session);
+    /* start again on a new connection only if the old one was stale */
+    if (! kept || answered) {
+      found = -1;
+      break;
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return found;
+}
+
+/*
+  Collects the REPORT_MATCHREG stream answering the request with
+  'sequence_number', the first of which is in 'inbuf', into up to 'max'
+  of 'entries'. Returns how many there are, or -1 on error, with the
+  connection dropped.
+*/
+static int smsg_session_matches(smsg_session_t * session,
+				smsg_byte sequence_number,
+				component_entry_t * entries,
+				int max)
+{
+  smsg_report_matchreg_t report_matchreg;
+  int count, i;
+
+  /* collect reports until the last one */
+  for (count = 0; ; ) {
+    if (SMSG_CODE_REPORT_MATCHREG != smsg_message_identifier(session->inbuf) ||
+	0 != smsg_message_to_report_matchreg(session->inbuf, &report_matchreg)) {
+      smsg_session_drop(session);
+      return -1;
+    }
+    for (i = 0; i < report_matchreg.count; i++, count++) {
+      if (count >= max) continue;
+      entries[count].component_id = report_matchreg.entries[i].component_id;
+      entries[count].instance_id = report_matchreg.entries[i].instance_id;
+      entries[count].node_id = report_matchreg.entries[i].node_id;
+      entries[count].subsystem_id = report_matchreg.entries[i].subsystem_id;
+      entries[count].address = report_matchreg.entries[i].address;
+      entries[count].port = report_matchreg.entries[i].port;
+      entries[count].fd = -1;
+    }
+    if (! report_matchreg.more) break;
+    if (0 >= smsg_session_reply(session, sequence_number)) {
+      smsg_session_drop(session);
+      return -1;
+    }
+  }
+
+  return count;
+}
+
+int
+smsg_session_match(smsg_session_t * session,
+		   smsg_byte mask,
+		   smsg_byte component_id,
+		   smsg_byte instance_id,
+		   smsg_byte node_id,
+		   smsg_byte subsystem_id,
+		   component_entry_t * entries,
+		   int max)
+{
+  smsg_query_matchreg_t query_matchreg;
+  int count;
+
+  query_matchreg.identifier = SMSG_CODE_QUERY_MATCHREG;
+  query_matchreg.mask = mask;
+  query_matchreg.component_id = component_id;
+  query_matchreg.instance_id = instance_id;
+  query_matchreg.node_id = node_id;
+  query_matchreg.subsystem_id = subsystem_id;
+
+  ulapi_mutex_take(session->mutex);
+  query_matchreg.sequence_number = smsg_session_next(session);
+  count = -1;
+  if (0 < smsg_session_call(session, smsg_query_matchreg_to_message(&query_matchreg, session->outbuf))) {
+    count = smsg_session_matches(session, query_matchreg.sequence_number, entries, max);
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return count;
+}
+
+int
+smsg_session_subscribe(smsg_session_t * session,
+		       smsg_byte mask,
+		       smsg_byte component_id,
+		       smsg_byte instance_id,
+		       smsg_byte node_id,
+		       smsg_byte subsystem_id,
+		       component_entry_t * entries,
+		       int max)
+{
+#ifdef HAVE_SMSG_SUBSCRIBE
+  smsg_request_subscribe_t request_subscribe;
+  smsg_uint key;
+  int count, i;
+
+  mask &= SMSG_MATCH_ALL;
+  request_subscribe.identifier = SMSG_CODE_REQUEST_SUBSCRIBE;
+  request_subscribe.mask = mask;
+  request_subscribe.component_id = component_id;
+  request_subscribe.instance_id = instance_id;
+  request_subscribe.node_id = node_id;
+  request_subscribe.subsystem_id = subsystem_id;
+  key = db_key(component_id, instance_id, node_id, subsystem_id) & db_key_mask(mask);
+
+  ulapi_mutex_take(session->mutex);
+  for (i = 0; i < session->subscriptions; i++) {
+    if (session->submasks[i] == mask && session->subkeys[i] == key) break;
+  }
+  if (i == SMSG_SESSION_SUBSCRIPTIONS) {
+    ulapi_mutex_give(session->mutex);
+    return -1;
+  }
+  request_subscribe.sequence_number = smsg_session_next(session);
+  count = -1;
+  if (0 < smsg_session_call(session, smsg_request_subscribe_to_message(&request_subscribe, session->outbuf))) {
+    if (SMSG_CODE_REPORT_DYNREG != smsg_message_identifier(session->inbuf)) {
+      count = smsg_session_matches(session, request_subscribe.sequence_number, entries, max);
+    }
+    /* the connection may be a new one, which has only this subscription */
+    if (count >= 0 && i >= session->subscriptions) {
+      i = session->subscriptions++;
+      session->submasks[i] = mask;
+      session->subkeys[i] = key;
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return count;
+#else
+  return -1;
+#endif
+}
+
+int
+smsg_session_unsubscribe(smsg_session_t * session,
+			 smsg_byte mask,
+			 smsg_byte component_id,
+			 smsg_byte instance_id,
+			 smsg_byte node_id,
+			 smsg_byte subsystem_id)
+{
+  smsg_request_unsubscribe_t request_unsubscribe;
+  smsg_uint key;
+  int retval = -1;
+  int i;
+
+  mask &= SMSG_MATCH_ALL;
+  request_unsubscribe.identifier = SMSG_CODE_REQUEST_UNSUBSCRIBE;
+  request_unsubscribe.mask = mask;
+  request_unsubscribe.component_id = component_id;
+  request_unsubscribe.instance_id = instance_id;
+  request_unsubscribe.node_id = node_id;
+  request_unsubscribe.subsystem_id = subsystem_id;
+  key = db_key(component_id, instance_id, node_id, subsystem_id) & db_key_mask(mask);
+
+  ulapi_mutex_take(session->mutex);
+  for (i = 0; i < session->subscriptions; i++) {
+    if (session->submasks[i] == mask && session->subkeys[i] == key) break;
+  }
+  if (i < session->subscriptions) {
+    session->subscriptions--;
+    session->submasks[i] = session->submasks[session->subscriptions];
+    session->subkeys[i] = session->subkeys[session->subscriptions];
+    request_unsubscribe.sequence_number = smsg_session_next(session);
+    /* on a new connection there's nothing to stop, but it's answered all the same */
+    if (0 < smsg_session_call(session, smsg_request_unsubscribe_to_message(&request_unsubscribe, session->outbuf))) {
+      if (SMSG_CODE_REPLY_DYNREG == smsg_message_identifier(session->inbuf)) {
+	retval = 0;
+      } else {
+	smsg_session_drop(session);
+      }
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return retval;
+}
+
+int
+smsg_session_change(smsg_session_t * session,
+		    smsg_report_change_t * change,
+		    double timeout)
+{
+  int retval;
+#ifdef HAVE_SMSG_SUBSCRIBE
+  ulapi_real deadline;
+  struct pollfd pollfd;
+  int wait;
+
+  deadline = ulapi_time() + timeout;
+#endif
+
+  ulapi_mutex_take(session->mutex);
+  for (;;) {
+#ifdef HAVE_SMSG_SUBSCRIBE
+    if (session->fd >= 0 && 0 != smsg_session_poll(session)) smsg_session_drop(session);
+#endif
+    if (session->changeslost) {
+      session->changeslost = 0;
+      retval = -1;
+      break;
+    }
+    if (session->changecount > 0) {
+      *change = session->changes[session->changefirst];
+      session->changefirst = (session->changefirst + 1) % SMSG_SESSION_CHANGES;
+      session->changecount--;
+      retval = 1;
+      break;
+    }
+    retval = 0;
+    /* with no connection, nothing's coming */
+    if (session->fd < 0) break;
+#ifdef HAVE_SMSG_SUBSCRIBE
+    if (timeout < 0) {
+      wait = -1;
+    } else {
+      wait = (int) (1000 * (deadline - ulapi_time()) + 0.5);
+      if (wait <= 0) break;
+    }
+    pollfd.fd = session->fd;
+    pollfd.events = POLLIN;
+    if (0 > poll(&pollfd, 1, wait) && EINTR != errno) {
+      smsg_session_drop(session);
+    }
+#else
+    break;
+#endif
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return retval;
+}
+
+int
+smsg_session_stats(smsg_session_t * session, smsg_report_stats_t * stats)
+{
+  smsg_query_stats_t query_stats;
+  int retval = -1;
+
+  query_stats.identifier = SMSG_CODE_QUERY_STATS;
+
+  ulapi_mutex_take(session->mutex);
+  query_stats.sequence_number = smsg_session_next(session);
+  if (0 < smsg_session_call(session, smsg_query_stats_to_message(&query_stats, session->outbuf))) {
+    if (SMSG_CODE_REPORT_STATS == smsg_message_identifier(session->inbuf) &&
+	0 == smsg_message_to_report_stats(session->inbuf, stats)) {
+      retval = 0;
+    } else {
+      smsg_session_drop(session);
+    }
+  }
+  ulapi_mutex_give(session->mutex);
+
+  return retval;
+}
+
+/*
+  The default session, for the whole process, is opened by whichever
+  thread first needs it while the others wait. It's never closed.
+*/
+static smsg_session_t smsg_default_session;
+static volatile int smsg_default_session_state = 0; /* 0 not open, 1 opening, 2 open */
+
+static smsg_session_t *smsg_session_get_default(void)
+{
+#if defined(__GNUC__)
+  if (__sync_bool_compare_and_swap(&smsg_default_session_state, 0, 1)) {
+#else
+  if (0 == smsg_default_session_state) {
+    smsg_default_session_state = 1;
+#endif
+    if (0 == smsg_session_open(&smsg_default_session, -1)) {
+#if defined(__GNUC__)
+      smsg_barrier();
+#endif
+      smsg_default_session_state = 2;
+    } else {
+      smsg_default_session_state = 0;
+      return NULL;
+    }
+  }
+  while (1 == smsg_default_session_state) ulapi_sleep(0.001);
+
+  return (2 == smsg_default_session_state) ? &smsg_default_session : NULL;
+}
+
+/*
+  The wrappers use the default session, or if they're given a proxy fd,
+  a session of their own over it, which 'proxy_session' is room for.
+*/
+static smsg_session_t *smsg_session_for(int fd, smsg_session_t * proxy_session)
+{
+  if (fd < 0) return smsg_session_get_default();
+  if (0 != smsg_session_open(proxy_session, fd)) return NULL;
+
+  return proxy_session;
+}
+
+static void smsg_session_done(smsg_session_t * session, smsg_session_t * proxy_session)
+{
+  if (session == proxy_session) smsg_session_close(proxy_session);
+}
+
+int smsg_register_component(int fd, /* if >= 0, the proxy fd */
+			    smsg_byte component_id,
+			    smsg_byte instance_id,
+			    smsg_byte node_id,
+			    smsg_byte subsystem_id,
+			    smsg_addr * host_addr,
+			    smsg_port * component_port)
+{
+  smsg_session_t proxy_session;
+  smsg_session_t *session;
+  int retval;
+
+  session = smsg_session_for(fd, &proxy_session);
+  if (NULL == session) return -1;
+  retval = smsg_session_register(session, component_id, instance_id, node_id, subsystem_id, host_addr, component_port);
+  smsg_session_done(session, &proxy_session);
+
+  return retval;
+}
+
+int smsg_unregister_component(int fd, /* if >= 0, the proxy fd */
+			      smsg_byte component_id,
+			      smsg_byte instance_id,
+			      smsg_byte node_id,
+			      smsg_byte subsystem_id)
+{
+  smsg_session_t proxy_session;
+  smsg_session_t *session;
+  int retval;
+
+  session = smsg_session_for(fd, &proxy_session);
+  if (NULL == session) return -1;
+  retval = smsg_session_unregister(session, component_id, instance_id, node_id, subsystem_id);
+  smsg_session_done(session, &proxy_session);
+
+  return retval;
+}
+
+int smsg_find_component(int fd, /* if >= 0, the proxy fd */
+			smsg_byte component_id, /* what you are */
+			smsg_byte instance_id, /* what instance */
+			smsg_byte node_id, /* what node */
+			smsg_byte subsystem_id, /* what subsystem */
+			smsg_addr * host_addr, /* filled in with host */
+			smsg_port * component_port) /* filled in with port */
+{
+  smsg_session_t proxy_session;
+  smsg_session_t *session;
+  int retval;
+
+  session = smsg_session_for(fd, &proxy_session);
+  if (NULL == session) return -1;
+  retval = smsg_session_find(session, component_id, instance_id, node_id, subsystem_id, host_addr, component_port);
+  smsg_session_done(session, &proxy_session);
+
+  return retval;
+}
+
+int smsg_wait_component(int fd, /* if >= 0, the proxy fd */
+			smsg_byte component_id, /* what you are */
+			smsg_byte instance_id, /* what instance */
+			smsg_byte node_id, /* what node */
+			smsg_byte subsystem_id, /* what subsystem */
+			smsg_uint timeout, /* milliseconds to wait */
+			smsg_addr * host_addr, /* filled in with host */
+			smsg_port * component_port) /* filled in with port */
+{
+  smsg_session_t own_session;
+  int retval;
+
+  /* a wait would hold up everyone else on the default session, so it gets its own */
+  if (0 != smsg_session_open(&own_session, fd)) return -1;
+  retval = smsg_session_wait(&own_session, component_id, instance_id, node_id, subsystem_id, timeout, host_addr, component_port);
+  smsg_session_close(&own_session);
+
+  return retval;
+}
+
+int smsg_find_components(int fd, /* if >= 0, the proxy fd */
+			 component_entry_t * entries, /* ids in, filled in with finds */
+			 int count) /* how many entries */
+{
+  smsg_session_t proxy_session;
+  smsg_session_t *session;
+  int retval;
+
+  session = smsg_session_for(fd, &proxy_session);
+  if (NULL == session) return -1;
+  retval = smsg_session_find_batch(session, entries, count);
+  smsg_session_done(session, &proxy_session);
+
+  return retval;
+}
+
+int smsg_match_components(int fd, /* if >= 0, the proxy fd */
+			  smsg_byte mask, /* SMSG_MATCH_ bits to match */
+			  smsg_byte component_id,
+			  smsg_byte instance_id,
+			  smsg_byte node_id,
+			  smsg_byte subsystem_id,
+			  component_entry_t * entries, /* filled in with matches */
+			  int max) /* room in 'entries' */
+{
+  smsg_session_t proxy_session;
+  smsg_session_t *session;
+  int retval;
+
+  session = smsg_session_for(fd, &proxy_session);
+  if (NULL == session) return -1;
+  retval = smsg_session_match(session, mask, component_id, instance_id, node_id, subsystem_id, entries, max);
+  smsg_session_done(session, &proxy_session);
+
+  return retval;
+}
+
+int smsg_query_stats(int fd, /* if >= 0, the proxy fd */
+		     smsg_report_stats_t * stats) /* filled in */
+{
+  smsg_session_t proxy_session;
+  smsg_session_t *session;
+  int retval;
+
+  session = smsg_session_for(fd, &proxy_session);
+  if (NULL == session) return -1;
+  retval = smsg_session_stats(session, stats);
+  smsg_session_done(session, &proxy_session);
+
+  return retval;
+}
+
+/* messages the message handler threads couldn't decode */
+static smsg_uint smsg_decode_errors = 0;
+
+static void smsg_decode_error(void)
+{
+#if defined(__GNUC__)
+  __sync_fetch_and_add(&smsg_decode_errors, 1);
+#else
+  smsg_decode_errors++;
+#endif
+}
+
+smsg_uint
+smsg_get_decode_errors(void)
+{
+  return smsg_decode_errors;
+}
+
+static int smsg_shm_rings = 0;
+
+int
+smsg_set_shm_rings(int on)
+{
+#ifdef HAVE_SMSG_RING
+  smsg_shm_rings = on;
+  return 0;
+#else
+  smsg_shm_rings = 0;
+  return on ? -1 : 0;
+#endif
+}
+
+int
+smsg_get_shm_rings(void)
+{
+  return smsg_shm_rings;
+}
+
+#ifdef HAVE_SMSG_RING
+
+/*
+  Each ring's head and tail count every byte ever written and read, so
+  they're equal when it's empty and SMSG_RING_SIZE apart when it's full,
+  and each is the futex word its reader or writer sleeps on. They're on
+  separate cache lines so the two ends don't fight over one.
+*/
+
+enum {
+  SMSG_RING_LINE = 64,		/* cache line */
+  SMSG_RING_MAGIC = 0x72696E67,	/* set up */
+  SMSG_RING_NAP_MS = 100,	/* longest sleep before looking for the peer */
+  SMSG_RING_TRIES = 256,	/* keys to try for a free segment */
+  SMSG_RING_TIMEOUT_MS = 1000	/* how long to wait for the server to answer */
+};
+
+typedef struct {
+  smsg_uint head;		/* moved only by the writer */
+  smsg_uint reader_waiting;	/* the reader's asleep on 'head' */
+  char pad0[SMSG_RING_LINE - 2 * sizeof(smsg_uint)];
+  smsg_uint tail;		/* moved only by the reader */
+  smsg_uint writer_waiting;	/* the writer's asleep on 'tail' */
+  char pad1[SMSG_RING_LINE - 2 * sizeof(smsg_uint)];
+  char data[SMSG_RING_SIZE];
+} smsg_ring_t;
+
+/*
+  The segment, which the client makes for just this connection, with
+  only its own user able to attach it. The server checks that it was
+  made by the process on the other end of the socket, and once the
+  server has attached the client removes it, so that it goes away when
+  both ends are done.
+*/
+typedef struct {
+  smsg_uint magic;
+  smsg_uint served;		/* a server's attached */
+  smsg_uint closed[2];		/* the client, then the server, are done */
+  char pad[SMSG_RING_LINE - 4 * sizeof(smsg_uint)];
+  smsg_ring_t rings[2];		/* client to server, and back */
+} smsg_ring_shared_t;
+
+/* one end of a connection's rings */
+typedef struct {
+  int fd;			/* the socket they were set up over */
+  int side;			/* 0 for the client, 1 for the server */
+  int shm_id;
+  smsg_ring_shared_t *shared;
+  smsg_ring_t *in;
+  smsg_ring_t *out;
+  void *writemutex;		/* for any number of threads sending */
+  void *reader;			/* the thread handing 'in' to the handler */
+  smsg_message_handler_t handler;
+  void *handler_args;
+  int stopping;
+} smsg_ring_pair_t;
+
+/* by fd, under the mutex for changes but looked up without it */
+static smsg_ring_pair_t *smsg_rings[SMSG_RING_FDS];
+static void *smsg_rings_mutex = NULL;
+static smsg_uint smsg_ring_count = 0;
+static int smsg_ring_spins = -1;	/* SMSG_RING_SPINS, or none with one processor */
+
+static smsg_ring_pair_t *smsg_ring_find(int fd)
+{
+  if (fd < 0 || fd >= SMSG_RING_FDS) return NULL;
+
+  return __atomic_load_n(&smsg_rings[fd], __ATOMIC_ACQUIRE);
+}
+
+static int smsg_ring_lock(void)
+{
+  void *mutex;
+
+  if (NULL == smsg_rings_mutex) {
+    mutex = ulapi_mutex_new(0);
+    if (NULL == mutex) return -1;
+    if (! __sync_bool_compare_and_swap(&smsg_rings_mutex, NULL, mutex)) ulapi_mutex_delete(mutex);
+  }
+  ulapi_mutex_take(smsg_rings_mutex);
+
+  return 0;
+}
+
+/* puts 'pair' in the table for its fd; returns 0, or -1 if the fd has some already */
+static int smsg_ring_add(smsg_ring_pair_t * pair)
+{
+  int retval = -1;
+
+  if (0 != smsg_ring_lock()) return -1;
+  if (NULL == smsg_rings[pair->fd]) {
+    __atomic_store_n(&smsg_rings[pair->fd], pair, __ATOMIC_RELEASE);
+    retval = 0;
+  }
+  ulapi_mutex_give(smsg_rings_mutex);
+
+  return retval;
+}
+
+static smsg_ring_pair_t *smsg_ring_remove(int fd)
+{
+  smsg_ring_pair_t *pair;
+
+  if (fd < 0 || fd >= SMSG_RING_FDS || NULL == smsg_ring_find(fd)) return NULL;
+  if (0 != smsg_ring_lock()) return NULL;
+  pair = smsg_rings[fd];
+  __atomic_store_n(&smsg_rings[fd], NULL, __ATOMIC_RELEASE);
+  ulapi_mutex_give(smsg_rings_mutex);
+
+  return pair;
+}
+
+static smsg_ring_pair_t *smsg_ring_pair_new(int fd, int side)
+{
+  smsg_ring_pair_t *pair;
+
+  if (smsg_ring_spins < 0) {
+    /* with just one, the other end can't move while we spin */
+    smsg_ring_spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SMSG_RING_SPINS : 0;
+  }
+
+  pair = malloc(sizeof(*pair));
+  if (NULL == pair) return NULL;
+  pair->fd = fd;
+  pair->side = side;
+  pair->shm_id = -1;
+  pair->shared = NULL;
+  pair->in = pair->out = NULL;
+  pair->reader = NULL;
+  pair->handler = NULL;
+  pair->handler_args = NULL;
+  pair->stopping = 0;
+  pair->writemutex = ulapi_mutex_new(0);
+  if (NULL == pair->writemutex) {
+    free(pair);
+    return NULL;
+  }
+
+  return pair;
+}
+
+/* points the pair at its ends of the segment */
+static void smsg_ring_pair_attach(smsg_ring_pair_t * pair)
+{
+  pair->in = &pair->shared->rings[pair->side];
+  pair->out = &pair->shared->rings[1 - pair->side];
+}
+
+static void smsg_ring_pair_delete(smsg_ring_pair_t * pair)
+{
+  if (NULL != pair->shared) shmdt(pair->shared);
+  ulapi_mutex_delete(pair->writemutex);
+  free(pair);
+}
+
+/* sleeps while '*word' is 'value', for a while at most; returns 0 if woken, -1 if not */
+static int smsg_ring_sleep(smsg_uint * word, smsg_uint value)
+{
+  struct timespec nap;
+
+  nap.tv_sec = 0;
+  nap.tv_nsec = SMSG_RING_NAP_MS * 1000000L;
+
+  return 0 == syscall(SYS_futex, word, FUTEX_WAIT, value, &nap, NULL, 0) ? 0 : -1;
+}
+
+static void smsg_ring_wake(smsg_uint * word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* wakes anyone sleeping on either ring, at either end */
+static void smsg_ring_wake_all(smsg_ring_pair_t * pair)
+{
+  smsg_ring_wake(&pair->in->head);
+  smsg_ring_wake(&pair->in->tail);
+  smsg_ring_wake(&pair->out->head);
+  smsg_ring_wake(&pair->out->tail);
+}
+
+/* returns non-zero once this end is closing, or the other's gone */
+static int smsg_ring_gone(smsg_ring_pair_t * pair, int slept)
+{
+  struct pollfd pollfd;
+
+  if (__atomic_load_n(&pair->stopping, __ATOMIC_ACQUIRE) ||
+      __atomic_load_n(&pair->shared->closed[1 - pair->side], __ATOMIC_ACQUIRE)) return 1;
+  if (! slept) return 0;
+
+  /* it may have died without saying, which closes the socket */
+  pollfd.fd = pair->fd;
+  pollfd.events = 0;
+  pollfd.revents = 0;
+
+  return poll(&pollfd, 1, 0) > 0 && (pollfd.revents & (POLLHUP | POLLERR | POLLNVAL));
+}
+
+static void smsg_ring_copy_in(smsg_ring_t * ring, smsg_uint pos, const void *buf, int len)
+{
+  int at = (int) (pos & (SMSG_RING_SIZE - 1));
+  int first = (len < SMSG_RING_SIZE - at) ? len : SMSG_RING_SIZE - at;
+
+  memcpy(ring->data + at, buf, first);
+  memcpy(ring->data, (const char *) buf + first, len - first);
+}
+
+static void smsg_ring_copy_out(smsg_ring_t * ring, smsg_uint pos, void *buf, int len)
+{
+  int at = (int) (pos & (SMSG_RING_SIZE - 1));
+  int first = (len < SMSG_RING_SIZE - at) ? len : SMSG_RING_SIZE - at;
+
+  memcpy(buf, ring->data + at, first);
+  memcpy((char *) buf + first, ring->data, len - first);
+}
+
+/* how much of the ring a message takes, its length and it rounded up */
+#define smsg_ring_frame(len) (sizeof(smsg_uint) + (((len) + 3) & ~3))
+
+/* writes a message to 'out', waiting for room; returns 0, or -1 if the rings are done with */
+static int smsg_ring_put(smsg_ring_pair_t * pair, smsg_byte * smsg_outbuf, smsg_uint smsg_outbuflen)
+{
+  smsg_ring_t *ring = pair->out;
+  smsg_uint need = smsg_ring_frame(smsg_outbuflen);
+  smsg_uint head, tail;
+  int spins, slept;
+
+  head = ring->head;
+  for (spins = slept = 0;; spins++) {
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail + need <= SMSG_RING_SIZE) break;
+    if (smsg_ring_gone(pair, slept)) return -1;
+    if (spins < smsg_ring_spins) continue;
+    /* the reader looks for this after moving the tail, as we look at the tail after saying it */
+    __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+    slept = 0;
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail) slept = smsg_ring_sleep(&ring->tail, tail);
+    __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+  }
+
+  smsg_ring_copy_in(ring, head, &smsg_outbuflen, sizeof(smsg_outbuflen));
+  smsg_ring_copy_in(ring, head + sizeof(smsg_outbuflen), smsg_outbuf, smsg_outbuflen);
+  __atomic_store_n(&ring->head, head + need, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->reader_waiting, __ATOMIC_SEQ_CST)) smsg_ring_wake(&ring->head);
+
+  return 0;
+}
+
+/* reads the next message from 'in', waiting for one; returns its length, or -1 if the rings are done with */
+static int smsg_ring_get(smsg_ring_pair_t * pair, smsg_byte * smsg_inbuf)
+{
+  smsg_ring_t *ring = pair->in;
+  smsg_uint head, tail;
+  smsg_uint smsg_inbuflen;
+  int spins, slept;
+
+  tail = ring->tail;
+  for (spins = slept = 0;; spins++) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head != tail) break;
+    if (smsg_ring_gone(pair, slept)) return -1;
+    if (spins < smsg_ring_spins) continue;
+    __atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    slept = 0;
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail) slept = smsg_ring_sleep(&ring->head, tail);
+    __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+  }
+
+  smsg_ring_copy_out(ring, tail, &smsg_inbuflen, sizeof(smsg_inbuflen));
+  if (smsg_inbuflen > SMSG_INBUFSIZE || smsg_ring_frame(smsg_inbuflen) > head - tail) return -1;
+  smsg_ring_copy_out(ring, tail + sizeof(smsg_inbuflen), smsg_inbuf, smsg_inbuflen);
+  __atomic_store_n(&ring->tail, tail + smsg_ring_frame(smsg_inbuflen), __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->writer_waiting, __ATOMIC_SEQ_CST)) smsg_ring_wake(&ring->tail);
+
+  return (int) smsg_inbuflen;
+}
+
+/* hands what comes in the ring to the handler, until it or the rings are done */
+static void smsg_ring_reader(void *args)
+{
+  smsg_ring_pair_t *pair = (smsg_ring_pair_t *) args;
+  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];
+
+  while (smsg_ring_get(pair, smsg_inbuf) >= 2) {
+    if (0 != pair->handler(smsg_inbuf, pair->fd, pair->handler_args)) {
+      /* the handler's done with the connection, so have the socket's thread close it */
+      shutdown(pair->fd, SHUT_RDWR);
+      break;
+    }
+  }
+
+  ulapi_task_exit(0);
+}
+
+/* starts the thread handing the rings on 'fd' to 'handler', if there are rings and it's not started */
+static void smsg_ring_serve(int fd, smsg_message_handler_t handler, void *handler_args)
+{
+  smsg_ring_pair_t *pair;
+  void *task;
+
+  pair = smsg_ring_find(fd);
+  if (NULL == pair || NULL != pair->reader) return;
+
+  pair->handler = handler;
+  pair->handler_args = handler_args;
+  task = ulapi_task_new();
+  if (NULL == task) return;
+  if (ULAPI_OK != ulapi_task_start(task, smsg_ring_reader, pair, ulapi_prio_highest(), 1)) {
+    ulapi_task_delete(task);
+    return;
+  }
+  pair->reader = task;
+  smsg_print_debug(SMSG_DEBUG_MSG, "Handling fd %d from shared-memory rings\n", fd);
+}
+
+/* attaches the server's end of the rings asked for on 'fd', and answers */
+static void smsg_ring_accept(int fd, smsg_byte * smsg_inbuf, smsg_message_handler_t handler, void *handler_args)
+{
+  smsg_open_ring_t open_ring;
+  smsg_return_ring_t return_ring;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  char writebuf[SMSG_WRITEBUFSIZE];
+  int writebuflen;
+  smsg_ring_pair_t *pair;
+  struct shmid_ds ds;
+  void *shared;
+  int pid, uid, gid;
+
+  if (0 != smsg_message_to_open_ring(smsg_inbuf, &open_ring)) return;
+  return_ring.sequence_number = open_ring.sequence_number;
+  return_ring.status = 1;
+
+  pair = NULL;
+  if (fd < SMSG_RING_FDS && NULL == smsg_ring_find(fd) &&
+      0 == smsg_get_peer_credentials(fd, &pid, &uid, &gid)) {
+    pair = smsg_ring_pair_new(fd, 1);
+  }
+  if (NULL != pair) {
+    /* it has to have been made by whoever's on the other end */
+    pair->shm_id = shmget((key_t) open_ring.key, 0, 0);
+    if (pair->shm_id >= 0 &&
+	0 == shmctl(pair->shm_id, IPC_STAT, &ds) &&
+	(pid_t) pid == ds.shm_cpid &&
+	(uid_t) uid == ds.shm_perm.cuid &&
+	ds.shm_segsz >= sizeof(smsg_ring_shared_t)) {
+      shared = shmat(pair->shm_id, NULL, 0);
+      if ((void *) -1 != shared) pair->shared = shared;
+    }
+    /* and be set up, and not taken */
+    if (NULL == pair->shared ||
+	SMSG_RING_MAGIC != __atomic_load_n(&pair->shared->magic, __ATOMIC_ACQUIRE) ||
+	! __sync_bool_compare_and_swap(&pair->shared->served, 0, 1)) {
+      smsg_print_debug(SMSG_DEBUG_MSG, "Refusing rings from process %d on fd %d\n", pid, fd);
+      smsg_ring_pair_delete(pair);
+      pair = NULL;
+    }
+  }
+  if (NULL != pair) {
+    smsg_ring_pair_attach(pair);
+    if (0 != smsg_ring_add(pair)) {
+      smsg_ring_pair_delete(pair);
+    } else {
+      smsg_ring_serve(fd, handler, handler_args);
+      if (NULL == pair->reader) {
+	smsg_close_ring(fd);
+      } else {
+	return_ring.status = 0;
+      }
+    }
+  }
+
+  /* on the socket, where the client's waiting for it */
+  smsg_outbuflen = smsg_return_ring_to_message(&return_ring, smsg_outbuf);
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+  ulapi_socket_write(fd, writebuf, writebuflen);
+}
+
+int
+smsg_open_ring(int fd)
+{
+  smsg_ring_pair_t *pair;
+  smsg_ring_shared_t *shared;
+  smsg_open_ring_t open_ring;
+  smsg_return_ring_t return_ring;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];
+  int smsg_inbuflen;
+  smsg_uint key;
+  void *addr;
+  int pid, uid, gid;
+  int tries;
+
+  if (fd < 0 || fd >= SMSG_RING_FDS || NULL != smsg_ring_find(fd)) return -1;
+  /* the server has to be able to tell it's us that set them up */
+  if (0 != smsg_get_peer_credentials(fd, &pid, &uid, &gid)) return -1;
+
+  pair = smsg_ring_pair_new(fd, 0);
+  if (NULL == pair) return -1;
+
+  /* make a new segment, at a key no one else is using */
+  for (tries = 0; tries < SMSG_RING_TRIES; tries++) {
+    key = SMSG_RING_KEY + (((smsg_uint) getpid() & 0xFFFF) << 8) + (__sync_fetch_and_add(&smsg_ring_count, 1) & 0xFF);
+    pair->shm_id = shmget((key_t) key, sizeof(smsg_ring_shared_t), IPC_CREAT | IPC_EXCL | 0600);
+    if (pair->shm_id >= 0 || EEXIST != errno) break;
+  }
+  if (pair->shm_id < 0) {
+    smsg_print_debug(SMSG_DEBUG_MSG, "Can't get a segment for rings on fd %d\n", fd);
+    smsg_ring_pair_delete(pair);
+    return -1;
+  }
+  addr = shmat(pair->shm_id, NULL, 0);
+  if ((void *) -1 == addr) {
+    shmctl(pair->shm_id, IPC_RMID, NULL);
+    smsg_ring_pair_delete(pair);
+    return -1;
+  }
+
+  /* it starts out zeroed */
+  shared = pair->shared = addr;
+  smsg_ring_pair_attach(pair);
+  __atomic_store_n(&shared->magic, SMSG_RING_MAGIC, __ATOMIC_RELEASE);
+
+  open_ring.sequence_number = (smsg_byte) (key & 0xFF) | 1;
+  open_ring.key = key;
+  smsg_outbuflen = smsg_open_ring_to_message(&open_ring, smsg_outbuf);
+  smsg_inbuflen = smsg_send_and_recv(fd, smsg_outbuf, smsg_outbuflen, smsg_inbuf, SMSG_RING_TIMEOUT_MS / 1000.0);
+  if (smsg_inbuflen < 0 ||
+      0 != smsg_message_to_return_ring(smsg_inbuf, &return_ring) ||
+      0 != return_ring.status ||
+      0 != smsg_ring_add(pair)) {
+    smsg_print_debug(SMSG_DEBUG_MSG, "Server on fd %d won't take rings\n", fd);
+    /* a server that's attached but answered late finds it closed, and one that hasn't can't */
+    __atomic_store_n(&shared->closed[0], 1, __ATOMIC_SEQ_CST);
+    shmctl(pair->shm_id, IPC_RMID, NULL);
+    smsg_ring_pair_delete(pair);
+    return -1;
+  }
+  /* both ends are attached, so it goes once they've both detached */
+  shmctl(pair->shm_id, IPC_RMID, NULL);
+  smsg_print_debug(SMSG_DEBUG_MSG, "Set up rings on fd %d with key %x\n", fd, key);
+
+  return 0;
+}
+
+void
+smsg_close_ring(int fd)
+{
+  smsg_ring_pair_t *pair;
+  smsg_ring_shared_t *shared;
+
+  pair = smsg_ring_remove(fd);
+  if (NULL == pair) return;
+  shared = pair->shared;
+
+  __atomic_store_n(&pair->stopping, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&shared->closed[pair->side], 1, __ATOMIC_SEQ_CST);
+  smsg_ring_wake_all(pair);
+  if (NULL != pair->reader) {
+    ulapi_task_join(pair->reader, NULL);
+    ulapi_task_delete(pair->reader);
+  }
+  smsg_print_debug(SMSG_DEBUG_MSG, "Closed rings on fd %d\n", fd);
+  smsg_ring_pair_delete(pair);
+}
+
+int
+smsg_send(int fd, smsg_byte * smsg_outbuf, int smsg_outbuflen)
+{
+  smsg_ring_pair_t *pair;
+  char writebuf[SMSG_WRITEBUFSIZE];
+  int writebuflen;
+  int retval;
+
+  if (smsg_outbuflen < 2 || smsg_outbuflen > (int) SMSG_MAX_MESSAGE_SIZE) return -1;
+
+  pair = smsg_ring_find(fd);
+  if (NULL != pair) {
+    ulapi_mutex_take(pair->writemutex);
+    retval = smsg_ring_put(pair, smsg_outbuf, (smsg_uint) smsg_outbuflen);
+    ulapi_mutex_give(pair->writemutex);
+    return retval;
+  }
+
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+
+  return writebuflen == ulapi_socket_write(fd, writebuf, writebuflen) ? 0 : -1;
+}
+
+#else
+
+#define smsg_ring_find(fd) NULL
+#define smsg_ring_serve(fd, handler, handler_args)
+
+int
+smsg_open_ring(int fd)
+{
+  return -1;
+}
+
+void
+smsg_close_ring(int fd)
+{
+  return;
+}
+
+int
+smsg_send(int fd, smsg_byte * smsg_outbuf, int smsg_outbuflen)
+{
+  char writebuf[SMSG_WRITEBUFSIZE];
+  int writebuflen;
+
+  if (smsg_outbuflen < 2 || smsg_outbuflen > (int) SMSG_MAX_MESSAGE_SIZE) return -1;
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+
+  return writebuflen == ulapi_socket_write(fd, writebuf, writebuflen) ? 0 : -1;
+}
+
+#endif	/* HAVE_SMSG_RING */
+
+/* hands a message to the handler, unless it's one the library answers itself */
+static int smsg_handle(smsg_message_handler_t handler, smsg_byte * smsg_inbuf, int fd, void *handler_args)
+{
+#ifdef HAVE_SMSG_RING
+  if (SMSG_CODE_OPEN_RING == smsg_message_identifier(smsg_inbuf)) {
+    smsg_ring_accept(fd, smsg_inbuf, handler, handler_args);
+    return 0;
+  }
+#endif
+
+  return handler(smsg_inbuf, fd, handler_args);
+}
+
+/*
+  io_uring rings, for serving sockets without a system call per read
+  and write. A ring takes multishot accepts and receives, which stay
+  armed and post a completion for each client or each piece of input,
+  and sends, and everything queued is submitted together with the
+  next wait. Receives land in the ring's own buffers, registered with
+  the kernel as a provided-buffer ring, so nothing is copied into
+  them from a caller's buffer; each must be handed back with
+  smsg_uring_release once it's used.
+
+  The ring is driven through its system calls directly, so it needs
+  no library, and where the kernel or headers don't have it every
+  smsg_uring_ function fails and callers carry on as before.
 */
+
+static int smsg_io_uring = 0;
+
 int
-db_find_fd(component_db_t * db, int fd, component_entry_t * entry)
+smsg_set_io_uring(int on)
+{
+#ifdef HAVE_SMSG_URING
+  smsg_io_uring = on;
+  return 0;
+#else
+  smsg_io_uring = 0;
+  return on ? -1 : 0;
+#endif
+}
+
+int
+smsg_get_io_uring(void)
+{
+  return smsg_io_uring;
+}
+
+#ifdef HAVE_SMSG_URING
+
+enum {
+  SMSG_URING_TYPE_MASK = 3,	/* low bits of user_data for the type */
+  SMSG_URING_GROUP = 0		/* buffer group for receives */
+};
+
+typedef struct {
+  int fd;
+  /* submission queue */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sq_local_tail;	/* our copy of the tail */
+  unsigned sq_pending;		/* queued, not yet submitted */
+  struct io_uring_sqe *sqes;
+  /* completion queue */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* the mappings of all that */
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  /* provided receive buffers */
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  unsigned buf_count;
+  unsigned short buf_tail;
+  int buf_size;
+  char *bufs;
+} smsg_uring_t;
+
+static int smsg_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int smsg_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int smsg_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* rounds up to a power of two, which the rings need */
+static unsigned smsg_uring_pow2(int n)
+{
+  unsigned p;
+
+  for (p = 1; (int) p < n; p <<= 1);
+
+  return p;
+}
+
+/* puts a receive buffer back for the kernel to fill */
+static void smsg_uring_buf_add(smsg_uring_t *ring, int buf_id)
+{
+  struct io_uring_buf *buf;
+
+  buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+  buf->addr = (unsigned long) (ring->bufs + (size_t) buf_id * ring->buf_size);
+  buf->len = ring->buf_size;
+  buf->bid = (unsigned short) buf_id;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+void
+smsg_uring_delete(void *ring_ptr)
+{
+  smsg_uring_t *ring = ring_ptr;
+  struct io_uring_buf_reg reg;
+
+  if (NULL == ring) return;
+
+  if (NULL != ring->buf_ring) {
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = SMSG_URING_GROUP;
+    smsg_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  }
+  if (NULL != ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (NULL != ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if (NULL != ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+  if (NULL != ring->bufs) free(ring->bufs);
+  free(ring);
+}
+
+void *
+smsg_uring_new(int entries, int buffers, int buffer_size)
+{
+  smsg_uring_t *ring;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  char *sq_ring;
+  char *cq_ring;
+  int i;
+
+  if (entries < 1 || buffers < 1 || buffers > 32768 || buffer_size < 1) return NULL;
+
+  ring = malloc(sizeof(*ring));
+  if (NULL == ring) return NULL;
+  memset(ring, 0, sizeof(*ring));
+
+  memset(&params, 0, sizeof(params));
+#ifdef IORING_SETUP_COOP_TASKRUN
+  /* we always enter the ring to reap, so the kernel needn't interrupt us */
+  params.flags = IORING_SETUP_COOP_TASKRUN;
+#endif
+  ring->fd = smsg_uring_setup(smsg_uring_pow2(entries), &params);
+  if (ring->fd < 0 && 0 != params.flags) {
+    memset(&params, 0, sizeof(params));
+    ring->fd = smsg_uring_setup(smsg_uring_pow2(entries), &params);
+  }
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == ring->sq_ring) {
+    ring->sq_ring = NULL;
+    smsg_uring_delete(ring);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == ring->cq_ring) {
+      ring->cq_ring = NULL;
+      smsg_uring_delete(ring);
+      return NULL;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (MAP_FAILED == ring->sqes) {
+    ring->sqes = NULL;
+    smsg_uring_delete(ring);
+    return NULL;
+  }
+
+  sq_ring = ring->sq_ring;
+  ring->sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  cq_ring = ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+  /* the receive buffers, and the ring that hands them to the kernel */
+  ring->buf_count = smsg_uring_pow2(buffers);
+  ring->buf_size = buffer_size;
+  ring->bufs = malloc((size_t) ring->buf_count * buffer_size);
+  ring->buf_ring_size = ring->buf_count * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == ring->buf_ring) ring->buf_ring = NULL;
+  if (NULL == ring->bufs || NULL == ring->buf_ring) {
+    smsg_uring_delete(ring);
+    return NULL;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) ring->buf_ring;
+  reg.ring_entries = ring->buf_count;
+  reg.bgid = SMSG_URING_GROUP;
+  if (0 != smsg_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    munmap(ring->buf_ring, ring->buf_ring_size);
+    ring->buf_ring = NULL;
+    smsg_uring_delete(ring);
+    return NULL;
+  }
+  ring->buf_tail = 0;
+  for (i = 0; i < (int) ring->buf_count; i++) {
+    smsg_uring_buf_add(ring, i);
+  }
+
+  return ring;
+}
+
+/* gets the next submission entry, submitting what's queued if it's full */
+static struct io_uring_sqe *smsg_uring_sqe(smsg_uring_t *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned index;
+  int n;
+
+  if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    n = smsg_uring_enter(ring->fd, ring->sq_pending, 0, 0);
+    if (n > 0) ring->sq_pending -= n;
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+  }
+
+  index = ring->sq_local_tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+
+  return sqe;
+}
+
+/* makes the entry from smsg_uring_sqe visible to the kernel */
+static void smsg_uring_queue(smsg_uring_t *ring, struct io_uring_sqe *sqe, void *tag, int type)
+{
+  sqe->user_data = (unsigned long) tag | (unsigned long) type;
+  ring->sq_local_tail++;
+  ring->sq_pending++;
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+int
+smsg_uring_accept(void *ring_ptr, int fd, void *tag)
+{
+  smsg_uring_t *ring = ring_ptr;
+  struct io_uring_sqe *sqe;
+
+  sqe = smsg_uring_sqe(ring);
+  if (NULL == sqe) return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  smsg_uring_queue(ring, sqe, tag, SMSG_URING_ACCEPT);
+
+  return 0;
+}
+
+int
+smsg_uring_recv(void *ring_ptr, int fd, void *tag)
+{
+  smsg_uring_t *ring = ring_ptr;
+  struct io_uring_sqe *sqe;
+
+  sqe = smsg_uring_sqe(ring);
+  if (NULL == sqe) return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = SMSG_URING_GROUP;
+  smsg_uring_queue(ring, sqe, tag, SMSG_URING_RECV);
+
+  return 0;
+}
+
+int
+smsg_uring_send(void *ring_ptr, int fd, const void *buf, int len, void *tag)
+{
+  smsg_uring_t *ring = ring_ptr;
+  struct io_uring_sqe *sqe;
+
+  sqe = smsg_uring_sqe(ring);
+  if (NULL == sqe) return -1;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) buf;
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  smsg_uring_queue(ring, sqe, tag, SMSG_URING_SEND);
+
+  return 0;
+}
+
+/* takes up to 'max' completions off the ring, without waiting */
+static int smsg_uring_reap(smsg_uring_t *ring, smsg_uring_event_t *events, int max)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  unsigned tail;
+  int n;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (n = 0; head != tail && n < max; head++, n++) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    events[n].type = (int) (cqe->user_data & SMSG_URING_TYPE_MASK);
+    events[n].tag = (void *) (unsigned long) (cqe->user_data & ~(unsigned long long) SMSG_URING_TYPE_MASK);
+    events[n].result = cqe->res;
+    events[n].more = (cqe->flags & IORING_CQE_F_MORE) ? 1 : 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      events[n].buf_id = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      events[n].buf = ring->bufs + (size_t) events[n].buf_id * ring->buf_size;
+    } else {
+      events[n].buf_id = -1;
+      events[n].buf = NULL;
+    }
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+int
+smsg_uring_wait(void *ring_ptr, smsg_uring_event_t *events, int max)
+{
+  smsg_uring_t *ring = ring_ptr;
+  int n;
+  int submitted;
+
+  for (;;) {
+    n = smsg_uring_reap(ring, events, max);
+    if (n > 0 && 0 == ring->sq_pending) return n;
+    /* submit what's queued, waiting for a completion if we have none */
+    submitted = smsg_uring_enter(ring->fd, ring->sq_pending, n > 0 ? 0 : 1, IORING_ENTER_GETEVENTS);
+    if (submitted < 0) {
+      if (EINTR == errno || EAGAIN == errno || EBUSY == errno) {
+	if (n > 0) return n;
+	if (EINTR == errno) continue;
+      }
+      return -1;
+    }
+    ring->sq_pending -= submitted;
+    if (n > 0) return n;
+  }
+
+  return -1;
+}
+
+void
+smsg_uring_release(void *ring_ptr, int buf_id)
+{
+  smsg_uring_t *ring = ring_ptr;
+
+  if (buf_id >= 0 && buf_id < (int) ring->buf_count) smsg_uring_buf_add(ring, buf_id);
+}
+
+/*
+  The io_uring side of smsg_message_handler_thread. A multishot
+  receive stays armed on 'fd', and each piece of input is decoded
+  straight from the ring's buffer. Returns -1 if there's no ring to be
+  had, so the caller reads the usual way, otherwise 0 once the fd is
+  done with.
+*/
+static int smsg_message_handler_uring(smsg_message_handler_t handler, int fd, void *handler_args, serdes_decode_state *state, smsg_byte *smsg_inbuf)
+{
+  enum {EVENTS = 16};
+  void *ring;
+  smsg_uring_event_t events[EVENTS];
+  int readlen;
+  int smsg_inbuflen;
+  int done;
+  int n, i;
+
+  ring = smsg_uring_new(EVENTS, SMSG_URING_BUFFERS, SMSG_URING_BUFFER_SIZE);
+  if (NULL == ring) return -1;
+  if (0 != smsg_uring_recv(ring, fd, NULL)) {
+    smsg_uring_delete(ring);
+    return -1;
+  }
+  smsg_print_debug(SMSG_DEBUG_MSG, "Handling fd %d with io_uring\n", fd);
+
+  for (done = 0; ! done; ) {
+    n = smsg_uring_wait(ring, events, EVENTS);
+    if (n < 0) break;
+    for (i = 0; i < n; i++) {
+      if (done) {
+	/* just give back the buffers */
+      } else if (events[i].result > 0) {
+	/* the decoder carries on from whatever buffer it's given */
+	state->encptr = events[i].buf;
+	readlen = events[i].result;
+	for (;;) {
+	  smsg_inbuflen = serdes_decode(events[i].buf, &readlen, (char *) smsg_inbuf, state);
+	  if (0 == smsg_inbuflen) break;
+	  if (0 > smsg_inbuflen) smsg_decode_error();
+	  if (0 > smsg_inbuflen || 0 != smsg_handle(handler, smsg_inbuf, fd, handler_args)) {
+	    done = 1;
+	    break;
+	  }
+	}
+      } else if (-ENOBUFS != events[i].result) {
+	/* end of file or read error */
+	done = 1;
+      }
+      if (NULL != events[i].buf) smsg_uring_release(ring, events[i].buf_id);
+      /* the receive stops when it runs out of buffers; start it again */
+      if (! done && ! events[i].more && 0 != smsg_uring_recv(ring, fd, NULL)) done = 1;
+    }
+  }
+
+  smsg_uring_delete(ring);
+
+  return 0;
+}
+
+#else
+
+void *
+smsg_uring_new(int entries, int buffers, int buffer_size)
+{
+  return NULL;
+}
+
+void
+smsg_uring_delete(void *ring)
+{
+  return;
+}
+
+int
+smsg_uring_accept(void *ring, int fd, void *tag)
+{
+  return -1;
+}
+
+int
+smsg_uring_recv(void *ring, int fd, void *tag)
+{
+  return -1;
+}
+
+int
+smsg_uring_send(void *ring, int fd, const void *buf, int len, void *tag)
+{
+  return -1;
+}
+
+int
+smsg_uring_wait(void *ring, smsg_uring_event_t *events, int max)
+{
+  return -1;
+}
+
+void
+smsg_uring_release(void *ring, int buf_id)
+{
+  return;
+}
+
+#endif	/* HAVE_SMSG_URING */
+
+void
+smsg_message_handler_thread(void *args)
 {
-  int index, retval;
+  smsg_message_handler_t handler;
+  int fd;
+  void *handler_args;
+  int retval;
+
+  /* reading, decoding and unpacking smsg messages */
+  enum {READ_SIZE = 80};	/* how big a block to read */
+  char readbuf[READ_SIZE]; /* into here */
+  int readlen;			/* how many chars were read */
+  serdes_decode_state state;	/* decoder */
+  smsg_byte smsg_inbuf[SMSG_INBUFSIZE]; /* decoded and packed smsg message */
+  int smsg_inbuflen;		/* how big smsg_inbuf was decoded to be */
+
+  handler = ((smsg_message_handler_thread_args_t *) args)->handler;
+  fd = ((smsg_message_handler_thread_args_t *) args)->fd;
+  handler_args = ((smsg_message_handler_thread_args_t *) args)->handler_args;
+  /* this frees the memory allocated by smsg_start_message_handler */
+  my_free(args);
+
+#define PEXIT(r)	\
+  smsg_print_debug(SMSG_DEBUG_MSG, "Stopping message handler on fd %d with return %d\n", (int) fd, (int) r); \
+  if (fd >= 0) smsg_close_ring(fd); \
+  if (fd >= 0) ulapi_socket_close(fd); \
+  ulapi_task_exit(0); \
+  return
+
+  /* initialize the decoder */
+  retval = serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, READ_SIZE, SMSG_INBUFSIZE);
+  if (0 != retval) {
+    PEXIT(NULL);
+  }
+
+  /* anything that comes in rings goes to the handler from a thread of its own */
+  smsg_ring_serve(fd, handler, handler_args);
+
+#ifdef HAVE_SMSG_URING
+  if (smsg_get_io_uring() &&
+      0 == smsg_message_handler_uring(handler, fd, handler_args, &state, smsg_inbuf)) {
+    PEXIT(NULL);
+  }
+#endif
+
+  for (;;) {
+    /* read from fd */
+    readlen = ulapi_socket_read(fd, readbuf, READ_SIZE);
+    if (0 == readlen) break;	/* end of file */
+    if (0 > readlen) break;	/* read error */
+
+    for (;;) {
+      smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
+      if (0 == smsg_inbuflen) break;
+      if (0 > smsg_inbuflen) {
+	smsg_decode_error();
+	PEXIT(NULL);
+      }
+
+      /* handle message */
+      if (0 != smsg_handle(handler, smsg_inbuf, fd, handler_args)) {
+	PEXIT(NULL);
+      }
+    } /* for (;;) to build message */
+  } /* for (;;) to read fd */
+
+  PEXIT(NULL);
+#undef PEXIT
+}
+
+int
+smsg_start_message_handler(smsg_message_handler_t handler, int fd, void * handler_args, void **thread_ptr)
+{
+  void *thread;
+  smsg_message_handler_thread_args_t * args;
+  ulapi_result retval;
 
-  retval = -1;
+  /* these are freed just after reference in the smsg_message_handler_thread */
+  args = my_malloc(sizeof(smsg_message_handler_thread_args_t));
+  args->handler = handler;
+  args->fd = fd;
+  args->handler_args = handler_args;
 
-  ulapi_mutex_take(db->mutex);
-  for (index = 0; index < db->index; index++) {
-    if (db->entries[index].fd == fd) {
-      *entry = db->entries[index];
-      retval = index;
-      break;
+  thread = ulapi_task_new();
+  if (NULL == thread) {
+    return -1;
+  }
+
+  retval = ulapi_task_start(thread,
+			    smsg_message_handler_thread,
+			    args,
+			    ulapi_prio_highest(),
+			    1);
+
+  if (ULAPI_OK != retval) {
+    if (NULL != handler_args) {
+      my_free(handler_args);
+    }
+  } else {
+    if (NULL != thread_ptr) {
+      *thread_ptr = thread;
     }
   }
-  ulapi_mutex_give(db->mutex);
 
   return retval;
 }
 
+#if defined(HAVE_SYS_SOCKET_H) && defined(MSG_PEEK)
+
 /*
-  Add this entry to the database. If it's already in the database,
-  the non-negative index of the entry is returned. Otherwise any
-  zero address or port will be filled in, and the index returned.
-  On error, -1 is returned.
+  Reads from a socket without taking what's read, so that only the
+  bytes a reply came in need be taken, with smsg_recv_take. Other fds
+  are read as usual, and then '*peeking' is cleared.
 */
+static int smsg_recv_peek(int fd, char *buf, int len, int *peeking)
+{
+  int n;
+
+  if (*peeking) {
+    n = recv(fd, buf, len, MSG_PEEK);
+    if (n >= 0 || ENOTSOCK != errno) return n;
+    *peeking = 0;
+  }
+
+  return ulapi_socket_read(fd, buf, len);
+}
+
+/* takes the first 'len' bytes that were peeked at; returns 0, or -1 on error */
+static int smsg_recv_take(int fd, char *buf, int len, int peeking)
+{
+  if (! peeking || len <= 0) return 0;
+
+  return len == recv(fd, buf, len, 0) ? 0 : -1;
+}
+
+#else
+
+#define smsg_recv_peek(fd, buf, len, peeking) (*(peeking) = 0, ulapi_socket_read(fd, buf, len))
+#define smsg_recv_take(fd, buf, len, peeking) ((void) (len), 0)
+
+#endif
+
 int
-db_add(component_db_t * db, component_entry_t * entry)
+smsg_send_and_recv(int fd, smsg_byte * smsg_outbuf, int smsg_outbuflen, smsg_byte * smsg_inbuf, double timeout)
 {
-  int retval = -1;
+  char writebuf[SMSG_WRITEBUFSIZE];
+  int writebuflen;
+  char readbuf[SMSG_SESSION_READ_SIZE];
+  int readlen;
+  int peeked;
+  int peeking;
+  serdes_decode_state state;
+  int smsg_inbuflen;
+#ifdef HAVE_POLL_H
+  struct pollfd pollfd;
+  ulapi_real deadline;
+  int wait;
+#endif
+
+  if (smsg_outbuflen < 2 || smsg_outbuflen > (int) SMSG_MAX_MESSAGE_SIZE) return -1;
+#ifndef HAVE_POLL_H
+  if (timeout > 0) {
+    smsg_print_debug(SMSG_DEBUG_MSG, "Can't time out waiting for replies on this platform\n");
+    return -1;
+  }
+#endif
 
-  if (0 > db_find(db, entry)) {
-    /* not in our database */
-    ulapi_mutex_take(db->mutex);
-    if (db->index >= db->size) {
-      if (0 == db->size) {
-	db->size = 1;
-	db->entries = my_malloc(db->size * sizeof(*entry));
-      } else {
-	db->size *= 2;
-	db->entries = my_realloc(db->entries, db->size * sizeof(*entry));
-	smsg_print_debug(SMSG_DEBUG_DB, "Grew db to %d entries\n", db->size);
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+  if (writebuflen != ulapi_socket_write(fd, writebuf, writebuflen)) return -1;
+
+  if (0 != serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, sizeof(readbuf), SMSG_INBUFSIZE)) {
+    return -1;
+  }
+#ifdef HAVE_POLL_H
+  deadline = ulapi_time() + timeout;
+#endif
+
+  for (readlen = 0, peeked = 0, peeking = 1;;) {
+    while (readlen > 0) {
+      smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
+      if (0 > smsg_inbuflen) return -1;
+      if (smsg_inbuflen >= 2 &&
+	  smsg_message_sequence_number(smsg_inbuf) == smsg_message_sequence_number(smsg_outbuf)) {
+	/* what's past the reply is left for whoever reads next */
+	if (0 != smsg_recv_take(fd, readbuf, peeked - readlen, peeking)) return -1;
+	return smsg_inbuflen;
       }
-      if (NULL == db->entries) {
-	db->size = 0;
-	db->index = 0;
-	retval = -1;
-	smsg_print_debug(SMSG_DEBUG_DB, "Can't grow database\n");
-      } else {
-	if (0 == entry->address) entry->address = ulapi_get_host_address();
-	if (0 == entry->port) entry->port = db->port++;
-	retval = db->index;
-	db->entries[db->index++] = *entry;
-	smsg_print_debug(SMSG_DEBUG_DB, "Added to db with component %d %d %d %d %s %d %d\n", 
-		(int) entry->component_id,
-		(int) entry->instance_id,
-		(int) entry->node_id,
-		(int) entry->subsystem_id,
-		ulapi_address_to_hostname(entry->address),
-		(int) entry->port,
-		(int) entry->fd);
+      if (smsg_inbuflen >= 2) {
+	smsg_print_debug(SMSG_DEBUG_MSG, "Passing over %s with sequence number %d on fd %d\n", smsg_id_to_string(smsg_message_identifier(smsg_inbuf)), (int) smsg_message_sequence_number(smsg_inbuf), fd);
+      }
+    }
+    if (0 != smsg_recv_take(fd, readbuf, peeked, peeking)) return -1;
+    peeked = 0;
+#ifdef HAVE_POLL_H
+    if (timeout > 0) {
+      wait = (int) ((deadline - ulapi_time()) * 1000.0 + 0.5);
+      if (wait <= 0) return -1;
+      pollfd.fd = fd;
+      pollfd.events = POLLIN;
+      wait = poll(&pollfd, 1, wait);
+      if (0 > wait && EINTR == errno) continue;
+      if (0 >= wait) return -1;
+    }
+#endif
+    readlen = smsg_recv_peek(fd, readbuf, sizeof(readbuf), &peeking);
+    if (0 >= readlen) return -1;
+    peeked = readlen;
+    state.encptr = readbuf;
+  }
+}
+
+#ifdef HAVE_SMSG_RPC
+
+/*
+  Takes the call numbered 'sequence_number' off the connection,
+  finished with 'status'. Calls with callbacks go onto 'done', to be
+  called back once the mutex, which is held, is given back.
+*/
+static smsg_rpc_call_t *smsg_rpc_finish(smsg_rpc_t * rpc, smsg_byte sequence_number, int status, smsg_rpc_call_t * done)
+{
+  smsg_rpc_call_t *call;
+
+  call = rpc->calls[sequence_number];
+  rpc->calls[sequence_number] = NULL;
+  rpc->inflight--;
+  call->status = status;
+  if (NULL == call->callback) return done;
+  call->next = done;
+
+  return call;
+}
+
+/* calls back the calls finished by smsg_rpc_finish */
+static void smsg_rpc_callback(smsg_rpc_call_t * done)
+{
+  smsg_rpc_call_t *next;
+
+  for (; NULL != done; done = next) {
+    /* the callback may be done with the call */
+    next = done->next;
+    done->callback(done, done->callback_args);
+  }
+}
+
+/* fails every call out, since the connection's gone */
+static void smsg_rpc_fail(smsg_rpc_t * rpc)
+{
+  smsg_rpc_call_t *done = NULL;
+  int i;
+
+  ulapi_mutex_take(rpc->mutex);
+  rpc->dead = 1;
+  for (i = 1; i < 256; i++) {
+    if (NULL != rpc->calls[i]) done = smsg_rpc_finish(rpc, i, SMSG_RPC_FAILED, done);
+  }
+  ulapi_cond_broadcast(rpc->cond);
+  ulapi_mutex_give(rpc->mutex);
+  smsg_rpc_callback(done);
+}
+
+/* gets the reader out of poll, to look again at deadlines or stop */
+static void smsg_rpc_wake(smsg_rpc_t * rpc)
+{
+  char c = 0;
+
+  /* it doesn't block, and if the pipe's full the reader's waking anyway */
+  if (1 != write(rpc->wakefds[1], &c, 1)) return;
+}
+
+/*
+  Times out the calls whose deadlines have passed, and returns how
+  many milliseconds until the next one does, or -1 if none will.
+*/
+static int smsg_rpc_expire(smsg_rpc_t * rpc)
+{
+  smsg_rpc_call_t *done = NULL;
+  ulapi_real now;
+  int expired = 0;
+  int wait;
+  int i;
+
+  ulapi_mutex_take(rpc->mutex);
+  now = ulapi_time();
+  rpc->until = 0;
+  for (i = 1; i < 256 && rpc->inflight > 0; i++) {
+    if (NULL == rpc->calls[i] || 0 == rpc->calls[i]->deadline) continue;
+    if (rpc->calls[i]->deadline <= now) {
+      done = smsg_rpc_finish(rpc, i, SMSG_RPC_TIMEDOUT, done);
+      expired = 1;
+    } else if (0 == rpc->until || rpc->calls[i]->deadline < rpc->until) {
+      rpc->until = rpc->calls[i]->deadline;
+    }
+  }
+  /* rounded up, so it's not woken just short of the deadline */
+  wait = (0 == rpc->until) ? -1 : (int) ((rpc->until - now) * 1000.0) + 1;
+  if (expired) ulapi_cond_broadcast(rpc->cond);
+  ulapi_mutex_give(rpc->mutex);
+  smsg_rpc_callback(done);
+
+  return wait;
+}
+
+/* finishes the call that 'smsg_inbuf' answers, or passes it to the handler */
+static int smsg_rpc_answer(smsg_rpc_t * rpc, smsg_byte * smsg_inbuf, int smsg_inbuflen)
+{
+  smsg_byte sequence_number;
+  smsg_rpc_call_t *call;
+  smsg_rpc_call_t *done;
+
+  sequence_number = smsg_message_sequence_number(smsg_inbuf);
+  ulapi_mutex_take(rpc->mutex);
+  call = (0 == sequence_number) ? NULL : rpc->calls[sequence_number];
+  if (NULL == call) {
+    ulapi_mutex_give(rpc->mutex);
+    if (NULL != rpc->handler) return rpc->handler(smsg_inbuf, rpc->fd, rpc->handler_args);
+    smsg_print_debug(SMSG_DEBUG_MSG, "Passing over %s %d on fd %d\n", smsg_id_to_string(smsg_message_identifier(smsg_inbuf)), (int) sequence_number, rpc->fd);
+    return 0;
+  }
+  memcpy(call->reply, smsg_inbuf, smsg_inbuflen);
+  call->replylen = smsg_inbuflen;
+  done = smsg_rpc_finish(rpc, sequence_number, SMSG_RPC_DONE, NULL);
+  ulapi_cond_broadcast(rpc->cond);
+  ulapi_mutex_give(rpc->mutex);
+  smsg_rpc_callback(done);
+
+  return 0;
+}
+
+/* the reader thread, which reads replies and times out calls until it's closed */
+static void smsg_rpc_reader(void *args)
+{
+  smsg_rpc_t *rpc = (smsg_rpc_t *) args;
+  struct pollfd pollfds[2];
+  char readbuf[SMSG_RPC_READ_SIZE];
+  int readlen;
+  serdes_decode_state state;
+  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];
+  int smsg_inbuflen;
+  int closing;
+  int stop;
+  int n;
+
+  if (0 != serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, SMSG_RPC_READ_SIZE, SMSG_INBUFSIZE)) {
+    smsg_rpc_fail(rpc);
+    ulapi_task_exit(0);
+    return;
+  }
+  pollfds[0].fd = rpc->fd;
+  pollfds[0].events = POLLIN;
+  pollfds[1].fd = rpc->wakefds[0];
+  pollfds[1].events = POLLIN;
+
+  for (stop = 0; ! stop;) {
+    n = smsg_rpc_expire(rpc);
+    ulapi_mutex_take(rpc->mutex);
+    closing = rpc->closing;
+    ulapi_mutex_give(rpc->mutex);
+    if (closing) break;
+
+    n = poll(pollfds, 2, n);
+    if (0 > n) {
+      if (EINTR == errno) continue;
+      break;
+    }
+    if (pollfds[1].revents & POLLIN) {
+      if (0 >= read(rpc->wakefds[0], readbuf, SMSG_RPC_READ_SIZE)) break;
+    }
+    if (! (pollfds[0].revents & (POLLIN | POLLERR | POLLHUP))) continue;
+
+    readlen = ulapi_socket_read(rpc->fd, readbuf, SMSG_RPC_READ_SIZE);
+    if (0 >= readlen) break;	/* end of file or read error */
+    state.encptr = readbuf;
+    while (! stop) {
+      smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
+      if (0 == smsg_inbuflen) break;
+      if (0 > smsg_inbuflen) {
+	smsg_decode_error();
+	stop = 1;
+      } else if (smsg_inbuflen >= 2) {
+	stop = (0 != smsg_rpc_answer(rpc, smsg_inbuf, smsg_inbuflen));
       }
+    }
+  }
+
+  smsg_print_debug(SMSG_DEBUG_MSG, "Stopping RPC reader on fd %d\n", rpc->fd);
+  smsg_rpc_fail(rpc);
+  ulapi_task_exit(0);
+}
+
+int
+smsg_rpc_open(smsg_rpc_t * rpc, int fd, smsg_message_handler_t handler, void *handler_args)
+{
+  int i;
+
+  /* the reader would wait on the socket while the replies came in the rings */
+  if (NULL != smsg_ring_find(fd)) return -1;
+
+  rpc->fd = fd;
+  rpc->handler = handler;
+  rpc->handler_args = handler_args;
+  for (i = 0; i < 256; i++) rpc->calls[i] = NULL;
+  rpc->inflight = 0;
+  rpc->sequence = 0;
+  rpc->until = 0;
+  rpc->closing = 0;
+  rpc->dead = 0;
+  rpc->mutex = ulapi_mutex_new(0);
+  rpc->cond = ulapi_cond_new(0);
+  rpc->writemutex = ulapi_mutex_new(0);
+  rpc->reader = ulapi_task_new();
+  if (0 != pipe(rpc->wakefds)) {
+    rpc->wakefds[0] = rpc->wakefds[1] = -1;
+  } else {
+    fcntl(rpc->wakefds[1], F_SETFL, O_NONBLOCK);
+  }
+  if (NULL == rpc->mutex || NULL == rpc->cond || NULL == rpc->writemutex ||
+      NULL == rpc->reader || rpc->wakefds[0] < 0 ||
+      ULAPI_OK != ulapi_task_start(rpc->reader, smsg_rpc_reader, rpc, ulapi_prio_highest(), 1)) {
+    if (NULL != rpc->mutex) ulapi_mutex_delete(rpc->mutex);
+    if (NULL != rpc->cond) ulapi_cond_delete(rpc->cond);
+    if (NULL != rpc->writemutex) ulapi_mutex_delete(rpc->writemutex);
+    if (NULL != rpc->reader) ulapi_task_delete(rpc->reader);
+    if (rpc->wakefds[0] >= 0) {
+      close(rpc->wakefds[0]);
+      close(rpc->wakefds[1]);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+smsg_rpc_close(smsg_rpc_t * rpc)
+{
+  ulapi_mutex_take(rpc->mutex);
+  rpc->closing = 1;
+  ulapi_mutex_give(rpc->mutex);
+  smsg_rpc_wake(rpc);
+  ulapi_task_join(rpc->reader, NULL);
+  ulapi_task_delete(rpc->reader);
+  /* the reader failed what was left on its way out */
+  close(rpc->wakefds[0]);
+  close(rpc->wakefds[1]);
+  ulapi_mutex_delete(rpc->mutex);
+  ulapi_cond_delete(rpc->cond);
+  ulapi_mutex_delete(rpc->writemutex);
+
+  return 0;
+}
+
+int
+smsg_rpc_send(smsg_rpc_t * rpc,
+	      smsg_rpc_call_t * call,
+	      smsg_byte * smsg_outbuf,
+	      int smsg_outbuflen,
+	      double timeout,
+	      smsg_rpc_callback_t callback,
+	      void *callback_args)
+{
+  smsg_byte sequence_number;
+  int writebuflen;
+  int sent;
+
+  if (smsg_outbuflen < 2 || smsg_outbuflen > (int) SMSG_MAX_MESSAGE_SIZE) return -1;
+
+  call->status = SMSG_RPC_PENDING;
+  call->replylen = 0;
+  call->callback = callback;
+  call->callback_args = callback_args;
+  call->deadline = (timeout > 0) ? ulapi_time() + timeout : 0;
+
+  ulapi_mutex_take(rpc->mutex);
+  while (! rpc->dead && ! rpc->closing && rpc->inflight >= SMSG_RPC_WINDOW) {
+    ulapi_cond_wait(rpc->cond, rpc->mutex);
+  }
+  if (rpc->dead || rpc->closing) {
+    ulapi_mutex_give(rpc->mutex);
+    return -1;
+  }
+  /* the next number that's not out, and never 0 */
+  do {
+    if (0 == ++rpc->sequence) rpc->sequence = 1;
+  } while (NULL != rpc->calls[rpc->sequence]);
+  sequence_number = rpc->sequence;
+  rpc->calls[sequence_number] = call;
+  rpc->inflight++;
+  if (0 != call->deadline && (0 == rpc->until || call->deadline < rpc->until)) {
+    /* the reader's asleep past this deadline */
+    rpc->until = call->deadline;
+    smsg_rpc_wake(rpc);
+  }
+  ulapi_mutex_give(rpc->mutex);
+
+  /* the reply may be read before this returns, so 'call' isn't ours any more */
+  ulapi_mutex_take(rpc->writemutex);
+  memcpy(rpc->outbuf, smsg_outbuf, smsg_outbuflen);
+  smsg_message_sequence_number(rpc->outbuf) = sequence_number;
+  writebuflen = serdes_encode((char *) rpc->outbuf, smsg_outbuflen, rpc->writebuf, SMSG_WRITEBUFSIZE);
+  sent = (writebuflen == ulapi_socket_write(rpc->fd, rpc->writebuf, writebuflen));
+  ulapi_mutex_give(rpc->writemutex);
+  if (! sent) smsg_rpc_fail(rpc);
+
+  return 0;
+}
+
+int
+smsg_rpc_wait(smsg_rpc_t * rpc, smsg_rpc_call_t * call)
+{
+  ulapi_mutex_take(rpc->mutex);
+  while (SMSG_RPC_PENDING == call->status) {
+    ulapi_cond_wait(rpc->cond, rpc->mutex);
+  }
+  ulapi_mutex_give(rpc->mutex);
+
+  return (SMSG_RPC_DONE == call->status) ? call->replylen : -1;
+}
+
+int
+smsg_rpc_dead(smsg_rpc_t * rpc)
+{
+  int dead;
+
+  ulapi_mutex_take(rpc->mutex);
+  dead = rpc->dead;
+  ulapi_mutex_give(rpc->mutex);
+
+  return dead;
+}
+
+#else
+
+int
+smsg_rpc_open(smsg_rpc_t * rpc, int fd, smsg_message_handler_t handler, void *handler_args)
+{
+  return -1;
+}
+
+int
+smsg_rpc_close(smsg_rpc_t * rpc)
+{
+  return -1;
+}
+
+int
+smsg_rpc_send(smsg_rpc_t * rpc,
+	      smsg_rpc_call_t * call,
+	      smsg_byte * smsg_outbuf,
+	      int smsg_outbuflen,
+	      double timeout,
+	      smsg_rpc_callback_t callback,
+	      void *callback_args)
+{
+  return -1;
+}
+
+int
+smsg_rpc_wait(smsg_rpc_t * rpc, smsg_rpc_call_t * call)
+{
+  return -1;
+}
+
+int
+smsg_rpc_dead(smsg_rpc_t * rpc)
+{
+  return 1;
+}
+
+#endif	/* HAVE_SMSG_RPC */
+
+int
+smsg_rpc_call(smsg_rpc_t * rpc,
+	      smsg_byte * smsg_outbuf,
+	      int smsg_outbuflen,
+	      smsg_byte * smsg_inbuf,
+	      double timeout)
+{
+  smsg_rpc_call_t call;
+  int smsg_inbuflen;
+
+  if (0 != smsg_rpc_send(rpc, &call, smsg_outbuf, smsg_outbuflen, timeout, NULL, NULL)) return -1;
+  smsg_inbuflen = smsg_rpc_wait(rpc, &call);
+  if (smsg_inbuflen > 0) memcpy(smsg_inbuf, call.reply, smsg_inbuflen);
+
+  return smsg_inbuflen;
+}
+
+#ifdef HAVE_SMSG_PROXY
+
+/*
+  A proxy link's end. One thread serves each, polling the link and the
+  sockets of its connections, and holding the mutex except while it
+  polls. Connection numbers are handed out by the proxy, and a number
+  isn't handed out again until both ends have said they're done with
+  it, so nothing still on its way for an old connection can reach a
+  new one. Callers asking the proxy for a connection queue their
+  request for the link and wait for the reply, which the link's thread
+  binds to their socket before it reads any more from the link.
+*/
+
+/* how often callers' waits are checked, in milliseconds */
+#define SMSG_PROXY_TICK 100
+
+typedef struct {
+  char *buf;			/* what's queued is from 'pos' to 'len' */
+  int pos;
+  int len;
+  int size;
+} smsg_proxy_queue_t;
+
+typedef enum {
+  SMSG_PROXY_FREE = 0,
+  SMSG_PROXY_STREAM,		/* carries a connection's stream both ways */
+  SMSG_PROXY_LISTENER,		/* at the proxy, where a server's clients come in */
+  SMSG_PROXY_SERVER,		/* at the component, where it accepts them from */
+  SMSG_PROXY_CLOSED		/* done here, waiting to hear the other end's done */
+} smsg_proxy_kind_t;
+
+typedef struct {
+  smsg_proxy_kind_t kind;
+  int fd;			/* the local socket */
+  smsg_proxy_queue_t out;	/* from the link, for 'fd' */
+  int closing;			/* done at the other end, so close once 'out' is written */
+} smsg_proxy_conn_t;
+
+typedef struct {
+  int waiting;			/* non-zero while the caller is */
+  int done;			/* set with 'connection' when it's answered or out of time */
+  smsg_byte connection;		/* or 0 if the proxy couldn't */
+  smsg_proxy_kind_t kind;	/* what the caller's socket is to be */
+  int fd;
+  ulapi_real deadline;
+} smsg_proxy_call_t;
+
+typedef struct {
+  int link;
+  int remote;			/* non-zero at the proxy, which makes the network connections */
+  void *task;			/* the link's thread, at the component */
+  void *mutex;
+  void *cond;			/* for callers, when their calls are done */
+  int wakefds[2];		/* a pipe, for waking the link's thread */
+  int dead;			/* non-zero once the link's gone */
+  smsg_proxy_conn_t conns[256];	/* by number, 0 being none */
+  int next;			/* whose turn comes first */
+  smsg_byte last;		/* the number last handed out */
+  smsg_proxy_queue_t out;	/* encoded, for the link */
+  smsg_byte sequence;		/* of the last call */
+  smsg_proxy_call_t calls[256];	/* by sequence number */
+  int calling;			/* how many callers are waiting */
+} smsg_proxy_t;
+
+/* adds to a queue, unless that would put more than 'max' in it; returns 0, or -1 */
+static int smsg_proxy_queue_put(smsg_proxy_queue_t * queue, const void *buf, int len, int max)
+{
+  char *grown;
+  int size;
+
+  if (queue->len + len > queue->size && queue->pos > 0) {
+    /* slide what's left down to make room */
+    memmove(queue->buf, queue->buf + queue->pos, queue->len - queue->pos);
+    queue->len -= queue->pos;
+    queue->pos = 0;
+  }
+  if (queue->len + len > queue->size) {
+    if (queue->len + len > max) return -1;
+    for (size = queue->size > 0 ? queue->size : SMSG_PROXY_READ_SIZE; size < queue->len + len; size *= 2);
+    grown = realloc(queue->buf, size);
+    if (NULL == grown) return -1;
+    queue->buf = grown;
+    queue->size = size;
+  }
+  memcpy(queue->buf + queue->len, buf, len);
+  queue->len += len;
+
+  return 0;
+}
+
+/* writes what 'fd' will take from a queue; returns 0, or -1 if it's gone */
+static int smsg_proxy_queue_flush(smsg_proxy_queue_t * queue, int fd, int is_socket)
+{
+  int n;
+
+  while (queue->pos < queue->len) {
+    if (is_socket) {
+      n = send(fd, queue->buf + queue->pos, queue->len - queue->pos, MSG_NOSIGNAL);
     } else {
-      if (0 == entry->address) entry->address = ulapi_get_host_address();
-      if (0 == entry->port) entry->port = db->port++;
-      retval = db->index;
-      db->entries[db->index++] = *entry;
-      smsg_print_debug(SMSG_DEBUG_DB, "Added to db with component %d %d %d %d %s %d %d\n", 
-	      (int) entry->component_id,
-	      (int) entry->instance_id,
-	      (int) entry->node_id,
-	      (int) entry->subsystem_id,
-	      ulapi_address_to_hostname(entry->address),
-	      (int) entry->port,
-	      (int) entry->fd);
+      n = write(fd, queue->buf + queue->pos, queue->len - queue->pos);
     }
-    ulapi_mutex_give(db->mutex);
+    if (n < 0) {
+      if (EINTR == errno) continue;
+      if (EAGAIN == errno || EWOULDBLOCK == errno) return 0;
+      return -1;
+    }
+    queue->pos += n;
+  }
+  queue->pos = queue->len = 0;
+
+  return 0;
+}
+
+static void smsg_proxy_queue_free(smsg_proxy_queue_t * queue)
+{
+  if (NULL != queue->buf) free(queue->buf);
+  queue->buf = NULL;
+  queue->pos = queue->len = queue->size = 0;
+}
+
+/* queues a message for the link */
+static void smsg_proxy_send(smsg_proxy_t * proxy, smsg_byte * smsg_outbuf, int smsg_outbuflen)
+{
+  char writebuf[SMSG_WRITEBUFSIZE];
+  int writebuflen;
+
+  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, sizeof(writebuf));
+  if (0 != smsg_proxy_queue_put(&proxy->out, writebuf, writebuflen, INT_MAX)) {
+    smsg_print_debug(SMSG_DEBUG_ERR, "Can't queue %s for proxy link fd %d\n", smsg_id_to_string(smsg_message_identifier(smsg_outbuf)), proxy->link);
+  }
+}
+
+/* tells the other end this one's done with connection 'connection' */
+static void smsg_proxy_send_close(smsg_proxy_t * proxy, int connection, smsg_proxy_kind_t kind)
+{
+  smsg_close_client_connection_t close_client_connection;
+  smsg_close_server_connection_t close_server_connection;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+
+  if (SMSG_PROXY_LISTENER == kind || SMSG_PROXY_SERVER == kind) {
+    close_server_connection.sequence_number = 0;
+    close_server_connection.connection = connection;
+    smsg_outbuflen = smsg_close_server_connection_to_message(&close_server_connection, smsg_outbuf);
   } else {
-      smsg_print_debug(SMSG_DEBUG_DB, "Already have db entry for component %d %d %d %d %s %d %d\n", 
-	      (int) entry->component_id,
-	      (int) entry->instance_id,
-	      (int) entry->node_id,
-	      (int) entry->subsystem_id,
-	      ulapi_address_to_hostname(entry->address),
-	      (int) entry->port,
-	      (int) entry->fd);
+    close_client_connection.sequence_number = 0;
+    close_client_connection.connection = connection;
+    smsg_outbuflen = smsg_close_client_connection_to_message(&close_client_connection, smsg_outbuf);
   }
+  smsg_proxy_send(proxy, smsg_outbuf, smsg_outbuflen);
+}
 
-  return retval;
+static void smsg_proxy_wake(smsg_proxy_t * proxy)
+{
+  char c = 0;
+
+  /* it doesn't block, and if the pipe's full the thread's waking anyway */
+  if (1 != write(proxy->wakefds[1], &c, 1)) return;
+}
+
+/* puts 'fd' on connection 'connection' */
+static void smsg_proxy_bind(smsg_proxy_t * proxy, int connection, smsg_proxy_kind_t kind, int fd)
+{
+  smsg_proxy_conn_t *conn = &proxy->conns[connection];
+
+  conn->kind = kind;
+  conn->fd = fd;
+  conn->closing = 0;
+  /* the component's listening socket is left as the component wants it */
+  if (SMSG_PROXY_SERVER != kind) ulapi_socket_set_nonblocking(fd);
+}
+
+/* gives 'fd' the next free number; returns it, or 0 if they're all in use */
+static smsg_byte smsg_proxy_add(smsg_proxy_t * proxy, smsg_proxy_kind_t kind, int fd)
+{
+  int i;
+
+  for (i = 0; i < 255; i++) {
+    if (0 == ++proxy->last) proxy->last = 1;
+    if (SMSG_PROXY_FREE == proxy->conns[proxy->last].kind) {
+      smsg_proxy_bind(proxy, proxy->last, kind, fd);
+      return proxy->last;
+    }
+  }
+
+  return 0;
 }
 
 /*
-  Given 'fd', add this entry to the database. If it's already in the
-  database, the non-negative index of the entry is returned. Otherwise
-  any zero address or port will be filled in, and the index returned.
-  On error, -1 is returned.
+  Closes the socket of connection 'connection' and tells the other end.
+  The number's free once the other end says it's done too, or right
+  away if it already has.
 */
-int
-db_add_fd(component_db_t * db, int fd, component_entry_t * entry)
+static void smsg_proxy_close(smsg_proxy_t * proxy, int connection)
 {
-  int retval = -1;
+  smsg_proxy_conn_t *conn = &proxy->conns[connection];
+
+  smsg_print_debug(SMSG_DEBUG_MSG, "Closing proxy connection %d on fd %d\n", connection, conn->fd);
+  smsg_proxy_send_close(proxy, connection, conn->kind);
+  /* the component's listening socket is its own */
+  if (SMSG_PROXY_SERVER != conn->kind) ulapi_socket_close(conn->fd);
+  smsg_proxy_queue_free(&conn->out);
+  conn->fd = -1;
+  conn->kind = conn->closing ? SMSG_PROXY_FREE : SMSG_PROXY_CLOSED;
+  conn->closing = 0;
+}
 
-  if (0 > db_find_fd(db, fd, entry)) {
-    /* not in our database */
-    ulapi_mutex_take(db->mutex);
-    if (db->index >= db->size) {
-      if (0 == db->size) {
-	db->size = 1;
-	db->entries = my_malloc(db->size * sizeof(*entry));
-      } else {
-	db->size *= 2;
-	db->entries = my_realloc(db->entries, db->size * sizeof(*entry));
-	smsg_print_debug(SMSG_DEBUG_DB, "Grew db to %d entries\n", db->size);
-      }
-      if (NULL == db->entries) {
-	db->size = 0;
-	db->index = 0;
-	retval = -1;
-	smsg_print_debug(SMSG_DEBUG_DB, "Can't grow database\n");
-      } else {
-	if (0 == entry->address) entry->address = ulapi_get_host_address();
-	if (0 == entry->port) entry->port = db->port++;
-	retval = db->index;
-	db->entries[db->index++] = *entry;
-	smsg_print_debug(SMSG_DEBUG_DB, "Added to db with component %d %d %d %d %s %d %d\n", 
-		(int) entry->component_id,
-		(int) entry->instance_id,
-		(int) entry->node_id,
-		(int) entry->subsystem_id,
-		ulapi_address_to_hostname(entry->address),
-		(int) entry->port,
-		(int) entry->fd);
-      }
+/* turns down connection 'connection', which this end couldn't take */
+static void smsg_proxy_refuse(smsg_proxy_t * proxy, int connection)
+{
+  if (SMSG_PROXY_FREE != proxy->conns[connection].kind) return;
+  smsg_proxy_send_close(proxy, connection, SMSG_PROXY_STREAM);
+  proxy->conns[connection].kind = SMSG_PROXY_CLOSED;
+}
+
+/* connects to the component's listening socket 'listener'; returns the fd, or -1 */
+static int smsg_proxy_connect_local(int listener)
+{
+  struct sockaddr_un addr;
+  socklen_t addrlen = sizeof(addr);
+  int fd;
+
+  if (0 != getsockname(listener, (struct sockaddr *) &addr, &addrlen)) return -1;
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (0 != connect(fd, (struct sockaddr *) &addr, addrlen)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* finishes a caller's call with 'connection', binding its socket if it's still waiting */
+static void smsg_proxy_answer(smsg_proxy_t * proxy, smsg_byte sequence_number, smsg_byte connection)
+{
+  smsg_proxy_call_t *call = &proxy->calls[sequence_number];
+
+  if (! call->waiting || call->done) {
+    /* the caller's given up, so it goes right back */
+    if (0 != connection) smsg_proxy_refuse(proxy, connection);
+    return;
+  }
+  if (0 != connection) {
+    if (SMSG_PROXY_FREE == proxy->conns[connection].kind) {
+      smsg_proxy_bind(proxy, connection, call->kind, call->fd);
     } else {
-      if (0 == entry->address) entry->address = ulapi_get_host_address();
-      if (0 == entry->port) entry->port = db->port++;
-      retval = db->index;
-      db->entries[db->index++] = *entry;
-      smsg_print_debug(SMSG_DEBUG_DB, "Added to db with component %d %d %d %d %s %d %d\n", 
-	      (int) entry->component_id,
-	      (int) entry->instance_id,
-	      (int) entry->node_id,
-	      (int) entry->subsystem_id,
-	      ulapi_address_to_hostname(entry->address),
-	      (int) entry->port,
-	      (int) entry->fd);
+      smsg_print_debug(SMSG_DEBUG_ERR, "Proxy handed out connection %d, already in use\n", (int) connection);
+      connection = 0;
     }
-    ulapi_mutex_give(db->mutex);
-  } else {
-      smsg_print_debug(SMSG_DEBUG_DB, "Already have db entry for component %d %d %d %d %s %d %d\n", 
-	      (int) entry->component_id,
-	      (int) entry->instance_id,
-	      (int) entry->node_id,
-	      (int) entry->subsystem_id,
-	      ulapi_address_to_hostname(entry->address),
-	      (int) entry->port,
-	      (int) entry->fd);
   }
-
-  return retval;
+  call->connection = connection;
+  call->done = 1;
+  ulapi_cond_broadcast(proxy->cond);
 }
 
-/*
-  Pass an index, and the entry will be filled in and the index returned.
-  If there is no entry at that index, the entry is left alone and a 
-  negative value is returned.
-*/
-int
-db_lookup(component_db_t * db, int index, component_entry_t * entry)
+/* finishes the calls that have waited too long, or all of them if the link's gone */
+static void smsg_proxy_expire(smsg_proxy_t * proxy)
 {
-  int retval = -1;
+  ulapi_real now;
+  int i;
+
+  if (0 == proxy->calling) return;
+  now = ulapi_time();
+  for (i = 1; i < 256; i++) {
+    if (proxy->calls[i].waiting && ! proxy->calls[i].done &&
+	(proxy->dead || proxy->calls[i].deadline <= now)) {
+      proxy->calls[i].connection = 0;
+      proxy->calls[i].done = 1;
+      ulapi_cond_broadcast(proxy->cond);
+    }
+  }
+}
 
-  ulapi_mutex_take(db->mutex);
+/* opens the network connection a component asks for, at the proxy, and returns its number, or 0 */
+static smsg_byte smsg_proxy_open(smsg_proxy_t * proxy, smsg_proxy_kind_t kind, smsg_addr address, smsg_port port)
+{
+  smsg_byte connection;
+  int fd;
 
-  if (index < 0 || index >= db->index) {
-    retval = -1;
+  if (SMSG_PROXY_LISTENER == kind) {
+    fd = ulapi_socket_get_server_id(port);
   } else {
-    *entry = db->entries[index];
-    retval = index;
+    fd = smsg_get_client_fd(address, port);
+  }
+  if (fd < 0) {
+    smsg_print_debug(SMSG_DEBUG_MSG, "Can't open proxy connection to port %d\n", (int) port);
+    return 0;
+  }
+  connection = smsg_proxy_add(proxy, kind, fd);
+  if (0 == connection) {
+    ulapi_socket_close(fd);
+  } else {
+    smsg_print_debug(SMSG_DEBUG_MSG, "Opened proxy connection %d to port %d on fd %d\n", (int) connection, (int) port, fd);
   }
 
-  ulapi_mutex_give(db->mutex);
-
-  return retval;
+  return connection;
 }
 
-/*
-  Returns index of last entry, -1 if empty
-*/
-int
-db_last(component_db_t * db)
+/* handles a message from the link */
+static void smsg_proxy_take(smsg_proxy_t * proxy, smsg_byte * smsg_inbuf)
 {
-  int index;
-
-  ulapi_mutex_take(db->mutex);
-
-  index = db->index - 1;
+  smsg_byte identifier;
+  smsg_connection_data_t connection_data;
+  smsg_close_client_connection_t close_client_connection;
+  smsg_open_client_connection_t open_client_connection;
+  smsg_return_client_connection_t return_client_connection;
+  smsg_open_server_connection_t open_server_connection;
+  smsg_return_server_connection_t return_server_connection;
+  smsg_accept_connection_t accept_connection;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  smsg_proxy_conn_t *conn;
+  int fd;
 
-  ulapi_mutex_give(db->mutex);
+  identifier = smsg_message_identifier(smsg_inbuf);
+
+  switch (identifier) {
+  case SMSG_CODE_CONNECTION_DATA:
+    if (0 != smsg_message_to_connection_data(smsg_inbuf, &connection_data)) break;
+    conn = &proxy->conns[connection_data.connection];
+    /* anything for a connection that's closing or closed is passed over */
+    if (SMSG_PROXY_STREAM != conn->kind || conn->closing) break;
+    if (0 != smsg_proxy_queue_put(&conn->out, connection_data.data, connection_data.length, SMSG_PROXY_QUEUE_MAX)) {
+      smsg_print_debug(SMSG_DEBUG_MSG, "Proxy connection %d on fd %d isn't reading, closing it\n", (int) connection_data.connection, conn->fd);
+      smsg_proxy_close(proxy, connection_data.connection);
+      break;
+    }
+    if (0 != smsg_proxy_queue_flush(&conn->out, conn->fd, 1)) smsg_proxy_close(proxy, connection_data.connection);
+    break;
+
+  case SMSG_CODE_CLOSE_CLIENT_CONNECTION:
+  case SMSG_CODE_CLOSE_SERVER_CONNECTION:
+    /* these are laid out the same */
+    smsg_message_to_close_client_connection(smsg_inbuf, &close_client_connection);
+    conn = &proxy->conns[close_client_connection.connection];
+    if (SMSG_PROXY_CLOSED == conn->kind) {
+      conn->kind = SMSG_PROXY_FREE;
+    } else if (SMSG_PROXY_FREE != conn->kind) {
+      conn->closing = 1;
+    }
+    break;
+
+  case SMSG_CODE_OPEN_CLIENT_CONNECTION:
+    if (! proxy->remote || 0 != smsg_message_to_open_client_connection(smsg_inbuf, &open_client_connection)) break;
+    return_client_connection.sequence_number = open_client_connection.sequence_number;
+    return_client_connection.connection = smsg_proxy_open(proxy, SMSG_PROXY_STREAM, open_client_connection.address, open_client_connection.port);
+    smsg_outbuflen = smsg_return_client_connection_to_message(&return_client_connection, smsg_outbuf);
+    smsg_proxy_send(proxy, smsg_outbuf, smsg_outbuflen);
+    break;
+
+  case SMSG_CODE_OPEN_SERVER_CONNECTION:
+    if (! proxy->remote || 0 != smsg_message_to_open_server_connection(smsg_inbuf, &open_server_connection)) break;
+    return_server_connection.sequence_number = open_server_connection.sequence_number;
+    return_server_connection.connection = smsg_proxy_open(proxy, SMSG_PROXY_LISTENER, open_server_connection.address, open_server_connection.port);
+    smsg_outbuflen = smsg_return_server_connection_to_message(&return_server_connection, smsg_outbuf);
+    smsg_proxy_send(proxy, smsg_outbuf, smsg_outbuflen);
+    break;
+
+  case SMSG_CODE_RETURN_CLIENT_CONNECTION:
+    if (proxy->remote || 0 != smsg_message_to_return_client_connection(smsg_inbuf, &return_client_connection)) break;
+    smsg_proxy_answer(proxy, return_client_connection.sequence_number, return_client_connection.connection);
+    break;
+
+  case SMSG_CODE_RETURN_SERVER_CONNECTION:
+    if (proxy->remote || 0 != smsg_message_to_return_server_connection(smsg_inbuf, &return_server_connection)) break;
+    smsg_proxy_answer(proxy, return_server_connection.sequence_number, return_server_connection.connection);
+    break;
+
+  case SMSG_CODE_ACCEPT_CONNECTION:
+    if (proxy->remote || 0 != smsg_message_to_accept_connection(smsg_inbuf, &accept_connection)) break;
+    conn = &proxy->conns[accept_connection.server];
+    fd = -1;
+    if (SMSG_PROXY_SERVER == conn->kind && ! conn->closing &&
+	SMSG_PROXY_FREE == proxy->conns[accept_connection.connection].kind) {
+      fd = smsg_proxy_connect_local(conn->fd);
+    }
+    if (fd < 0) {
+      smsg_proxy_refuse(proxy, accept_connection.connection);
+      break;
+    }
+    smsg_proxy_bind(proxy, accept_connection.connection, SMSG_PROXY_STREAM, fd);
+    break;
 
-  return index;
+  default:
+    smsg_print_debug(SMSG_DEBUG_MSG, "Unexpected message on proxy link: %s\n", smsg_id_to_string(identifier));
+    break;
+  }
 }
 
-int smsg_register_component(int fd, /* if >= 0, the proxy fd */
-			    smsg_byte component_id,
-			    smsg_byte instance_id,
-			    smsg_byte node_id,
-			    smsg_byte subsystem_id,
-			    smsg_addr * host_addr,
-			    smsg_port * component_port)
+/* takes a client that's come in on a listener, at the proxy */
+static void smsg_proxy_accept(smsg_proxy_t * proxy, int server)
 {
-  int proxy;
-  int port = SMSG_PORT;
-  char host[] = "127.0.0.1";
-
-  /* reading, decoding and unpacking smsg messages */
-  enum {READ_SIZE = 80};	/* how big a block to read */
-  char readbuf[READ_SIZE]; /* into here */
-  int readlen;			/* how many chars were read */
-  serdes_decode_state state;	/* decoder */
-  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];	/* decoded and packed smsg message */
-  int smsg_inbuflen;		/* how big smsg_inbuf was decoded to be */
-
-  /* packing, encoding and writing smsg messages */
-  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];	/* packed smsg message */
-  int smsg_outbuflen;		/* how big smsg_outbuf was packed to be */
-  char writebuf[SMSG_WRITEBUFSIZE];	/* encoded message */
-  int writebuflen;		/* how big writebuf was encoded to be */
-
-  /* messages we'll send and receive */
-  smsg_request_dynreg_t request_dynreg;
-  smsg_reply_dynreg_t reply_dynreg;
-
-  proxy = (fd >= 0 ? 1 : 0);
-
-#define RETURN(r) \
-  if (! proxy && 0 <= fd) ulapi_socket_close(fd); \
-  return (r)
+  smsg_accept_connection_t accept_connection;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  int fd;
 
-  /* initialize the decoder */
-  if (0 != serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, READ_SIZE, SMSG_INBUFSIZE)) {
-    RETURN(-1);
+  fd = accept(proxy->conns[server].fd, NULL, NULL);
+  if (fd < 0) return;
+  accept_connection.sequence_number = 0;
+  accept_connection.server = server;
+  accept_connection.connection = smsg_proxy_add(proxy, SMSG_PROXY_STREAM, fd);
+  if (0 == accept_connection.connection) {
+    ulapi_socket_close(fd);
+    return;
   }
+  smsg_outbuflen = smsg_accept_connection_to_message(&accept_connection, smsg_outbuf);
+  smsg_proxy_send(proxy, smsg_outbuf, smsg_outbuflen);
+}
 
-  /* open connection to node manager */
-  if (! proxy) {
-    fd = ulapi_socket_get_client_id(port, host);
-    if (0 > fd) {
-      RETURN(-1);
-    }
+/* sends the next piece of a connection's stream, or closes it at its end */
+static void smsg_proxy_read(smsg_proxy_t * proxy, int connection)
+{
+  smsg_connection_data_t connection_data;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  int n;
+
+  n = recv(proxy->conns[connection].fd, connection_data.data, SMSG_CONNECTION_DATA, 0);
+  if (n > 0) {
+    connection_data.sequence_number = 0;
+    connection_data.connection = connection;
+    connection_data.length = n;
+    smsg_outbuflen = smsg_connection_data_to_message(&connection_data, smsg_outbuf);
+    smsg_proxy_send(proxy, smsg_outbuf, smsg_outbuflen);
+    return;
   }
+  if (n < 0 && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)) return;
+  /* end of file, or it's gone */
+  smsg_proxy_close(proxy, connection);
+}
 
-  /* send a request to register this component and instance */
-  request_dynreg.identifier = SMSG_CODE_REQUEST_DYNREG;
-  request_dynreg.sequence_number = 1;
-  request_dynreg.component_id = component_id;
-  request_dynreg.instance_id = instance_id;
-  request_dynreg.node_id = node_id;
-  request_dynreg.subsystem_id = subsystem_id;
-  smsg_outbuflen = smsg_request_dynreg_to_message(&request_dynreg, smsg_outbuf);
-  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, SMSG_WRITEBUFSIZE);
-  ulapi_socket_write(fd, writebuf, writebuflen);
+/* serves the link until it goes */
+static void smsg_proxy_run(smsg_proxy_t * proxy)
+{
+  struct pollfd pollfds[2 + 255];
+  int which[2 + 255];		/* the connection of each pollfd after the first two */
+  char readbuf[SMSG_PROXY_READ_SIZE];
+  int readlen;
+  serdes_decode_state state;
+  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];
+  int smsg_inbuflen;
+  smsg_proxy_conn_t *conn;
+  int reading;
+  int n, first, i, j, k;
+
+  ulapi_mutex_take(proxy->mutex);
+  if (0 != serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, SMSG_PROXY_READ_SIZE, SMSG_INBUFSIZE) ||
+      0 != fcntl(proxy->link, F_SETFL, fcntl(proxy->link, F_GETFL) | O_NONBLOCK)) {
+    proxy->dead = 1;
+  }
 
-  /* receive a reply */
-  for (;;) {
-    readlen = ulapi_socket_read(fd, readbuf, READ_SIZE);
-    if (0 == readlen) break;	/* end of file */
-    if (0 > readlen) {
-      RETURN(-1);
+  while (! proxy->dead) {
+    /* connections are only read while the link's keeping up */
+    reading = (proxy->out.len - proxy->out.pos < SMSG_PROXY_HIGH);
+    pollfds[0].fd = proxy->link;
+    pollfds[0].events = POLLIN | (proxy->out.len > proxy->out.pos ? POLLOUT : 0);
+    pollfds[1].fd = proxy->wakefds[0];
+    pollfds[1].events = POLLIN;
+    for (n = 2, i = 1; i < 256; i++) {
+      conn = &proxy->conns[i];
+      if (SMSG_PROXY_STREAM != conn->kind && SMSG_PROXY_LISTENER != conn->kind) continue;
+      pollfds[n].events = (reading && ! conn->closing) ? POLLIN : 0;
+      if (conn->out.len > conn->out.pos) pollfds[n].events |= POLLOUT;
+      if (0 == pollfds[n].events) continue;
+      pollfds[n].fd = conn->fd;
+      which[n++] = i;
     }
-    /* try to form a full message */
-    for (;;) {
-      smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
-      if (0 == smsg_inbuflen) break; /* not a full message yet */
-      if (0 > smsg_inbuflen) {	/* decoding error */
-	RETURN(-1);
+    ulapi_mutex_give(proxy->mutex);
+    k = poll(pollfds, n, proxy->calling > 0 ? SMSG_PROXY_TICK : -1);
+    ulapi_mutex_take(proxy->mutex);
+    if (k < 0) {
+      if (EINTR == errno) continue;
+      break;
+    }
+    if (pollfds[1].revents & POLLIN) {
+      if (0 >= read(proxy->wakefds[0], readbuf, SMSG_PROXY_READ_SIZE)) break;
+    }
+    smsg_proxy_expire(proxy);
+
+    if (pollfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+      readlen = read(proxy->link, readbuf, SMSG_PROXY_READ_SIZE);
+      if (0 == readlen) break;	/* end of file */
+      if (readlen < 0 && EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno) break;
+      if (readlen > 0) state.encptr = readbuf;
+      while (readlen > 0) {
+	smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
+	if (0 == smsg_inbuflen) break;
+	if (0 > smsg_inbuflen) {
+	  /* line noise, so start again with the next read */
+	  smsg_decode_error();
+	  serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, SMSG_PROXY_READ_SIZE, SMSG_INBUFSIZE);
+	  break;
+	}
+	if (smsg_inbuflen >= 2) smsg_proxy_take(proxy, smsg_inbuf);
+      }
+    }
+
+    /* the connections take turns, starting after the last one served */
+    for (first = 2; first < n && which[first] < proxy->next; first++);
+    for (k = 0; k < n - 2; k++) {
+      j = 2 + (first - 2 + k) % (n - 2);
+      i = which[j];
+      conn = &proxy->conns[i];
+      /* the link may have closed it meanwhile, or even given the number out again */
+      if (conn->fd != pollfds[j].fd ||
+	  (SMSG_PROXY_STREAM != conn->kind && SMSG_PROXY_LISTENER != conn->kind)) {
+	continue;
+      }
+      if ((pollfds[j].revents & POLLOUT) && 0 != smsg_proxy_queue_flush(&conn->out, conn->fd, 1)) {
+	smsg_proxy_close(proxy, i);
+	continue;
       }
-      /* else we got a full message */
-      if (SMSG_CODE_REPLY_DYNREG == smsg_message_identifier(smsg_inbuf)) {
-	smsg_message_to_reply_dynreg(smsg_inbuf, &reply_dynreg);
-	*host_addr = reply_dynreg.address;
-	*component_port = reply_dynreg.port;
-	RETURN(0);
+      if (! (pollfds[j].revents & (POLLIN | POLLERR | POLLHUP)) || conn->closing) continue;
+      /* once the link's full the rest wait for the next turn */
+      if (proxy->out.len - proxy->out.pos >= SMSG_PROXY_HIGH) break;
+      if (SMSG_PROXY_LISTENER == conn->kind) {
+	smsg_proxy_accept(proxy, i);
+      } else {
+	smsg_proxy_read(proxy, i);
       }
-      /* else go something else */
-      RETURN(-1);
+      proxy->next = i + 1;
+    }
+
+    for (i = 1; i < 256; i++) {
+      conn = &proxy->conns[i];
+      if (conn->closing && conn->out.len == conn->out.pos) smsg_proxy_close(proxy, i);
     }
+
+    /* everything from this turn goes to the link in one write */
+    if (0 != smsg_proxy_queue_flush(&proxy->out, proxy->link, 0)) break;
   }
 
-  RETURN(-1);
-#undef RETURN
+  smsg_print_debug(SMSG_DEBUG_CFG, "Proxy link on fd %d is gone\n", proxy->link);
+  proxy->dead = 1;
+  for (i = 1; i < 256; i++) {
+    conn = &proxy->conns[i];
+    if (SMSG_PROXY_STREAM == conn->kind || SMSG_PROXY_LISTENER == conn->kind) ulapi_socket_close(conn->fd);
+    smsg_proxy_queue_free(&conn->out);
+    conn->kind = SMSG_PROXY_FREE;
+  }
+  smsg_proxy_queue_free(&proxy->out);
+  smsg_proxy_expire(proxy);
+  ulapi_mutex_give(proxy->mutex);
 }
 
-int smsg_find_component(int fd, /* if >= 0, the proxy fd */
-			smsg_byte component_id, /* what you are */
-			smsg_byte instance_id, /* what instance */
-			smsg_byte node_id, /* what node */
-			smsg_byte subsystem_id, /* what subsystem */
-			smsg_addr * host_addr, /* filled in with host */
-			smsg_port * component_port) /* filled in with port */
+static void smsg_proxy_delete(smsg_proxy_t * proxy)
 {
-  int proxy;
-  int port = SMSG_PORT;
-  char host[] = "127.0.0.1";
-
-  /* reading, decoding and unpacking smsg messages */
-  enum {READ_SIZE = 80};	/* how big a block to read */
-  char readbuf[READ_SIZE]; /* into here */
-  int readlen;			/* how many chars were read */
-  serdes_decode_state state;	/* decoder */
-  smsg_byte smsg_inbuf[SMSG_INBUFSIZE];	/* decoded and packed smsg message */
-  int smsg_inbuflen;		/* how big smsg_inbuf was decoded to be */
+  if (NULL != proxy->task) ulapi_task_delete(proxy->task);
+  if (NULL != proxy->mutex) ulapi_mutex_delete(proxy->mutex);
+  if (NULL != proxy->cond) ulapi_cond_delete(proxy->cond);
+  if (proxy->wakefds[0] >= 0) {
+    close(proxy->wakefds[0]);
+    close(proxy->wakefds[1]);
+  }
+  free(proxy);
+}
 
-  /* packing, encoding and writing smsg messages */
-  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];	/* packed smsg message */
-  int smsg_outbuflen;		/* how big smsg_outbuf was packed to be */
-  char writebuf[SMSG_WRITEBUFSIZE];	/* encoded message */
-  int writebuflen;		/* how big writebuf was encoded to be */
+static smsg_proxy_t *smsg_proxy_new(int link, int remote)
+{
+  smsg_proxy_t *proxy;
+  int i;
+
+  proxy = malloc(sizeof(*proxy));
+  if (NULL == proxy) return NULL;
+  memset(proxy, 0, sizeof(*proxy));
+  proxy->link = link;
+  proxy->remote = remote;
+  for (i = 0; i < 256; i++) proxy->conns[i].fd = -1;
+  proxy->mutex = ulapi_mutex_new(0);
+  proxy->cond = ulapi_cond_new(0);
+  if (0 != pipe(proxy->wakefds)) {
+    proxy->wakefds[0] = proxy->wakefds[1] = -1;
+  } else {
+    fcntl(proxy->wakefds[1], F_SETFL, O_NONBLOCK);
+  }
+  if (NULL == proxy->mutex || NULL == proxy->cond || proxy->wakefds[0] < 0) {
+    smsg_proxy_delete(proxy);
+    return NULL;
+  }
 
-  /* messages we'll send and receive */
-  smsg_query_dynreg_t query_dynreg;
-  smsg_report_dynreg_t report_dynreg;
+  return proxy;
+}
 
-  proxy = (fd >= 0 ? 1 : 0);
+/* the thread serving the component's end of a link */
+static void smsg_proxy_thread(void *args)
+{
+  smsg_proxy_run((smsg_proxy_t *) args);
+  ulapi_task_exit(0);
+}
 
-#define RETURN(r) \
-  if (! proxy && 0 <= fd) ulapi_socket_close(fd); \
-  return (r)
+static smsg_proxy_t *smsg_proxies[SMSG_PROXY_LINKS];
+static void *smsg_proxies_mutex = NULL;
 
-  /* initialize the decoder */
-  if (0 != serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, READ_SIZE, SMSG_INBUFSIZE)) {
-    RETURN(-1);
+/* gets the component's end of link 'link', starting it if it's new or gone */
+static smsg_proxy_t *smsg_proxy_for(int link)
+{
+  smsg_proxy_t *proxy = NULL;
+  void *mutex;
+  int i;
+
+  /* the first caller makes the mutex for the table */
+  if (NULL == smsg_proxies_mutex) {
+    mutex = ulapi_mutex_new(0);
+    if (NULL == mutex) return NULL;
+    if (! __sync_bool_compare_and_swap(&smsg_proxies_mutex, NULL, mutex)) ulapi_mutex_delete(mutex);
   }
 
-  /* open connection to node manager */
-  if (! proxy) {
-    fd = ulapi_socket_get_client_id(port, host);
-    if (0 > fd) {
-      RETURN(-1);
-    }
+  ulapi_mutex_take(smsg_proxies_mutex);
+  for (i = 0; i < SMSG_PROXY_LINKS; i++) {
+    if (NULL != smsg_proxies[i] && smsg_proxies[i]->link == link) break;
   }
-
-  /* send a query to find this component */
-  query_dynreg.identifier = SMSG_CODE_QUERY_DYNREG;
-  query_dynreg.sequence_number = 1;
-  query_dynreg.component_id = component_id;
-  query_dynreg.instance_id = instance_id;
-  query_dynreg.node_id = node_id;
-  query_dynreg.subsystem_id = subsystem_id;
-  smsg_outbuflen = smsg_query_dynreg_to_message(&query_dynreg, smsg_outbuf);
-  writebuflen = serdes_encode((char *) smsg_outbuf, smsg_outbuflen, writebuf, SMSG_WRITEBUFSIZE);
-  ulapi_socket_write(fd, writebuf, writebuflen);
-
-  /* loop to receive message pieces and build a full message */
-  for (;;) {
-    readlen = ulapi_socket_read(fd, readbuf, READ_SIZE);
-    if (0 == readlen) break;	/* end of file */
-    if (0 > readlen) {
-      RETURN(-1);
-    }
-    /* try to form a full message */
-    for (;;) {
-      smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
-      if (0 == smsg_inbuflen) break; /* not a full message yet */
-      if (0 > smsg_inbuflen) {	/* decoding error */
-	RETURN(-1);
-      }
-      /* else we got a full message */
-      if (SMSG_CODE_REPORT_DYNREG == smsg_message_identifier(smsg_inbuf)) {
-	smsg_message_to_report_dynreg(smsg_inbuf, &report_dynreg);
-	if (0 == report_dynreg.address || 0 == report_dynreg.port) {
-	  RETURN(-1);
-	} else {
-	  *host_addr = report_dynreg.address;
-	  *component_port = report_dynreg.port;
-	  RETURN(0);
+  if (i < SMSG_PROXY_LINKS && smsg_proxies[i]->dead) {
+    ulapi_task_join(smsg_proxies[i]->task, NULL);
+    smsg_proxy_delete(smsg_proxies[i]);
+    smsg_proxies[i] = NULL;
+  }
+  if (i == SMSG_PROXY_LINKS || NULL == smsg_proxies[i]) {
+    for (i = 0; i < SMSG_PROXY_LINKS && NULL != smsg_proxies[i]; i++);
+    if (i < SMSG_PROXY_LINKS) {
+      smsg_proxies[i] = smsg_proxy_new(link, 0);
+      if (NULL != smsg_proxies[i]) {
+	smsg_proxies[i]->task = ulapi_task_new();
+	if (NULL == smsg_proxies[i]->task ||
+	    ULAPI_OK != ulapi_task_start(smsg_proxies[i]->task, smsg_proxy_thread, smsg_proxies[i], ulapi_prio_highest(), 1)) {
+	  smsg_proxy_delete(smsg_proxies[i]);
+	  smsg_proxies[i] = NULL;
 	}
       }
-      /* else got something else */
-      RETURN(-1);
     }
   }
+  if (i < SMSG_PROXY_LINKS) proxy = smsg_proxies[i];
+  ulapi_mutex_give(smsg_proxies_mutex);
 
-  RETURN(-1);
-#undef RETURN
+  return proxy;
 }
 
-void
-smsg_message_handler_thread(void *args)
+/*
+  Asks the proxy to open a connection, with the message in
+  'smsg_outbuf', for the caller's socket 'fd'. Returns the connection's
+  number, or 0 if the proxy couldn't or didn't answer in time.
+*/
+static smsg_byte smsg_proxy_call(smsg_proxy_t * proxy, smsg_byte * smsg_outbuf, int smsg_outbuflen, smsg_proxy_kind_t kind, int fd)
 {
-  smsg_message_handler_t handler;
-  int fd;
-  void *handler_args;
-  int retval;
-
-  /* reading, decoding and unpacking smsg messages */
-  enum {READ_SIZE = 80};	/* how big a block to read */
-  char readbuf[READ_SIZE]; /* into here */
-  int readlen;			/* how many chars were read */
-  serdes_decode_state state;	/* decoder */
-  smsg_byte smsg_inbuf[SMSG_INBUFSIZE]; /* decoded and packed smsg message */
-  int smsg_inbuflen;		/* how big smsg_inbuf was decoded to be */
+  smsg_proxy_call_t *call;
+  smsg_byte connection;
+  int i;
+
+  ulapi_mutex_take(proxy->mutex);
+  for (i = 0; i < 256; i++) {
+    if (0 == ++proxy->sequence) proxy->sequence = 1;
+    if (! proxy->calls[proxy->sequence].waiting) break;
+  }
+  if (proxy->dead || i == 256) {
+    ulapi_mutex_give(proxy->mutex);
+    return 0;
+  }
+  call = &proxy->calls[proxy->sequence];
+  call->waiting = 1;
+  call->done = 0;
+  call->connection = 0;
+  call->kind = kind;
+  call->fd = fd;
+  call->deadline = ulapi_time() + SMSG_PROXY_TIMEOUT;
+  proxy->calling++;
+  smsg_message_sequence_number(smsg_outbuf) = proxy->sequence;
+  smsg_proxy_send(proxy, smsg_outbuf, smsg_outbuflen);
+  smsg_proxy_wake(proxy);
+  while (! call->done) {
+    ulapi_cond_wait(proxy->cond, proxy->mutex);
+  }
+  connection = call->connection;
+  call->waiting = 0;
+  proxy->calling--;
+  ulapi_mutex_give(proxy->mutex);
 
-  handler = ((smsg_message_handler_thread_args_t *) args)->handler;
-  fd = ((smsg_message_handler_thread_args_t *) args)->fd;
-  handler_args = ((smsg_message_handler_thread_args_t *) args)->handler_args;
-  /* this frees the memory allocated by smsg_start_message_handler */
-  my_free(args);
+  return connection;
+}
 
-#define PEXIT(r)	\
-  smsg_print_debug(SMSG_DEBUG_MSG, "Stopping message handler on fd %d with return %d\n", (int) fd, (int) r); \
-  if (fd >= 0) ulapi_socket_close(fd); \
-  ulapi_task_exit(0); \
-  return
+int
+smsg_open_proxy_link(const char *path)
+{
+  struct termios termios;
+  int fd;
 
-  /* initialize the decoder */
-  retval = serdes_decode_state_init(&state, readbuf, (char *) smsg_inbuf, READ_SIZE, SMSG_INBUFSIZE);
-  if (0 != retval) {
-    PEXIT(NULL);
+  fd = open(path, O_RDWR | O_NOCTTY);
+  if (fd < 0) return -1;
+  /* a serial device or pseudo-terminal passes bytes through as they are */
+  if (isatty(fd)) {
+    if (0 != tcgetattr(fd, &termios)) {
+      close(fd);
+      return -1;
+    }
+    cfmakeraw(&termios);
+    if (0 != tcsetattr(fd, TCSANOW, &termios)) {
+      close(fd);
+      return -1;
+    }
   }
 
-  for (;;) {
-    /* read from fd */
-    readlen = ulapi_socket_read(fd, readbuf, READ_SIZE);
-    if (0 == readlen) break;	/* end of file */
-    if (0 > readlen) break;	/* read error */
+  return fd;
+}
 
-    for (;;) {
-      smsg_inbuflen = serdes_decode(readbuf, &readlen, (char *) smsg_inbuf, &state);
-      if (0 == smsg_inbuflen) break;
-      if (0 > smsg_inbuflen) {
-	PEXIT(NULL);
-      }
+int
+smsg_close_proxy_link(int fd)
+{
+  return close(fd);
+}
 
-      /* handle message */
-      if (0 != handler(smsg_inbuf, fd, handler_args)) {
-	PEXIT(NULL);
-      }
-    } /* for (;;) to build message */
-  } /* for (;;) to read fd */
+int
+smsg_proxy_serve(int fd)
+{
+  smsg_proxy_t *proxy;
 
-  PEXIT(NULL);
-#undef PEXIT
+  proxy = smsg_proxy_new(fd, 1);
+  if (NULL == proxy) return -1;
+  smsg_print_debug(SMSG_DEBUG_CFG, "Serving proxy link on fd %d\n", fd);
+  smsg_proxy_run(proxy);
+  smsg_proxy_delete(proxy);
+
+  return 0;
 }
 
 int
-smsg_start_message_handler(smsg_message_handler_t handler, int fd, void * handler_args, void **thread_ptr)
+smsg_get_proxy_socket_fd(int fd, int port)
 {
-  void *thread;
-  smsg_message_handler_thread_args_t * args;
-  ulapi_result retval;
-
-  /* these are freed just after reference in the smsg_message_handler_thread */
-  args = my_malloc(sizeof(smsg_message_handler_thread_args_t));
-  args->handler = handler;
-  args->fd = fd;
-  args->handler_args = handler_args;
+  smsg_proxy_t *proxy;
+  smsg_open_server_connection_t open_server_connection;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  struct sockaddr_un addr;
+  int listener;
+
+  proxy = smsg_proxy_for(fd);
+  if (NULL == proxy) return -1;
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) return -1;
+  /* an address of just the family gets a unique one of its own */
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (0 != bind(listener, (struct sockaddr *) &addr, sizeof(addr.sun_family)) ||
+      0 != listen(listener, SOMAXCONN)) {
+    close(listener);
+    return -1;
+  }
 
-  thread = ulapi_task_new();
-  if (NULL == thread) {
+  open_server_connection.address = 0;
+  open_server_connection.port = port;
+  smsg_outbuflen = smsg_open_server_connection_to_message(&open_server_connection, smsg_outbuf);
+  if (0 == smsg_proxy_call(proxy, smsg_outbuf, smsg_outbuflen, SMSG_PROXY_SERVER, listener)) {
+    close(listener);
     return -1;
   }
 
-  retval = ulapi_task_start(thread,
-			    smsg_message_handler_thread,
-			    args,
-			    ulapi_prio_highest(),
-			    1);
+  return listener;
+}
 
-  if (ULAPI_OK != retval) {
-    if (NULL != handler_args) {
-      my_free(handler_args);
-    }
-  } else {
-    if (NULL != thread_ptr) {
-      *thread_ptr = thread;
-    }
+int
+smsg_get_proxy_server_fd(int fd, char *hostname, smsg_port port)
+{
+  smsg_proxy_t *proxy;
+  smsg_open_client_connection_t open_client_connection;
+  smsg_byte smsg_outbuf[SMSG_MAX_MESSAGE_SIZE];
+  int smsg_outbuflen;
+  int fds[2];
+
+  proxy = smsg_proxy_for(fd);
+  if (NULL == proxy) return -1;
+
+  /* the component's not on the network, so the name has to be one it knows */
+  if (0 == strcmp(hostname, "localhost")) hostname = "127.0.0.1";
+  open_client_connection.address = inet_addr(hostname);
+  if (INADDR_NONE == open_client_connection.address) return -1;
+  open_client_connection.port = port;
+
+  if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) return -1;
+  smsg_outbuflen = smsg_open_client_connection_to_message(&open_client_connection, smsg_outbuf);
+  if (0 == smsg_proxy_call(proxy, smsg_outbuf, smsg_outbuflen, SMSG_PROXY_STREAM, fds[0])) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
   }
 
-  return retval;
+  return fds[1];
+}
+
+#else
+
+int
+smsg_open_proxy_link(const char *path)
+{
+  return -1;
+}
+
+int
+smsg_close_proxy_link(int fd)
+{
+  return -1;
+}
+
+int
+smsg_proxy_serve(int fd)
+{
+  return -1;
+}
+
+int
+smsg_get_proxy_socket_fd(int fd, int port)
+{
+  return -1;
+}
+
+int
+smsg_get_proxy_server_fd(int fd, char *hostname, smsg_port port)
+{
+  return -1;
 }
 
+#endif	/* HAVE_SMSG_PROXY */
+
 static smsg_byte smsg_node_id = 1;
 static smsg_byte smsg_subsystem_id = 1;
 
@@ -66,7 +66,23 @@ enum {
   SMSG_CODE_RETURN_SERVER_CONNECTION = 11,
   SMSG_CODE_CLOSE_SERVER_CONNECTION = 12,
   SMSG_CODE_QUERY_TEST = 13,
-  SMSG_CODE_REPORT_TEST = 14
+  SMSG_CODE_REPORT_TEST = 14,
+  SMSG_CODE_QUERY_MATCHREG = 15,
+  SMSG_CODE_REPORT_MATCHREG = 16,
+  SMSG_CODE_QUERY_ONEREG = 17,
+  SMSG_CODE_QUERY_WAITREG = 18,
+  SMSG_CODE_QUERY_STATS = 19,
+  SMSG_CODE_REPORT_STATS = 20,
+  SMSG_CODE_REQUEST_UNREG = 21,
+  SMSG_CODE_QUERY_MULTIREG = 22,
+  SMSG_CODE_QUERY_CACHEREG = 23,
+  SMSG_CODE_REPORT_CHANGE = 24,
+  SMSG_CODE_REQUEST_SUBSCRIBE = 25,
+  SMSG_CODE_REQUEST_UNSUBSCRIBE = 26,
+  SMSG_CODE_ACCEPT_CONNECTION = 27,
+  SMSG_CODE_CONNECTION_DATA = 28,
+  SMSG_CODE_OPEN_RING = 29,
+  SMSG_CODE_RETURN_RING = 30
 };
 
 extern const char *smsg_id_to_string(int id);
@@ -86,6 +102,9 @@ typedef unsigned int smsg_port;	/* e.g., 11601 */
 /* Returns the identifier. */
 #define smsg_message_identifier(msg) (*((smsg_byte *) msg))
 
+/* every message has its sequence number next */
+#define smsg_message_sequence_number(msg) (((smsg_byte *) (msg))[1])
+
 /*
   Request dynamic registration of this component.
 
@@ -165,6 +184,308 @@ typedef struct {
 extern int smsg_message_to_report_allreg(smsg_byte *msg, smsg_report_allreg_t *smsg_msg);
 extern int smsg_report_allreg_to_message(smsg_report_allreg_t *smsg_msg, smsg_byte *msg);
 
+/*
+  Query for all components that match some of the ids, e.g., all
+  instances of one component on any node, or everything in a
+  subsystem. The mask says which ids must match; the others are
+  wildcards. A mask of SMSG_MATCH_ALL is an exact query.
+
+  [15] [seq] [mask] [component id] [instance id] [node id] [subsystem id]
+*/
+enum {
+  SMSG_MATCH_COMPONENT = 0x1,
+  SMSG_MATCH_INSTANCE = 0x2,
+  SMSG_MATCH_NODE = 0x4,
+  SMSG_MATCH_SUBSYSTEM = 0x8,
+  SMSG_MATCH_ALL = 0xF
+};
+
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte mask;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_query_matchreg_t;
+
+extern int smsg_message_to_query_matchreg(smsg_byte *msg, smsg_query_matchreg_t *smsg_msg);
+extern int smsg_query_matchreg_to_message(smsg_query_matchreg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  One registration, as carried in multi-entry reports.
+
+  [component id] [instance id] [node id] [subsystem id] [address] [port]
+*/
+typedef struct {
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+  smsg_addr address;
+  smsg_port port;
+} smsg_reg_entry_t;
+
+/*
+  The matches for a QUERY_MATCHREG, streamed as a series of these
+  reports with up to SMSG_MATCHREG_ENTRIES each. All but the last have
+  'more' set. No matches is a single report with a count of 0.
+
+  [16] [seq] [more] [count] [entry] ... count entries
+*/
+enum {SMSG_MATCHREG_ENTRIES = 8};
+
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte more;		/* non-zero if more reports follow */
+  smsg_byte count;		/* how many entries in this report */
+  smsg_reg_entry_t entries[SMSG_MATCHREG_ENTRIES];
+} smsg_report_matchreg_t;
+
+extern int smsg_message_to_report_matchreg(smsg_byte *msg, smsg_report_matchreg_t *smsg_msg);
+extern int smsg_report_matchreg_to_message(smsg_report_matchreg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Broadcast query for one component, from a node manager that doesn't
+  know it. Only the node manager the component registered with
+  answers, with a broadcast REPORT_ALLREG that every node manager can
+  take; the others stay silent.
+
+  [17] [seq] [component id] [instance id] [node id] [subsystem id]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_query_onereg_t;
+
+extern int smsg_message_to_query_onereg(smsg_byte *msg, smsg_query_onereg_t *smsg_msg);
+extern int smsg_query_onereg_to_message(smsg_query_onereg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Query for a component that may not have registered yet. If the node
+  manager doesn't know it, it holds on to the query and sends the
+  REPORT_DYNREG as soon as the component registers with it or is
+  reported by another node manager, or an empty one after 'timeout'
+  milliseconds, whichever comes first.
+
+  [18] [seq] [component id] [instance id] [node id] [subsystem id] [timeout]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+  smsg_uint timeout;		/* milliseconds */
+} smsg_query_waitreg_t;
+
+extern int smsg_message_to_query_waitreg(smsg_byte *msg, smsg_query_waitreg_t *smsg_msg);
+extern int smsg_query_waitreg_to_message(smsg_query_waitreg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Query for a node manager's statistics, answered with a REPORT_STATS.
+
+  [19] [seq]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+} smsg_query_stats_t;
+
+extern int smsg_message_to_query_stats(smsg_byte *msg, smsg_query_stats_t *smsg_msg);
+extern int smsg_query_stats_to_message(smsg_query_stats_t *smsg_msg, smsg_byte *msg);
+
+/*
+  A node manager's statistics since it started: the counters, which
+  wrap around, the size of its database, and a summary of each of its
+  latency histograms, in microseconds. A percentile is the top of the
+  histogram bucket it falls in, which is at most an eighth above it.
+
+  [20] [seq] [counter] ... SMSG_STATS_COUNTERS [db size]
+       [count] [p50] [p90] [p99] [max] ... SMSG_STATS_LATENCIES
+*/
+enum {
+  SMSG_STATS_REGISTRATIONS,	/* REQUEST_DYNREGs */
+  SMSG_STATS_QUERIES,		/* QUERY_DYNREGs, CACHEREGs, WAITREGs, MATCHREGs, MULTIREG keys and subscriptions */
+  SMSG_STATS_MISSES,		/* DYNREGs, CACHEREGs, WAITREGs and keys not in the database */
+  SMSG_STATS_TIMEOUTS,		/* WAITREGs that ran out of time */
+  SMSG_STATS_BROADCASTS_SENT,	/* to other node managers */
+  SMSG_STATS_BROADCASTS_RECEIVED,
+  SMSG_STATS_DECODE_ERRORS,	/* input that couldn't be decoded */
+  SMSG_STATS_COUNTERS
+};
+
+enum {
+  SMSG_STATS_REGISTER,		/* to answer a REQUEST_DYNREG */
+  SMSG_STATS_QUERY,		/* to answer a query from the database */
+  SMSG_STATS_WAIT,		/* to answer a WAITREG that was parked */
+  SMSG_STATS_LATENCIES
+};
+
+typedef struct {
+  smsg_uint count;
+  smsg_uint p50;
+  smsg_uint p90;
+  smsg_uint p99;
+  smsg_uint max;
+} smsg_latency_t;
+
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_uint counters[SMSG_STATS_COUNTERS];
+  smsg_uint db_size;
+  smsg_latency_t latencies[SMSG_STATS_LATENCIES];
+} smsg_report_stats_t;
+
+extern int smsg_message_to_report_stats(smsg_byte *msg, smsg_report_stats_t *smsg_msg);
+extern int smsg_report_stats_to_message(smsg_report_stats_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Request to drop a component's registration, answered with a
+  REPLY_DYNREG carrying the address and port it had, or 0s if it
+  wasn't registered with this node manager.
+
+  [21] [seq] [component id] [instance id] [node id] [subsystem id]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_request_unreg_t;
+
+extern int smsg_message_to_request_unreg(smsg_byte *msg, smsg_request_unreg_t *smsg_msg);
+extern int smsg_request_unreg_to_message(smsg_request_unreg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Query for many components at once, by their exact ids. Answered
+  with the REPORT_MATCHREG stream, one entry per key in the order
+  asked, with an address and port of 0 for any that aren't known.
+
+  [22] [seq] [count] [key] ... count keys
+*/
+enum {SMSG_MULTIREG_KEYS = 32};
+
+typedef struct {
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_reg_key_t;
+
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte count;		/* how many keys */
+  smsg_reg_key_t keys[SMSG_MULTIREG_KEYS];
+} smsg_query_multireg_t;
+
+extern int smsg_message_to_query_multireg(smsg_byte *msg, smsg_query_multireg_t *smsg_msg);
+extern int smsg_query_multireg_to_message(smsg_query_multireg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Query for one component, as QUERY_DYNREG, from a client that caches
+  what it finds. A node manager that can tell the client when the
+  component is added or dropped answers with a REPORT_CHANGE, and
+  pushes it another with each change for as long as the connection
+  lasts. One that can't answers with a REPORT_DYNREG, which the client
+  doesn't cache.
+
+  [23] [seq] [component id] [instance id] [node id] [subsystem id]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_query_cachereg_t;
+
+extern int smsg_message_to_query_cachereg(smsg_byte *msg, smsg_query_cachereg_t *smsg_msg);
+extern int smsg_query_cachereg_to_message(smsg_query_cachereg_t *smsg_msg, smsg_byte *msg);
+
+/*
+  A component's registration as it is now, in answer to a
+  QUERY_CACHEREG, or pushed with a sequence number of 0 when it's
+  added or dropped, to clients that cache it or subscribe to it. The change is SMSG_CHANGE_ADD if it's registered,
+  with its address and port, or SMSG_CHANGE_REMOVE with 0s if not.
+
+  [24] [seq] [change] [component id] [instance id] [node id] [subsystem id] [address] [port]
+*/
+enum {
+  SMSG_CHANGE_ADD = 1,
+  SMSG_CHANGE_REMOVE = 2
+};
+
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte change;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+  smsg_addr address;
+  smsg_port port;
+} smsg_report_change_t;
+
+extern int smsg_message_to_report_change(smsg_byte *msg, smsg_report_change_t *smsg_msg);
+extern int smsg_report_change_to_message(smsg_report_change_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Request to be pushed a REPORT_CHANGE whenever a component matching
+  the ids is added or dropped, for as long as the connection lasts.
+  The mask says which ids must match, as for QUERY_MATCHREG. A node
+  manager that can push to the client answers with the REPORT_MATCHREG
+  stream of what matches now, and one that can't with an empty
+  REPORT_DYNREG.
+
+  [25] [seq] [mask] [component id] [instance id] [node id] [subsystem id]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte mask;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_request_subscribe_t;
+
+extern int smsg_message_to_request_subscribe(smsg_byte *msg, smsg_request_subscribe_t *smsg_msg);
+extern int smsg_request_subscribe_to_message(smsg_request_subscribe_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Request to stop a subscription, with the same mask and ids it was
+  made with. Answered with a REPLY_DYNREG of the ids, with 0s for the
+  address and port.
+
+  [26] [seq] [mask] [component id] [instance id] [node id] [subsystem id]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte mask;
+  smsg_byte component_id;
+  smsg_byte instance_id;
+  smsg_byte node_id;
+  smsg_byte subsystem_id;
+} smsg_request_unsubscribe_t;
+
+extern int smsg_message_to_request_unsubscribe(smsg_byte *msg, smsg_request_unsubscribe_t *smsg_msg);
+extern int smsg_request_unsubscribe_to_message(smsg_request_unsubscribe_t *smsg_msg, smsg_byte *msg);
+
 /* message equivalent to opening a socket connection to a server as a client */
 typedef struct {
   /* the destination ids will be filled in by the sender, and put
@@ -188,6 +509,16 @@ typedef struct {
 extern int smsg_message_to_return_client_connection(smsg_byte *msg, smsg_return_client_connection_t *smsg_msg);
 extern int smsg_return_client_connection_to_message(smsg_return_client_connection_t *smsg_msg, smsg_byte *msg);
 
+/* message equivalent of closing a client's file descriptor, from either end */
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte connection;
+} smsg_close_client_connection_t;
+
+extern int smsg_message_to_close_client_connection(smsg_byte *msg, smsg_close_client_connection_t *smsg_msg);
+extern int smsg_close_client_connection_to_message(smsg_close_client_connection_t *smsg_msg, smsg_byte *msg);
+
 /* message equivalent to opening a socket connection as a server to await clients */
 typedef struct {
   smsg_byte identifier;
@@ -209,6 +540,77 @@ typedef struct {
 extern int smsg_message_to_return_server_connection(smsg_byte *msg, smsg_return_server_connection_t *smsg_msg);
 extern int smsg_return_server_connection_to_message(smsg_return_server_connection_t *smsg_msg, smsg_byte *msg);
 
+/* message equivalent of closing a server's listening file descriptor */
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte connection;
+} smsg_close_server_connection_t;
+
+extern int smsg_message_to_close_server_connection(smsg_byte *msg, smsg_close_server_connection_t *smsg_msg);
+extern int smsg_close_server_connection_to_message(smsg_close_server_connection_t *smsg_msg, smsg_byte *msg);
+
+/* message equivalent of accepting a client on a server connection */
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte server;		/* the server connection it came in on */
+  smsg_byte connection;		/* the client's, new */
+} smsg_accept_connection_t;
+
+extern int smsg_message_to_accept_connection(smsg_byte *msg, smsg_accept_connection_t *smsg_msg);
+extern int smsg_accept_connection_to_message(smsg_accept_connection_t *smsg_msg, smsg_byte *msg);
+
+/* how many bytes of a connection's stream go in one message */
+enum {SMSG_CONNECTION_DATA = 64};
+
+/*
+  Message equivalent of reading or writing a file descriptor, carrying
+  the next piece of a connection's byte stream.
+
+  [28] [seq] [connection] [length] [length bytes of data]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte connection;
+  smsg_byte length;
+  smsg_byte data[SMSG_CONNECTION_DATA];
+} smsg_connection_data_t;
+
+extern int smsg_message_to_connection_data(smsg_byte *msg, smsg_connection_data_t *smsg_msg);
+extern int smsg_connection_data_to_message(smsg_connection_data_t *smsg_msg, smsg_byte *msg);
+
+/*
+  Asks the server on a local connection to take the rest of it over
+  the shared-memory rings set up at 'key'.
+
+  [29] [seq] [key]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_uint key;
+} smsg_open_ring_t;
+
+extern int smsg_message_to_open_ring(smsg_byte *msg, smsg_open_ring_t *smsg_msg);
+extern int smsg_open_ring_to_message(smsg_open_ring_t *smsg_msg, smsg_byte *msg);
+
+/*
+  The server's answer, 0 if it's now reading the rings, otherwise
+  non-zero and the connection carries on as a socket.
+
+  [30] [seq] [status]
+*/
+typedef struct {
+  smsg_byte identifier;
+  smsg_byte sequence_number;
+  smsg_byte status;
+} smsg_return_ring_t;
+
+extern int smsg_message_to_return_ring(smsg_byte *msg, smsg_return_ring_t *smsg_msg);
+extern int smsg_return_ring_to_message(smsg_return_ring_t *smsg_msg, smsg_byte *msg);
+
 /* a request for the test message */
 typedef struct {
   smsg_byte identifier;
@@ -271,12 +673,102 @@ typedef struct {
   int fd;			/* what port the proxy is using, if any */
 } component_entry_t;
 
+/*
+  An unchanging copy of the database at one moment, shared by everyone
+  who asks for one until the database changes. Read 'count' entries
+  from 'entries' freely, without the database mutex, then release it.
+*/
 typedef struct {
-  void *mutex;
   component_entry_t *entries;
-  int size;
+  int count;
+  unsigned int generation;	/* of the database it copies */
+  int refs;			/* holders, guarded by the database mutex */
+} component_snapshot_t;
+
+/* links for the secondary indexes, one per entry */
+typedef struct {
+  int component_next;		/* next entry with this component id, or -1 */
+  int component_prev;
+  int subsystem_next;		/* next entry with this subsystem id, or -1 */
+  int subsystem_prev;
+} component_link_t;
+
+/*
+  Entries are kept in fixed-size segments that are never moved once
+  allocated, found through a fixed directory of segment pointers, so
+  growing the database never copies them. Slots aren't stable, though:
+  removing an entry moves the last one into its slot, so an index or
+  slot is only good while the shard's mutex is held. Segments come from
+  an arena of blocks of several segments each, with the block size
+  doubling up to DB_ARENA_SEGMENTS as the database grows.
+
+  Within a segment the entries are split into arrays by field, so that
+  scans over the packed 32-bit keys touch nothing else and can compare
+  several keys at once.
+*/
+enum {
+  DB_SEGMENT_ENTRIES = 64,	/* entries per segment, a power of two */
+  DB_SEGMENTS = 256,		/* most segments in a shard's directory */
+  DB_ARENA_SEGMENTS = 16,	/* most segments allocated at once */
+  DB_SHARD_ENTRIES = DB_SEGMENTS * DB_SEGMENT_ENTRIES, /* most in a shard */
+  DB_SHARDS = 16		/* shards, by subsystem id */
+};
+
+typedef struct {
+  smsg_uint keys[DB_SEGMENT_ENTRIES]; /* the four ids, packed */
+  smsg_addr addresses[DB_SEGMENT_ENTRIES];
+  unsigned short ports[DB_SEGMENT_ENTRIES]; /* TCP ports are 16 bits */
+  int fds[DB_SEGMENT_ENTRIES];
+  component_link_t links[DB_SEGMENT_ENTRIES];
+} component_segment_t;
+
+/*
+  The entries for subsystem ids s, s + DB_SHARDS, s + 2 DB_SHARDS, ...
+  go in shard s, which has its own mutex, segments and indexes, so
+  that changes in one subsystem don't hold up lookups in another.
+  Writers also bump the sequence number before and after each change,
+  so that lookups can go without the mutex and retry if they overlap
+  a change.
+*/
+typedef struct {
+  void *mutex;
+  volatile unsigned int sequence; /* odd while the shard is being changed */
+  component_segment_t *segments[DB_SEGMENTS]; /* the segment directory */
+  void *blocks[DB_SEGMENTS];	/* the arena blocks they came from */
+  int segment_count;
+  int block_count;
+  int size;			/* entries there's room for */
   int index;
+  /* secondary indexes, lists of entries threaded through their links */
+  int component_head[UCHAR_MAX + 1]; /* first entry for each component id */
+  int subsystem_head[(UCHAR_MAX + 1) / DB_SHARDS]; /* by subsystem id / DB_SHARDS */
+} component_shard_t;
+
+/*
+  Operations on one subsystem take just its shard's mutex. Those that
+  span shards, like snapshots and the store's compaction, copy one
+  shard at a time and start over if anything changed meanwhile. Adds by
+  fd take 'fd_mutex' before any shard's. The database 'mutex' guards
+  what the shards share, and is taken after any shard mutexes, never
+  before.
+
+  Entry indexes run from 0 to one less than db_size, through the
+  shards in order, so a change in one shard shifts the indexes of
+  those after it.
+*/
+typedef struct {
+  void *mutex;
+  void *compact_mutex;		/* one compaction at a time, taken before all others */
+  void *fd_mutex;		/* taken by adds by fd, before any shard's */
+  component_shard_t shards[DB_SHARDS];
   smsg_port port;
+  char *store_path;		/* the on-disk entry file, if any */
+  int log_fd;			/* its write-ahead log, or -1 */
+  int log_count;		/* records logged since the last compaction */
+  int shm_id;			/* the published registry's segment, or -1 */
+  void *shm_table;		/* its address */
+  unsigned int generation;	/* bumped on each change */
+  component_snapshot_t *snapshot; /* the latest, if still current */
 } component_db_t;
 
 extern int
@@ -330,11 +822,124 @@ extern int
 db_lookup(component_db_t *db, int index, component_entry_t *entry);
 
 /*
-  Returns index of last entry, -1 if empty
+  Returns index of last entry, -1 if empty. The indexes run from 0 to
+  db_size() - 1 with no gaps, though a change may move an entry to
+  another index, or shrink them, between calls.
 */
 extern int
 db_last(component_db_t *db);
 
+/*
+  Returns how many entries there are.
+*/
+extern int
+db_size(component_db_t *db);
+
+/*
+  Returns a consistent copy of the whole database, or NULL if there's
+  no memory for one. Taking it costs one pass under the mutex, and
+  only if the database changed since the last one was taken. Pass it
+  to db_snapshot_release when done.
+*/
+extern component_snapshot_t *
+db_snapshot(component_db_t *db);
+
+extern void
+db_snapshot_release(component_db_t *db, component_snapshot_t *snapshot);
+
+/*
+  Returns a copy of the entries whose ids match those in 'pattern' for
+  each SMSG_MATCH_ bit set in 'mask', or NULL if there's no memory.
+  Queries on component or subsystem id use the secondary indexes
+  rather than scanning the database. Pass the result to
+  db_snapshot_release when done.
+*/
+extern component_snapshot_t *
+db_match(component_db_t *db, component_entry_t *pattern, int mask);
+
+/*
+  Fill in entry.component,instance,node,subsystem_id and pass pointer.
+  If it's in the DB, it's removed, the rest of 'entry' is filled in and
+  the non-negative index it had is returned. The last entry is moved
+  into the vacated index. Otherwise, a negative value is returned and
+  entry is left alone.
+*/
+extern int
+db_remove(component_db_t *db, component_entry_t *entry);
+
+/*
+  Keep the database in the file at 'path', with a write-ahead log of
+  changes kept alongside it in 'path' with ".wal" appended. Any entries
+  already stored there are loaded first, so a restarted node manager
+  comes back with the database it had. Returns the number of entries
+  loaded, or -1 on error, in which case the database carries on
+  without a store.
+*/
+extern int
+db_open_store(component_db_t *db, const char *path);
+
+/*
+  Rewrite the entry file from the database and empty the write-ahead
+  log. This can be called at any time. Returns 0 if OK, otherwise -1.
+*/
+extern int
+db_compact_store(component_db_t *db);
+
+/*
+  Compact the store if enough changes have been logged since it last
+  was. Changes don't compact it themselves, so this should be called
+  every so often, from a thread that can wait for the entry file to be
+  written, as the node manager does. Returns 0 if OK, otherwise -1.
+*/
+extern int
+db_compact_store_due(component_db_t *db);
+
+/*
+  Compact and stop using the store. Returns 0 if OK, otherwise -1.
+*/
+extern int
+db_close_store(component_db_t *db);
+
+/*
+  The node manager publishes its database in shared memory, so that
+  components on its host can look up others without a round trip to
+  the node manager. The registry is a hash table of SMSG_SHM_ENTRIES
+  keys, written only by the node manager under a sequence lock: the
+  sequence is odd while a change is in progress, and readers retry if
+  it changed while they looked. Only the node manager can write it;
+  components attach it read-only, only if the node manager answering
+  on the local socket made it, and stop trusting it if the node
+  manager hasn't marked it alive for SMSG_SHM_STALE seconds. Entries
+  that don't fit, or a node manager that isn't publishing, just mean a
+  miss, and the lookup goes to the node manager as usual.
+*/
+enum {SMSG_SHM_KEY = SMSG_PORT};
+enum {SMSG_SHM_ENTRIES = 4096};	/* must be a power of two */
+enum {SMSG_SHM_BEAT = 1};	/* seconds between heartbeats */
+enum {SMSG_SHM_STALE = 3};	/* seconds before a quiet registry is ignored */
+
+/*
+  Publish the database in the shared memory with this 'key', and keep
+  it up to date with each change. Returns 0 if OK, 1 if the key is held
+  by a segment that can't be removed, such as another user's, otherwise
+  -1.
+*/
+extern int
+db_open_shm(component_db_t *db, int key);
+
+/*
+  Mark the published database alive, which should be done every
+  SMSG_SHM_BEAT seconds. Returns 0 if OK, otherwise -1.
+*/
+extern int
+db_beat_shm(component_db_t *db);
+
+/*
+  Stop publishing the database. Returns 0 if OK, otherwise -1.
+*/
+extern int
+db_close_shm(component_db_t *db);
+
 /*!
   \defgroup Dynamic Registration
 
@@ -498,17 +1103,238 @@ typedef void *(*start_routine)(void *);
 extern int
 smsg_start_message_handler(smsg_message_handler_t handler, int fd, void *args, void **thread_ptr);
 
-/* convenience function for sending a message and returning the first response */
-extern int smsg_send_and_recv(int proxy_fd, smsg_byte *smsg_msgout, smsg_byte *smsg_outbuf, smsg_byte *writebuf, int writebufsize, smsg_byte *readbuf, int readbufsize, serdes_decode_state *state, smsg_byte *smsg_inbuf, int smsg_inbufsize, smsg_byte *smsg_msgin);
+/* how many messages the message handler threads couldn't decode */
+extern smsg_uint
+smsg_get_decode_errors(void);
+
+/*
+  io_uring rings, where the platform has them. smsg_uring_new returns
+  a ring for 'entries' requests at a time, with 'buffers' receive
+  buffers of 'buffer_size' each, or NULL if there's no io_uring. The
+  accept and receive are multishot, staying armed until an event comes
+  back without 'more' set. The 'tag' comes back with each event; it
+  must be NULL or aligned like anything malloc'd, since its low bits
+  carry the type. Requests are submitted by the next smsg_uring_wait,
+  which returns how many events it filled in, or -1 on error.
+*/
+
+enum {
+  SMSG_URING_ACCEPT = 1,	/* 'result' is the new client's fd */
+  SMSG_URING_RECV,		/* 'result' is the length in 'buf', 0 at end of file */
+  SMSG_URING_SEND		/* 'result' is how much was sent */
+};
+
+enum {
+  SMSG_URING_BUFFERS = 64,	/* receive buffers per ring, by default */
+  SMSG_URING_BUFFER_SIZE = 4096	/* and their size */
+};
+
+typedef struct {
+  int type;			/* SMSG_URING_ACCEPT, RECV, SEND */
+  void *tag;			/* as given with the request */
+  int result;			/* as above, or -errno */
+  int more;			/* non-zero if a multishot request is still armed */
+  char *buf;			/* the received data, or NULL */
+  int buf_id;			/* to hand 'buf' back with smsg_uring_release */
+} smsg_uring_event_t;
+
+extern void *
+smsg_uring_new(int entries, int buffers, int buffer_size);
+
+extern void
+smsg_uring_delete(void *ring);
+
+extern int
+smsg_uring_accept(void *ring, int fd, void *tag);
+
+extern int
+smsg_uring_recv(void *ring, int fd, void *tag);
+
+/* 'buf' must stay put until the send's event comes back */
+extern int
+smsg_uring_send(void *ring, int fd, const void *buf, int len, void *tag);
 
-/* called by nonse to get proxy to open a socket */
+extern int
+smsg_uring_wait(void *ring, smsg_uring_event_t *events, int max);
+
+extern void
+smsg_uring_release(void *ring, int buf_id);
+
+/* turns io_uring on for message handlers; returns -1 if there's none */
+extern int
+smsg_set_io_uring(int on);
+
+extern int
+smsg_get_io_uring(void);
+
+/*
+  Sends the 'smsg_outbuflen' bytes packed in 'smsg_outbuf' on 'fd' and
+  gets the first message back with the same sequence number into
+  'smsg_inbuf', which must hold SMSG_INBUFSIZE, passing over any others.
+  Nothing else may be reading 'fd' meanwhile. On a socket, what comes
+  after the reply is left unread, but on other fds it may be lost, so
+  connections that carry more than one call at a time should use the
+  RPC calls below instead. Returns the reply's length, or -1 on error
+  or if 'timeout' seconds go by first, when it's > 0, or if there's no
+  way to wait that long on this platform.
+*/
+extern int
+smsg_send_and_recv(int fd, smsg_byte *smsg_outbuf, int smsg_outbuflen, smsg_byte *smsg_inbuf, double timeout);
+
+/*
+  Proxy links. Each connection a component makes through the proxy
+  gets a number, handed out by the proxy, and each piece of its stream
+  goes over the link in a CONNECTION_DATA message tagged with it, so
+  any number share the link. At either end a connection is a socket,
+  so the component reads and writes it, or accepts from it, as usual.
+
+  Both ends take turns among their connections, sending one piece
+  from each that has anything before another from any, so a busy one
+  can't keep the others off the link. What a turn sends goes in one
+  write. Connections are only read while the link's keeping up, and
+  what's come for a connection waits in its own queue until its socket
+  takes it, up to SMSG_PROXY_QUEUE_MAX, past which it's closed.
+
+  The component talks to the node manager over a connection too, to
+  the proxy's own SMSG_PORT, whose fd is then the proxy fd given to
+  smsg_register_component and the rest.
+*/
+enum {
+  SMSG_PROXY_READ_SIZE = 4096,
+  SMSG_PROXY_HIGH = 4096,	/* queued for the link before connections wait */
+  SMSG_PROXY_QUEUE_MAX = 1 << 16, /* most queued for one connection */
+  SMSG_PROXY_LINKS = 8,		/* most links a component can use at once */
+  SMSG_PROXY_TIMEOUT = 5	/* how long to wait on the proxy, in seconds */
+};
+
+/* opens a serial device or pseudo-terminal as a proxy link, raw; returns its fd, or -1 */
+extern int
+smsg_open_proxy_link(const char *path);
+
+extern int
+smsg_close_proxy_link(int fd);
+
+/*
+  Serves the proxy's end of the link 'fd', opening the connections the
+  component asks for. Returns when the link goes, or -1 right away if
+  there's no proxying on this platform.
+*/
+extern int
+smsg_proxy_serve(int fd);
+
+/*
+  Called by the component on its end of the link 'fd' to have the
+  proxy serve 'port'. Returns a listening socket to accept clients
+  from, or -1 on error.
+*/
 extern int
 smsg_get_proxy_socket_fd(int fd, int port);
 
-/* called by proxy client to set up connection via proxy */
+/*
+  Called by the component on its end of the link 'fd' to connect to
+  'hostname', an address in dots or "localhost", on 'port', through
+  the proxy. Returns the connected socket, or -1 on error.
+*/
 extern int
 smsg_get_proxy_server_fd(int fd, char *hostname, smsg_port port);
 
+/*
+  Local sockets. Components on the same host, and the node manager,
+  can reach each other over AF_UNIX stream sockets instead of TCP
+  loopback. The socket for a port is named for it, SMSG_LOCAL_NAME
+  with the port, in the abstract namespace on Linux and otherwise as
+  a file in SMSG_LOCAL_DIR, so anything that gives a port, such as a
+  registration reply, gives the local socket too. A server that wants
+  local clients listens on both.
+*/
+#define SMSG_LOCAL_NAME "smsg.%d"
+#define SMSG_LOCAL_DIR "/tmp"
+
+/* returns a listening local socket for 'port', to accept clients from, or -1 */
+extern int
+smsg_get_local_server_fd(smsg_port port);
+
+/* returns a socket connected to the local socket for 'port', or -1 if nothing's there */
+extern int
+smsg_get_local_client_fd(smsg_port port);
+
+/*
+  Connects to 'port' at 'address', over the local socket if the
+  address is this host's and something's listening on it, otherwise
+  over TCP. Returns the connected socket, or -1 on error.
+*/
+extern int
+smsg_get_client_fd(smsg_addr address, smsg_port port);
+
+/*
+  Fills in the process, user and group ids of the peer on the local
+  socket 'fd', as the kernel has them. Returns 0, or -1 if 'fd' isn't
+  a local socket or there's no way to tell.
+*/
+extern int
+smsg_get_peer_credentials(int fd, int *pid, int *uid, int *gid);
+
+/*
+  Shared-memory rings. A connection over a local socket can carry its
+  messages in shared memory instead, a ring each way with one writer
+  and one reader, which takes no system calls while both ends are
+  busy. Messages go in packed, as they come from the _to_message
+  functions, each after its length, so there's no encoding either.
+  A reader that finds its ring empty for a while sleeps on a futex,
+  and the writer only wakes it if it's asleep; likewise a writer that
+  finds its ring full.
+
+  The client makes a segment only its own user can attach and sends
+  OPEN_RING over the socket, and the server's message handler thread
+  attaches to it, checking that it was made by the process at the other
+  end of the socket, then answers and hands what comes in the ring to
+  the same handler. The client removes the segment once the server's
+  attached, so it goes away with the connection. Servers running as
+  another user can't attach, and the connection stays on the socket.
+  The socket stays open, and its closing closes the rings. Servers
+  need do nothing to take rings but send with smsg_send, so clients
+  can choose them by calling smsg_set_shm_rings, after which every
+  local connection from smsg_get_client_fd gets them if the server's
+  willing. Connections with rings can't be used with smsg_rpc_open.
+*/
+enum {
+  SMSG_RING_KEY = 0x53000000,	/* segments' keys start here, plus the process id and a count */
+  SMSG_RING_SIZE = 1 << 16,	/* bytes in each ring, a power of two */
+  SMSG_RING_SPINS = 1000,	/* times to look at an empty or full ring before sleeping, with more than one processor */
+  SMSG_RING_FDS = 1024		/* connections on fds past this don't get rings */
+};
+
+/* turns rings on for the local connections smsg_get_client_fd makes; returns -1 if there are none */
+extern int
+smsg_set_shm_rings(int on);
+
+extern int
+smsg_get_shm_rings(void);
+
+/*
+  Sets up rings on the local connection 'fd', before any messages go
+  over it. Returns 0, or -1 if the server's not willing or there's no
+  way to, in which case the socket carries on as it was.
+*/
+extern int
+smsg_open_ring(int fd);
+
+/*
+  Closes the rings on 'fd', if it has any, waiting for its handler
+  thread's reader; the message handler thread does this when the
+  socket closes, otherwise call it before closing 'fd' yourself.
+*/
+extern void
+smsg_close_ring(int fd);
+
+/*
+  Sends the 'smsg_outbuflen' bytes packed in 'smsg_outbuf' on 'fd',
+  over its rings if it has them, otherwise encoded on the socket.
+  Returns 0, or -1 on error.
+*/
+extern int
+smsg_send(int fd, smsg_byte *smsg_outbuf, int smsg_outbuflen);
+
 /* get a broadcast port */
 extern int
 smsg_get_broadcast_fd(void);
@@ -527,6 +1353,14 @@ smsg_register_component(int fd, /* if >= 0, the proxy fd */
 			smsg_addr *host_addr, /* filled in with host */
 			smsg_port *component_port); /* filled in with port */
 
+/* called by client to drop its registration with the node manager */
+extern int
+smsg_unregister_component(int fd, /* if >= 0, the proxy fd */
+			  smsg_byte component_id,
+			  smsg_byte instance_id,
+			  smsg_byte node_id,
+			  smsg_byte subsystem_id);
+
 /* called by client to find a component via the node manager */
 extern int
 smsg_find_component(int fd,	/* if >= 0, the proxy fd */
@@ -537,6 +1371,72 @@ smsg_find_component(int fd,	/* if >= 0, the proxy fd */
 		    smsg_addr *host_addr, /* filled in with host */
 		    smsg_port *component_port); /* filled in with port */
 
+/*
+  Called by client to find many components at once via the node
+  manager, with the ids of each in 'entries'. They're asked for
+  SMSG_MULTIREG_KEYS to a query, with the queries pipelined, so the
+  lot takes about one round trip. Fills in the address and port of
+  each one found and 0s for the rest, which don't fail the batch.
+  Returns how many were found, or -1 on error.
+*/
+extern int
+smsg_find_components(int fd,	/* if >= 0, the proxy fd */
+		     component_entry_t *entries, /* ids in, filled in with finds */
+		     int count); /* how many entries */
+
+/*
+  Called by client to find a component via the node manager, waiting
+  up to 'timeout' milliseconds for it to register if it hasn't yet.
+  Returns 0 and fills in the host address and port if it's found in
+  time, otherwise -1.
+*/
+extern int
+smsg_wait_component(int fd,	/* if >= 0, the proxy fd */
+		    smsg_byte component_id, /* what you are */
+		    smsg_byte instance_id, /* what instance */
+		    smsg_byte node_id, /* what node */
+		    smsg_byte subsystem_id, /* what subsystem */
+		    smsg_uint timeout, /* milliseconds to wait */
+		    smsg_addr *host_addr, /* filled in with host */
+		    smsg_port *component_port); /* filled in with port */
+
+/*
+  Looks up a component in the registry published by the node manager
+  on this host, without contacting it. Returns 0 and fills in the host
+  address and port if it's there, otherwise -1.
+*/
+extern int
+smsg_lookup_component(smsg_byte component_id, /* what you are */
+		      smsg_byte instance_id, /* what instance */
+		      smsg_byte node_id, /* what node */
+		      smsg_byte subsystem_id, /* what subsystem */
+		      smsg_addr *host_addr, /* filled in with host */
+		      smsg_port *component_port); /* filled in with port */
+
+/*
+  Called by client to find all components matching the ids selected by
+  'mask', as for db_match, via the node manager. Up to 'max' of them
+  are copied into 'entries'. Returns how many matched, which may be
+  more than 'max', or -1 on error.
+*/
+extern int
+smsg_match_components(int fd,	/* if >= 0, the proxy fd */
+		      smsg_byte mask, /* SMSG_MATCH_ bits to match */
+		      smsg_byte component_id,
+		      smsg_byte instance_id,
+		      smsg_byte node_id,
+		      smsg_byte subsystem_id,
+		      component_entry_t *entries, /* filled in with matches */
+		      int max);	/* room in 'entries' */
+
+/*
+  Called by client to get the node manager's statistics. Returns 0 and
+  fills in 'stats', or -1 on error.
+*/
+extern int
+smsg_query_stats(int fd,	/* if >= 0, the proxy fd */
+		 smsg_report_stats_t *stats); /* filled in */
+
 /* this union of all our messages will give us the max message size */
 typedef union {
   smsg_request_dynreg_t request_dynreg;
@@ -545,10 +1445,19 @@ typedef union {
   smsg_report_dynreg_t report_dynreg;
   smsg_query_allreg_t query_allreg;
   smsg_report_allreg_t report_allreg;
+  smsg_query_matchreg_t query_matchreg;
+  smsg_report_matchreg_t report_matchreg;
+  smsg_query_multireg_t query_multireg;
+  smsg_report_change_t report_change;
+  smsg_report_stats_t report_stats;
   smsg_open_client_connection_t open_client_connection;
   smsg_return_client_connection_t return_client_connection;
   smsg_open_server_connection_t open_server_connection;
   smsg_return_server_connection_t return_server_connection;
+  smsg_accept_connection_t accept_connection;
+  smsg_connection_data_t connection_data;
+  smsg_open_ring_t open_ring;
+  smsg_return_ring_t return_ring;
 } smsg_all_message_t;
 
 /* the max size of the packed bytes for our messages, which will be
@@ -561,6 +1470,293 @@ typedef union {
 /* how much space an encoded message will take */
 #define SMSG_WRITEBUFSIZE serdes_encode_size(SMSG_MAX_MESSAGE_SIZE)
 
+/*
+  A session keeps one connection to the node manager open for all its
+  calls, instead of connecting for each, along with its decoder state
+  and buffers. It connects on its first call. Calls on a session take
+  turns. If the node manager has gone away since the last call, the
+  call connects again and is retried once. The smsg_register_component
+  family are wrappers over a default session for the whole process,
+  or over a session on the proxy fd they're given.
+
+  Each request carries the session's next sequence number, which the
+  node manager puts on its replies, so replies are matched to their
+  requests and any to requests given up on are passed over. Batches
+  keep up to SMSG_SESSION_WINDOW requests in flight at once. Requests
+  are never numbered 0, which is for what the node manager pushes.
+
+  A session that makes its own connection caches what it looks up,
+  found or not, when the node manager promises to push it changes, and
+  before each hit it takes in any that have come. Entries also run out
+  after the times set with smsg_set_cache_ttl, and they all go when
+  the connection does, since its pushes stop with it.
+
+  A session can also subscribe to changes, up to
+  SMSG_SESSION_SUBSCRIPTIONS at once. The changes that are pushed for
+  them are queued, up to SMSG_SESSION_CHANGES, until they're taken
+  with smsg_session_change. If the queue fills, or the connection and
+  with it the subscriptions go, changes are lost, which the next
+  smsg_session_change says.
+*/
+enum {
+  SMSG_SESSION_READ_SIZE = 256,
+  SMSG_SESSION_WINDOW = 32,	/* must be less than 256 */
+  SMSG_SESSION_SUBSCRIPTIONS = 16,
+  SMSG_SESSION_CHANGES = 64
+};
+
+typedef struct {
+  int fd;			/* to the node manager, or -1 until connected */
+  int proxy;			/* non-zero if 'fd' is a proxy fd, not ours to close */
+  smsg_byte sequence;		/* of the last request */
+  void *mutex;			/* for one call at a time */
+  void *cache;			/* of lookups, or NULL if not caching */
+  smsg_byte submasks[SMSG_SESSION_SUBSCRIPTIONS]; /* of each subscription */
+  smsg_uint subkeys[SMSG_SESSION_SUBSCRIPTIONS]; /* with the wildcards 0 */
+  int subscriptions;		/* how many */
+  smsg_report_change_t changes[SMSG_SESSION_CHANGES]; /* pushed, not yet taken */
+  int changefirst;
+  int changecount;
+  int changeslost;		/* non-zero if some didn't make it */
+  smsg_report_change_t lastchange; /* the last one pushed */
+  char readbuf[SMSG_SESSION_READ_SIZE];
+  int readlen;			/* how much in 'readbuf' isn't decoded yet */
+  serdes_decode_state state;
+  smsg_byte inbuf[SMSG_INBUFSIZE];
+  smsg_byte outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[SMSG_WRITEBUFSIZE];
+} smsg_session_t;
+
+/*
+  Sets up a session to the local node manager, or over the proxy fd
+  'fd' if it's >= 0. Returns 0, or -1 on error.
+*/
+extern int
+smsg_session_open(smsg_session_t *session, int fd);
+
+/* closes the session's connection, unless it's a proxy fd */
+extern void
+smsg_session_close(smsg_session_t *session);
+
+/*
+  Sets how long, in seconds, sessions keep what they look up: 'ttl'
+  for components that were found and 'miss_ttl' for ones that weren't.
+  A time of 0 stops caching those.
+*/
+extern void
+smsg_set_cache_ttl(double ttl, double miss_ttl);
+
+/* as smsg_register_component */
+extern int
+smsg_session_register(smsg_session_t *session,
+		      smsg_byte component_id,
+		      smsg_byte instance_id,
+		      smsg_byte node_id,
+		      smsg_byte subsystem_id,
+		      smsg_addr *host_addr,
+		      smsg_port *component_port);
+
+/*
+  Drops a component's registration with the node manager. Returns 0
+  if it was registered there, otherwise -1.
+*/
+extern int
+smsg_session_unregister(smsg_session_t *session,
+			smsg_byte component_id,
+			smsg_byte instance_id,
+			smsg_byte node_id,
+			smsg_byte subsystem_id);
+
+/* as smsg_find_component */
+extern int
+smsg_session_find(smsg_session_t *session,
+		  smsg_byte component_id,
+		  smsg_byte instance_id,
+		  smsg_byte node_id,
+		  smsg_byte subsystem_id,
+		  smsg_addr *host_addr,
+		  smsg_port *component_port);
+
+/* as smsg_wait_component */
+extern int
+smsg_session_wait(smsg_session_t *session,
+		  smsg_byte component_id,
+		  smsg_byte instance_id,
+		  smsg_byte node_id,
+		  smsg_byte subsystem_id,
+		  smsg_uint timeout,
+		  smsg_addr *host_addr,
+		  smsg_port *component_port);
+
+/* as smsg_find_components */
+extern int
+smsg_session_find_batch(smsg_session_t *session,
+			component_entry_t *entries,
+			int count);
+
+/*
+  Subscribes the session to changes to components matching the ids,
+  where the mask says which must match, as for smsg_match_components.
+  Fills in 'entries' with up to 'max' that match now, and returns how
+  many there are, or -1 if the node manager can't push changes to it.
+*/
+extern int
+smsg_session_subscribe(smsg_session_t *session,
+		       smsg_byte mask,
+		       smsg_byte component_id,
+		       smsg_byte instance_id,
+		       smsg_byte node_id,
+		       smsg_byte subsystem_id,
+		       component_entry_t *entries,
+		       int max);
+
+/* stops a subscription; returns 0, or -1 if there wasn't one */
+extern int
+smsg_session_unsubscribe(smsg_session_t *session,
+			 smsg_byte mask,
+			 smsg_byte component_id,
+			 smsg_byte instance_id,
+			 smsg_byte node_id,
+			 smsg_byte subsystem_id);
+
+/*
+  Waits up to 'timeout' seconds, or for as long as it takes if it's
+  negative, for the next change to something subscribed to. Returns 1
+  with it in 'change', 0 if none came in time, or -1 if some were
+  lost, after which subscribing again gets things as they are now.
+  The session is held while waiting, so one that's waited on for long
+  is best used for that alone.
+*/
+extern int
+smsg_session_change(smsg_session_t *session,
+		    smsg_report_change_t *change,
+		    double timeout);
+
+/* as smsg_match_components */
+extern int
+smsg_session_match(smsg_session_t *session,
+		   smsg_byte mask,
+		   smsg_byte component_id,
+		   smsg_byte instance_id,
+		   smsg_byte node_id,
+		   smsg_byte subsystem_id,
+		   component_entry_t *entries,
+		   int max);
+
+/* as smsg_query_stats */
+extern int
+smsg_session_stats(smsg_session_t *session, smsg_report_stats_t *stats);
+
+/*
+  RPC, for applications using identifiers 32 through 255. An RPC
+  connection puts a sequence number that isn't already out on each
+  request it sends, and the server puts that number on its reply, as
+  reporttest does. One reader thread per connection matches replies to
+  their calls, so any number of threads can have calls out at once,
+  up to SMSG_RPC_WINDOW, past which a new call waits for one to finish.
+
+  A call with a callback is finished by the reader thread calling it.
+  One without is waited on with smsg_rpc_wait, like a future. Either
+  way the call must stay put until it's finished. A call that isn't
+  answered within its timeout is finished without a reply, and any
+  reply that comes later is passed over. Messages numbered 0, and any
+  others that don't answer a call, go to the handler given to
+  smsg_rpc_open, if there is one. If the connection goes, every call
+  out on it is finished without a reply.
+*/
+enum {
+  SMSG_RPC_WINDOW = 64,		/* must be less than 256 */
+  SMSG_RPC_READ_SIZE = 4096
+};
+
+/* how a call finished */
+enum {
+  SMSG_RPC_PENDING = 0,		/* it hasn't yet */
+  SMSG_RPC_DONE,		/* with the reply */
+  SMSG_RPC_TIMEDOUT,
+  SMSG_RPC_FAILED		/* the connection went */
+};
+
+struct smsg_rpc_call;
+
+/* called on the reader thread, which can't read more until it returns */
+typedef void (*smsg_rpc_callback_t)(struct smsg_rpc_call *call, void *callback_args);
+
+typedef struct smsg_rpc_call {
+  int status;			/* SMSG_RPC_PENDING, DONE, ... */
+  int replylen;			/* of 'reply', 0 if there's none */
+  smsg_byte reply[SMSG_INBUFSIZE];
+  smsg_rpc_callback_t callback;	/* or NULL to wait for it */
+  void *callback_args;
+  double deadline;		/* or 0 for none */
+  struct smsg_rpc_call *next;	/* while it's being called back */
+} smsg_rpc_call_t;
+
+typedef struct {
+  int fd;			/* not ours to close */
+  void *mutex;			/* for the calls */
+  void *cond;			/* for when one finishes */
+  void *writemutex;		/* for one request at a time on 'fd' */
+  void *reader;			/* the thread */
+  int wakefds[2];		/* a pipe, for waking the reader */
+  double until;			/* when the reader's next due to wake, or 0 */
+  smsg_message_handler_t handler; /* for what doesn't answer a call */
+  void *handler_args;
+  smsg_rpc_call_t *calls[256];	/* out, by sequence number */
+  int inflight;			/* how many */
+  smsg_byte sequence;		/* of the last request */
+  int closing;
+  int dead;			/* non-zero once the connection's gone */
+  smsg_byte outbuf[SMSG_MAX_MESSAGE_SIZE];
+  char writebuf[SMSG_WRITEBUFSIZE];
+} smsg_rpc_t;
+
+/*
+  Starts RPC on the connected 'fd', which the RPC's reader thread is
+  then the only one to read. Returns 0, or -1 on error or if there's
+  no RPC on this platform.
+*/
+extern int
+smsg_rpc_open(smsg_rpc_t *rpc, int fd, smsg_message_handler_t handler, void *handler_args);
+
+/* stops the reader, failing any calls still out; 'fd' stays open */
+extern int
+smsg_rpc_close(smsg_rpc_t *rpc);
+
+/*
+  Sends the 'smsg_outbuflen' bytes packed in 'smsg_outbuf' as a call,
+  giving up on the reply after 'timeout' seconds if it's > 0, and
+  calling 'callback' when it's finished, unless that's NULL. Returns 0
+  once it's out, after which it will finish, or -1 if it couldn't go.
+*/
+extern int
+smsg_rpc_send(smsg_rpc_t *rpc,
+	      smsg_rpc_call_t *call,
+	      smsg_byte *smsg_outbuf,
+	      int smsg_outbuflen,
+	      double timeout,
+	      smsg_rpc_callback_t callback,
+	      void *callback_args);
+
+/* waits for a call without a callback; returns the reply's length, or -1 if there's none */
+extern int
+smsg_rpc_wait(smsg_rpc_t *rpc, smsg_rpc_call_t *call);
+
+/*
+  Returns non-zero once the connection's gone, when calls fail rather
+  than time out, otherwise 0.
+*/
+extern int
+smsg_rpc_dead(smsg_rpc_t *rpc);
+
+/* sends a call and waits for it, as smsg_send_and_recv but over 'rpc' */
+extern int
+smsg_rpc_call(smsg_rpc_t *rpc,
+	      smsg_byte *smsg_outbuf,
+	      int smsg_outbuflen,
+	      smsg_byte *smsg_inbuf,
+	      double timeout);
+
 /* fills in the network address of the calling host */
 extern smsg_addr
 smsg_get_host_address(void);